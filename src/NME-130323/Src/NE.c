@@ -20,6 +20,7 @@
 
 #define kBufferSize 65536L	// a larger value might be marginally more efficient
 #define kPathSize 512	// must be large enough for document paths
+#define kDictSize 32768	// size of deflate window used to prime parallel blocks
 
 #define DOCDIR "OPS"
 #define ROOTDOC "content.opf"
@@ -140,19 +141,314 @@ void NEStringFree(char **str)
 	*str = NULL;
 }
 
-NEErr NEBegin(NEPtr ne, char const *filename)
+/// Make room in an NEString for len more bytes and a null terminator
+static NEErr StringReserve(NEString *str, int len)
 {
-	int zerr;
-	static char const mimetype[] = "application/epub+zip\n";
+	char *s;
+	int size;
 	
-	if (filename)
+	if (str->len + len + 1 <= str->size)
+		return kNEErrOk;
+	for (size = str->size > 0 ? 2 * str->size : 64; size < str->len + len + 1; size *= 2)
+		;
+	s = realloc(str->str, size);
+	if (!s)
+		return kNEErrMalloc;
+	str->str = s;
+	str->size = size;
+	return kNEErrOk;
+}
+
+NEErr NEStringAppend(NEString *str, char const *src, int srcLen)
+{
+	NEErr err;
+	
+	if (srcLen < 0)
+		srcLen = strlen(src);
+	Chk(StringReserve(str, srcLen));
+	memcpy(str->str + str->len, src, srcLen);
+	str->len += srcLen;
+	str->str[str->len] = '\0';
+	return kNEErrOk;
+}
+
+NEErr NEStringAppendPart(NEString *str, char const *src, int srcLen)
+{
+	NEErr err;
+	
+	if (str->len > 0 || str->str)
+		Chk(NEStringAppend(str, "\n", 1));
+	return NEStringAppend(str, src, srcLen);
+}
+
+void NEStringRelease(NEString *str)
+{
+	if (str->str)
+		free(str->str);
+	str->str = NULL;
+	str->len = str->size = 0;
+}
+
+/// Hash value of a string (FNV-1a)
+static unsigned HashString(char const *str, int len)
+{
+	unsigned h = 2166136261u;
+	int i;
+	
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)str[i]) * 16777619u;
+	return h;
+}
+
+/**	Find a part in an index.
+	@param[in] index index
+	@param[in] str indexed string
+	@param[in] part part to find
+	@param[in] partLen length of part
+	@return slot of the part if found, else slot where it can be added
+*/
+static int IndexFindSlot(NEStringIndex const *index, NEString const *str,
+		char const *part, int partLen)
+{
+	int i;
+	
+	for (i = HashString(part, partLen) & (index->size - 1);
+			index->slots[i] > 0
+				&& !NEStringEq(str->str + index->slots[i] - 1, part, partLen);
+			i = (i + 1) & (index->size - 1))
+		;
+	return i;
+}
+
+/**	Check if a part is in an index.
+	@param[in] index index
+	@param[in] str indexed string
+	@param[in] part part to find
+	@param[in] partLen length of part
+	@return TRUE if found
+*/
+static NEBoolean IndexContains(NEStringIndex const *index, NEString const *str,
+		char const *part, int partLen)
+{
+	return index->size > 0
+			&& index->slots[IndexFindSlot(index, str, part, partLen)] > 0;
+}
+
+/**	Add a part to an index.
+	@param[in,out] index index
+	@param[in] str indexed string
+	@param[in] offset offset of part in str
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr IndexAdd(NEStringIndex *index, NEString const *str, int offset)
+{
+	int *slots, size, i, j;
+	
+	// keep the table at most half full
+	if (2 * (index->count + 1) > index->size)
 	{
-		ne->zf = zipOpen64(filename, APPEND_STATUS_CREATE);
-		if (!ne->zf)
-			return kNEErrCannotCreateEPUBFile;
+		size = index->size > 0 ? 2 * index->size : 64;
+		slots = calloc(size, sizeof(int));
+		if (!slots)
+			return kNEErrMalloc;
+		for (i = 0; i < index->size; i++)
+			if (index->slots[i] > 0)
+			{
+				char const *part = str->str + index->slots[i] - 1;
+				for (j = HashString(part, NEStringPartLength(part)) & (size - 1);
+						slots[j] > 0;
+						j = (j + 1) & (size - 1))
+					;
+				slots[j] = index->slots[i];
+			}
+		free(index->slots);
+		index->slots = slots;
+		index->size = size;
 	}
-	else
-		ne->zf = NULL;
+	
+	i = IndexFindSlot(index, str, str->str + offset, NEStringPartLength(str->str + offset));
+	if (index->slots[i] == 0)
+	{
+		index->slots[i] = offset + 1;
+		index->count++;
+	}
+	return kNEErrOk;
+}
+
+/// Deallocate an index
+static void IndexFree(NEStringIndex *index)
+{
+	free(index->slots);
+	index->slots = NULL;
+	index->size = index->count = 0;
+}
+
+/**	Add a part to an lf-separated list unless it's already there.
+	@param[in,out] str list
+	@param[in,out] index index of str
+	@param[in] part part to add
+	@param[in] partLen length of part in bytes, or -1 if null-terminated
+	@param[out] added TRUE if added, FALSE if already there (can be NULL)
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr AddIndexedPart(NEString *str, NEStringIndex *index,
+		char const *part, int partLen,
+		NEBoolean *added)
+{
+	int offset;
+	NEErr err;
+	
+	if (partLen < 0)
+		partLen = strlen(part);
+	if (added)
+		*added = FALSE;
+	if (IndexContains(index, str, part, partLen))
+		return kNEErrOk;
+	
+	offset = str->str ? str->len + 1 : 0;
+	Chk(NEStringAppendPart(str, part, partLen));
+	Chk(IndexAdd(index, str, offset));
+	if (added)
+		*added = TRUE;
+	return kNEErrOk;
+}
+
+/// minizip open function of NEOutput (the stream is the NEOutput itself)
+static voidpf ZCALLBACK OutputOpen(voidpf opaque, void const *filename, int mode)
+{
+	(void)filename;
+	(void)mode;
+	return opaque;
+}
+
+/// minizip read function of NEOutput (only data not passed yet to write)
+static uLong ZCALLBACK OutputRead(voidpf opaque, voidpf stream,
+		void *buf, uLong size)
+{
+	NEOutput *output = (NEOutput *)stream;
+	
+	(void)opaque;
+	if (size > (uLong)(output->data.len - output->pos))
+		size = output->data.len - output->pos;
+	memcpy(buf, output->data.str + output->pos, size);
+	output->pos += size;
+	return size;
+}
+
+/// minizip write function of NEOutput
+static uLong ZCALLBACK OutputWrite(voidpf opaque, voidpf stream,
+		void const *buf, uLong size)
+{
+	NEOutput *output = (NEOutput *)stream;
+	
+	(void)opaque;
+	if (output->error || size > (uLong)(0x7ffffffe - output->pos))
+	{
+		output->error = TRUE;
+		return 0;
+	}
+	if (output->pos + (int)size > output->data.len)
+	{
+		if (StringReserve(&output->data, output->pos + size - output->data.len)
+				!= kNEErrOk)
+		{
+			output->error = TRUE;
+			return 0;
+		}
+		output->data.len = output->pos + size;
+	}
+	memcpy(output->data.str + output->pos, buf, size);
+	output->pos += size;
+	return size;
+}
+
+/// minizip tell function of NEOutput
+static ZPOS64_T ZCALLBACK OutputTell(voidpf opaque, voidpf stream)
+{
+	NEOutput *output = (NEOutput *)stream;
+	
+	(void)opaque;
+	return output->base + output->pos;
+}
+
+/// minizip seek function of NEOutput (data passed to write can't be changed)
+static long ZCALLBACK OutputSeek(voidpf opaque, voidpf stream,
+		ZPOS64_T offset, int origin)
+{
+	NEOutput *output = (NEOutput *)stream;
+	ZPOS64_T pos;
+	
+	(void)opaque;
+	switch (origin)
+	{
+		case ZLIB_FILEFUNC_SEEK_SET:
+			pos = offset;
+			break;
+		case ZLIB_FILEFUNC_SEEK_CUR:
+			pos = output->base + output->pos + offset;
+			break;
+		case ZLIB_FILEFUNC_SEEK_END:
+			pos = output->base + output->data.len + offset;
+			break;
+		default:
+			return -1;
+	}
+	if (pos < output->base || pos > output->base + output->data.len)
+		return -1;
+	output->pos = (int)(pos - output->base);
+	return 0;
+}
+
+/// minizip close function of NEOutput (data is released by NEEnd)
+static int ZCALLBACK OutputClose(voidpf opaque, voidpf stream)
+{
+	(void)opaque;
+	(void)stream;
+	return 0;
+}
+
+/// minizip error function of NEOutput
+static int ZCALLBACK OutputError(voidpf opaque, voidpf stream)
+{
+	(void)opaque;
+	return ((NEOutput *)stream)->error;
+}
+
+/**	Pass the data of complete zip entries to the write function of the
+	output, if any; minizip only seeks back to the local header of the
+	current entry, hence it must be called when no entry is open.
+	@param[in,out] ne reference to EPUB main structure
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr FlushOutput(NEPtr ne)
+{
+	NEOutput *output = ne->output;
+	NEErr err;
+	
+	if (!output || !output->write || output->data.len == 0)
+		return kNEErrOk;
+	if (output->error)
+		return kNEErrZip;
+	err = output->write(output->data.str, output->data.len, output->writeData);
+	if (err != kNEErrOk)
+	{
+		output->error = TRUE;
+		return err;
+	}
+	output->base += output->data.len;
+	output->data.len = output->pos = 0;
+	return kNEErrOk;
+}
+
+/**	Initialize the EPUB main structure once the zip file is open, and
+	add the mimetype file.
+	@param[in,out] ne reference to EPUB main structure
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr Begin(NEPtr ne)
+{
+	int zerr;
+	static char const mimetype[] = "application/epub+zip\n";
 	
 	// initialize meta information
 	ne->title = NULL;
@@ -169,21 +465,31 @@ NEErr NEBegin(NEPtr ne, char const *filename)
 	ne->rights = NULL;
 	
 	// initialize parts and other documents
-	ne->parts = NULL;
-	ne->auxParts = NULL;
+	memset(&ne->parts, 0, sizeof(NEString));
+	memset(&ne->partsIndex, 0, sizeof(NEStringIndex));
+	memset(&ne->auxParts, 0, sizeof(NEString));
+	memset(&ne->auxPartsIndex, 0, sizeof(NEStringIndex));
 	ne->cover = NULL;
-	ne->other = NULL;
+	memset(&ne->other, 0, sizeof(NEString));
+	memset(&ne->otherIndex, 0, sizeof(NEStringIndex));
 	ne->coverImage = NULL;
 	
 	// initialize other fields
-	ne->tocEntries = NULL;
+	memset(&ne->tocEntries, 0, sizeof(NEString));
 	ne->ncxCount = 0;
 	ne->maxTOCDepth = 1;
-	ne->endnotes = NULL;
+	memset(&ne->endnotes, 0, sizeof(NEString));
 	ne->endnoteCount = 0;
 	ne->lastRefLink = NULL;
 	ne->currentDoc = NULL;
 	
+	// initialize compression policy
+	ne->level = Z_DEFAULT_COMPRESSION;
+	ne->mediaLevel = 0;
+	ne->blockSize = 0;
+	ne->runTasks = NULL;
+	ne->runTasksData = NULL;
+	
 	// add file "mimetype" (first file, uncompressed)
 	zerr = zipOpenNewFileInZip(ne->zf,
 			"mimetype", NULL,
@@ -199,7 +505,75 @@ NEErr NEBegin(NEPtr ne, char const *filename)
 	if (zerr != Z_OK)
 		return kNEErrZip;
 	
-	return kNEErrOk;
+	return FlushOutput(ne);
+}
+
+NEErr NEBegin(NEPtr ne, char const *filename)
+{
+	if (filename)
+	{
+		ne->zf = zipOpen64(filename, APPEND_STATUS_CREATE);
+		if (!ne->zf)
+			return kNEErrCannotCreateEPUBFile;
+	}
+	else
+		ne->zf = NULL;
+	ne->output = NULL;
+	
+	return Begin(ne);
+}
+
+NEErr NEBeginMemory(NEPtr ne)
+{
+	return NEBeginCallback(ne, NULL, NULL);
+}
+
+NEErr NEBeginCallback(NEPtr ne, NEWriteFun write, void *writeData)
+{
+	zlib_filefunc64_def fileFunc;
+	
+	ne->output = malloc(sizeof(NEOutput));
+	if (!ne->output)
+		return kNEErrMalloc;
+	memset(&ne->output->data, 0, sizeof(NEString));
+	ne->output->base = 0;
+	ne->output->pos = 0;
+	ne->output->write = write;
+	ne->output->writeData = writeData;
+	ne->output->error = FALSE;
+	
+	fileFunc.zopen64_file = OutputOpen;
+	fileFunc.zread_file = OutputRead;
+	fileFunc.zwrite_file = OutputWrite;
+	fileFunc.ztell64_file = OutputTell;
+	fileFunc.zseek64_file = OutputSeek;
+	fileFunc.zclose_file = OutputClose;
+	fileFunc.zerror_file = OutputError;
+	fileFunc.opaque = ne->output;
+	ne->zf = zipOpen2_64("", APPEND_STATUS_CREATE, NULL, &fileFunc);
+	if (!ne->zf)
+	{
+		free(ne->output);
+		ne->output = NULL;
+		return kNEErrCannotCreateEPUBFile;
+	}
+	
+	return Begin(ne);
+}
+
+void NESetCompression(NEPtr ne, int level, int mediaLevel)
+{
+	ne->level = level;
+	ne->mediaLevel = mediaLevel;
+}
+
+void NESetParallelDeflate(NEPtr ne,
+		int blockSize,
+		NERunTasksFun runTasks, void *runTasksData)
+{
+	ne->blockSize = runTasks ? blockSize : 0;
+	ne->runTasks = runTasks;
+	ne->runTasksData = runTasksData;
 }
 
 NEErr NEAddMetadata(NEPtr ne,
@@ -255,53 +629,79 @@ NEErr NEAddPart(NEPtr ne, char const *filename, NEBoolean auxiliary)
 	NEErr err;
 	
 	if (auxiliary)
-		Chk(NEStringAdd(&ne->auxParts, filename, -1));
+		Chk(AddIndexedPart(&ne->auxParts, &ne->auxPartsIndex, filename, -1, NULL));
 	else
-		Chk(NEStringAdd(&ne->parts, filename, -1));
+		Chk(AddIndexedPart(&ne->parts, &ne->partsIndex, filename, -1, NULL));
 	return kNEErrOk;
 }
 
-static char const *SuffixToMimetype(char const *filename, int filenameLen)
+/// Known file types
+static struct
+{
+	char const *suffix;	///< file name suffix
+	char const *mimetype;	///< MIME type
+	NEBoolean compressed;	///< TRUE if already compressed
+} const fileTypes[] = {
+	{"gif", "image/gif", TRUE},
+	{"jpg", "image/jpeg", TRUE},
+	{"jpeg", "image/jpeg", TRUE},
+	{"png", "image/png", TRUE},
+	{"svg", "image/svg+xml", FALSE},
+	{"xhtml", "text/xhtml+xml", FALSE},
+	{"css", "text/css", FALSE},
+	{"xml", "application/xml", FALSE},
+	{"ncx", "application/x-dtbncx+xml", FALSE},
+	{NULL, NULL, FALSE}
+};
+
+/// Find the type of a file in fileTypes from its whole suffix (case
+/// insensitive), or return -1
+static int FindFileType(char const *filename, int filenameLen)
 {
 	int i, suffix;
-	static struct
-	{
-		char const *suffix;
-		char const *mimetype;
-	} const m[] = {
-		{"gif", "image/gif"},
-		{"jpg", "image/jpeg"},
-		{"png", "image/png"},
-		{"svg", "image/svg+xml"},
-		{"xhtml", "text/xhtml+xml"},
-		{"css", "text/css"},
-		{"xml", "application/xml"},
-		{"ncx", "application/x-dtbncx+xml"},
-		{NULL, NULL}
-	};
 	
 	if (filenameLen < 0)
 		filenameLen = strlen(filename);
 	for (suffix = filenameLen; suffix > 0 && filename[suffix - 1] != '.'; suffix--)
 		;
 	if (suffix <= 0)
-		return "text/plain";	// default
+		return -1;
+	
+	for (i = 0; fileTypes[i].suffix; i++)
+		if ((int)strlen(fileTypes[i].suffix) == filenameLen - suffix
+				&& !strncasecmp(filename + suffix, fileTypes[i].suffix, filenameLen - suffix))
+			return i;
+	
+	return -1;
+}
+
+static char const *SuffixToMimetype(char const *filename, int filenameLen)
+{
+	int i = FindFileType(filename, filenameLen);
 	
-	for (i = 0; m[i].suffix; i++)
-		if (!strncasecmp(filename + suffix, m[i].suffix, filenameLen - suffix))
-			return m[i].mimetype;
+	return i >= 0 ? fileTypes[i].mimetype : "text/plain";	// default
+}
+
+/// Compression level of a file (0 to store it uncompressed)
+static int FileLevel(NEPtr ne, char const *filename)
+{
+	int i = FindFileType(filename, -1);
 	
-	return "text/plain";	// default
+	return i >= 0 && fileTypes[i].compressed ? ne->mediaLevel : ne->level;
 }
 
 NEErr NEAddOther(NEPtr ne,
 		char const *filename, int filenameLen,
 		char const *mimetype)
 {
-	NEStringAdd(&ne->other, filename, filenameLen);
-	NEStringAdd(&ne->other,
-			mimetype ? mimetype : SuffixToMimetype(filename, filenameLen),
-			-1);
+	NEBoolean added;
+	NEErr err;
+	
+	Chk(AddIndexedPart(&ne->other, &ne->otherIndex, filename, filenameLen, &added));
+	if (added)
+		Chk(NEStringAppendPart(&ne->other,
+				mimetype ? mimetype : SuffixToMimetype(filename, filenameLen),
+				-1));
 	return kNEErrOk;
 }
 
@@ -315,7 +715,7 @@ void NEEnumOther(NEPtr ne,
 		*filename = NEStringNextPart(*filename);
 	}
 	else
-		*filename = ne->other;
+		*filename = ne->other.str;
 	if (*filename)
 		*filenameLength = NEStringPartLength(*filename);
 }
@@ -325,21 +725,48 @@ NEErr NEAddFile(NEPtr ne,
 	char const *path)
 {
 	FILE *fp = NULL;
-	char *buffer = NULL;
+	char *buffer = NULL, *deflated;
 	long n;
+	int deflatedLen;
+	unsigned long crc;
 	NEErr err;
 	
 	if (!ne->zf)
 		return kNEErrOk;
 	
-	buffer = malloc(kBufferSize);
-	if (!buffer)
-		return kNEErrMalloc;
 	fp = fopen(path, "rb");
 	if (!fp)
+		return kNEErrCannotOpenFile;
+	
+	// large file compressed in parallel: read it at once
+	if (ne->blockSize > 0 && FileLevel(ne, filename) != 0
+			&& fseek(fp, 0, SEEK_END) == 0
+			&& (n = ftell(fp)) >= 2L * ne->blockSize
+			&& fseek(fp, 0, SEEK_SET) == 0)
 	{
+		buffer = malloc(n);
+		if (!buffer)
+		{
+			fclose(fp);
+			return kNEErrMalloc;
+		}
+		n = fread(buffer, 1, n, fp);
+		fclose(fp);
+		err = NEDeflate(ne, filename, buffer, n, &deflated, &deflatedLen, &crc);
 		free(buffer);
-		return kNEErrCannotOpenFile;
+		if (err != kNEErrOk)
+			return err;
+		err = NEAddDeflatedFile(ne, filename, deflated, deflatedLen, n, crc);
+		free(deflated);
+		return err;
+	}
+	fseek(fp, 0, SEEK_SET);
+	
+	buffer = malloc(kBufferSize);
+	if (!buffer)
+	{
+		fclose(fp);
+		return kNEErrMalloc;
 	}
 	
 	err = NENewFile(ne, filename);
@@ -359,9 +786,9 @@ NEErr NEAddFile(NEPtr ne,
 		}
 	}
 	
+	fclose(fp);
 	free(buffer);
-	NECloseFile(ne);
-	return kNEErrOk;
+	return NECloseFile(ne);
 	
 error:
 	if (fp)
@@ -381,47 +808,53 @@ NEErr NEAddTOCEntry(NEPtr ne, char const *title, char const *relativeUrl, int le
 	
 	// warning: level isn't used yet
 	
-	NEStringCat(&ne->tocEntries, "<navPoint id=\"", -1);
+	NEStringAppend(&ne->tocEntries, "<navPoint id=\"", -1);
 	sprintf(str, "p%d", ne->ncxCount);
-	NEStringCat(&ne->tocEntries, str, -1);
-	NEStringCat(&ne->tocEntries, "\" playOrder=\"", -1);
+	NEStringAppend(&ne->tocEntries, str, -1);
+	NEStringAppend(&ne->tocEntries, "\" playOrder=\"", -1);
 	sprintf(str, "%d", ne->ncxCount);
-	NEStringCat(&ne->tocEntries, str, -1);
-	NEStringCat(&ne->tocEntries, "\"><navLabel><text>", -1);
-	NEStringCat(&ne->tocEntries, title, -1);
-	NEStringCat(&ne->tocEntries, "</text></navLabel><content src=\"", -1);
-	NEStringCat(&ne->tocEntries, relativeUrl, -1);
-	NEStringCat(&ne->tocEntries, "\"/></navPoint>\n", -1);
+	NEStringAppend(&ne->tocEntries, str, -1);
+	NEStringAppend(&ne->tocEntries, "\"><navLabel><text>", -1);
+	NEStringAppend(&ne->tocEntries, title, -1);
+	NEStringAppend(&ne->tocEntries, "</text></navLabel><content src=\"", -1);
+	NEStringAppend(&ne->tocEntries, relativeUrl, -1);
+	NEStringAppend(&ne->tocEntries, "\"/></navPoint>\n", -1);
 	
 	return kNEErrOk;
 }
 
-NEErr NENewFile(NEPtr ne,
-	char const *filename)
+/// Get the path of a file in the zip archive (see NENewFile)
+static void ZipPath(char const *filename, char *path)
 {
-	int zerr;
-	char filename2[kPathSize];
-	
-	if (!ne->zf)
-		return kNEErrOk;
-	
 	if (filename[0] == '/')
 	{
 		// skip slash
-		strncpy(filename2, filename + 1, kPathSize);
+		strncpy(path, filename + 1, kPathSize);
 	}
 	else
 	{
 		// prepend DOCDIR "/"
-		strcpy(filename2, DOCDIR "/");
-		strncat(filename2, filename, kPathSize);
+		strcpy(path, DOCDIR "/");
+		strncat(path, filename, kPathSize);
 	}
+}
+
+NEErr NENewFile(NEPtr ne,
+	char const *filename)
+{
+	int zerr, level;
+	char filename2[kPathSize];
+	
+	if (!ne->zf)
+		return kNEErrOk;
 	
+	ZipPath(filename, filename2);
+	level = FileLevel(ne, filename);
 	zerr = zipOpenNewFileInZip(ne->zf,
 			filename2, NULL,
 			NULL, 0, NULL, 0,
 			NULL,
-			Z_DEFLATED, Z_DEFAULT_COMPRESSION);
+			level != 0 ? Z_DEFLATED : 0, level);
 	return zerr == Z_OK ? kNEErrOk : kNEErrZip;
 }
 
@@ -443,7 +876,234 @@ NEErr NECloseFile(NEPtr ne)
 {
 	if (!ne->zf)
 		return kNEErrOk;
-	return zipCloseFileInZip(ne->zf) == Z_OK ? kNEErrOk : kNEErrZip;
+	if (zipCloseFileInZip(ne->zf) != Z_OK)
+		return kNEErrZip;
+	return FlushOutput(ne);
+}
+
+/// Blocks of data compressed in parallel by DeflateBlock
+typedef struct
+{
+	char const *data;	///< data
+	int len;	///< length of data
+	int level;	///< zlib level
+	int blockSize;	///< size of blocks
+	char **blocks;	///< compressed blocks
+	int *blockLen;	///< length of compressed blocks
+	unsigned long *blockCRC;	///< CRC-32 of uncompressed blocks
+} DeflateBlocks;
+
+/**	Compress a block into a raw deflate fragment, ended with a sync flush
+	(byte boundary) except for the last block, so that all the compressed
+	blocks can be concatenated (NETaskFun).
+	@param[in] i block index
+	@param[in,out] taskData DeflateBlocks
+*/
+static void DeflateBlock(int i, void *taskData)
+{
+	DeflateBlocks *d = (DeflateBlocks *)taskData;
+	int begin = i * d->blockSize;
+	int len = d->len - begin < d->blockSize ? d->len - begin : d->blockSize;
+	int dictLen = begin < kDictSize ? begin : kDictSize;
+	NEBoolean last = begin + len >= d->len;
+	z_stream zs;
+	int size, zerr;
+	
+	d->blocks[i] = NULL;
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+	if (deflateInit2(&zs, d->level, Z_DEFLATED,
+			-MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+	
+	// prime with the end of the previous block, like pigz
+	if (dictLen > 0)
+		deflateSetDictionary(&zs, (Bytef const *)d->data + begin - dictLen, dictLen);
+	
+	// room for the sync flush marker (empty stored block)
+	size = deflateBound(&zs, len) + 16;
+	d->blocks[i] = malloc(size);
+	if (d->blocks[i])
+	{
+		zs.next_in = (Bytef *)d->data + begin;
+		zs.avail_in = len;
+		zs.next_out = (Bytef *)d->blocks[i];
+		zs.avail_out = size;
+		zerr = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (last ? zerr != Z_STREAM_END : (zerr != Z_OK || zs.avail_out == 0))
+		{
+			free(d->blocks[i]);
+			d->blocks[i] = NULL;
+		}
+		d->blockLen[i] = zs.total_out;
+		d->blockCRC[i] = crc32(0L, (Bytef const *)d->data + begin, len);
+	}
+	deflateEnd(&zs);
+}
+
+/// Compress data in blocks run as parallel tasks (see NEDeflate)
+static NEErr DeflateParallel(NEPtr ne, int level,
+		char const *data, int len,
+		char **deflated, int *deflatedLen,
+		unsigned long *crc)
+{
+	DeflateBlocks d;
+	int i, n, blockCount;
+	NEErr err;
+	
+	blockCount = (len + ne->blockSize - 1) / ne->blockSize;
+	d.data = data;
+	d.len = len;
+	d.level = level;
+	d.blockSize = ne->blockSize;
+	d.blocks = calloc(blockCount, sizeof(char *));
+	d.blockLen = malloc(blockCount * sizeof(int));
+	d.blockCRC = malloc(blockCount * sizeof(unsigned long));
+	if (!d.blocks || !d.blockLen || !d.blockCRC)
+	{
+		err = kNEErrMalloc;
+		goto done;
+	}
+	
+	err = ne->runTasks(blockCount, DeflateBlock, &d, ne->runTasksData);
+	if (err != kNEErrOk)
+		goto done;
+	
+	// concatenate blocks and combine their CRC
+	for (i = 0, n = 0; i < blockCount; i++)
+		if (d.blocks[i])
+			n += d.blockLen[i];
+		else
+		{
+			err = kNEErrZip;
+			goto done;
+		}
+	*deflated = malloc(n > 0 ? n : 1);
+	if (!*deflated)
+	{
+		err = kNEErrMalloc;
+		goto done;
+	}
+	*deflatedLen = n;
+	*crc = crc32(0L, Z_NULL, 0);
+	for (i = 0, n = 0; i < blockCount; i++)
+	{
+		memcpy(*deflated + n, d.blocks[i], d.blockLen[i]);
+		n += d.blockLen[i];
+		*crc = crc32_combine(*crc, d.blockCRC[i],
+				i < blockCount - 1 ? d.blockSize : len - i * d.blockSize);
+	}
+	
+done:
+	if (d.blocks)
+		for (i = 0; i < blockCount; i++)
+			if (d.blocks[i])
+				free(d.blocks[i]);
+	free(d.blocks);
+	free(d.blockLen);
+	free(d.blockCRC);
+	return err;
+}
+
+NEErr NEDeflate(NEPtr ne,
+		char const *filename,
+		char const *data, int len,
+		char **deflated, int *deflatedLen,
+		unsigned long *crc)
+{
+	z_stream zs;
+	int zerr, level;
+	
+	if (len < 0)
+		len = strlen(data);
+	
+	level = FileLevel(ne, filename);
+	if (level == 0)
+	{
+		// stored: plain copy
+		*deflated = malloc(len > 0 ? len : 1);
+		if (!*deflated)
+			return kNEErrMalloc;
+		memcpy(*deflated, data, len);
+		*deflatedLen = len;
+		*crc = crc32(0L, (Bytef const *)data, len);
+		return kNEErrOk;
+	}
+	
+	if (ne->blockSize > 0 && len >= 2 * ne->blockSize)
+		return DeflateParallel(ne, level, data, len, deflated, deflatedLen, crc);
+	
+	// raw deflate with the same parameters as minizip
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+	if (deflateInit2(&zs, level, Z_DEFLATED,
+			-MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return kNEErrZip;
+	*deflatedLen = deflateBound(&zs, len);
+	*deflated = malloc(*deflatedLen > 0 ? *deflatedLen : 1);
+	if (!*deflated)
+	{
+		deflateEnd(&zs);
+		return kNEErrMalloc;
+	}
+	
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)*deflated;
+	zs.avail_out = *deflatedLen;
+	zerr = deflate(&zs, Z_FINISH);
+	*deflatedLen = zs.total_out;
+	deflateEnd(&zs);
+	if (zerr != Z_STREAM_END)
+	{
+		free(*deflated);
+		*deflated = NULL;
+		return kNEErrZip;
+	}
+	
+	*crc = crc32(0L, (Bytef const *)data, len);
+	return kNEErrOk;
+}
+
+NEErr NEAddDeflatedFile(NEPtr ne,
+	char const *filename,
+	char const *deflated, int deflatedLen,
+	int len, unsigned long crc)
+{
+	int zerr, level;
+	char filename2[kPathSize];
+	
+	if (!ne->zf)
+		return kNEErrOk;
+	
+	ZipPath(filename, filename2);
+	level = FileLevel(ne, filename);
+	zerr = zipOpenNewFileInZip2(ne->zf,
+			filename2, NULL,
+			NULL, 0, NULL, 0,
+			NULL,
+			level != 0 ? Z_DEFLATED : 0, level, 1);
+	if (zerr != Z_OK)
+		return kNEErrZip;
+	zerr = zipWriteInFileInZip(ne->zf, deflated, deflatedLen);
+	if (zerr != Z_OK)
+	{
+		zipCloseFileInZipRaw(ne->zf, len, crc);
+		return kNEErrZip;
+	}
+	zerr = zipCloseFileInZipRaw(ne->zf, len, crc);
+	if (zerr != Z_OK)
+		return kNEErrZip;
+	return FlushOutput(ne);
+}
+
+int NEEndnoteRefLink(int n, char *refLink)
+{
+	// &nbsp;<a href="ENDNOTESDOC#enN" id="enRefN">[N]</a>
+	return sprintf(refLink, "&nbsp;<a href=\"" ENDNOTESDOC "#en%d\" id=\"enRef%d\">[%d]</a>",
+			n, n, n);
 }
 
 NEErr NEAddEndnote(NEPtr ne,
@@ -451,29 +1111,24 @@ NEErr NEAddEndnote(NEPtr ne,
 		char const *refDoc, int refDocLen,
 		char const **refLink)
 {
-	char str[16];
+	char str[16], link[kNERefLinkSize];
 	NEBoolean beginsWithP, quoted, squoted;
 	int i;
 	
 	sprintf(str, "%d", ++ne->endnoteCount);
 	
-	// create refLink = &nbsp;<a href="ENDNOTESDOC#enN" id="enRefN">[N]</a>
-	NEStringCopy(&ne->lastRefLink, "&nbsp;<a href=\"" ENDNOTESDOC "#en", -1);
-	NEStringCat(&ne->lastRefLink, str, -1);
-	NEStringCat(&ne->lastRefLink, "\" id=\"enRef", -1);
-	NEStringCat(&ne->lastRefLink, str, -1);
-	NEStringCat(&ne->lastRefLink, "\">[", -1);
-	NEStringCat(&ne->lastRefLink, str, -1);
-	NEStringCat(&ne->lastRefLink, "]</a>", -1);
+	// create refLink
+	NEEndnoteRefLink(ne->endnoteCount, link);
+	NEStringCopy(&ne->lastRefLink, link, -1);
 	*refLink = ne->lastRefLink;
 	
 	// create endnote
 	// <div class="endnote" id="enN"><p><a href="refDoc#enRefN">[N]</a> endnote</p></div>
 	// insert hyperlink at the beginning of first p element or prepend a new
 	//  p element with the hyperlink alone if it is another type (typically pre)
-	NEStringCat(&ne->endnotes, "<div class=\"endnote\" id=\"en", -1);
-	NEStringCat(&ne->endnotes, str, -1);
-	NEStringCat(&ne->endnotes, "\">\n", -1);
+	NEStringAppend(&ne->endnotes, "<div class=\"endnote\" id=\"en", -1);
+	NEStringAppend(&ne->endnotes, str, -1);
+	NEStringAppend(&ne->endnotes, "\">\n", -1);
 	beginsWithP = endnote[0] == '<' && endnote[1] == 'p'
 		&& (endnote[2] < 'a' || endnote[2] > 'z')
 		&& (endnote[2] < 'A' || endnote[2] > 'Z');
@@ -490,29 +1145,29 @@ NEErr NEAddEndnote(NEPtr ne,
 		if (i < len)
 			i++;
 		// copy it to ne->endnotes
-		NEStringCat(&ne->endnotes, endnote, i);
+		NEStringAppend(&ne->endnotes, endnote, i);
 	}
 	else
-		NEStringCat(&ne->endnotes, "<p>", -1);
+		NEStringAppend(&ne->endnotes, "<p>", -1);
 	// link
-	NEStringCat(&ne->endnotes, "<a href=\"", -1);
-	NEStringCat(&ne->endnotes, refDoc, refDocLen);
-	NEStringCat(&ne->endnotes, "#enRef", -1);
-	NEStringCat(&ne->endnotes, str, -1);
-	NEStringCat(&ne->endnotes, "\">[", -1);
-	NEStringCat(&ne->endnotes, str, -1);
-	NEStringCat(&ne->endnotes, "]</a>", -1);
+	NEStringAppend(&ne->endnotes, "<a href=\"", -1);
+	NEStringAppend(&ne->endnotes, refDoc, refDocLen);
+	NEStringAppend(&ne->endnotes, "#enRef", -1);
+	NEStringAppend(&ne->endnotes, str, -1);
+	NEStringAppend(&ne->endnotes, "\">[", -1);
+	NEStringAppend(&ne->endnotes, str, -1);
+	NEStringAppend(&ne->endnotes, "]</a>", -1);
 	if (beginsWithP)
 	{
-		NEStringCat(&ne->endnotes, " ", -1);
-		NEStringCat(&ne->endnotes, endnote + i, len - i);
+		NEStringAppend(&ne->endnotes, " ", -1);
+		NEStringAppend(&ne->endnotes, endnote + i, len - i);
 	}
 	else
 	{
-		NEStringCat(&ne->endnotes, "</p>\n", -1);
-		NEStringCat(&ne->endnotes, endnote, len);
+		NEStringAppend(&ne->endnotes, "</p>\n", -1);
+		NEStringAppend(&ne->endnotes, endnote, len);
 	}
-	NEStringCat(&ne->endnotes, "</div>\n", -1);
+	NEStringAppend(&ne->endnotes, "</div>\n", -1);
 	
 	return kNEErrOk;
 }
@@ -642,7 +1297,7 @@ static NEErr WriteEndnotes(NEPtr ne)
 {
 	NEErr err;
 	
-	if (!ne->endnotes)
+	if (!ne->endnotes.str)
 		return kNEErrOk;
 	
 	Chk(NENewFile(ne, ENDNOTESDOC));
@@ -661,8 +1316,8 @@ static NEErr WriteEndnotes(NEPtr ne)
 		"<body>\n",
 		-1));
 	Chk(NEWriteToFile(ne,
-		ne->endnotes,
-		-1));
+		ne->endnotes.str,
+		ne->endnotes.len));
 	Chk(NEWriteToFile(ne,
 		"</body>\n"
 		"</html>\n",
@@ -719,7 +1374,7 @@ static NEErr WriteOPF(NEPtr ne)
 		"\"\n   media-type=\"application/x-dtbncx+xml\"/>\n",
 		-1));
 	for (p = 0, id = 1; p < 3; p++)
-		for (sub = p == 0 ? ne->cover : p == 1 ? ne->parts : ne->auxParts;
+		for (sub = p == 0 ? ne->cover : p == 1 ? ne->parts.str : ne->auxParts.str;
 			sub;
 			sub = NEStringNextPart(sub), id++)
 		{
@@ -730,7 +1385,7 @@ static NEErr WriteOPF(NEPtr ne)
 			Chk(NEWriteToFile(ne, sub, NEStringPartLength(sub)));
 			Chk(NEWriteToFile(ne, "\"\n   media-type=\"application/xhtml+xml\"/>\n", -1));
 		}
-	for (sub = ne->other; sub; sub = NEStringNextPart(sub), id++)
+	for (sub = ne->other.str; sub; sub = NEStringNextPart(sub), id++)
 	{
 		Chk(NEWriteToFile(ne, "  <item id=\"", -1));
 		sprintf(idStr, "id%d", id);
@@ -755,7 +1410,7 @@ static NEErr WriteOPF(NEPtr ne)
 		" <spine toc=\"ncx\">\n",
 		-1));
 	for (p = 0, id = 1; p < 3; p++)
-		for (sub = p == 0 ? ne->cover : p == 1 ? ne->parts : ne->auxParts;
+		for (sub = p == 0 ? ne->cover : p == 1 ? ne->parts.str : ne->auxParts.str;
 			sub;
 			sub = NEStringNextPart(sub), id++)
 		{
@@ -842,8 +1497,8 @@ static NEErr WriteNCX(NEPtr ne)
 	Chk(NEWriteToFile(ne,
 		" <navMap>\n",
 		-1));
-	if (ne->tocEntries)
-		Chk(NEWriteToFile(ne, ne->tocEntries, -1));
+	if (ne->tocEntries.str)
+		Chk(NEWriteToFile(ne, ne->tocEntries.str, ne->tocEntries.len));
 	Chk(NEWriteToFile(ne,
 		" </navMap>\n",
 		-1));
@@ -855,9 +1510,13 @@ static NEErr WriteNCX(NEPtr ne)
 	return kNEErrOk;
 }
 
-NEErr NEEnd(NEPtr ne)
+/**	Write the endnotes, the OPF and NCX files and the container, which
+	complete the EPUB file.
+	@param[in,out] ne reference to EPUB main structure
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr WriteEnd(NEPtr ne)
 {
-	int zerr;
 	NEErr err;
 	
 	Chk(WriteEndnotes(ne));
@@ -878,9 +1537,15 @@ NEErr NEEnd(NEPtr ne)
 		, -1));
 	Chk(NECloseFile(ne));
 	
-	zerr = zipClose(ne->zf, NULL);
-	
-	// release all resources
+	return kNEErrOk;
+}
+
+/**	Release all resources of the EPUB main structure once the zip file has
+	been closed.
+	@param[in,out] ne reference to EPUB main structure
+*/
+static void Release(NEPtr ne)
+{
 	NEStringFree(&ne->title);
 	NEStringFree(&ne->creator);
 	NEStringFree(&ne->identifier);
@@ -891,16 +1556,71 @@ NEErr NEEnd(NEPtr ne)
 	NEStringFree(&ne->date);
 	NEStringFree(&ne->source);
 	NEStringFree(&ne->rights);
-	NEStringFree(&ne->endnotes);
+	NEStringRelease(&ne->endnotes);
 	NEStringFree(&ne->lastRefLink);
-	NEStringFree(&ne->parts);
-	NEStringFree(&ne->auxParts);
+	NEStringRelease(&ne->parts);
+	IndexFree(&ne->partsIndex);
+	NEStringRelease(&ne->auxParts);
+	IndexFree(&ne->auxPartsIndex);
 	NEStringFree(&ne->cover);
 	NEStringFree(&ne->coverImage);
-	NEStringFree(&ne->other);
-	NEStringFree(&ne->tocEntries);
+	NEStringRelease(&ne->other);
+	IndexFree(&ne->otherIndex);
+	NEStringRelease(&ne->tocEntries);
+	if (ne->output)
+	{
+		NEStringRelease(&ne->output->data);
+		free(ne->output);
+		ne->output = NULL;
+	}
+}
+
+/**	Finish writing the EPUB file and release all resources, even if an
+	error occurs
+	@param[in,out] ne reference to EPUB main structure
+	@param[out] data contents of the EPUB file created in memory, or NULL
+	to release them
+	@param[out] len length of data in bytes
+	@return kNEErrOk for success, error code for failure
+*/
+static NEErr End(NEPtr ne, char **data, int *len)
+{
+	int zerr;
+	NEErr err;
 	
-	if (zerr != Z_OK)
-		return kNEErrZip;
-	return kNEErrOk;
+	err = WriteEnd(ne);
+	
+	// close the zip file in any case to release it
+	zerr = zipClose(ne->zf, NULL);
+	if (err == kNEErrOk)
+		err = zerr == Z_OK ? FlushOutput(ne) : kNEErrZip;
+	
+	if (ne->output && data && err == kNEErrOk)
+	{
+		// pass the contents to the caller
+		*data = ne->output->data.str;
+		*len = ne->output->data.len;
+		memset(&ne->output->data, 0, sizeof(NEString));
+	}
+	Release(ne);
+	
+	return err;
+}
+
+NEErr NEEnd(NEPtr ne)
+{
+	return End(ne, NULL, NULL);
+}
+
+NEErr NEEndMemory(NEPtr ne, char **data, int *len)
+{
+	*data = NULL;
+	*len = 0;
+	return End(ne, data, len);
+}
+
+void NEAbort(NEPtr ne)
+{
+	zipClose(ne->zf, NULL);
+	Release(ne);
 }
@@ -55,6 +55,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *	NE ne;
  *	// begin EPUB and specify its path
  *	NEBegin(&ne, epubFilename);
+ *	 or, to create it in memory or pass it to a write function as it's created
+ *	NEBeginMemory(&ne);
+ *	NEBeginCallback(&ne, write, writeData);
  *	// add metadata (can do it at any time before NEEnd)
  *	NEAddMetadata(&ne, kNEMetaTitle, "...");
  *	...
@@ -75,8 +78,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *	// specify TOC entries in the correct order with hyperlinks to XHTML files
  *	NEAddTOCEntry(&ne, title, relativeUrl, level);
  *	...
+ *	// compression policy (can be changed before adding contents)
+ *	NESetCompression(&ne, level, mediaLevel);
+ *	NESetParallelDeflate(&ne, blockSize, runTasks, runTasksData);
+ *	...
  *	// finish the creation of the EPUB file
  *	NEEnd(&ne);
+ *	 or, after NEBeginMemory, to get its contents
+ *	NEEndMemory(&ne, &data, &len);
+ *	 or, to give up after an error
+ *	NEAbort(&ne);
  *	@endcode
  */
 
@@ -121,10 +132,65 @@ typedef enum
 	kNEMetaRights	///< copyright notice
 } NEMetadataKey;
 
+/**	Function which performs a task, for NERunTasksFun.
+	@param[in] i task index, from 0 to taskCount-1
+	@param[in,out] taskData data passed to NERunTasksFun
+*/
+typedef void (*NETaskFun)(int i, void *taskData);
+
+/**	Function which runs tasks in any order, possibly in parallel, and returns
+	once all of them have completed (see NESetParallelDeflate).
+	@param[in] taskCount number of tasks
+	@param[in] task task function, called once for each task index
+	@param[in,out] taskData data passed to task
+	@param[in,out] runTasksData data specified with NESetParallelDeflate
+	@return kNEErrOk for success, error code for failure
+*/
+typedef NEErr (*NERunTasksFun)(int taskCount,
+		NETaskFun task, void *taskData,
+		void *runTasksData);
+
+/// String built by appending, with cached length and capacity doubled when full
+typedef struct
+{
+	char *str;	///< null-terminated string allocated by malloc, or NULL if empty
+	int len;	///< length of str in bytes
+	int size;	///< allocated size of str in bytes
+} NEString;
+
+/// Hash index of the lf-separated parts of an NEString, for duplicate detection
+typedef struct
+{
+	int *slots;	///< offset + 1 of indexed parts in the string, or 0 if empty
+	int size;	///< number of slots (power of 2), or 0
+	int count;	///< number of indexed parts
+} NEStringIndex;
+
+/**	Function which receives the contents of the EPUB file created with
+	NEBeginCallback, in order.
+	@param[in] data block of data
+	@param[in] len length of data in bytes
+	@param[in,out] writeData data specified with NEBeginCallback
+	@return kNEErrOk for success, error code to abort the creation
+*/
+typedef NEErr (*NEWriteFun)(char const *data, int len, void *writeData);
+
+/// EPUB file output to memory or to a write function, for minizip
+typedef struct
+{
+	NEString data;	///< bytes written by minizip and not passed yet to write
+	ZPOS64_T base;	///< offset of data.str in the EPUB file
+	int pos;	///< current position in data
+	NEWriteFun write;	///< function receiving the data, or NULL to keep all in memory
+	void *writeData;	///< data passed to write
+	NEBoolean error;	///< TRUE after an error
+} NEOutput;
+
 /// Main NE structure (shouldn't be accessed directly)
 typedef struct
 {
 	zipFile zf;	///< minizip reference
+	NEOutput *output;	///< output to memory or write function, or NULL for a file
 	
 	// required metadata
 	char *title;	///< book title
@@ -141,24 +207,34 @@ typedef struct
 	char *rights;	///< copyright
 	
 	// endnotes
-	char *endnotes;	///< XHTML document, built with NEAddEndnote
+	NEString endnotes;	///< XHTML document, built with NEAddEndnote
 	int endnoteCount;	///< number of endnotes (last endnote label)
 	char *lastRefLink;	///< last refLink created by NEAddEndnote
 	char *currentDoc;	///< name of current document (not managed by NE)
 	
 	// parts (XHTML)
-	char *parts;	///< main parts of the book (filenames, lf-separated)
-	char *auxParts;	///< auxiliary parts of the book (filenames, linear="no", lf-separated)
+	NEString parts;	///< main parts of the book (filenames, lf-separated)
+	NEStringIndex partsIndex;	///< index of parts
+	NEString auxParts;	///< auxiliary parts of the book (filenames, linear="no", lf-separated)
+	NEStringIndex auxPartsIndex;	///< index of auxParts
 	char *cover;	///< cover (filename)
 	char *coverImage;	///< cover image (filename)
 	
 	// other documents (images, css, etc.)
-	char *other;	///< filenames, lf-separated
+	NEString other;	///< filenames and mimetypes, lf-separated
+	NEStringIndex otherIndex;	///< index of filenames in other
 	
 	// toc entries
-	char *tocEntries;	///< XML fragment (contents of navMap in NCX file)
+	NEString tocEntries;	///< XML fragment (contents of navMap in NCX file)
 	int ncxCount;	///< number of NCX entries
 	int maxTOCDepth;	///< maximum toc depth
+	
+	// compression
+	int level;	///< zlib level of entries (0 to store)
+	int mediaLevel;	///< zlib level of already compressed media (0 to store)
+	int blockSize;	///< size of blocks compressed in parallel, or 0
+	NERunTasksFun runTasks;	///< function running block compression tasks
+	void *runTasksData;	///< data passed to runTasks
 } NE, *NEPtr;
 
 /**	Begin the creation of an EPUB file
@@ -168,6 +244,47 @@ typedef struct
 */
 NEErr NEBegin(NEPtr ne, char const *filename);
 
+/**	Begin the creation of an EPUB file in memory; it must be finished
+	with NEEndMemory instead of NEEnd
+	@param[out] ne reference to EPUB main structure
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEBeginMemory(NEPtr ne);
+
+/**	Begin the creation of an EPUB file passed to a write function as it's
+	created (entries are buffered until they're complete, and the write
+	function is called at the latest by NEEnd)
+	@param[out] ne reference to EPUB main structure
+	@param[in] write function receiving the contents of the EPUB file
+	@param[in,out] writeData data passed to write
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEBeginCallback(NEPtr ne, NEWriteFun write, void *writeData);
+
+/**	Set the compression levels of the files added afterwards.
+	@param[in,out] ne reference to EPUB main structure
+	@param[in] level zlib level of XHTML and other files (1=fastest to
+	9=best, Z_DEFAULT_COMPRESSION, or 0 to store them uncompressed)
+	(default: Z_DEFAULT_COMPRESSION)
+	@param[in] mediaLevel zlib level of already compressed media, i.e.
+	GIF, JPEG and PNG images (default: 0)
+*/
+void NESetCompression(NEPtr ne, int level, int mediaLevel);
+
+/**	Enable the compression of large files in independent blocks run as
+	parallel tasks, like pigz: each block is primed with the last 32 KB of
+	the previous one, so that the loss of compression is marginal. It
+	applies to files added with NEAddFile and data compressed with NEDeflate.
+	@param[in,out] ne reference to EPUB main structure
+	@param[in] blockSize size of blocks in bytes (files smaller than two
+	blocks are compressed as a whole), or 0 to disable parallel compression
+	@param[in] runTasks function which runs compression tasks
+	@param[in] runTasksData data passed to runTasks
+*/
+void NESetParallelDeflate(NEPtr ne,
+		int blockSize,
+		NERunTasksFun runTasks, void *runTasksData);
+
 /**	Add metadata
 	@param[in,out] ne reference to EPUB main structure
 	@param[in] key kind of metadata
@@ -179,7 +296,8 @@ NEErr NEAddMetadata(NEPtr ne,
 	NEMetadataKey key, char const *data, int dataLen);
 
 /**	Add an XHTML part to the book manifest; its contents should also be added
-	with NEAddFile or NENewFile/NEWriteToFile/NECloseFile
+	with NEAddFile or NENewFile/NEWriteToFile/NECloseFile. Parts already added
+	are ignored.
 	@param[in,out] ne reference to EPUB main structure
 	@param[in] filename filename
 	@param[in] auxiliary TRUE for auxiliary content (referenced via hyperlinks),
@@ -189,7 +307,8 @@ NEErr NEAddMetadata(NEPtr ne,
 NEErr NEAddPart(NEPtr ne, char const *filename, NEBoolean auxiliary);
 
 /**	Add non-HTML content to the book (images, css, etc.); its contents should
-	also be added with NEAddFile or NENewFile/NEWriteToFile/NECloseFile
+	also be added with NEAddFile or NENewFile/NEWriteToFile/NECloseFile. Files
+	already added are ignored.
 	@param[in,out] ne reference to EPUB main structure
 	@param[in] filename filename
 	@param[in] filenameLen length of filename in bytes
@@ -252,6 +371,53 @@ NEErr NEWriteToFile(NEPtr ne,
 */
 NEErr NECloseFile(NEPtr ne);
 
+/**	Compress data as the contents of a file for NEAddDeflatedFile (raw
+	deflate, like zip entries, or a plain copy if the file is stored
+	uncompressed), with the compression policy of ne. Doesn't change ne,
+	hence can be called from any thread while another one writes the
+	EPUB file.
+	@param[in] ne reference to EPUB main structure
+	@param[in] filename file name (its suffix selects the compression level)
+	@param[in] data data
+	@param[in] len length of data in bytes, or -1 if null-terminated
+	@param[out] deflated compressed data (to be deallocated with free)
+	@param[out] deflatedLen length of deflated in bytes
+	@param[out] crc CRC-32 of data
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEDeflate(NEPtr ne,
+		char const *filename,
+		char const *data, int len,
+		char **deflated, int *deflatedLen,
+		unsigned long *crc);
+
+/**	Add a file whose contents has already been compressed by NEDeflate
+	@param[in,out] ne reference to EPUB main structure
+	@param[in] filename filename in document subdirectory, or in EPUB root
+	if it starts with "/"
+	@param[in] deflated data compressed by NEDeflate with the same filename
+	@param[in] deflatedLen length of deflated in bytes
+	@param[in] len length of uncompressed data in bytes
+	@param[in] crc CRC-32 of uncompressed data
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEAddDeflatedFile(NEPtr ne,
+	char const *filename,
+	char const *deflated, int deflatedLen,
+	int len, unsigned long crc);
+
+/// Size of a buffer large enough for NEEndnoteRefLink
+#define kNERefLinkSize 96
+
+/**	Get the XHTML code NEAddEndnote gives as the link to an endnote,
+	for any endnote number (e.g. to render references before endnotes are
+	numbered).
+	@param[in] n endnote number (1 for first endnote)
+	@param[out] refLink null-terminated XHTML code (at least kNERefLinkSize bytes)
+	@return length of refLink in bytes
+*/
+int NEEndnoteRefLink(int n, char *refLink);
+
 /**	Add an endnote.
 	@param[in,out] ne reference to EPUB main structure
 	@param[in] endnote XHTML code for the endnote (without number)
@@ -277,11 +443,28 @@ NEErr NEMakeCover(NEPtr ne);
 */
 NEErr NESetCoverImage(NEPtr ne, char const *filename, int filenameLen);
 
-/**	Finish writing the EPUB file and release all resources
+/**	Finish writing the EPUB file and release all resources (even if an
+	error occurs)
 	@return kNEErrOk for success, error code for failure
 */
 NEErr NEEnd(NEPtr ne);
 
+/**	Finish writing an EPUB file begun with NEBeginMemory and release all
+	resources except for its contents (also released if an error occurs)
+	@param[in,out] ne reference to EPUB main structure
+	@param[out] data contents of the EPUB file (to be freed with free)
+	@param[out] len length of data in bytes
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEEndMemory(NEPtr ne, char **data, int *len);
+
+/**	Give up the creation of an EPUB file after an error (e.g. from the write
+	function of NEBeginCallback) and release all resources; the EPUB file
+	is left incomplete
+	@param[in,out] ne reference to EPUB main structure
+*/
+void NEAbort(NEPtr ne);
+
 // utility string functions
 
 /**	Copy a string to a sring allocated by malloc.
@@ -308,6 +491,28 @@ NEErr NEStringCat(char **str, char const *src, int srcLen);
 */
 NEErr NEStringAdd(char **str, char const *src, int srcLen);
 
+/**	Append a string to an NEString.
+	@param[in,out] str string
+	@param[in] src source string to be appended
+	@param[in] srcLen length of src in bytes, or -1 if null-terminated
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEStringAppend(NEString *str, char const *src, int srcLen);
+
+/**	Append a string to an NEString with a linefeed separator character
+	if it isn't empty.
+	@param[in,out] str string
+	@param[in] src source string to be appended
+	@param[in] srcLen length of src in bytes, or -1 if null-terminated
+	@return kNEErrOk for success, error code for failure
+*/
+NEErr NEStringAppendPart(NEString *str, char const *src, int srcLen);
+
+/**	Deallocate the memory of an NEString and make it empty.
+	@param[in,out] str string
+*/
+void NEStringRelease(NEString *str);
+
 /**	Find next part after the next linefeed character
 	@param[in] str input null-terminated string, or NULL
 	@return address of string following the next (first) line-feed, or NULL if none
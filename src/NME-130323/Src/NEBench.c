@@ -0,0 +1,299 @@
+/**
+ *	@file NEBench.c
+ *	@brief Benchmark for the compression policies of Nyctergatis EPUB.
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	@section nebenchUsage nebench Usage
+ *	This program creates EPUB files with generated contents (XHTML chapters
+ *	made of random words, and incompressible data in place of JPEG images)
+ *	with different compression policies, and displays the time to create
+ *	them and their size. It can be called as follows:
+ *	@code
+ *	./nebench options
+ *	@endcode
+ *	Here is the list of options it supports:
+ *	- \c --chapters \e n  number of XHTML chapters (default: 40)
+ *	- \c --chaptersize \e n size of each chapter in bytes (default: 500000)
+ *	- \c --help           help message
+ *	- \c --images \e n    number of images (default: 20)
+ *	- \c --imagesize \e n size of each image in bytes (default: 300000)
+ *	- \c -o \e path       path of the EPUB files created (default: nebench.epub)
+ *	- \c --threads \e n   number of threads for parallel compression (default: 4)
+ */
+
+/* License: new BSD license (see NE.h) */
+
+#include "NE.h"
+#include "NMEThreads.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#	include <sys/time.h>
+#	define useThreads	///< POSIX threads for parallel compression
+#endif
+
+/// Size of blocks compressed in parallel
+#define BLOCKSIZE (128 * 1024)
+
+/// Compression policy
+typedef struct
+{
+	char const *name;	///< description
+	int level;	///< level of XHTML
+	int mediaLevel;	///< level of images
+	NEBoolean parallel;	///< TRUE for parallel compression of large files
+} Policy;
+
+/// Policies compared by the benchmark
+static Policy const policies[] =
+{
+	{"deflate all", Z_DEFAULT_COMPRESSION, Z_DEFAULT_COMPRESSION, FALSE},
+	{"store media, level 1", 1, 0, FALSE},
+	{"store media, level 6", Z_DEFAULT_COMPRESSION, 0, FALSE},
+	{"store media, level 9", 9, 0, FALSE},
+#if defined(useThreads)
+	{"store media, level 6, parallel", Z_DEFAULT_COMPRESSION, 0, TRUE},
+#endif
+	{NULL, 0, 0, FALSE}
+};
+
+/// Elapsed time in seconds
+static double now(void)
+{
+#if defined(useThreads)
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/** Generate an XHTML chapter made of random words.
+	@param[in] size approximate size in bytes
+	@param[out] len length of chapter
+	@return chapter (to be freed with free), or NULL if not enough memory
+*/
+static char *makeChapter(int size, int *len)
+{
+	static char const * const words[] =
+	{
+		"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta",
+		"iota", "kappa", "lambda", "mu", "nu", "xi", "omicron", "pi", "rho",
+		"sigma", "tau", "upsilon", "phi", "chi", "psi", "omega"
+	};
+	char *doc;
+	int i;
+	
+	doc = malloc(size + 256);
+	if (!doc)
+		return NULL;
+	*len = sprintf(doc, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+			"<html xmlns=\"http://www.w3.org/1999/xhtml\">\n<body>\n<p>");
+	for (i = 1; *len < size; i++)
+		*len += sprintf(doc + *len, "%s%s", words[rand() % 24],
+				i % 100 == 0 ? "</p>\n<p>" : i % 12 == 0 ? "\n" : " ");
+	*len += sprintf(doc + *len, "</p>\n</body>\n</html>\n");
+	return doc;
+}
+
+/** Write incompressible data to a file, in place of an image.
+	@param[in] path path of file
+	@param[in] size size in bytes
+	@return TRUE for success, else FALSE
+*/
+static NEBoolean makeImage(char const *path, int size)
+{
+	FILE *fp;
+	int i;
+	
+	fp = fopen(path, "wb");
+	if (!fp)
+		return FALSE;
+	for (i = 0; i < size; i++)
+		fputc(rand() >> 4 & 0xff, fp);
+	fclose(fp);
+	return TRUE;
+}
+
+#if defined(useThreads)
+
+/// Task runner for parallel compression (runTasksData points to the number of threads)
+static NEErr runTasksThreads(int taskCount,
+		NETaskFun task, void *taskData,
+		void *runTasksData)
+{
+	NMERunTasksThreads(taskCount, task, taskData, *(int *)runTasksData);
+	return kNEErrOk;
+}
+
+#endif
+
+/** Create an EPUB file with a compression policy.
+	@param[in] path path of EPUB file
+	@param[in] policy compression policy
+	@param[in] chapters XHTML chapters
+	@param[in] chapterLen length of chapters
+	@param[in] chapterCount number of chapters
+	@param[in] imageCount number of images (files "nebenchN.jpg")
+	@param[in] threadCount number of threads for parallel compression
+	@return error code
+*/
+static NEErr makeEPub(char const *path, Policy const *policy,
+		char **chapters, int const *chapterLen, int chapterCount,
+		int imageCount, int threadCount)
+{
+	NE ne;
+	char filename[64], *deflated;
+	int i, deflatedLen;
+	unsigned long crc;
+	NEErr err;
+	
+	err = NEBegin(&ne, path);
+	if (err != kNEErrOk)
+		return err;
+	NESetCompression(&ne, policy->level, policy->mediaLevel);
+#if defined(useThreads)
+	if (policy->parallel)
+		NESetParallelDeflate(&ne, BLOCKSIZE, runTasksThreads, &threadCount);
+#endif
+	
+	for (i = 0; err == kNEErrOk && i < chapterCount; i++)
+	{
+		sprintf(filename, "ch%d.xhtml", i + 1);
+		if (policy->parallel)
+		{
+			err = NEDeflate(&ne, filename, chapters[i], chapterLen[i],
+					&deflated, &deflatedLen, &crc);
+			if (err == kNEErrOk)
+			{
+				err = NEAddDeflatedFile(&ne, filename, deflated, deflatedLen,
+						chapterLen[i], crc);
+				free(deflated);
+			}
+		}
+		else
+		{
+			err = NENewFile(&ne, filename);
+			if (err == kNEErrOk)
+				err = NEWriteToFile(&ne, chapters[i], chapterLen[i]);
+			if (err == kNEErrOk)
+				err = NECloseFile(&ne);
+		}
+		if (err == kNEErrOk)
+			err = NEAddPart(&ne, filename, FALSE);
+	}
+	for (i = 0; err == kNEErrOk && i < imageCount; i++)
+	{
+		sprintf(filename, "nebench%d.jpg", i + 1);
+		err = NEAddFile(&ne, filename, filename);
+		if (err == kNEErrOk)
+			err = NEAddOther(&ne, filename, -1, NULL);
+	}
+	
+	if (err == kNEErrOk)
+		err = NEEnd(&ne);
+	return err;
+}
+
+/// Application entry point
+int main(int argc, char **argv)
+{
+	int i, chapterCount = 40, chapterSize = 500000;
+	int imageCount = 20, imageSize = 300000, threadCount = 4;
+	char const *path = "nebench.epub";
+	char **chapters, filename[64];
+	int *chapterLen;
+	long size;
+	double t;
+	FILE *fp;
+	NEErr err;
+	
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--chapters") && i + 1 < argc)
+			chapterCount = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--chaptersize") && i + 1 < argc)
+			chapterSize = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--images") && i + 1 < argc)
+			imageCount = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--imagesize") && i + 1 < argc)
+			imageSize = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			path = argv[++i];
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			threadCount = strtol(argv[++i], NULL, 0);
+		else
+		{
+			if (strcmp(argv[i], "--help"))
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+			fprintf(stderr, "Usage: %s [options]\n"
+					"Benchmark for the compression policies of Nyctergatis EPUB.\n"
+					"--chapters n      number of XHTML chapters\n"
+					"--chaptersize n   size of each chapter in bytes\n"
+					"--help            display this help message and exit\n"
+					"--images n        number of images\n"
+					"--imagesize n     size of each image in bytes\n"
+					"-o path           path of the EPUB files created\n"
+					"--threads n       number of threads for parallel compression\n",
+				argv[0]);
+			exit(0);
+		}
+	
+	// generate contents
+	chapters = malloc(chapterCount * sizeof(char *));
+	chapterLen = malloc(chapterCount * sizeof(int));
+	if (!chapters || !chapterLen)
+		exit(1);
+	for (i = 0; i < chapterCount; i++)
+	{
+		chapters[i] = makeChapter(chapterSize, &chapterLen[i]);
+		if (!chapters[i])
+			exit(1);
+	}
+	for (i = 0; i < imageCount; i++)
+	{
+		sprintf(filename, "nebench%d.jpg", i + 1);
+		if (!makeImage(filename, imageSize))
+		{
+			fprintf(stderr, "Cannot create \"%s\"\n", filename);
+			exit(1);
+		}
+	}
+	
+	printf("policy                                time (s)      size\n");
+	for (i = 0; policies[i].name; i++)
+	{
+		t = now();
+		err = makeEPub(path, &policies[i], chapters, chapterLen, chapterCount,
+				imageCount, threadCount);
+		t = now() - t;
+		if (err != kNEErrOk)
+		{
+			printf("Error %d\n", err);
+			exit(1);
+		}
+		fp = fopen(path, "rb");
+		if (!fp)
+			exit(1);
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fclose(fp);
+		printf("%-36s %9.3f %9ld\n", policies[i].name, t, size);
+	}
+	
+	for (i = 0; i < imageCount; i++)
+	{
+		sprintf(filename, "nebench%d.jpg", i + 1);
+		remove(filename);
+	}
+	for (i = 0; i < chapterCount; i++)
+		free(chapters[i]);
+	free(chapters);
+	free(chapterLen);
+	
+	return 0;
+}
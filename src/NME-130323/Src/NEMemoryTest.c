@@ -0,0 +1,252 @@
+/**
+ *	@file NEMemoryTest.c
+ *	@brief Test of the memory and callback output of Nyctergatis EPUB.
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	@section nememorytestUsage nememorytest Usage
+ *	This program creates the same EPUB file with NEBegin (on disk),
+ *	NEBeginMemory and NEBeginCallback, and checks that their contents are
+ *	identical byte for byte. It also checks that an error returned by the
+ *	write function aborts the creation of the EPUB file. It can be called
+ *	as follows:
+ *	@code
+ *	./nememorytest options
+ *	@endcode
+ *	Here is the list of options it supports:
+ *	- \c --chapters \e n  number of XHTML chapters (default: 10)
+ *	- \c --help           help message
+ *	- \c -o \e path       path of the EPUB file created on disk
+ *	(default: nememorytest.epub)
+ *
+ *	Exit code is 0 if all contents match, 1 otherwise.
+ */
+
+/* License: new BSD license (see NE.h) */
+
+#include "NE.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Path of the image file added to the EPUB files
+#define kImagePath "nememorytest.jpg"
+
+/// Data received by collect
+typedef struct
+{
+	NEString data;	///< contents received so far
+	int calls;	///< number of calls
+	int maxCalls;	///< number of calls before an error, or -1 for no limit
+} Collected;
+
+/// Write function for NEBeginCallback which collects the EPUB contents
+static NEErr collect(char const *data, int len, void *writeData)
+{
+	Collected *c = (Collected *)writeData;
+	
+	if (c->maxCalls >= 0 && c->calls >= c->maxCalls)
+		return kNEErrCannotCreateEPUBFile;
+	c->calls++;
+	return NEStringAppend(&c->data, data, len);
+}
+
+/** Add contents to an EPUB file and finish it with NEEnd, or with
+	NEEndMemory if data isn't NULL; after an error, give it up with NEAbort.
+	@param[in,out] ne reference to EPUB main structure, after NEBegin,
+	NEBeginMemory or NEBeginCallback
+	@param[in] chapterCount number of XHTML chapters
+	@param[out] data contents for NEEndMemory, or NULL for NEEnd
+	@param[out] len length of data in bytes
+	@return error code
+*/
+static NEErr makeEPub(NEPtr ne, int chapterCount, char **data, int *len)
+{
+	char filename[64], title[64], doc[4096], *deflated;
+	int i, j, docLen, deflatedLen;
+	unsigned long crc;
+	NEErr err;
+	
+	err = NEAddMetadata(ne, kNEMetaTitle, "Memory test", -1);
+	if (err == kNEErrOk)
+		err = NEAddMetadata(ne, kNEMetaCreator, "nememorytest", -1);
+	for (i = 0; err == kNEErrOk && i < chapterCount; i++)
+	{
+		sprintf(filename, "ch%d.xhtml", i + 1);
+		docLen = sprintf(doc, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+				"<html xmlns=\"http://www.w3.org/1999/xhtml\">\n<body>\n"
+				"<h1>Chapter %d</h1>\n", i + 1);
+		for (j = 0; j < 40; j++)
+			docLen += sprintf(doc + docLen, "<p>Paragraph %d of chapter %d.</p>\n",
+					j + 1, i + 1);
+		docLen += sprintf(doc + docLen, "</body>\n</html>\n");
+		
+		// odd chapters deflated in memory, even chapters written directly
+		if (i % 2)
+		{
+			err = NEDeflate(ne, filename, doc, docLen, &deflated, &deflatedLen, &crc);
+			if (err == kNEErrOk)
+			{
+				err = NEAddDeflatedFile(ne, filename, deflated, deflatedLen,
+						docLen, crc);
+				free(deflated);
+			}
+		}
+		else
+		{
+			err = NENewFile(ne, filename);
+			if (err == kNEErrOk)
+				err = NEWriteToFile(ne, doc, docLen);
+			if (err == kNEErrOk)
+				err = NECloseFile(ne);
+		}
+		if (err == kNEErrOk)
+			err = NEAddPart(ne, filename, FALSE);
+		sprintf(title, "Chapter %d", i + 1);
+		if (err == kNEErrOk)
+			err = NEAddTOCEntry(ne, title, filename, 1);
+	}
+	if (err == kNEErrOk)
+		err = NEAddFile(ne, kImagePath, kImagePath);
+	if (err == kNEErrOk)
+		err = NEAddOther(ne, kImagePath, -1, NULL);
+	
+	if (err != kNEErrOk)
+	{
+		NEAbort(ne);
+		return err;
+	}
+	return data ? NEEndMemory(ne, data, len) : NEEnd(ne);
+}
+
+/// Application entry point
+int main(int argc, char **argv)
+{
+	int i, chapterCount = 10, memoryLen, calls, maxCalls;
+	char const *path = "nememorytest.epub";
+	char *file, *memory;
+	long fileLen;
+	Collected c;
+	NE ne;
+	FILE *fp;
+	NEErr err;
+	NEBoolean ok = TRUE;
+	
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--chapters") && i + 1 < argc)
+			chapterCount = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			path = argv[++i];
+		else
+		{
+			if (strcmp(argv[i], "--help"))
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+			fprintf(stderr, "Usage: %s [options]\n"
+					"Test of the memory and callback output of Nyctergatis EPUB.\n"
+					"--chapters n      number of XHTML chapters\n"
+					"--help            display this help message and exit\n"
+					"-o path           path of the EPUB file created on disk\n",
+				argv[0]);
+			exit(0);
+		}
+	
+	// incompressible data in place of an image (stored uncompressed)
+	fp = fopen(kImagePath, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "Cannot create \"%s\"\n", kImagePath);
+		exit(1);
+	}
+	for (i = 0; i < 100000; i++)
+		fputc(rand() >> 4 & 0xff, fp);
+	fclose(fp);
+	
+	// reference: EPUB file on disk
+	err = NEBegin(&ne, path);
+	if (err == kNEErrOk)
+		err = makeEPub(&ne, chapterCount, NULL, NULL);
+	if (err != kNEErrOk)
+	{
+		fprintf(stderr, "NEBegin: error %d\n", err);
+		exit(1);
+	}
+	fp = fopen(path, "rb");
+	if (!fp)
+		exit(1);
+	fseek(fp, 0, SEEK_END);
+	fileLen = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	file = malloc(fileLen);
+	if (!file || fread(file, 1, fileLen, fp) != (size_t)fileLen)
+		exit(1);
+	fclose(fp);
+	
+	// in memory
+	err = NEBeginMemory(&ne);
+	if (err == kNEErrOk)
+		err = makeEPub(&ne, chapterCount, &memory, &memoryLen);
+	if (err != kNEErrOk)
+	{
+		printf("NEBeginMemory: error %d\n", err);
+		ok = FALSE;
+	}
+	else
+	{
+		if (memoryLen != fileLen || memcmp(memory, file, fileLen))
+		{
+			printf("NEBeginMemory: contents differ (%d bytes instead of %ld)\n",
+					memoryLen, fileLen);
+			ok = FALSE;
+		}
+		free(memory);
+	}
+	
+	// passed to a write function
+	memset(&c, 0, sizeof(c));
+	c.maxCalls = -1;
+	err = NEBeginCallback(&ne, collect, &c);
+	if (err == kNEErrOk)
+		err = makeEPub(&ne, chapterCount, NULL, NULL);
+	if (err != kNEErrOk)
+	{
+		printf("NEBeginCallback: error %d\n", err);
+		ok = FALSE;
+	}
+	else if (c.data.len != fileLen || memcmp(c.data.str, file, fileLen))
+	{
+		printf("NEBeginCallback: contents differ (%d bytes instead of %ld)\n",
+				c.data.len, fileLen);
+		ok = FALSE;
+	}
+	else if (c.calls < 2)
+	{
+		printf("NEBeginCallback: contents written at once\n");
+		ok = FALSE;
+	}
+	NEStringRelease(&c.data);
+	calls = c.calls;
+	
+	// error returned by the write function, while contents are added and
+	// in NEEnd (all resources must be released in both cases)
+	for (i = 0; i < 2; i++)
+	{
+		maxCalls = i == 0 ? 2 : calls - 1;
+		memset(&c, 0, sizeof(c));
+		c.maxCalls = maxCalls;
+		err = NEBeginCallback(&ne, collect, &c);
+		if (err == kNEErrOk)
+			err = makeEPub(&ne, chapterCount, NULL, NULL);
+		if (err != kNEErrCannotCreateEPUBFile)
+		{
+			printf("NEBeginCallback: write error after %d calls not reported (error %d)\n",
+					maxCalls, err);
+			ok = FALSE;
+		}
+		NEStringRelease(&c.data);
+	}
+	
+	free(file);
+	remove(kImagePath);
+	printf("%s (%ld bytes)\n", ok ? "ok" : "failed", fileLen);
+	return ok ? 0 : 1;
+}
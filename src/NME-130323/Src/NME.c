@@ -9,6 +9,14 @@
 
 #include "NME.h"
 
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#	define NME_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define NME_SSE2
+#endif
+
 #define kMaxNesting 8	///< maximum nesting of lists
 
 // #define useHTMLEmphasisTags	///< if defined, use em/strong instead of i/b
@@ -37,9 +45,10 @@ enum
 #define isAlphaNum(c) \
 	(((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || isDigit(c))
 
-/// Test if a byte is the first byte of a UTF-8 character
-#define isFirstUTF8Byte(c) \
-	(((c) & 0x80) == 0 || ((c) & 0xe0) == 0xc0 || ((c) & 0xf0) == 0xe0)
+/// Number of UTF-16 code units of the character beginning with a UTF-8 byte
+/// (0 for continuation bytes, 2 for the first byte of 4-byte sequences)
+#define ucs16Units(c) \
+	((((c) & 0xc0) != 0x80) + (((c) & 0xf8) == 0xf0))
 
 /// Maximum number of numbered heading levels
 #define kMaxNumberedHeadingLevels 2
@@ -50,6 +59,13 @@ enum
 /// Tabulator width
 #define kTabWidth 4
 
+/// Initial size added to buffers allocated by NMEProcessAlloc
+#define kAllocExtraSize 1024
+
+/** Size of the records of headings and deferred plugin calls in the context
+	(five 32-bit little-endian numbers) */
+#define kDeferredRecordSize 20
+
 /// Assign return value to err and return it unless kNMEErrOk
 #define CheckError(c) \
 	do { err = (c); if (err != kNMEErrOk) return err; } while (0)
@@ -90,9 +106,38 @@ typedef enum NMEToken
 	kNMETokenPlugin,	///< << with other data on the same line
 	kNMETokenPluginBlock,	///< << alone on a line (end tag must also be alone)
 	kNMETokenPlaceholder,	///< <<< with other data on the same line
-	kNMETokenPlaceholderBlock	///< <<< alone on a line (end tag must also be alone)
+	kNMETokenPlaceholderBlock,	///< <<< alone on a line (end tag must also be alone)
+	kNMETokenText	///< run of characters which are never markup in the current state
 } NMEToken;
 
+/// Bit of charMarkup set for characters which can be markup in kNMEStatePar
+#define kCharMarkupPar 1
+/// Bit of charMarkup set for characters which can be markup in kNMEStateHeading
+#define kCharMarkupHeading 2
+/// Bit of charMarkup set for characters which can be markup in kNMEStatePre
+#define kCharMarkupPre 4
+
+/// Classes of characters for kNMETokenText (combination of kCharMarkupPar etc.)
+static unsigned char const charMarkup[256] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 0, 0, 7, 0, 0,	// \t \n \r
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	7, 0, 0, 3, 0, 0, 0, 0, 0, 0, 3, 0, 3, 0, 0, 3,	// space # * , /
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 3, 2, 0, 0,	// : < =
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 3, 3, 3,	// [ \ ] ^ _
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 3, 3, 0,	// { | } ~
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
 /** Text style */
 typedef enum NMEStyle
 {
@@ -115,7 +160,9 @@ struct NMEContextStruct
 	NMEText dest;	///< address of encoded text
 	NMEInt destLen;	///< current length of dest
 	
-	NMEInt destLenUCS16;	///< destLen in UCS16 (16-bit unicode), assuming UTF-8 input
+	NMEInt destLenUCS16;	/**< length in UCS16 (16-bit unicode) of output until
+		dest[destLenCountedUCS16], assuming UTF-8 input (counted lazily) */
+	NMEInt destLenCountedUCS16;	///< number of bytes of dest counted in destLenUCS16
 	
 	NMEText src;	///< NME source text
 	NMEInt srcIndex;	///< index in src[]
@@ -124,13 +171,20 @@ struct NMEContextStruct
 	NMEInt srcLineNum;	///< line number in src[] corresponding to srcIndexForLineNum
 	NMEInt srcIndexForLineNum;	///< index in src[] corresponding to srcLineNum
 	
-	NMEInt bufSize;	///< size of dest and src
+	NMEInt bufSize;	///< size of dest
+	NMEInt srcSize;	///< size of src (source code followed by temporary memory)
+	NMEReallocFun reallocFun;	///< function to enlarge dest and src (NULL if fixed)
+	NMEBoolean srcInPlace;	///< TRUE if src is the caller's input (read-only)
+	void *reallocData;	///< data passed to reallocFun
 	
 	NMEInt currentIndent;	///< current indenting (0=none, 1=next one, etc.)
 	NMEInt col;	///< current column
+	NMEInt wrapCheckedBegin;	///< beginning of span of current line in dest without wordwrap point
+	NMEInt wrapCheckedEnd;	///< end of span of current line in dest without wordwrap point
 	
 	NMEInt listNum[kMaxNesting];	///< current number or kNMEListNumUL/DT/DD/Indented
 	NMEInt nesting;	///< level of list nesting (0 outside)
+	NMEChar listNestingStr[kMaxNesting + 1];	///< string returned by NMECurrentListNesting (cache, set through a const context)
 	
 	NMEOutputFormat const *outputFormat;	///< output format strings
 	NMEConstText eol;	///< null-terminated string used for end-of-line
@@ -145,11 +199,245 @@ struct NMEContextStruct
 	NMEInt linkLength;///< length of link/image in src for the current kNMEStyleLink/kNMEStyleImage
 	
 	NMEBoolean xref;	///< TRUE if headings should have labels for hyperlink targets
+	
+	NMEInt destOffset;	///< length of output already flushed by streaming functions
+	NMEInt stateUsed;	/**< kStateUsed flags of values which have been used and
+		which are unknown or can change in chunks of NMEProcessParallel or
+		blocks of NMEIncremental */
+	NMEInt itemBefore;	///< value of item while it's -1 (set at beginning of chunk or block)
+	NMEInt srcTail;	///< number of bytes at the end of src which mustn't be parsed yet
+	NMEInt tokenIndex;	///< value of srcIndex before parsing current token
+	NMEInt noAutoOrPluginLen;	///< initial span of src protected against autoconvert and plugins
+	NMEInt reparsedEnd;	///< end in src of the plugin output reinserted to be parsed
+	NMEInt autoconvertNext;	/**< index in src of the next char where an
+		autoconvert can match, or of the end of the part scanned until now */
+	unsigned char autoconvertTrigger[256];	/**< nonzero for chars where an
+		autoconvert can match (all if an autoconvert has no triggers) */
+	NMEInt autoLinkBegin;	///< index in src of link reported by NMEAddAutoconvertLink, or -1
+	NMEInt autoLinkEnd;	///< index in src after link reported by NMEAddAutoconvertLink, or -1
+	NMEInt autoLinkOffset;	///< offset of link target reported by NMEAddAutoconvertLink
+	NMEInt autoLinkLength;	///< length of link target reported by NMEAddAutoconvertLink
+	NMEInt autoLinkTextOffset;	///< offset of link text reported by NMEAddAutoconvertLink
+	NMEInt autoLinkTextLength;	///< length of link text reported by NMEAddAutoconvertLink
+	
+	NMEState state;	///< current parser state
+	NMEInt headingNum[kMaxNumberedHeadingLevels];	///< last heading number
+	NMEInt headingFlags;	///< bit i-1 is 1 if currently in a section at level i
+	NMEInt headingLevel;	///< current heading level (1=top-level heading)
+	NMEInt itemNesting;	///< nesting of last list item
+	NMEStyle styleStack[kNMEStylesCount];	///< stack of styles
+	NMEInt styleNesting;	///< number of styles in styleStack
+	NMEStyle newStyle;	///< style of last kNMETokenStyle
+	
+	NMEProcessOutputFun streamOutputFun;	///< output function (NULL if not streaming)
+	void *streamOutputData;	///< data passed to streamOutputFun
+	NMEInt scanTail;	///< number of bytes at the end of src not scanned for block boundaries
+	NMEBoolean scanPre;	///< TRUE if block boundary scan is in a preformatted block
+	NMEInt scanPluginEndLen;	///< length of expected end of plugin tag, or 0 if not in plugin
+	NMEBoolean scanPluginBlock;	///< TRUE if end of plugin tag must begin a line
+	
+	NMEEncodeCharTable encodeCharTable;	/**< encodeCharData compiled if encodeCharFun
+		is NMEEncodeCharFunDict (dict is NULL otherwise) */
+	NMEEncodeCharTable encodeCharPreTable;	/**< encodeCharPreData compiled if
+		encodeCharPreFun is NMEEncodeCharFunDict (dict is NULL otherwise) */
+	
+	struct NMEEventRecorderStruct *recorder;	/**< events recorded instead of
+		output by NMEProcessEvents (NULL if not recording) */
+	
+	NMEBoolean deferPlugins;	/**< TRUE if plugins with kNMEPluginOptDeferred
+		are called by callDeferredPlugins, with headings collected until then */
+	NMEBoolean deferredCall;	///< TRUE while callDeferredPlugins calls plugins
+	NMEText headings;	/**< kDeferredRecordSize-byte records of headings
+		(level, item, input index, offset and length of text in deferredText) */
+	NMEInt headingsLen;	///< length of headings
+	NMEInt headingsSize;	///< size of headings
+	NMEInt headingTextBegin;	///< input index of the text of the current heading
+	NMEText deferredSlots;	/**< kDeferredRecordSize-byte records of deferred
+		plugin calls (index in dest, plugin index, offset of name in deferredText,
+		name length, data length) */
+	NMEInt deferredSlotsLen;	///< length of deferredSlots
+	NMEInt deferredSlotsSize;	///< size of deferredSlots
+	NMEText deferredText;	///< heading text and plugin name and data
+	NMEInt deferredTextLen;	///< length of deferredText
+	NMEInt deferredTextSize;	///< size of deferredText
+};
+
+/** Events recorded by NMEProcessEvents: output operations of the parser
+	which don't depend on the output format, replayed by NMERenderEvents */
+typedef struct NMEEventRecorderStruct
+{
+	NMEText events;	///< header followed by events
+	NMEInt eventsLen;	///< length of events
+	NMEInt eventsSize;	///< size of events
+	NMEInt lastEvent;	///< kind of last event
+	NMEInt mappedBegin;	/**< index in src after which src matches the
+		caller's input at srcIndexOffset (before, it's output reparsed) */
+	NMEInt flags;	///< kEventsUsed flags
+	NMEInt headingLevelMax;	///< highest heading level found
+	NMEInt inputIndex;	///< input index at the last kEventInputIndex
+	NMEInt lineNum;	///< line number at the last kEventLineNum
+	NMEInt level;	///< level at the last kEventLevel
+	NMEInt item;	///< item at the last kEventItem
+	NMEInt nesting;	///< nesting at the last kEventList
+	NMEInt listNum[kMaxNesting];	///< listNum at the last kEventList
+} NMEEventRecorder;
+
+/** Kinds of events (low bits of the first byte of each event), followed by
+	numbers written by emitEventNumber; spans of source code are written by
+	emitEventSpan */
+enum
+{
+	kEventTemplate = 1,	///< template (index of field in NMEOutputFormat)
+	kEventWordwrap,	///< wordwrap check
+	kEventText,	///< text (span; kEventFlagA for preformatted)
+	kEventChar,	/**< single character encoded with encodeCharFun (span from
+		beginning of token, index of character in span; kEventFlagA for preformatted) */
+	kEventPreBlank,	///< space in preformatted text (kEventFlagA for tab)
+	kEventGobbleSpaces,	///< removal of trailing spaces
+	kEventIndent,	///< indenting after wordwrap (list nesting)
+	kEventLinkBegin,	/**< beginning of link or image (span, offset and length
+		of link, offset and length of text in span; kEventFlagA for image,
+		kEventFlagB to write text) */
+	kEventLinkEnd,	///< end of link or image (kEventFlagA for image)
+	kEventPlugin,	/**< plugin whose output isn't parsed again (index, span,
+		offset and length of name and data in span) */
+	kEventDivHook,	/**< divHookFun (level, item, input index, line number,
+		null-terminated markup; kEventFlagA for enter) */
+	kEventParHook,	///< parHookFun (same as kEventDivHook)
+	kEventSpanHook,	///< spanHookFun (same as kEventDivHook)
+	kEventInputIndex,	///< input index (difference with previous one)
+	kEventLineNum,	///< line number (difference with previous one)
+	kEventLevel,	///< level
+	kEventItem,	///< item
+	kEventList,	///< list nesting and listNum
+	
+	kEventKindMask = 0x1f,	///< mask of event kind
+	kEventInline = 0x20,	///< span of source code copied in events
+	kEventFlagA = 0x40,	///< flag specific to event kind
+	kEventFlagB = 0x80	///< flag specific to event kind
+};
+
+/// Flags of NMEEventRecorder.flags (byte 5 of header)
+enum
+{
+	kEventsUsedSublist = 1,	///< sublistInListItem has changed the parsing
+	kEventsUsedNoStyleInAlt = 2,	///< noStyleInAlt has changed the parsing
+	kEventsSublistInListItem = 4,	///< value of sublistInListItem
+	kEventsNoStyleInAlt = 8	///< value of noStyleInAlt
+};
+
+/** Size of the header of events: "NMEe", version, flags, maxHeadingLevel of
+	output format, highest heading level, options and source length
+	(32-bit little-endian) */
+#define kEventsHeaderSize 16
+
+/// Version of events (byte 4 of header)
+#define kEventsVersion 1
+
+/** Check whether a sublist is nested in the parent list item, according
+	to sublistInListItem of the output format (its use is flagged in events
+	recorded by NMEProcessEvents).
+	@param[in,out] context current context
+	@param[in] nested TRUE if a sublist could be nested in the parent item
+	@return TRUE if the sublist must be nested in the parent item
+*/
+static NMEBoolean sublistInListItem(NMEContext *context, NMEBoolean nested)
+{
+	if (!nested)
+		return FALSE;
+	if (context->recorder)
+		context->recorder->flags |= kEventsUsedSublist;
+	return context->outputFormat->sublistInListItem;
+}
+
+/** Check whether a style in image alt text is ignored, according to
+	noStyleInAlt of the output format (its use is flagged in events recorded
+	by NMEProcessEvents).
+	@param[in,out] context current context
+	@return TRUE if the style must be ignored
+*/
+static NMEBoolean noStyleInAlt(NMEContext *context)
+{
+	if (context->recorder)
+		context->recorder->flags |= kEventsUsedNoStyleInAlt;
+	return context->outputFormat->noStyleInAlt;
+}
+
+/// Flags of NMEContextStruct.stateUsed
+enum
+{
+	kStateUsedOutputIndex = 1,	///< output index (variable p, NMECurrentOutputIndex)
+	kStateUsedItemBefore = 2,	///< item number before it has been set in the chunk or block
+	kStateUsedInputIndex = 4,	///< input index (variable o, NMECurrentInputIndex, NMECurrentLink)
+	kStateUsedLineNum = 8	///< line number (variable L)
 };
 
 /// Set the context level and item number
 #define setContext(c, l, i) do { (c).level = l; (c).item = (i) < 0 ? 0 : (i); } while (0)
 
+/** Count the UTF-16 code units of UTF-8 text.
+	@param[in] str UTF-8 text
+	@param[in] len length of str in bytes
+	@return length in UTF-16 code units
+*/
+static NMEInt countUCS16(NMEConstText str, NMEInt len)
+{
+	NMEInt n = 0, i = 0;
+	
+#if defined(__AVX2__)
+	// count 32 bytes at a time; 8-bit counters can sum up to 127 blocks
+	while (len - i >= 32)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		NMEInt blocks;
+		
+		for (blocks = (len - i) / 32 < 127 ? (len - i) / 32 : 127;
+				blocks > 0;
+				blocks--, i += 32)
+		{
+			__m256i v = _mm256_loadu_si256((__m256i const *)(str + i));
+			
+			// 1 for bytes which aren't continuation bytes (0x80-0xbf),
+			// 1 more for first bytes of 4-byte sequences (0xf0-0xf7)
+			acc = _mm256_sub_epi8(acc,
+					_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-65)));
+			acc = _mm256_sub_epi8(acc,
+					_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-17)),
+						_mm256_cmpgt_epi8(_mm256_set1_epi8(-8), v)));
+		}
+		acc = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+		n += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+				+ _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+	}
+#elif defined(NME_SSE2)	// (or earlier AVX2)
+	// count 16 bytes at a time; 8-bit counters can sum up to 127 blocks
+	while (len - i >= 16)
+	{
+		__m128i acc = _mm_setzero_si128();
+		NMEInt blocks;
+		
+		for (blocks = (len - i) / 16 < 127 ? (len - i) / 16 : 127;
+				blocks > 0;
+				blocks--, i += 16)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const *)(str + i));
+			
+			// 1 for bytes which aren't continuation bytes (0x80-0xbf),
+			// 1 more for first bytes of 4-byte sequences (0xf0-0xf7)
+			acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, _mm_set1_epi8(-65)));
+			acc = _mm_sub_epi8(acc,
+					_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(-17)),
+						_mm_cmplt_epi8(v, _mm_set1_epi8(-8))));
+		}
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		n += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+	for ( ; i < len; i++)
+		n += ucs16Units(str[i]);
+	return n;
+}
+
 /** Skip spaces and tabs
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
@@ -208,34 +496,243 @@ static void execOperator(NMEInt stack[], NMEInt *stackDepth, NMEChar op)
 	(*stackDepth)--;
 }
 
+/** Count the line ends in a range of text, i.e. LF and CR not followed
+	by LF in the range (CR LF counts once unless the range ends between them).
+	@param[in] str text
+	@param[in] begin index of the beginning of the range in str
+	@param[in] end index of the end of the range in str
+	@return number of line ends
+*/
+static NMEInt countLineEnds(NMEConstText str, NMEInt begin, NMEInt end)
+{
+	NMEInt n = 0, i = begin;
+	
+#if defined(NME_SSE2)
+	// count 16 bytes at a time (plus the next one for CR LF);
+	// 8-bit counters can sum up to 255 blocks
+	while (end - i >= 17)
+	{
+		__m128i acc = _mm_setzero_si128();
+		NMEInt blocks;
+		
+		for (blocks = (end - i - 1) / 16 < 255 ? (end - i - 1) / 16 : 255;
+				blocks > 0;
+				blocks--, i += 16)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const *)(str + i));
+			__m128i next = _mm_loadu_si128((__m128i const *)(str + i + 1));
+			
+			// LF, or CR not followed by LF
+			acc = _mm_sub_epi8(acc,
+					_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+						_mm_andnot_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('\n')),
+							_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))));
+		}
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		n += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+	for ( ; i < end; i++)
+		if (str[i] == '\n'
+				|| (str[i] == '\r' && (i + 1 == end || str[i + 1] != '\n')))
+			n++;
+	return n;
+}
+
 /**	Update srcLineNum and srcIndexForLineNum so that srcIndexForLineNum = srcIndex.
-	@param[in] src source code
+	Positions in src only move forward between calls, except when output is
+	reinserted or src is compacted, where srcIndexForLineNum is updated too;
+	hence lines are counted only once.
 	@param[in,out] context context
 */
 static void updateLineNum(NMEContext *context)
 {
-	for ( ;
-			context->srcIndexForLineNum < context->srcIndex;
-			context->srcIndexForLineNum++)
-		if (context->src[context->srcIndexForLineNum] == '\n'
-				|| (context->src[context->srcIndexForLineNum] == '\r'
-					&& (context->srcIndexForLineNum + 1 == context->srcIndex
-						|| context->src[context->srcIndexForLineNum + 1] != '\n')))
-			context->srcLineNum++;
+	if (context->srcIndexForLineNum < context->srcIndex)
+	{
+		context->srcLineNum += countLineEnds(context->src,
+				context->srcIndexForLineNum, context->srcIndex);
+		context->srcIndexForLineNum = context->srcIndex;
+	}
+}
+
+#define kExprStackSize 16	///< size of operator stack
+#define kExprErrorValue 1	///< default value if error
+
+/// Number of slots of NMEOutputFormat which can hold a template string
+#define kTemplateCount ((NMEInt)(sizeof(NMEOutputFormat) / sizeof(NMEConstText)))
+
+/// Instructions of compiled templates
+enum
+{
+	kOpEnd = 0,	///< end of template or of replicated string
+	kOpLiteral,	///< literal run without eol (offset in template, length)
+	kOpEol,	///< end of line
+	kOpNumber,	///< push number (value)
+	kOpVariable,	///< push variable (name)
+	kOpOperator,	///< execute operator (operator character)
+	kOpWrite,	///< write result of expression
+	kOpReplicate,	///< replicate string (length of code for string ending with kOpEnd, code)
+	kOpListNesting	///< write current list nesting
+};
+
+/** Output format templates compiled by NMECompileOutputFormat */
+struct NMECompiledOutputFormatStruct
+{
+	NMEInt fontSize;	///< value of s
+	NMEBoolean xref;	///< value of x
+	NMEChar ctrlChar;	///< control character templates have been compiled with
+	NMEConstText str[kTemplateCount];	///< compiled template strings (NULL if none)
+	NMEInt code[kTemplateCount];	///< index of compiled templates in ops
+	NMEPlugin const *plugins;	///< plugins indexed by name (NULL if none)
+	NMEInt pluginSlotCount;	///< number of slots of the plugin hash table (power of 2)
+	NMEInt pluginSlots;	/**< index in ops of the plugin hash table (index of
+		the first plugin with a given name and kind of brackets, or -1 if empty) */
+	NMEInt pluginPartial;	/**< index in ops of the list of plugins with
+		kNMEPluginOptPartialName in increasing order, ending with -1 */
+	NMEInt opsLen;	///< length of ops
+	NMEInt ops[1];	///< compiled templates (actual size given by opsLen)
+};
+
+/// Target of parseExpression (evaluation or compilation)
+typedef struct
+{
+	NMEContext *context;	///< context for variables, or NULL to compile expression
+	NMEInt stack[kExprStackSize + 1];	///< operands (constant operands when compiling)
+	NMEBoolean isConst[kExprStackSize + 1];	///< TRUE for constant operands when compiling
+	NMEInt stackDepth;	///< operand stack depth
+	NMEInt *ops;	///< compiled code
+	NMEInt opsLen;	///< length of compiled code
+	NMEInt opsSize;	///< size of ops (code beyond is counted but discarded)
+	NMEInt fontSize;	///< value of constant s when compiling
+	NMEBoolean xref;	///< value of constant x when compiling
+} NMEExprTarget;
+
+/** Get the value of a variable.
+	@param[in,out] context context
+	@param[in] name variable name
+	@return value
+*/
+static NMEInt variableValue(NMEContext *context, NMEChar name)
+{
+	switch (name)
+	{
+		case 'l':
+			return context->level;
+		case 'i':
+			if (context->item < 0)
+			{
+				// see convertChunkTask and renderBlock
+				context->stateUsed |= kStateUsedItemBefore;
+				return context->itemBefore;
+			}
+			return context->item;
+		case 's':
+			return context->fontSize;
+		case 'o':
+			context->stateUsed |= kStateUsedInputIndex;
+			return context->srcIndexOffset + context->srcIndex;
+		case 'L':
+			context->stateUsed |= kStateUsedLineNum;
+			updateLineNum(context);
+			return context->srcLineNum;
+		case 'p':
+			context->stateUsed |= kStateUsedOutputIndex;
+			return context->destOffset + context->destLen;
+		case 'x':
+			return context->xref;
+		default:
+			// custom variable
+			return context->outputFormat->getVarFun
+					? context->outputFormat->getVarFun(name,
+							context->outputFormat->getVarData)
+					: 0;
+	}
+}
+
+/** Append an instruction word to compiled code.
+	@param[in,out] target compilation target
+	@param[in] word instruction or argument
+*/
+static void emitOp(NMEExprTarget *target, NMEInt word)
+{
+	if (target->opsLen < target->opsSize)
+		target->ops[target->opsLen] = word;
+	target->opsLen++;
+}
+
+/** Push a number onto the operand stack, or compile it.
+	@param[in,out] target evaluation or compilation target
+	@param[in] value number
+*/
+static void pushNumber(NMEExprTarget *target, NMEInt value)
+{
+	if (!target->context)
+	{
+		emitOp(target, kOpNumber);
+		emitOp(target, value);
+		target->isConst[target->stackDepth] = TRUE;
+	}
+	target->stack[target->stackDepth++] = value;
+}
+
+/** Push the value of a variable onto the operand stack, or compile it
+	(s and x are constant during the whole conversion).
+	@param[in,out] target evaluation or compilation target
+	@param[in] name variable name
+*/
+static void pushVariable(NMEExprTarget *target, NMEChar name)
+{
+	if (target->context)
+		target->stack[target->stackDepth++] = variableValue(target->context, name);
+	else if (name == 's' || name == 'x')
+		pushNumber(target, name == 's' ? target->fontSize : target->xref);
+	else
+	{
+		emitOp(target, kOpVariable);
+		emitOp(target, name);
+		target->isConst[target->stackDepth++] = FALSE;
+	}
+}
+
+/** Execute an operator on the operand stack, or compile it (operators
+	with constant operands are folded).
+	@param[in,out] target evaluation or compilation target
+	@param[in] op operator
+*/
+static void applyOperator(NMEExprTarget *target, NMEChar op)
+{
+	if (!target->context)
+	{
+		if (!target->isConst[target->stackDepth - 2]
+				|| !target->isConst[target->stackDepth - 1]
+				|| (op == '/' && target->stack[target->stackDepth - 1] == 0))
+		{
+			emitOp(target, kOpOperator);
+			emitOp(target, op);
+			target->isConst[--target->stackDepth - 1] = FALSE;
+			return;
+		}
+		target->opsLen -= 4;	// replace both kOpNumber with result
+		execOperator(target->stack, &target->stackDepth, op);
+		target->stackDepth--;
+		pushNumber(target, target->stack[target->stackDepth]);
+		return;
+	}
+	execOperator(target->stack, &target->stackDepth, op);
 }
 
-/** Evaluate expression (are supported: + - * / = !(ne) > < & | ? :, parenthesis,
-	integers, l=level, i=item, s=size, o=src offset, L=line num, p=dest offset, x=xref).
+/** Parse expression (are supported: + - * / = !(ne) > < & | ? :, parenthesis,
+	integers, l=level, i=item, s=size, o=src offset, L=line num, p=dest offset, x=xref),
+	evaluating or compiling it on the fly.
 	@param[in] src source code
 	@param[in] srcLen length of source code
-	@param[in,out] context context for variables
-	@return result, or 1 if error
+	@param[in,out] target evaluation or compilation target
+	@return TRUE for success (result in target->stack[0] if evaluated),
+	FALSE if error
 */
-static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
-		NMEContext *context)
+static NMEBoolean parseExpression(NMEConstText src, NMEInt srcLen,
+		NMEExprTarget *target)
 {
-#define kExprStackSize 16	///< size of operand and operator stacks
-#define kExprErrorValue 1	///< default value if error
 	static struct
 	{
 		NMEChar op;	///< operator character (nul for end of list)
@@ -250,19 +747,17 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		{'*', 6}, {'/', 6},
 		{'\0', 0}
 	};
-	NMEInt stack[kExprStackSize];	// stack of operands (intermediate results)
-	NMEInt stackDepth;
 	NMEInt opStack[kExprStackSize];
 		// stack of waiting operators (index in opList, -1=parenthesis)
 	NMEInt opStackDepth;
-	NMEInt i, j;
+	NMEInt i, j, n;
 	
-	for (i = stackDepth = opStackDepth = 0; ; )
+	for (i = target->stackDepth = opStackDepth = 0; ; )
 	{
 		skipBlanks(src, srcLen, &i);
 		
 		if (i >= srcLen)
-			return 1;	// unexpected end of expression
+			return FALSE;	// unexpected end of expression
 		
 		// decode opening parenthesis
 		while (i < srcLen && src[i] == '(' && opStackDepth < kExprStackSize)
@@ -274,48 +769,18 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		
 		// decode number or variable
 		if (isDigit(src[i]))
-			for (stack[stackDepth] = 0; i < srcLen && isDigit(src[i]); i++)
-				stack[stackDepth] = 10 * stack[stackDepth] + src[i] - '0';
+		{
+			for (n = 0; i < srcLen && isDigit(src[i]); i++)
+				n = 10 * n + src[i] - '0';
+			pushNumber(target, n);
+		}
+		else if (src[i] == 'l' || src[i] == 'i' || src[i] == 's'
+				|| src[i] == 'o' || src[i] == 'L' || src[i] == 'p'
+				|| src[i] == 'x'
+				|| (src[i] >= 'A' && src[i] <= 'Z'))
+			pushVariable(target, src[i++]);
 		else
-			switch (src[i++])
-			{
-				case 'l':
-					stack[stackDepth] = context->level;
-					break;
-				case 'i':
-					stack[stackDepth] = context->item;
-					break;
-				case 's':
-					stack[stackDepth] = context->fontSize;
-					break;
-				case 'o':
-					stack[stackDepth] = context->srcIndex;
-					break;
-				case 'L':
-					updateLineNum(context);
-					stack[stackDepth] = context->srcLineNum;
-					break;
-				case 'p':
-					stack[stackDepth] = context->destLen;
-					break;
-				case 'x':
-					stack[stackDepth] = context->xref;
-					break;
-				default:
-					if (src[i - 1] >= 'A' && src[i - 1] <= 'Z')
-					{
-						// custom variable
-						if (context->outputFormat->getVarFun)
-							stack[stackDepth]
-									= context->outputFormat->getVarFun(src[i - 1],
-											context->outputFormat->getVarData);
-						else
-							stack[stackDepth] = 0;
-					}
-					else
-						return kExprErrorValue;	// unknown variable, or garbage
-			}
-		stackDepth++;
+			return FALSE;	// unknown variable, or garbage
 		
 		skipBlanks(src, srcLen, &i);
 		
@@ -325,9 +790,8 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 			// flush all waiting operators, including parenthesis not closed
 			for ( ; opStackDepth > 0; opStackDepth--)
 				if (opStack[opStackDepth - 1] >= 0)
-					execOperator(stack, &stackDepth,
-							opList[opStack[opStackDepth - 1]].op);
-			return stack[0];
+					applyOperator(target, opList[opStack[opStackDepth - 1]].op);
+			return TRUE;
 		}
 		
 		// decode closing parenthesis (those without matching opening parenthesis are ignored)
@@ -335,8 +799,7 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		{
 			// flush waiting operators until matching opening parenthesis
 			for ( ; opStackDepth > 0 && opStack[opStackDepth - 1] >= 0; opStackDepth--)
-				execOperator(stack, &stackDepth,
-						opList[opStack[opStackDepth - 1]].op);
+				applyOperator(target, opList[opStack[opStackDepth - 1]].op);
 			if (opStackDepth > 0)
 				opStackDepth--;	// opening parenthesis
 			
@@ -349,18 +812,18 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 		for (j = 0; opList[j].op && src[i] != opList[j].op; j++)
 			;
 		if (!opList[j].op)
-			return kExprErrorValue;	// unknown operator, or garbage
+			return FALSE;	// unknown operator, or garbage
 		
 		// execute operators with higher priority
 		for ( ; opStackDepth > 0
 					&& opStack[opStackDepth - 1] >= 0
 					&& opList[j].priority <= opList[opStack[opStackDepth - 1]].priority;
 				opStackDepth--)
-			execOperator(stack, &stackDepth, opList[opStack[opStackDepth - 1]].op);
+			applyOperator(target, opList[opStack[opStackDepth - 1]].op);
 		
 		// give up if op stack is full
 		if (opStackDepth >= kExprStackSize)
-			return kExprErrorValue;
+			return FALSE;
 		
 		// store operator in opStack
 		opStack[opStackDepth++] = j;
@@ -370,6 +833,242 @@ static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
 	}
 }
 
+/** Evaluate expression (see parseExpression).
+	@param[in] src source code
+	@param[in] srcLen length of source code
+	@param[in,out] context context for variables
+	@return result, or 1 if error
+*/
+static NMEInt evalExpression(NMEConstText src, NMEInt srcLen,
+		NMEContext *context)
+{
+	NMEExprTarget target;
+	
+	target.context = context;
+	return parseExpression(src, srcLen, &target)
+			? target.stack[0] : kExprErrorValue;
+}
+
+/** Enlarge dest or src with reallocFun, if any (the size is at least
+	doubled to avoid frequent reallocations).
+	@param[in,out] context current context
+	@param[in,out] buf buffer to enlarge (&context->dest or &context->src)
+	@param[in,out] size size of buf
+	@param[in] minSize minimum size
+	@return TRUE for success, FALSE if buf cannot be enlarged
+*/
+static NMEBoolean growBuffer(NMEContext *context,
+		NMEText *buf, NMEInt *size,
+		NMEInt minSize)
+{
+	NMEInt newSize;
+	NMEText newBuf;
+	
+	if (minSize <= *size)
+		return TRUE;
+	if (!context->reallocFun)
+		return FALSE;
+	
+	newSize = 2 * *size;
+	if (newSize < minSize)
+		newSize = minSize;
+	newBuf = (NMEText)context->reallocFun(*buf, newSize, context->reallocData);
+	if (!newBuf)
+		return FALSE;
+	*buf = newBuf;
+	*size = newSize;
+	return TRUE;
+}
+
+/// Check that dest has room for n more bytes, enlarging it if possible
+#define destHasRoom(c, n) \
+	((c)->destLen + (n) <= (c)->bufSize \
+		|| growBuffer((c), &(c)->dest, &(c)->bufSize, (c)->destLen + (n)))
+
+/** Update destLenUCS16 so that it counts the first len bytes of dest.
+	@param[in,out] context current context
+	@param[in] len number of bytes of dest to count
+*/
+static void countDestUCS16(NMEContext *context, NMEInt len)
+{
+	if (len > context->destLenCountedUCS16)
+		context->destLenUCS16 += countUCS16(context->dest + context->destLenCountedUCS16,
+				len - context->destLenCountedUCS16);
+	else
+		context->destLenUCS16 -= countUCS16(context->dest + len,
+				context->destLenCountedUCS16 - len);
+	context->destLenCountedUCS16 = len;
+}
+
+/** Truncate dest, keeping destLenUCS16 consistent.
+	@param[in,out] context current context
+	@param[in] len new length of dest
+*/
+static void truncateDest(NMEContext *context, NMEInt len)
+{
+	if (context->destLenCountedUCS16 > len)
+		countDestUCS16(context, len);
+	if (context->wrapCheckedEnd > len - 1)
+		context->wrapCheckedEnd = len - 1;	// last char will have a different successor
+	context->destLen = len;
+}
+
+/** Add a record to the headings or deferred plugin calls of the context.
+	@param[in,out] context current context
+	@param[in,out] buf buffer (&context->headings or &context->deferredSlots)
+	@param[in,out] len length of buf
+	@param[in,out] size size of buf
+	@param[in] n kDeferredRecordSize/4 numbers
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addDeferredRecord(NMEContext *context,
+		NMEText *buf, NMEInt *len, NMEInt *size,
+		NMEInt const n[])
+{
+	NMEInt i, k;
+	
+	if (!growBuffer(context, buf, size, *len + kDeferredRecordSize))
+		return FALSE;
+	for (i = 0; i < kDeferredRecordSize / 4; i++)
+		for (k = 0; k < 4; k++)
+			(*buf)[(*len)++] = (NMEChar)(n[i] >> 8 * k);
+	return TRUE;
+}
+
+/** Get a number of a record added by addDeferredRecord.
+	@param[in] rec record
+	@param[in] i index of number in record
+	@return number
+*/
+static NMEInt getDeferredRecordNumber(NMEConstText rec, NMEInt i)
+{
+	NMEInt k, n;
+	
+	for (k = 3, n = 0; k >= 0; k--)
+		n = n << 8 | (unsigned char)rec[4 * i + k];
+	return n;
+}
+
+/** Add text to context->deferredText.
+	@param[in,out] context current context
+	@param[in] text text
+	@param[in] len length of text
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addDeferredText(NMEContext *context,
+		NMEConstText text, NMEInt len)
+{
+	NMEInt i;
+	
+	if (!growBuffer(context, &context->deferredText, &context->deferredTextSize,
+			context->deferredTextLen + len))
+		return FALSE;
+	for (i = 0; i < len; i++)
+		context->deferredText[context->deferredTextLen++] = text[i];
+	return TRUE;
+}
+
+/** Add an end of line to dest.
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addEol(NMEContext *context)
+{
+	if (!destHasRoom(context, (context->eol[1] ? 1 : 0)
+			+ context->currentIndent + 1))
+		return FALSE;
+	context->dest[context->destLen++] = context->eol[0];
+	if (context->eol[1])
+		context->dest[context->destLen++] = context->eol[1];
+	context->col = context->currentIndent;
+	return TRUE;
+}
+
+/** Add the result of an expression to dest as a decimal number.
+	@param[in,out] context current context
+	@param[in] result number
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addNumber(NMEContext *context, NMEInt result)
+{
+	NMEInt i;
+	
+	if (!destHasRoom(context, 12))
+		return FALSE;
+	if (result < 0)
+	{
+		context->dest[context->destLen++] = '-';
+		result = -result;
+		context->col++;
+	}
+	for (i = 1000000000; i >= 1; i /= 10)
+		if (result >= i || i == 1)
+		{
+			context->dest[context->destLen++] = '0' + (result / i) % 10;
+			context->col++;
+		}
+	return TRUE;
+}
+
+/** Replicate the string added to dest since repStr.
+	@param[in,out] context current context
+	@param[in] repStr index of string in dest
+	@param[in] col0 value of col before string was added
+	@param[in] result number of times string is replicated (can be 0 or negative)
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean replicateString(NMEContext *context,
+		NMEInt repStr, NMEInt col0,
+		NMEInt result)
+{
+	NMEInt i, repStrLen;
+	
+	repStrLen = context->destLen - repStr;
+	truncateDest(context, repStr);
+	context->col = col0;
+	
+	// copy result times dest[*destLen..*destLen+len-1]
+	if (result > 100)
+		result = 100;	// avoid overflows
+	if (result > 0 && !destHasRoom(context, result * repStrLen))
+		return FALSE;
+	for (; result > 0; result--)
+	{
+		for (i = 0; i < repStrLen; i++)
+			context->dest[context->destLen++] = context->dest[repStr + i];
+		context->col += repStrLen;
+	}
+	return TRUE;
+}
+
+/// Markup character of a list nesting level (listNum[i])
+#define listNestingChar(n) \
+	((n) == kNMEListNumUL ? '*' \
+		: (n) == kNMEListNumDT ? ';' \
+		: (n) == kNMEListNumDD ? ':' \
+		: (n) == kNMEListIndented ? ':' \
+		: (n) == kNMEListNumTableCell ? '|' \
+		: (n) == kNMEListNumTableHCell ? '|' \
+		: '#')
+
+/** Add the current list nesting to dest.
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addListNesting(NMEContext *context)
+{
+	NMEInt i;
+	
+	if (!destHasRoom(context, kMaxNesting))
+		return FALSE;
+	for (i = 0; i < context->nesting; i++)
+	{
+		context->dest[context->destLen++] = listNestingChar(context->listNum[i]);
+		context->col++;
+	}
+	return TRUE;
+}
+
 NMEBoolean NMEAddString(NMEConstText str,
 		NMEInt strLen,
 		NMEChar ctrlChar,
@@ -385,30 +1084,20 @@ NMEBoolean NMEAddString(NMEConstText str,
 			;
 	
 	for (k = 0; k < strLen; )
-		if (context->destLen
-					+ (str[k] == '\n' ? (context->eol[1] ? 1 : 0)
-						+ context->currentIndent : 0)
-				>= context->bufSize)
-			return FALSE;
-		else if (str[k] == '\n')
+		if (str[k] == '\n')
 		{
-			context->dest[context->destLen++] = context->eol[0];
-			context->destLenUCS16++;
-			if (context->eol[1])
-			{
-				context->dest[context->destLen++] = context->eol[1];
-				context->destLenUCS16++;
-			}
+			if (!addEol(context))
+				return FALSE;
 			k++;
-			context->col = context->currentIndent;
 		}
+		else if (!destHasRoom(context, 1))
+			return FALSE;
 		else if (k + 2 < strLen
 				&& str[k] == ctrlChar
 				&& (str[k + 1] == '{' || (str[k + 1] == ctrlChar && str[k + 2] == '{')))
 		{
 			NMEBoolean replicate;
-			NMEText repStr;
-			NMEInt len, result, i, repStrLen, col0, destLenUCS160;
+			NMEInt len, result, repStr, col0;
 			
 			replicate = str[k + 1] == ctrlChar;
 			if (replicate)
@@ -431,74 +1120,25 @@ NMEBoolean NMEAddString(NMEConstText str,
 				// copy once, evaluating expressions
 				// (cannot have more recursive calls, because they occur only when
 				// the string contains double-ctrlChar which cannot happen here)
-				repStr = context->dest + context->destLen;	// repl. string after expr substitutions
-				destLenUCS160 = context->destLenUCS16;
+				repStr = context->destLen;	// index of repl. string after expr substitutions
 				col0 = context->col;
-				if (!NMEAddString(str + k, len, context->ctrlChar, context))
-					return FALSE;
-				repStrLen = context->dest + context->destLen - repStr;
-				context->destLen = repStr - context->dest;
-				context->destLenUCS16 = destLenUCS160;
-				context->col = col0;
-				
-				// copy result times dest[*destLen..*destLen+len-1]
-				if (result > 100)
-					result = 100;	// avoid overflows
-				if (result > 0 && context->destLen + result * repStrLen > context->bufSize)
+				if (!NMEAddString(str + k, len, context->ctrlChar, context)
+						|| !replicateString(context, repStr, col0, result))
 					return FALSE;
-				for (; result > 0; result--)
-				{
-					for (i = 0; i < repStrLen; i++)
-					{
-						context->dest[context->destLen++] = repStr[i];
-						if (isFirstUTF8Byte(repStr[i]))
-							context->destLenUCS16++;
-					}
-					context->col += repStrLen;
-				}
 				// skip rep string and double ctrlChar
 				k += len + 2;
 			}
-			else
-			{
-				// write result
-				if (context->destLen + 12 > context->bufSize)
-					return FALSE;
-				if (result < 0)
-				{
-					context->dest[context->destLen++] = '-';
-					context->destLenUCS16++;
-					result = -result;
-					context->col++;
-				}
-				for (i = 1000000000; i >= 1; i /= 10)
-					if (result >= i || i == 1)
-					{
-						context->dest[context->destLen++] = '0' + (result / i) % 10;
-						context->destLenUCS16++;
-						context->col++;
-					}
-			}
+			else if (!addNumber(context, result))
+				return FALSE;
 		}
 		else if (k + 2 < strLen && str[k] == ctrlChar && str[k + 1] == 'L')
 		{
-			NMEConstText str = NMECurrentListNesting(context);
-			NMEInt i;
-			
-			if (context->destLen + kMaxNesting > context->bufSize)
+			if (!addListNesting(context))
 				return FALSE;
-			for (i = 0; str[i]; i++)
-			{
-				context->dest[context->destLen++] = str[i];
-				context->destLenUCS16++;
-				context->col++;
-			}
 			k += 2;
 		}
 		else
 		{
-			if (isFirstUTF8Byte(str[k]))
-				context->destLenUCS16++;
 			context->dest[context->destLen++] = str[k++];
 			context->col++;
 		}
@@ -506,12 +1146,335 @@ NMEBoolean NMEAddString(NMEConstText str,
 	return TRUE;
 }
 
+/** Compile a template string, with the same semantics as NMEAddString.
+	@param[in] str template string
+	@param[in] begin index of the beginning of the string to compile in str
+	@param[in] end index of the end of the string to compile in str
+	@param[in] ctrlChar control character
+	@param[in,out] target compilation target
+*/
+static void compileTemplate(NMEConstText str, NMEInt begin, NMEInt end,
+		NMEChar ctrlChar,
+		NMEExprTarget *target)
+{
+	NMEInt k, len, opsLen0;
+	NMEBoolean replicate;
+	
+	for (k = begin; k < end; )
+		if (str[k] == '\n')
+		{
+			emitOp(target, kOpEol);
+			k++;
+		}
+		else if (k + 2 < end
+				&& str[k] == ctrlChar
+				&& (str[k + 1] == '{' || (str[k + 1] == ctrlChar && str[k + 2] == '{')))
+		{
+			replicate = str[k + 1] == ctrlChar;
+			if (replicate)
+				k++;
+			for (k += 2, len = 0; k + len < end && str[k + len] != '}'; len++)
+				;
+			if (k + len >= end)	// unexpected end of string
+				break;
+			opsLen0 = target->opsLen;
+			if (!parseExpression(str + k, len, target))
+			{
+				target->opsLen = opsLen0;
+				emitOp(target, kOpNumber);
+				emitOp(target, kExprErrorValue);
+			}
+			k += len + 1;	// skip after }
+			if (replicate)
+			{
+				// find string, until double-ctrlChar
+				for (len = 0;
+						k + len + 1 < end
+							&& (str[k + len] != ctrlChar
+									|| str[k + len + 1] != ctrlChar);
+						len++)
+					;
+				emitOp(target, kOpReplicate);
+				emitOp(target, 0);	// length of code, set below
+				opsLen0 = target->opsLen;
+				compileTemplate(str, k, k + len, ctrlChar, target);
+				if (opsLen0 <= target->opsSize)
+					target->ops[opsLen0 - 1] = target->opsLen - opsLen0;
+				// skip rep string and double ctrlChar
+				k += len + 2;
+			}
+			else
+				emitOp(target, kOpWrite);
+		}
+		else if (k + 2 < end && str[k] == ctrlChar && str[k + 1] == 'L')
+		{
+			emitOp(target, kOpListNesting);
+			k += 2;
+		}
+		else
+		{
+			// literal run until eol or control character
+			for (len = 0;
+					len == 0
+						|| (k + len < end && str[k + len] != '\n'
+							&& str[k + len] != ctrlChar);
+					len++)
+				;
+			emitOp(target, kOpLiteral);
+			emitOp(target, k);
+			emitOp(target, len);
+			k += len;
+		}
+	
+	emitOp(target, kOpEnd);
+}
+
+/** Add a compiled template string to dest.
+	@param[in,out] context current context
+	@param[in] str template string
+	@param[in] ops compiled code of str
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addCompiledString(NMEContext *context,
+		NMEConstText str, NMEInt const *ops)
+{
+	NMEInt stack[kExprStackSize + 1];
+	NMEInt stackDepth, repStr, col0, i;
+	
+	for (stackDepth = 0; ; )
+		switch (*ops++)
+		{
+			case kOpEnd:
+				return TRUE;
+			case kOpLiteral:
+				if (!destHasRoom(context, ops[1]))
+					return FALSE;
+				for (i = 0; i < ops[1]; i++)
+					context->dest[context->destLen++] = str[ops[0] + i];
+				context->col += ops[1];
+				ops += 2;
+				break;
+			case kOpEol:
+				if (!addEol(context))
+					return FALSE;
+				break;
+			case kOpNumber:
+				stack[stackDepth++] = *ops++;
+				break;
+			case kOpVariable:
+				stack[stackDepth++] = variableValue(context, (NMEChar)*ops++);
+				break;
+			case kOpOperator:
+				execOperator(stack, &stackDepth, (NMEChar)*ops++);
+				break;
+			case kOpWrite:
+				stackDepth = 0;
+				if (!addNumber(context, stack[0]))
+					return FALSE;
+				break;
+			case kOpReplicate:
+				stackDepth = 0;
+				repStr = context->destLen;
+				col0 = context->col;
+				if (!addCompiledString(context, str, ops + 1)
+						|| !replicateString(context, repStr, col0, stack[0]))
+					return FALSE;
+				ops += 1 + *ops;
+				break;
+			case kOpListNesting:
+				if (!addListNesting(context))
+					return FALSE;
+				break;
+		}
+}
+
+/** Append the first byte of an event to the events being recorded.
+	@param[in,out] context current context (context->recorder not NULL)
+	@param[in] event kEvent kind and flags
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean emitEvent(NMEContext *context, NMEInt event)
+{
+	NMEEventRecorder *recorder = context->recorder;
+	
+	if (!growBuffer(context, &recorder->events, &recorder->eventsSize,
+			recorder->eventsLen + 1))
+		return FALSE;
+	recorder->events[recorder->eventsLen++] = (NMEChar)event;
+	recorder->lastEvent = event & kEventKindMask;
+	return TRUE;
+}
+
+/** Append a number to the events being recorded, with 7 bits per byte
+	(least significant first, bit 7 set if more bytes follow) after mapping
+	0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+	@param[in,out] context current context (context->recorder not NULL)
+	@param[in] n number
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean emitEventNumber(NMEContext *context, NMEInt n)
+{
+	NMEEventRecorder *recorder = context->recorder;
+	unsigned long u = n < 0 ? ((unsigned long)-(n + 1) << 1) | 1 : (unsigned long)n << 1;
+	
+	if (!growBuffer(context, &recorder->events, &recorder->eventsSize,
+			recorder->eventsLen + 5))
+		return FALSE;
+	for ( ; u >= 0x80; u >>= 7)
+		recorder->events[recorder->eventsLen++] = (NMEChar)((u & 0x7f) | 0x80);
+	recorder->events[recorder->eventsLen++] = (NMEChar)u;
+	return TRUE;
+}
+
+/** Check whether a span of src can be referenced in the caller's input
+	or must be copied to events.
+	@param[in] context current context (context->recorder not NULL)
+	@param[in] begin index of the beginning of the span in src
+	@return kEventInline if the span must be copied, 0 otherwise
+*/
+#define eventSpanInline(context, begin) \
+	(!(context)->srcInPlace && (begin) < (context)->recorder->mappedBegin \
+		? kEventInline : 0)
+
+/** Append a span of src to the events being recorded: length and index
+	in the caller's input (as given by srcIndexOffset for reparsed output),
+	followed by the span itself if eventSpanInline.
+	@param[in,out] context current context (context->recorder not NULL)
+	@param[in] begin index of the beginning of the span in src
+	@param[in] end index of the end of the span in src
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean emitEventSpan(NMEContext *context, NMEInt begin, NMEInt end)
+{
+	NMEEventRecorder *recorder = context->recorder;
+	NMEInt k;
+	
+	if (!emitEventNumber(context, end - begin)
+			|| !emitEventNumber(context, context->srcIndexOffset + begin))
+		return FALSE;
+	if (eventSpanInline(context, begin))
+	{
+		if (!growBuffer(context, &recorder->events, &recorder->eventsSize,
+				recorder->eventsLen + end - begin))
+			return FALSE;
+		for (k = begin; k < end; k++)
+			recorder->events[recorder->eventsLen++] = context->src[k];
+	}
+	return TRUE;
+}
+
+/** Append events for the parser state which has changed since the last
+	call and which can be used by templates, hooks and plugins (input index,
+	line number, level, item and list nesting).
+	@param[in,out] context current context (context->recorder not NULL)
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean recordState(NMEContext *context)
+{
+	NMEEventRecorder *recorder = context->recorder;
+	NMEInt i;
+	
+	updateLineNum(context);
+	if (context->srcIndexOffset + context->srcIndex != recorder->inputIndex)
+	{
+		if (!emitEvent(context, kEventInputIndex)
+				|| !emitEventNumber(context,
+					context->srcIndexOffset + context->srcIndex - recorder->inputIndex))
+			return FALSE;
+		recorder->inputIndex = context->srcIndexOffset + context->srcIndex;
+	}
+	if (context->srcLineNum != recorder->lineNum)
+	{
+		if (!emitEvent(context, kEventLineNum)
+				|| !emitEventNumber(context, context->srcLineNum - recorder->lineNum))
+			return FALSE;
+		recorder->lineNum = context->srcLineNum;
+	}
+	if (context->level != recorder->level)
+	{
+		if (!emitEvent(context, kEventLevel)
+				|| !emitEventNumber(context, context->level))
+			return FALSE;
+		recorder->level = context->level;
+	}
+	if (context->item != recorder->item)
+	{
+		if (!emitEvent(context, kEventItem)
+				|| !emitEventNumber(context, context->item))
+			return FALSE;
+		recorder->item = context->item;
+	}
+	for (i = 0; i < context->nesting && context->listNum[i] == recorder->listNum[i]; i++)
+		;
+	if (context->nesting != recorder->nesting || i < context->nesting)
+	{
+		if (!emitEvent(context, kEventList)
+				|| !emitEventNumber(context, context->nesting))
+			return FALSE;
+		for (i = 0; i < context->nesting; i++)
+			if (!emitEventNumber(context, recorder->listNum[i] = context->listNum[i]))
+				return FALSE;
+		recorder->nesting = context->nesting;
+	}
+	return TRUE;
+}
+
+/** Add a template string of the output format to dest, using its compiled
+	code if it is still valid.
+	@param[in,out] context current context
+	@param[in] field address of template field in context->outputFormat
+	(recorded as an event by NMEProcessEvents)
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addTemplate(NMEContext *context, NMEConstText const *field)
+{
+	NMECompiledOutputFormat const *compiled = context->outputFormat->compiled;
+	NMEInt ix = (NMEInt)(field - &context->outputFormat->space);
+	
+	if (context->recorder)
+		return recordState(context)
+				&& emitEvent(context, kEventTemplate)
+				&& emitEventNumber(context, ix);
+	
+	if (compiled && *field
+			&& ix >= 0 && ix < kTemplateCount
+			&& compiled->str[ix] == *field
+			&& compiled->fontSize == context->fontSize
+			&& compiled->xref == context->xref
+			&& compiled->ctrlChar == context->ctrlChar)
+		return addCompiledString(context, *field, compiled->ops + compiled->code[ix]);
+	return NMEAddString(*field, -1, context->ctrlChar, context);
+}
+
+/// Add template field of the current output format to dest
+#define addFormatString(c, field) addTemplate((c), &(c)->outputFormat->field)
+
+NMEBoolean NMEAddAutoconvertLink(NMEInt linkOffset, NMEInt linkLength,
+		NMEInt textOffset, NMEInt textLength,
+		NMEContext *context)
+{
+	if (linkOffset < context->srcIndex || linkLength <= 0
+			|| linkOffset + linkLength > context->srcLen
+			|| textOffset < context->srcIndex || textLength <= 0
+			|| textOffset + textLength > context->srcLen)
+		return FALSE;
+	
+	context->autoLinkOffset = linkOffset;
+	context->autoLinkLength = linkLength;
+	context->autoLinkTextOffset = textOffset;
+	context->autoLinkTextLength = textLength;
+	context->autoLinkBegin = linkOffset < textOffset ? linkOffset : textOffset;
+	context->autoLinkEnd = linkOffset + linkLength > textOffset + textLength
+			? linkOffset + linkLength : textOffset + textLength;
+	return TRUE;
+}
+
 NMEErr NMEAddRawString(NMEConstText str,
 		NMEInt strLen,
 		NMEContext *context)
 {
 	NMEInt i;
-	NMEText d = context->dest + context->destLen;
+	NMEText d;
 	
 	if (!str)
 		return kNMEErrOk;	// no op if str is NULL
@@ -520,34 +1483,150 @@ NMEErr NMEAddRawString(NMEConstText str,
 		for (strLen = 0; str[strLen]; strLen++)
 			;
 	
-	if (context->destLen + strLen > context->bufSize)
+	if (!destHasRoom(context, strLen))
 		return kNMEErrNotEnoughMemory;
 	
+	d = context->dest + context->destLen;
 	for (i = 0; i < strLen; i++)
-	{
 		d[i] = str[i];
-		if (isFirstUTF8Byte(str[i]))
-			context->destLenUCS16++;
-	}
 	context->destLen += strLen;
 	context->col = 0;
 	
 	return kNMEErrOk;
 }
 
+/** Find the length of the initial run of characters which aren't replaced by
+	a compiled substitution table.
+	@param[in] src input characters
+	@param[in] len maximum length of the run
+	@param[in] table compiled substitution table
+	@return length of the run
+*/
+static NMEInt plainRunLength(NMEConstText src, NMEInt len,
+		NMEEncodeCharTable const *table)
+{
+	NMEInt n = 0;
+	
+#if defined(NME_SSE2)
+	if (table->dict == NMEXMLCharDict)
+	{
+		// skip 16 bytes at a time until one of <>"& or eol
+		__m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'),
+			quot = _mm_set1_epi8('"'), amp = _mm_set1_epi8('&'),
+			eol = _mm_set1_epi8('\n');
+		
+		for ( ; n + 16 <= len; n += 16)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const *)(src + n));
+			
+			if (_mm_movemask_epi8(_mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+					_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quot),
+							_mm_cmpeq_epi8(v, amp)),
+						_mm_cmpeq_epi8(v, eol)))))
+				break;	// found in this block by the loop below
+		}
+	}
+#endif
+	for ( ; n < len && !table->ix[(unsigned char)src[n]]; n++)
+		;
+	return n;
+}
+
+/** Add the replacement of a character to dest, copying it at once unless it
+	contains an eol or control sequences.
+	@param[in,out] context current context
+	@param[in] str null-terminated replacement string
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addReplacement(NMEContext *context, NMEConstText str)
+{
+	NMEInt len, k;
+	
+	for (len = 0; str[len]; len++)
+		if (str[len] == '\n' || str[len] == context->ctrlChar)
+			return NMEAddString(str, -1, context->ctrlChar, context);
+	if (!destHasRoom(context, len))
+		return FALSE;
+	for (k = 0; k < len; k++)
+		context->dest[context->destLen++] = str[k];
+	context->col += len;
+	return TRUE;
+}
+
+/** Encode characters with a compiled substitution table until the end of the
+	range or until the column reaches textWidth, whichever comes first (at
+	least one character is encoded), like NMEEncodeCharFunDict applied to each
+	character.
+	@param[in] src input characters
+	@param[in,out] i index in src
+	@param[in] end index of the end of the range in src
+	@param[in] table compiled substitution table
+	@param[in] textWidth column where to stop for wordwrap (0 for none)
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr encodeCharRun(NMEConstText src, NMEInt *i, NMEInt end,
+		NMEEncodeCharTable const *table,
+		NMEInt textWidth,
+		NMEContext *context)
+{
+	NMEInt n, k;
+	NMEErr err;
+	
+	while (*i < end)
+	{
+		// copy run of characters which aren't replaced, not beyond textWidth
+		n = end - *i;
+		if (textWidth > 0 && n > textWidth - context->col)
+			n = textWidth - context->col > 1 ? textWidth - context->col : 1;
+		n = plainRunLength(src + *i, n, table);
+		if (!destHasRoom(context, n))
+			return kNMEErrNotEnoughMemory;
+		for (k = 0; k < n; k++)
+			context->dest[context->destLen++] = src[*i + k];
+		context->col += n;
+		*i += n;
+		
+		if (n == 0)
+		{
+			// replace next character
+			k = table->ix[(unsigned char)src[*i]];
+			if (k == 255)
+				CheckError(NMEEncodeCharFunDict(src, end, i, context,
+						(void *)table->dict));
+			else if (!addReplacement(context, table->dict[k - 1].str))
+				return kNMEErrNotEnoughMemory;
+			else
+				(*i)++;
+		}
+		
+		if (textWidth > 0 && context->col >= textWidth)
+			break;
+	}
+	return kNMEErrOk;
+}
+
 NMEErr NMECopySource(NMEInt length,
 		NMEBoolean copy,
 		NMEBoolean encodeChar,
 		NMEContext *context)
 {
-	if (context->srcIndexOffset + context->srcIndex + length > context->srcLen)
-		length = context->srcLen - (context->srcIndexOffset + context->srcIndex);
+	if (context->srcIndex + length > context->srcLen)
+		length = context->srcLen - context->srcIndex;
 	if (copy)
 	{
 		NMEInt i;
 		NMEErr err;
 		
-		if (encodeChar && context->outputFormat->encodeCharFun)
+		if (encodeChar && context->encodeCharTable.dict)
+		{
+			for (i = context->srcIndex; i < context->srcIndex + length; )
+				CheckError(encodeCharRun(context->src, &i, context->srcIndex + length,
+						&context->encodeCharTable, 0,
+						context));
+		}
+		else if (encodeChar && context->outputFormat->encodeCharFun)
 		{
 			NMEEncodeCharFun fun = context->outputFormat->encodeCharFun;
 			void *data = context->outputFormat->encodeCharData;
@@ -558,17 +1637,14 @@ NMEErr NMECopySource(NMEInt length,
 		else
 		{
 			NMEConstText s = context->src + context->srcIndex;
-			NMEText d = context->dest + context->destLen;
+			NMEText d;
 			
-			if (context->destLen + length > context->bufSize)
+			if (!destHasRoom(context, length))
 				return kNMEErrNotEnoughMemory;
+			d = context->dest + context->destLen;
 			
 			for (i = 0; i < length; i++)
-			{
 				d[i] = s[i];
-				if (isFirstUTF8Byte(s[i]))
-					context->destLenUCS16++;
-			}
 			context->srcIndex += length;
 			context->destLen += length;
 		}
@@ -581,7 +1657,7 @@ NMEErr NMECopySource(NMEInt length,
 
 void NMEResetOutput(NMEContext *context)
 {
-	context->destLen = 0;
+	truncateDest(context, 0);
 }
 
 /** Check wordwrap, inserting an end-of-line and spaces for indenting if
@@ -593,6 +1669,11 @@ void NMEResetOutput(NMEContext *context)
 static NMEErr checkWordwrap(NMEContext *context,
 		NMEOutputFormat const *outputFormat)
 {
+	if (context->recorder)
+		return context->recorder->lastEvent == kEventWordwrap
+					|| emitEvent(context, kEventWordwrap)
+				? kNMEErrOk : kNMEErrNotEnoughMemory;
+	
 	if (outputFormat && outputFormat->textWidth > 0
 			&& context->col >= outputFormat->textWidth)
 	{
@@ -601,36 +1682,35 @@ static NMEErr checkWordwrap(NMEContext *context,
 		NMEInt i, j, dist;
 		NMEWordwrapPermission perm;
 		
+		// find last wordwrap point on current line, skipping the span already
+		// checked by previous calls (the last char is checked again, since
+		// wordwrapPermFun can depend on the next char)
 		perm = kNMEWordwrapNo;
-		if (outputFormat->wordwrapPermFun)
-		{
-			// find last wordwrap point on current line
-			for (i = context->destLen - 1;
-					i >= 0 && !isEol(context->dest[i]);
-					i--)
+		for (i = context->destLen - 1;
+				i >= 0 && !isEol(context->dest[i]);
+				i--)
+			if (i >= context->wrapCheckedBegin && i < context->wrapCheckedEnd)
+				i = context->wrapCheckedBegin;
+			else if (outputFormat->wordwrapPermFun)
 			{
 				perm = outputFormat->wordwrapPermFun(context->dest, context->destLen, i,
 						context, outputFormat->wordwrapPermData);
 				if (perm != kNMEWordwrapNo)
 					break;
 			}
-		}
-		else
-		{
-			// find last space on current line
-			for (i = context->destLen - 1;
-					i >= 0 && !isEol(context->dest[i]);
-					i--)
-				if (isBlank(context->dest[i]))
-				{
-					perm = kNMEWordwrapReplaceChar;
-					break;
-				}
-		}
+			else if (isBlank(context->dest[i]))
+			{
+				perm = kNMEWordwrapReplaceChar;
+				break;
+			}
 		
 		// ret. if none
 		if (perm == kNMEWordwrapNo)
+		{
+			context->wrapCheckedBegin = i + 1;
+			context->wrapCheckedEnd = context->destLen - 1;
 			return kNMEErrOk;
+		}
 		
 		// if eol has two char or spaceBeforeWordWrap, insert enough space
 		dist = (context->eol[1] ? 2 : 1)
@@ -638,12 +1718,17 @@ static NMEErr checkWordwrap(NMEContext *context,
 				+ context->currentIndent;
 		if (dist > 0)
 		{
-			if (context->destLen + dist > context->bufSize)
+			if (!destHasRoom(context, dist))
 				return kNMEErrNotEnoughMemory;
 			for (j = context->destLen - 1; j > i; j--)
 				context->dest[j + dist] = context->dest[j];
 			context->destLen += dist;
-			context->destLenUCS16 += dist;
+			if (context->destLenCountedUCS16 > i)
+			{
+				// spaces and eol inserted in the counted part
+				context->destLenCountedUCS16 += dist;
+				context->destLenUCS16 += dist;
+			}
 		}
 		
 		// insert eol
@@ -655,6 +1740,10 @@ static NMEErr checkWordwrap(NMEContext *context,
 		for (j = 0; j < context->currentIndent; j++)
 			context->dest[i++] = ' ';
 		context->col = context->destLen - i + context->currentIndent;
+		
+		// chars moved to the new line have been checked
+		context->wrapCheckedBegin = i;
+		context->wrapCheckedEnd = context->destLen - 1;
 	}
 	
 	return kNMEErrOk;
@@ -696,17 +1785,53 @@ NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	for (i = 0; ((NMEEncodeCharDict const *)data)[i].str; i++)
 		if (src[*srcIx] == ((NMEEncodeCharDict const *)data)[i].ch)
 		{
-			if (!NMEAddString(((NMEEncodeCharDict const *)data)[i].str, -1,
-					context->ctrlChar, context))
+			if (!addReplacement(context, ((NMEEncodeCharDict const *)data)[i].str))
 				return kNMEErrNotEnoughMemory;
 			(*srcIx)++;
 			return kNMEErrOk;
 		}
-	if (!NMEAddString(&src[(*srcIx)++], 1, context->ctrlChar, context))
-		return kNMEErrNotEnoughMemory;
+	if (src[*srcIx] == '\n')
+	{
+		if (!addEol(context))
+			return kNMEErrNotEnoughMemory;
+	}
+	else
+	{
+		if (!destHasRoom(context, 1))
+			return kNMEErrNotEnoughMemory;
+		context->dest[context->destLen++] = src[*srcIx];
+		context->col++;
+	}
+	(*srcIx)++;
 	return kNMEErrOk;
 }
 
+void NMECompileEncodeCharDict(NMEEncodeCharDict const *dict,
+		NMEEncodeCharTable *table)
+{
+	NMEInt i, n;
+	
+	table->dict = dict;
+	for (i = 0; i < 256; i++)
+		table->ix[i] = 0;
+	table->ix['\n'] = 255;	// eol
+	
+	// backward so that the first replacement of a character has precedence
+	for (n = 0; dict[n].str; n++)
+		;
+	for (i = n - 1; i >= 0; i--)
+		table->ix[(unsigned char)dict[i].ch] = i < 254 ? i + 1 : 255;
+}
+
+NMEErr NMEEncodeCharRange(NMEConstText src, NMEInt srcLen,
+		NMEEncodeCharTable const *table,
+		NMEContext *context)
+{
+	NMEInt i = 0;
+	
+	return encodeCharRun(src, &i, srcLen, table, 0, context);
+}
+
 /** encodeCharFunNME function for NME output; characters are left unescaped when
 	possible.
 	@param[in] src input characters
@@ -1023,14 +2148,12 @@ static NMEWordwrapPermission wordwrapCheckNMEFun(NMEConstText txt,
 		NMEContext *context,
 		void *data)
 {
-	NMEConstText listNesting;
 	NMEInt j;
 	(void)data;
 	
 	// check we aren't in a table
-	listNesting = NMECurrentListNesting(context);
-	for (j = 0; listNesting[j]; j++)
-		if (listNesting[j] == '|')
+	for (j = 0; j < context->nesting; j++)
+		if (listNestingChar(context->listNum[j]) == '|')
 			return kNMEWordwrapNo;
 	
 	// check the next character doesn't get a special meaning if moved to the beginning of a line
@@ -1174,15 +2297,11 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	
 	if ((src[*srcIx] & 0x80) == 0)	// one byte, ASCII
 	{
-		if (context->destLen + 1 >= context->bufSize)
+		if (!destHasRoom(context, 2))
 			return kNMEErrNotEnoughMemory;
 		if (src[*srcIx] == '\\' || src[*srcIx] == '{' || src[*srcIx] == '}')
-		{
 			context->dest[context->destLen++] = '\\';	// \, { and } must be escaped
-			context->destLenUCS16++;
-		}
 		context->dest[context->destLen++] = src[(*srcIx)++];
-		context->destLenUCS16++;
 		return kNMEErrOk;
 	}
 	else if (*srcIx + 1 < srcLen && (src[*srcIx] & 0xe0) == 0xc0	// two bytes
@@ -1204,7 +2323,7 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 		return kNMEErrOk;
 	}
 	
-	if (context->destLen + 9 >= context->bufSize)	// worst case (\u-30000?)
+	if (!destHasRoom(context, 10))	// worst case (\u-30000?)
 		return kNMEErrNotEnoughMemory;
 	
 	// unsigned -> signed
@@ -1216,18 +2335,13 @@ static NMEErr encodeCharRTFFun(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 	if (ch < 0)
 	{
 		context->dest[context->destLen++] = '-';
-		context->destLenUCS16++;
 		ch = -ch;
 	}
 	for (i = 1; i < ch; i *= 10)
 		;
 	for (i /= 10; i > 0; i /= 10)
-	{
 		context->dest[context->destLen++] = '0' + (ch / i) % 10;
-		context->destLenUCS16++;
-	}
 	context->dest[context->destLen++] = '?';	// ANSI representation
-	context->destLenUCS16 += 3;	// \u?
 	
 	return kNMEErrOk;
 }
@@ -1513,13 +2627,49 @@ static NMEErr addLink(NMEContext *context,
 	else
 	{
 		// copy link as is
-		if (context->destLen + linkLen > context->bufSize)
+		if (!destHasRoom(context, linkLen))
 			return kNMEErrNotEnoughMemory;
 		for (i = 0; i < linkLen; i++)
-		{
 			context->dest[context->destLen++] = link[i];
-			context->destLenUCS16++;
-		}
+	}
+	
+	return kNMEErrOk;
+}
+
+/** Write the separator and the link after the link text or image alt text
+	if the output format requires it (linkAfterSep or imageAfterSep).
+	@param[in] style kNMEStyleLink or kNMEStyleImage
+	@param[in] outputFormat format strings
+	@param[in,out] context current context where link position and source is stored
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addLinkAfterText(NMEStyle style,
+		NMEOutputFormat const *outputFormat,
+		NMEContext *context)
+{
+	NMEErr err;
+	
+	if (context->recorder)
+		return recordState(context)
+					&& emitEvent(context,
+						kEventLinkEnd | (style == kNMEStyleImage ? kEventFlagA : 0))
+				? kNMEErrOk : kNMEErrNotEnoughMemory;
+	
+	if (style == kNMEStyleLink
+			&& outputFormat->sepLink && outputFormat->linkAfterSep)
+	{
+		if (!addFormatString(context, sepLink))
+			return kNMEErrNotEnoughMemory;
+		CheckError(addLink(context, outputFormat));
+		CheckError(checkWordwrap(context, outputFormat));
+	}
+	else if (style == kNMEStyleImage
+			&& outputFormat->sepImage && outputFormat->imageAfterSep)
+	{
+		if (!addFormatString(context, sepImage))
+			return kNMEErrNotEnoughMemory;
+		CheckError(addLink(context, outputFormat));
+		CheckError(checkWordwrap(context, outputFormat));
 	}
 	
 	return kNMEErrOk;
@@ -1627,43 +2777,25 @@ static NMEErr processStyleTag(
 								kNMEStyleMonospace, NULL)))
 			{
 				// write separator and link if they must be after the text
-				if (styleStack[j] == kNMEStyleLink
-						&& outputFormat->sepLink && outputFormat->linkAfterSep)
-				{
-					if (!NMEAddString(outputFormat->sepLink, -1,
-								context->ctrlChar, context))
-						return kNMEErrNotEnoughMemory;
-					CheckError(addLink(context, outputFormat));
-					CheckError(checkWordwrap(context, outputFormat));
-				}
-				else if (styleStack[j] == kNMEStyleImage
-						&& outputFormat->sepImage && outputFormat->imageAfterSep)
-				{
-					if (!NMEAddString(outputFormat->sepImage, -1,
-								context->ctrlChar, context))
-						return kNMEErrNotEnoughMemory;
-					CheckError(addLink(context, outputFormat));
-					CheckError(checkWordwrap(context, outputFormat));
-				}
+				if (styleStack[j] == kNMEStyleLink || styleStack[j] == kNMEStyleImage)
+					CheckError(addLinkAfterText(styleStack[j], outputFormat, context));
 				
 				// write end tag
-				if (!NMEAddString(styleStack[j] == kNMEStyleBold
-								? outputFormat->endBold
+				if (!addTemplate(context, styleStack[j] == kNMEStyleBold
+								? &outputFormat->endBold
 							: styleStack[j] == kNMEStyleItalic
-								? outputFormat->endItalic
+								? &outputFormat->endItalic
 							: styleStack[j] == kNMEStyleUnderline
-								? outputFormat->endUnderline
+								? &outputFormat->endUnderline
 							: styleStack[j] == kNMEStyleSuperscript
-								? outputFormat->endSuperscript
+								? &outputFormat->endSuperscript
 							: styleStack[j] == kNMEStyleSubscript
-								? outputFormat->endSubscript
+								? &outputFormat->endSubscript
 							: styleStack[j] == kNMEStyleLink
-								? outputFormat->endLink
+								? &outputFormat->endLink
 							: styleStack[j] == kNMEStyleImage
-								? outputFormat->endImage
-								: outputFormat->endCode,
-							-1,
-							context->ctrlChar, context))
+								? &outputFormat->endImage
+								: &outputFormat->endCode))
 					return kNMEErrNotEnoughMemory;
 				CheckError(checkWordwrap(context, outputFormat));
 				
@@ -1679,19 +2811,17 @@ static NMEErr processStyleTag(
 				styleStack[i] = styleStack[j];
 				if (styleStack[i] != kNMEStyleVerbatim)
 				{
-					if (!NMEAddString(styleStack[i] == kNMEStyleBold
-								? outputFormat->beginBold
+					if (!addTemplate(context, styleStack[i] == kNMEStyleBold
+								? &outputFormat->beginBold
 							: styleStack[i] == kNMEStyleItalic
-								? outputFormat->beginItalic
+								? &outputFormat->beginItalic
 							: styleStack[i] == kNMEStyleUnderline
-								? outputFormat->beginUnderline
+								? &outputFormat->beginUnderline
 							: styleStack[i] == kNMEStyleSuperscript
-								? outputFormat->beginSuperscript
+								? &outputFormat->beginSuperscript
 							: styleStack[i] == kNMEStyleSubscript
-								? outputFormat->beginSubscript
-								: outputFormat->beginCode,
-							-1,
-							context->ctrlChar, context))
+								? &outputFormat->beginSubscript
+								: &outputFormat->beginCode))
 						return kNMEErrNotEnoughMemory;
 					CheckError(checkWordwrap(context, outputFormat));
 				}
@@ -1704,9 +2834,9 @@ static NMEErr processStyleTag(
 	// not found; add it unless it's kNMEStyleLink or kNMEStyleImage
 	//  or any style in image alt text if noStyleInAlt
 	if (style == kNMEStyleLink || style == kNMEStyleImage
-			|| (outputFormat->noStyleInAlt
-				&& findStyleInStyleStack(styleStack, *styleNesting,
-						kNMEStyleImage, NULL)))
+			|| (findStyleInStyleStack(styleStack, *styleNesting,
+						kNMEStyleImage, NULL)
+				&& noStyleInAlt(context)))
 		return kNMEErrOk;	// ignore
 	styleStack[(*styleNesting)++] = style;
 	
@@ -1717,14 +2847,12 @@ static NMEErr processStyleTag(
 								kNMEStyleMonospace, NULL)))
 		return kNMEErrOk;
 	HOOK(TRUE, style);
-	if (!NMEAddString(style == kNMEStyleBold ? outputFormat->beginBold
-					: style == kNMEStyleItalic ? outputFormat->beginItalic
-					: style == kNMEStyleUnderline ? outputFormat->beginUnderline
-					: style == kNMEStyleSuperscript ? outputFormat->beginSuperscript
-					: style == kNMEStyleSubscript ? outputFormat->beginSubscript
-					: outputFormat->beginCode,
-				-1,
-				context->ctrlChar, context))
+	if (!addTemplate(context, style == kNMEStyleBold ? &outputFormat->beginBold
+					: style == kNMEStyleItalic ? &outputFormat->beginItalic
+					: style == kNMEStyleUnderline ? &outputFormat->beginUnderline
+					: style == kNMEStyleSuperscript ? &outputFormat->beginSuperscript
+					: style == kNMEStyleSubscript ? &outputFormat->beginSubscript
+					: &outputFormat->beginCode))
 		return kNMEErrNotEnoughMemory;
 	CheckError(checkWordwrap(context, outputFormat));
 	return kNMEErrOk;
@@ -1756,42 +2884,24 @@ static NMEErr flushStyleTags(
 						&& !findStyleInStyleStack(styleStack, *styleNesting,
 								kNMEStyleMonospace, NULL)))
 		{
-			if (styleStack[i] == kNMEStyleLink
-					&& outputFormat->sepLink && outputFormat->linkAfterSep)
-			{
-				if (!NMEAddString(outputFormat->sepLink, -1,
-							context->ctrlChar, context))
-					return kNMEErrNotEnoughMemory;
-				CheckError(addLink(context, outputFormat));
-				CheckError(checkWordwrap(context, outputFormat));
-			}
-			else if (styleStack[i] == kNMEStyleImage
-					&& outputFormat->sepImage && outputFormat->imageAfterSep)
-			{
-				if (!NMEAddString(outputFormat->sepImage, -1,
-							context->ctrlChar, context))
-					return kNMEErrNotEnoughMemory;
-				CheckError(addLink(context, outputFormat));
-				CheckError(checkWordwrap(context, outputFormat));
-			}
+			if (styleStack[i] == kNMEStyleLink || styleStack[i] == kNMEStyleImage)
+				CheckError(addLinkAfterText(styleStack[i], outputFormat, context));
 			
-			if (!NMEAddString(styleStack[i] == kNMEStyleBold
-									? outputFormat->endBold
+			if (!addTemplate(context, styleStack[i] == kNMEStyleBold
+									? &outputFormat->endBold
 								: styleStack[i] == kNMEStyleItalic
-									? outputFormat->endItalic
+									? &outputFormat->endItalic
 								: styleStack[i] == kNMEStyleUnderline
-									? outputFormat->endUnderline
+									? &outputFormat->endUnderline
 								: styleStack[i] == kNMEStyleSuperscript
-									? outputFormat->endSuperscript
+									? &outputFormat->endSuperscript
 								: styleStack[i] == kNMEStyleSubscript
-									? outputFormat->endSubscript
+									? &outputFormat->endSubscript
 								: styleStack[i] == kNMEStyleLink
-									? outputFormat->endLink
+									? &outputFormat->endLink
 								: styleStack[i] == kNMEStyleImage
-									? outputFormat->endImage
-								: outputFormat->endCode,
-							-1,
-							context->ctrlChar, context))
+									? &outputFormat->endImage
+								: &outputFormat->endCode))
 				return kNMEErrNotEnoughMemory;
 			CheckError(checkWordwrap(context, outputFormat));
 				
@@ -1854,8 +2964,7 @@ static NMEErr addEndPar(NMEBoolean forceEndOfList,
 		if (context->listNum[context->nesting - 1] >= 0)	// ordered list
 		{
 			context->listNum[context->nesting - 1]++;
-			if (!NMEAddString(outputFormat->endOLItem, -1,
-						context->ctrlChar, context))
+			if (!addFormatString(context, endOLItem))
 				return kNMEErrNotEnoughMemory;
 			CheckError(checkWordwrap(context, outputFormat));
 			HOOK(parHookFun, context->level, context->item, FALSE, "#");
@@ -1863,17 +2972,14 @@ static NMEErr addEndPar(NMEBoolean forceEndOfList,
 		else if (context->listNum[context->nesting - 1] == kNMEListNumTableCell
 				|| context->listNum[context->nesting - 1] == kNMEListNumTableHCell)
 		{
-			if (!NMEAddString(context->listNum[context->nesting - 1] == kNMEListNumTableCell
-							? outputFormat->endTableCell
-							: outputFormat->endTableHCell,
-						-1,
-						context->ctrlChar, context))
+			if (!addTemplate(context, context->listNum[context->nesting - 1] == kNMEListNumTableCell
+							? &outputFormat->endTableCell
+							: &outputFormat->endTableHCell))
 				return kNMEErrNotEnoughMemory;
 			CheckError(checkWordwrap(context, outputFormat));
 			HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE,
 					context->listNum[context->nesting - 1] == kNMEListNumTableCell ? "|" : "|=");
-			if (!NMEAddString(outputFormat->endTableRow, -1,
-							context->ctrlChar, context))
+			if (!addFormatString(context, endTableRow))
 				return kNMEErrNotEnoughMemory;
 			CheckError(checkWordwrap(context, outputFormat));
 		}
@@ -1881,25 +2987,25 @@ static NMEErr addEndPar(NMEBoolean forceEndOfList,
 			switch (context->listNum[context->nesting - 1])
 			{
 				case kNMEListNumUL:
-					if (!NMEAddString(outputFormat->endULItem, -1, context->ctrlChar, context))
+					if (!addFormatString(context, endULItem))
 						return kNMEErrNotEnoughMemory;
 					CheckError(checkWordwrap(context, outputFormat));
 					HOOK(parHookFun, context->level, context->item, FALSE, "*");
 					break;
 				case kNMEListNumDT:
-					if (!NMEAddString(outputFormat->endDT, -1, context->ctrlChar, context))
+					if (!addFormatString(context, endDT))
 						return kNMEErrNotEnoughMemory;
 					CheckError(checkWordwrap(context, outputFormat));
 					HOOK(parHookFun, context->level, context->item, FALSE, ";");
 					break;
 				case kNMEListNumDD:
-					if (!NMEAddString(outputFormat->endDD, -1, context->ctrlChar, context))
+					if (!addFormatString(context, endDD))
 						return kNMEErrNotEnoughMemory;
 					CheckError(checkWordwrap(context, outputFormat));
 					HOOK(parHookFun, context->level, context->item, FALSE, ";:");
 					break;
 				case kNMEListIndented:
-					if (!NMEAddString(outputFormat->endIndentedPar, -1, context->ctrlChar, context))
+					if (!addFormatString(context, endIndentedPar))
 						return kNMEErrNotEnoughMemory;
 					CheckError(checkWordwrap(context, outputFormat));
 					HOOK(parHookFun, context->level, context->item, FALSE, ":");
@@ -1914,68 +3020,70 @@ static NMEErr addEndPar(NMEBoolean forceEndOfList,
 				switch (context->listNum[context->nesting - 1])
 				{
 					case kNMEListNumUL:
-						if (!NMEAddString(outputFormat->endUL, -1, context->ctrlChar, context))
+						if (!addFormatString(context, endUL))
 							return kNMEErrNotEnoughMemory;
 						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(divHookFun, context->level, 0, FALSE, "*");
 						break;
 					case kNMEListNumDT:
 					case kNMEListNumDD:
-						if (!NMEAddString(outputFormat->endDL, -1, context->ctrlChar, context))
+						if (!addFormatString(context, endDL))
 							return kNMEErrNotEnoughMemory;
 						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(divHookFun, context->level, 0, FALSE, ";");
 						break;
 					case kNMEListIndented:
-						if (!NMEAddString(outputFormat->endIndented, -1, context->ctrlChar, context))
+						if (!addFormatString(context, endIndented))
 							return kNMEErrNotEnoughMemory;
 						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(divHookFun, context->level, 0, FALSE, ":");
 						break;
 					case kNMEListNumTableCell:
 					case kNMEListNumTableHCell:
-						if (!NMEAddString(outputFormat->endTable, -1, context->ctrlChar, context))
+						if (!addFormatString(context, endTable))
 							return kNMEErrNotEnoughMemory;
 						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(divHookFun, kNMEHookLevelPar, 0, FALSE, "|");
 						break;
 					default:
-						if (!NMEAddString(outputFormat->endOL, -1, context->ctrlChar, context))
+						if (!addFormatString(context, endOL))
 							return kNMEErrNotEnoughMemory;
 						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(divHookFun, context->level, 0, FALSE, "#");
 						break;
 				}
 				context->nesting--;
-				setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
-				if (outputFormat->sublistInListItem && context->nesting > 0)
+				setContext(*context, context->nesting,
+						context->nesting > 0 ? context->listNum[context->nesting - 1] : 0);
+				if (sublistInListItem(context, context->nesting > 0))
 					switch (context->listNum[context->nesting - 1])
 					{
 						case kNMEListNumUL:
-							if (!NMEAddString(outputFormat->endULItem, -1, context->ctrlChar, context))
+							if (!addFormatString(context, endULItem))
 								return kNMEErrNotEnoughMemory;
 							break;
 						case kNMEListNumDT:
 						case kNMEListNumDD:
-							if (!NMEAddString(outputFormat->endDD, -1, context->ctrlChar, context))
+							if (!addFormatString(context, endDD))
 								return kNMEErrNotEnoughMemory;
 							break;
 						case kNMEListIndented:
 							// straight indenting, no nesting
 							break;
 						default:	// ordered list
-							if (!NMEAddString(outputFormat->endOLItem, -1, context->ctrlChar, context))
+							if (!addFormatString(context, endOLItem))
 								return kNMEErrNotEnoughMemory;
 							break;
 					}
 			}
 		
-		setContext(*context, level0, item0);
+		context->level = level0;
+		context->item = item0;
 		return kNMEErrOk;
 	}
 	else
 	{
-		if (!NMEAddString(outputFormat->endPar, -1, context->ctrlChar, context))
+		if (!addFormatString(context, endPar))
 			return kNMEErrNotEnoughMemory;
 		CheckError(checkWordwrap(context, outputFormat));
 		HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "p");
@@ -1984,6 +3092,91 @@ static NMEErr addEndPar(NMEBoolean forceEndOfList,
 #undef HOOK
 }
 
+/** Write the beginning of a link or image: beginLink or beginImage and, unless
+	linkAfterSep or imageAfterSep, the link followed by sepLink or sepImage
+	(if the output format has them); then the link text verbatim if it isn't
+	separate.
+	@param[in] isImage TRUE for image, FALSE for link
+	@param[in] verbatimText TRUE to write the link text verbatim
+	@param[in] textOffset index in src of link text
+	@param[in] textLength length of link text
+	@param[in] outputFormat format strings
+	@param[in,out] context current context where link position and source is stored
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addLinkBeginOutput(NMEBoolean isImage,
+		NMEBoolean verbatimText,
+		NMEInt textOffset,
+		NMEInt textLength,
+		NMEOutputFormat const *outputFormat,
+		NMEContext *context)
+{
+	NMEInt k, begin, end;
+	NMEErr err;
+	
+	if (context->recorder)
+	{
+		// span with link and text
+		begin = context->linkOffset < textOffset ? context->linkOffset : textOffset;
+		end = context->linkOffset + context->linkLength > textOffset + textLength
+				? context->linkOffset + context->linkLength : textOffset + textLength;
+		return recordState(context)
+					&& emitEvent(context, kEventLinkBegin
+						| (isImage ? kEventFlagA : 0) | (verbatimText ? kEventFlagB : 0)
+						| eventSpanInline(context, begin))
+					&& emitEventSpan(context, begin, end)
+					&& emitEventNumber(context, context->linkOffset - begin)
+					&& emitEventNumber(context, context->linkLength)
+					&& emitEventNumber(context, textOffset - begin)
+					&& emitEventNumber(context, textLength)
+				? kNMEErrOk : kNMEErrNotEnoughMemory;
+	}
+	
+	if (isImage ? outputFormat->sepImage : outputFormat->sepLink)
+	{
+		// write beginning of link
+		if (!addTemplate(context, isImage ? &outputFormat->beginImage : &outputFormat->beginLink))
+			return kNMEErrNotEnoughMemory;
+		CheckError(checkWordwrap(context, outputFormat));
+		// write link unless linkAfterSep or imageAfterSep
+		if (!(isImage ? outputFormat->imageAfterSep : outputFormat->linkAfterSep))
+		{
+			CheckError(addLink(context, outputFormat));
+			if (!addTemplate(context, isImage ? &outputFormat->sepImage : &outputFormat->sepLink))
+				return kNMEErrNotEnoughMemory;
+			CheckError(checkWordwrap(context, outputFormat));
+		}
+	}
+	
+	if (verbatimText)
+	{
+		// no separate link text or image alt text: write link verbatim
+		for (k = 0; k < textLength; )
+		{
+			if (outputFormat->charHookFun)
+				CheckError(outputFormat->charHookFun(textOffset + k,
+						context,
+						outputFormat->charHookData));
+			if (outputFormat->encodeCharFun)
+				CheckError(outputFormat->encodeCharFun(context->src + textOffset,
+						textLength, &k,
+						context,
+						outputFormat->encodeCharData));
+			else
+			{
+				if (!destHasRoom(context, 1))
+					return kNMEErrNotEnoughMemory;
+				context->dest[context->destLen++] = context->src[textOffset + k];
+				k++;
+				context->col++;
+			}
+			CheckError(checkWordwrap(context, outputFormat));
+		}
+	}
+	
+	return kNMEErrOk;
+}
+
 /** Parse the beginning of a link and leave the parsing point
 	at the beginning of the link text.
 	@param[in] isImage TRUE for image, FALSE for link
@@ -2001,14 +3194,33 @@ static NMEErr addLinkBegin(NMEBoolean isImage,
 		NMEOutputFormat const *outputFormat,
 		NMEContext *context)
 {
-	NMEInt j, k;
+	NMEInt j, k, textOffset, textLength;
+	NMEBoolean autoLink = context->srcIndex == context->autoLinkBegin;
+	NMEBoolean verbatimText;
 	NMEErr err;
 	
+	context->autoLinkBegin = -1;
+	
 	// check if already parsing a link or image
 	for (j = 0; j < *styleNesting; j++)
 		if ((styleStack[j] == kNMEStyleLink && !isImage)	// image in links are ok
 				|| styleStack[j] == kNMEStyleImage)
+		{
+			// autoconvert link is parsed as plain text
+			context->autoLinkEnd = -1;
 			return kNMEErrOk;
+		}
+	
+	if (autoLink)
+	{
+		// link reported by NMEAddAutoconvertLink, without any markup
+		context->linkOffset = context->autoLinkOffset;
+		context->linkLength = context->autoLinkLength;
+		textOffset = context->autoLinkTextOffset;
+		textLength = context->autoLinkTextLength;
+		j = context->autoLinkEnd;
+		goto linkFound;
+	}
 	
 	// skip spaces
 	skipBlanks(context->src, context->srcLen, &context->srcIndex);
@@ -2041,9 +3253,10 @@ static NMEErr addLinkBegin(NMEBoolean isImage,
 	}
 	
 	// set link location
-	context->linkOffset = context->srcIndex;
-	context->linkLength = k - context->srcIndex;
+	context->linkOffset = textOffset = context->srcIndex;
+	context->linkLength = textLength = k - context->srcIndex;
 	
+linkFound:
 	// call hook, if any
 	if (outputFormat->spanHookFun)
 	{
@@ -2056,59 +3269,19 @@ static NMEErr addLinkBegin(NMEBoolean isImage,
 				outputFormat->hookData));
 	}
 	
-	if (isImage ? outputFormat->sepImage : outputFormat->sepLink)
-	{
-		// write beginning of link
-		if (!NMEAddString(isImage ? outputFormat->beginImage : outputFormat->beginLink, -1,
-					context->ctrlChar, context))
-			return kNMEErrNotEnoughMemory;
-		CheckError(checkWordwrap(context, outputFormat));
-		// write link unless linkAfterSep or imageAfterSep
-		if (!(isImage ? outputFormat->imageAfterSep : outputFormat->linkAfterSep))
-		{
-			CheckError(addLink(context, outputFormat));
-			if (!NMEAddString(isImage ? outputFormat->sepImage : outputFormat->sepLink, -1,
-					context->ctrlChar, context))
-				return kNMEErrNotEnoughMemory;
-			CheckError(checkWordwrap(context, outputFormat));
-		}
-	}
+	// write link, and link text if there's no separate link text or image alt text
+	verbatimText = autoLink || j >= context->srcLen || context->src[j] != '|';
+	CheckError(addLinkBeginOutput(isImage, verbatimText, textOffset, textLength,
+			outputFormat, context));
 	
 	// continue with link text or image alt text
-	if (j < context->srcLen && context->src[j] == '|')
+	if (!verbatimText)
 	{
 		context->srcIndex = j + 1;
 		skipBlanks(context->src, context->srcLen, &context->srcIndex);
 	}
 	else
-	{
-		// no separate link text or image alt text: write link verbatim
-		for (k = 0; k < context->linkLength; )
-		{
-			if (outputFormat->charHookFun)
-				CheckError(outputFormat->charHookFun(context->linkOffset + k,
-						context,
-						outputFormat->charHookData));
-			if (outputFormat->encodeCharFun)
-				CheckError(outputFormat->encodeCharFun(context->src + context->linkOffset,
-						context->linkLength, &k,
-						context,
-						outputFormat->encodeCharData));
-			else
-			{
-				if (context->destLen + 1 > context->bufSize)
-					return kNMEErrNotEnoughMemory;
-				context->dest[context->destLen++] = context->src[context->linkOffset + k];
-				if (isFirstUTF8Byte(context->src[context->linkOffset + k]))
-					context->destLenUCS16++;
-				k++;
-				context->col++;
-			}
-			CheckError(checkWordwrap(context, outputFormat));
-		}
-		// skip to end of link, before the end markup
-		context->srcIndex = j;
-	}
+		context->srcIndex = j;	// skip to end of link, before the end markup
 	
 	// add link or image "style", which indicates we're expecting an
 	//  end-of-link marker
@@ -2117,7 +3290,50 @@ static NMEErr addLinkBegin(NMEBoolean isImage,
 	return kNMEErrOk;
 }
 
-/** Find plugin.
+/** Compute the hash code of a plugin name.
+	@param[in] name plugin name
+	@param[in] nameLen length of name
+	@param[in] isPlaceholder TRUE for triple angle brackets
+	@return hash code
+*/
+static unsigned long pluginHash(NMEConstText name, NMEInt nameLen,
+		NMEBoolean isPlaceholder)
+{
+	unsigned long h = isPlaceholder ? 2166136261UL : 84696351UL;
+	NMEInt k;
+	
+	for (k = 0; k < nameLen; k++)
+		h = ((h ^ (unsigned char)name[k]) * 16777619UL) & 0xffffffffUL;
+	return h;
+}
+
+/** Check if a plugin matches a plugin tag.
+	@param[in] plugin plugin
+	@param[in] name name in plugin tag
+	@param[in] nameLen length of name
+	@param[in] isPlaceholder if TRUE, end tag must be triple right angle brackets
+	@return TRUE if plugin matches
+*/
+static NMEBoolean pluginMatches(NMEPlugin const *plugin,
+		NMEConstText name, NMEInt nameLen,
+		NMEBoolean isPlaceholder)
+{
+	NMEInt k;
+	
+	if (!(isPlaceholder
+			^ ((plugin->options & kNMEPluginOptTripleAngleBrackets) == 0)))
+		return FALSE;
+	
+	// compare plugin name
+	for (k = 0; k < nameLen && plugin->name[k]; k++)
+		if (name[k] != plugin->name[k])
+			return FALSE;
+	return plugin->name[k] == '\0'
+			&& (k == nameLen || (plugin->options & kNMEPluginOptPartialName));
+}
+
+/** Find plugin, with the index of the compiled output format if it's
+	still valid or with a linear search otherwise.
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
 	@param[in] i parsing point
@@ -2129,8 +3345,9 @@ static NMEInt findPlugin(NMEConstText src, NMEInt srcLen, NMEInt i,
 		NMEBoolean isPlaceholder,
 		NMEOutputFormat const *outputFormat)
 {
+	NMECompiledOutputFormat const *compiled = outputFormat->compiled;
 	NMEConstText name;
-	NMEInt nameLen, j, k;
+	NMEInt nameLen, j, h;
 	
 	// find name
 	skipBlanks(src, srcLen, &i);
@@ -2143,25 +3360,36 @@ static NMEInt findPlugin(NMEConstText src, NMEInt srcLen, NMEInt i,
 			nameLen++)
 		;
 	
-	// find plugin
-	if (outputFormat->plugins && nameLen > 0)
-		for (j = 0; outputFormat->plugins[j].name; j++)
-			if (isPlaceholder
-					^ ((outputFormat->plugins[j].options & kNMEPluginOptTripleAngleBrackets) == 0))
-			{
-				// compare plugin name
-				for (k = 0; k < nameLen && outputFormat->plugins[j].name[k]; k++)
-					if (name[k] != outputFormat->plugins[j].name[k])
-						goto continueMainLoop;
-				if (outputFormat->plugins[j].name[k] != '\0'
-						|| (k < nameLen
-							&& !(outputFormat->plugins[j].options & kNMEPluginOptPartialName)))
-					goto continueMainLoop;
-				
-				return j;
-continueMainLoop:
-				;
-			}
+	if (!outputFormat->plugins || nameLen <= 0)
+		return -1;
+	
+	if (compiled && compiled->plugins == outputFormat->plugins)
+	{
+		NMEInt const *slots = compiled->ops + compiled->pluginSlots;
+		NMEInt const *partial = compiled->ops + compiled->pluginPartial;
+		NMEInt found = -1;
+		
+		// plugin with the same name
+		for (h = (NMEInt)(pluginHash(name, nameLen, isPlaceholder)
+					& (compiled->pluginSlotCount - 1));
+				slots[h] >= 0;
+				h = (h + 1) & (compiled->pluginSlotCount - 1))
+			if ((found < 0 || slots[h] < found)
+					&& pluginMatches(&outputFormat->plugins[slots[h]],
+						name, nameLen, isPlaceholder))
+				found = slots[h];
+		
+		// first plugin whose name is the beginning of name, if before
+		for (j = 0; partial[j] >= 0 && (found < 0 || partial[j] < found); j++)
+			if (pluginMatches(&outputFormat->plugins[partial[j]],
+					name, nameLen, isPlaceholder))
+				return partial[j];
+		return found;
+	}
+	
+	for (j = 0; outputFormat->plugins[j].name; j++)
+		if (pluginMatches(&outputFormat->plugins[j], name, nameLen, isPlaceholder))
+			return j;
 	
 	// not found
 	return -1;
@@ -2170,6 +3398,8 @@ continueMainLoop:
 /** Parse and process a plugin tag.
 	@param[in] isBlock if TRUE, end tag must be alone in a line
 	@param[in] isPlaceholder if TRUE, end tag must be triple right angle brackets
+	@param[in] pluginIndex index of plugin in outputFormat->plugins given by
+	findPlugin, or -1 if none matches
 	@param[in] options kNMEProcessOptDefault or sum of options
 	@param[in] outputFormat format strings, or NULL for default
 	@param[in,out] context current context
@@ -2178,6 +3408,7 @@ continueMainLoop:
 */
 static NMEErr addPlugin(NMEBoolean isBlock,
 		NMEBoolean isPlaceholder,
+		NMEInt pluginIndex,
 		NMEInt options,
 		NMEOutputFormat const *outputFormat,
 		NMEContext *context,
@@ -2185,9 +3416,12 @@ static NMEErr addPlugin(NMEBoolean isBlock,
 {
 	NMEConstText name, data;
 	NMEInt nameLen, dataLen;
-	NMEInt j, k;
+	NMEInt j;
+	NMEInt slot[kDeferredRecordSize / 4];
 	NMEErr err;
 	
+	*reparseOutput = FALSE;
+	
 	// find name
 	skipBlanks(context->src, context->srcLen, &context->srcIndex);
 	name = context->src + context->srcIndex;
@@ -2244,36 +3478,53 @@ static NMEErr addPlugin(NMEBoolean isBlock,
 	if (dataLen > 0 && data[dataLen - 1] == '\r')
 		dataLen--;
 	
-	// find plugin
-	if (outputFormat->plugins && nameLen > 0)
-		for (j = 0; outputFormat->plugins[j].name; j++)
-			if (isPlaceholder
-					^ ((outputFormat->plugins[j].options & kNMEPluginOptTripleAngleBrackets) == 0))
-			{
-				// compare plugin name
-				for (k = 0; k < nameLen && outputFormat->plugins[j].name[k]; k++)
-					if (name[k] != outputFormat->plugins[j].name[k])
-						goto continueMainLoop;
-				if (outputFormat->plugins[j].name[k] != '\0'
-						|| (k < nameLen
-							&& !(outputFormat->plugins[j].options & kNMEPluginOptPartialName)))
-					goto continueMainLoop;
-				
-				// execute plugin
-				CheckError(outputFormat->plugins[j].cb(name, nameLen,
-						data, dataLen,
-						context,
-						outputFormat->plugins[j].userData));
-				
-				*reparseOutput
-						= (outputFormat->plugins[j].options & kNMEPluginOptReparseOutput) != 0;
-				
-				return kNMEErrOk;
-continueMainLoop:
-				;
-			}
-	
 	// not found: ignore
+	if (pluginIndex < 0)
+		return kNMEErrOk;
+	
+	// plugin whose output isn't parsed again: executed by NMERenderEvents
+	if (context->recorder
+			&& !(outputFormat->plugins[pluginIndex].options & kNMEPluginOptReparseOutput))
+		return recordState(context)
+					&& emitEvent(context, kEventPlugin
+						| eventSpanInline(context, (NMEInt)(name - context->src)))
+					&& emitEventNumber(context, pluginIndex)
+					&& emitEventSpan(context, (NMEInt)(name - context->src),
+						(NMEInt)(data + dataLen - context->src))
+					&& emitEventNumber(context, 0)
+					&& emitEventNumber(context, nameLen)
+					&& emitEventNumber(context, (NMEInt)(data - name))
+					&& emitEventNumber(context, dataLen)
+				? kNMEErrOk : kNMEErrNotEnoughMemory;
+	
+	// plugin called by callDeferredPlugins, once all headings are known
+	if (context->deferPlugins
+			&& (outputFormat->plugins[pluginIndex].options
+				& (kNMEPluginOptDeferred | kNMEPluginOptReparseOutput))
+					== kNMEPluginOptDeferred)
+	{
+		slot[0] = context->destLen;
+		slot[1] = pluginIndex;
+		slot[2] = context->deferredTextLen;
+		slot[3] = nameLen;
+		slot[4] = dataLen;
+		return addDeferredRecord(context, &context->deferredSlots,
+					&context->deferredSlotsLen, &context->deferredSlotsSize, slot)
+				&& addDeferredText(context, name, nameLen)
+				&& addDeferredText(context, data, dataLen)
+				&& addDeferredText(context, "", 1)	// null byte, like ">>" in src
+			? kNMEErrOk : kNMEErrNotEnoughMemory;
+	}
+	
+	// execute plugin
+	CheckError(outputFormat->plugins[pluginIndex].cb(name, nameLen,
+			data, dataLen,
+			context,
+			outputFormat->plugins[pluginIndex].userData));
+	
+	*reparseOutput
+			= (outputFormat->plugins[pluginIndex].options & kNMEPluginOptReparseOutput) != 0;
+	
 	return kNMEErrOk;
 }
 
@@ -2306,10 +3557,60 @@ static void nextHeading(NMEInt *headingFlags,
 	}
 }
 
+/** Record the beginning of a heading for deferred plugins, once beginHeading
+	has been added.
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean beginHeadingRecord(NMEContext *context)
+{
+	NMEInt n[kDeferredRecordSize / 4];
+	
+	if (!context->deferPlugins)
+		return TRUE;
+	
+	context->headingTextBegin = context->srcIndexOffset + context->srcIndex;
+	n[0] = context->headingLevel;
+	n[1] = context->item;
+	n[2] = context->headingTextBegin;
+	n[3] = context->deferredTextLen;
+	n[4] = 0;	// text length set by endHeadingRecord
+	return addDeferredRecord(context, &context->headings,
+			&context->headingsLen, &context->headingsSize, n);
+}
+
+/** Record the end of a heading for deferred plugins, copying its text.
+	@param[in,out] context current context
+	@param[in] end index in src of the end of the heading text
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean endHeadingRecord(NMEContext *context, NMEInt end)
+{
+	NMEInt begin, k;
+	
+	if (!context->deferPlugins || context->headingsLen == 0)
+		return TRUE;
+	
+	// beginning of text, unless discarded from src
+	begin = context->headingTextBegin - context->srcIndexOffset;
+	if (begin < 0)
+		begin = 0;
+	else if (begin > end)
+		begin = end;
+	if (!addDeferredText(context, context->src + begin, end - begin))
+		return FALSE;
+	
+	// set text length, last number of the last record
+	for (k = 0; k < 4; k++)
+		context->headings[context->headingsLen - 4 + k] = (NMEChar)((end - begin) >> 8 * k);
+	return TRUE;
+}
+
 /** Parse next token, skipping it in the source code.
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
 	@param[in,out] i index in src (token to parse on input, next token on output)
+	@param[in] textEnd end of the part of src which can be parsed as kNMETokenText
 	@param[in] state current state of the parser
 	@param[in] verbatim TRUE if in inline verbatim mode
 	@param[in] nesting current list nesting
@@ -2327,6 +3628,7 @@ static void nextHeading(NMEInt *headingFlags,
 */
 static NMEBoolean parseNextToken(NMEConstText src, NMEInt srcLen,
 		NMEInt *i,
+		NMEInt textEnd,
 		NMEState state,
 		NMEBoolean verbatim,
 		NMEInt nesting,
@@ -2342,6 +3644,23 @@ static NMEBoolean parseNextToken(NMEConstText src, NMEInt srcLen,
 {
 	NMEInt k;	// temp. index in src
 	
+	// longest run of characters which cannot be markup
+	if (state == kNMEStatePar || state == kNMEStateHeading || state == kNMEStatePre)
+	{
+		unsigned char mask = state == kNMEStatePar ? kCharMarkupPar
+				: state == kNMEStateHeading ? kCharMarkupHeading
+				: kCharMarkupPre;
+		
+		for (k = *i; k < textEnd && !(charMarkup[(unsigned char)src[k]] & mask); k++)
+			;
+		if (k > *i)
+		{
+			*token = kNMETokenText;
+			*i = k;
+			return TRUE;
+		}
+	}
+	
 	// skip blanks before trailing = in headings (must do it here)
 	if (state == kNMEStateHeading && isBlank(src[*i]))
 	{
@@ -2802,229 +4121,594 @@ tokenLI:
 	return TRUE;
 }
 
-/** Swap source and destination buffers after some plugin or autoconvert
-	output must be reparsed.
-	@param[in,out] src input characters
-	@param[in,out] srcLen length of src in bytes
+/** Copy source code parsed in place (read-only caller's input) to a buffer
+	where it can be modified and followed by temporary memory. With fixed
+	buffers, buf is split in two halves for src and dest.
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr copySourceToBuffer(NMEContext *context)
+{
+	NMEInt k, size;
+	NMEText buf;
+	
+	if (!context->srcInPlace)
+		return kNMEErrOk;
+	
+	if (context->reallocFun)
+	{
+		// allocate src separately
+		size = 2 * context->srcLen + kAllocExtraSize;
+		buf = (NMEText)context->reallocFun(NULL, size, context->reallocData);
+		if (!buf)
+			return kNMEErrNotEnoughMemory;
+	}
+	else
+	{
+		// move dest to the second half of buf and give the first half to src
+		size = context->bufSize / 2;
+		if (context->srcLen > size || context->destLen > size)
+			return kNMEErrNotEnoughMemory;
+		buf = context->dest;
+		for (k = context->destLen - 1; k >= 0; k--)
+			buf[size + k] = buf[k];
+		context->dest = buf + size;
+		context->bufSize = size;
+	}
+	
+	for (k = 0; k < context->srcLen; k++)
+		buf[k] = context->src[k];
+	context->src = buf;
+	context->srcSize = size;
+	context->srcInPlace = FALSE;
+	return kNMEErrOk;
+}
+
+/** Move output of a plugin or autoconvert function, dest[destLen0..destLen-1],
+	to src just before srcIndex, so that it is parsed again.
 	@param[in,out] context current context
-	@param[in,out] commonLen number of bytes at beginning of dest already copied in src
 	@param[in] destLen0 value of destLen before plugin or autoconvert call
 	@return error code (kNMEErrOk for success)
-	@see NMEProcess
+	@see parseSource
 */
-static NMEErr swapBuffers(NMEText *src, NMEInt *srcLen,
-		NMEContext *context,
-		NMEInt *commonLen,
+static NMEErr reinsertOutput(NMEContext *context,
 		NMEInt destLen0)
 {
-	NMEInt k;
-	NMEText tmp;
+	NMEInt len, shift, k;
+	NMEErr err;
 	
-	// check size
-	if (*srcLen + context->destLen - context->srcIndex > context->bufSize
-			|| destLen0 > context->bufSize)
-		return kNMEErrNotEnoughMemory;
+	// source parsed in place is copied only now that it must be modified
+	CheckError(copySourceToBuffer(context));
 	
 	// update line number while we still have past src
 	updateLineNum(context);
 	
-	// see comment at beginning of NMEProcess
-	for (k = 0; k < *srcLen - context->srcIndex; k++)
-		context->dest[context->destLen + k] = (*src)[context->srcIndex + k];
-	for (k = 0; k < destLen0 - *commonLen; k++)
-		(*src)[*commonLen + k] = context->dest[*commonLen + k];
-	*commonLen = destLen0;
-	*srcLen += context->destLen - context->srcIndex;
-	context->srcIndexOffset -= context->destLen - context->srcIndex;
-	context->srcIndex = context->srcIndexForLineNum = context->destLen = destLen0;
-	tmp = *src; *src = context->dest; context->dest = tmp;
+	// see comment at beginning of parseSource
+	len = context->destLen - destLen0;
+	if (len > context->srcIndex)
+	{
+		// not enough processed input: move input still to be processed
+		shift = len - context->srcIndex;
+		if (!growBuffer(context, &context->src, &context->srcSize,
+				context->srcLen + shift))
+			return kNMEErrNotEnoughMemory;
+		for (k = context->srcLen - 1; k >= context->srcIndex; k--)
+			context->src[k + shift] = context->src[k];
+		if (context->noAutoOrPluginLen >= context->srcIndex)
+			context->noAutoOrPluginLen += shift;
+		if (context->recorder && context->recorder->mappedBegin >= context->srcIndex)
+			context->recorder->mappedBegin += shift;
+		context->srcLen += shift;
+		context->srcIndex += shift;
+		context->srcIndexOffset -= shift;
+	}
+	for (k = 0; k < len; k++)
+		context->src[context->srcIndex - len + k] = context->dest[destLen0 + k];
+	if (context->recorder && context->recorder->mappedBegin < context->srcIndex)
+		context->recorder->mappedBegin = context->srcIndex;
+	context->reparsedEnd = context->srcIndex;
+	context->srcIndex = context->srcIndexForLineNum = context->srcIndex - len;
+	context->autoconvertNext = 0;
+	context->autoLinkBegin = context->autoLinkEnd = -1;
+	truncateDest(context, destLen0);
 	
 	return kNMEErrOk;
 }
 
-NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
-		NMEText buf, NMEInt bufSize,
+/** Check whether an autoconvert can match at a given character.
+	@param[in] autoconvert autoconvert entry
+	@param[in] c character src[i] where the autoconvert would be called
+	@return TRUE if c is in autoconvert->triggers or if it has no triggers
+*/
+static NMEBoolean isAutoconvertTrigger(NMEAutoconvert const *autoconvert, NMEChar c)
+{
+	NMEConstText t;
+	
+	if (!autoconvert->triggers)
+		return TRUE;
+	for (t = autoconvert->triggers; *t; t++)
+		if (*t == c)
+			return TRUE;
+	return FALSE;
+}
+
+/** Set up format and parser state of a context before processing source code
+	(buffers are set up by the caller).
+	@param[out] context context to initialize
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+*/
+static void initContext(NMEContext *context,
 		NMEInt options,
 		NMEConstText eol,
 		NMEOutputFormat const *outputFormat,
-		NMEInt fontSize,
-		NMEText *output,
-		NMEInt *outputLen,
-		NMEInt *outputUCS16Len)
+		NMEInt fontSize)
 {
-	/*
-	NMEProcess uses two buffers for input and output and swaps them when
-	it must reprocess output, be it for plugins or autoconvert.
-	src[0..commonLen-1]: partial copy of processed output, same as dest[0..commonLen-1]
-	src[commonLen..i0-1]: processed input, can be discarded
-	src[i0..srcLen-1]: input still to be processed
-	dest[0..destLen0-1]: processed output
-	When having to consume src[i0..i-1] and replace it with dest[destLen0..destLen-1] which must
-	be processed again, the following steps occur:
-	- copy src[i..srcLen-1] to dest[destLen..destLen+srcLen-i-1]
-	- copy dest[commonLen..destLen0-1] to src[commonLen..destLen0-1]
-	- set commonLen to destLen0
-	- set srcLen to srcLen + destLen - i
-	- set i to destLen0
-	- set destLen to destLen0
-	- swap src and dest
-	*/
-	NMEInt destLenTmp;	// temp. destLen used with plugins and autoconvert
-	NMEInt commonLen;	// length of processed text shared in src and dest
-	NMEInt i0;	// value of srcIndex before parsing current token
-	NMEInt noAutoOrPluginLen;	// initial span of src protected against autoconvert and plugins
-	NMEBoolean reparseOutput;	// TRUE if plugin's output must be parsed again
-	NMEState state;	// current state
-	NMEToken token;	// next token
-	NMEInt headingNum[kMaxNumberedHeadingLevels];	// last heading number
-	NMEInt headingFlags;	// bit i-1 is 1 if currently in a section at level i
-	NMEStyle styleStack[kNMEStylesCount];	// stack of styles
-	NMEInt styleNesting;	// number of styles in styleStack
-	NMEStyle newStyle = (NMEStyle)0;
-	NMEInt itemNesting = 0;
-	NMEInt headingLevel = 0;	// current heading level (1=top-level heading)
-	NMEInt headingLevel0 = 0;	// heading level before current token
-	NMEBoolean firstIteration;	// TRUE during first loop iteration, used with sublistInListItem
-	NMEContext context;	// context used for expressions in output strings
-	NMEErr err;
+	NMEInt i, j;
+	NMEConstText t;
+	
+	// set up format
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	context->fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
+	context->options = options;
+	context->eol = eol;
+	context->ctrlChar = outputFormat->ctrlChar;
+	context->xref = (options & kNMEProcessOptXRef) != 0;
+	setContext(*context, 0, 0);
+	
+	// set up parser state
+	context->outputFormat = outputFormat;
+	context->destLen = context->col = 0;
+	context->destLenUCS16 = context->destLenCountedUCS16 = 0;
+	context->wrapCheckedBegin = context->wrapCheckedEnd = 0;
+	context->destOffset = 0;
+	context->stateUsed = 0;
+	context->itemBefore = 0;
+	context->noAutoOrPluginLen = 0;
+	context->reparsedEnd = 0;
+	context->currentIndent = 0;
+	context->state = kNMEStateBetweenPar;
+	context->nesting = 0;
+	context->styleNesting = 0;
+	context->newStyle = (NMEStyle)0;
+	context->itemNesting = 0;
+	context->headingLevel = 0;
+	context->headingNum[0] = -1;
+	nextHeading(&context->headingFlags, context->headingNum, 1);
+	context->headingFlags = 0;
+	context->srcIndex = 0;
+	context->srcIndexOffset = 0;
+	context->srcTail = 0;
+	context->tokenIndex = 0;
+	context->srcLineNum = 1;
+	context->srcIndexForLineNum = 0;
+	
+	// compile substitution tables of NMEEncodeCharFunDict
+	context->encodeCharTable.dict = context->encodeCharPreTable.dict = NULL;
+	if (outputFormat->encodeCharFun == NMEEncodeCharFunDict)
+		NMECompileEncodeCharDict((NMEEncodeCharDict const *)outputFormat->encodeCharData,
+				&context->encodeCharTable);
+	if (outputFormat->encodeCharPreFun == NMEEncodeCharFunDict)
+		NMECompileEncodeCharDict((NMEEncodeCharDict const *)outputFormat->encodeCharPreData,
+				&context->encodeCharPreTable);
+	
+	// union of the trigger sets of autoconverts
+	context->autoconvertNext = 0;
+	context->autoLinkBegin = context->autoLinkEnd = -1;
+	for (i = 0; i < 256; i++)
+		context->autoconvertTrigger[i] = 0;
+	if (outputFormat->autoconverts)
+		for (i = 0; outputFormat->autoconverts[i].cb; i++)
+		{
+			if (!outputFormat->autoconverts[i].triggers)
+			{
+				for (j = 0; j < 256; j++)
+					context->autoconvertTrigger[j] = 1;
+				break;
+			}
+			for (t = outputFormat->autoconverts[i].triggers; *t; t++)
+				context->autoconvertTrigger[(unsigned char)*t] = 1;
+		}
+	
+	// fixed buffers
+	context->reallocFun = NULL;
+	context->reallocData = NULL;
+	context->srcInPlace = FALSE;
 	
+	// no deferred plugin
+	context->deferPlugins = context->deferredCall = FALSE;
+	context->headings = context->deferredSlots = context->deferredText = NULL;
+	context->headingsLen = context->headingsSize = 0;
+	context->deferredSlotsLen = context->deferredSlotsSize = 0;
+	context->deferredTextLen = context->deferredTextSize = 0;
+	context->headingTextBegin = 0;
+	
+	// no streaming
+	context->streamOutputFun = NULL;
+	context->streamOutputData = NULL;
+	context->scanTail = 0;
+	context->scanPre = FALSE;
+	context->scanPluginEndLen = 0;
+	context->scanPluginBlock = FALSE;
+	
+	// no event recording
+	context->recorder = NULL;
+}
+
+/// Call the process hook cb of outputFormat (used in parseSource and endSource)
 #define HOOK(cb, l, it, e, m) \
 	do { \
 		if (outputFormat->cb) \
 		{ \
-			updateLineNum(&context); \
+			updateLineNum(context); \
 			err = outputFormat->cb(l, it, e, m, \
-					i0 + context.srcIndexOffset, \
-					context.srcLineNum, \
-					&context, \
+					i0 + context->srcIndexOffset, \
+					context->srcLineNum, \
+					context, \
 					outputFormat->hookData); \
 			if (err != kNMEErrOk) \
 				return err; \
 		} \
 	} while (0)
+
+/** Add a run of characters parsed as kNMETokenText to output, like a
+	sequence of kNMETokenChar (copied in a single block as long as there is
+	no encoder, no char hook and no wordwrap).
+	@param[in,out] context current context (srcIndex at the end of the run)
+	@param[in] i0 index of the beginning of the run in src
+	@param[in] pre TRUE for preformatted blocks (encodeCharPreFun, no char hook
+	and no wordwrap), FALSE for paragraphs and headings
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addText(NMEContext *context, NMEInt i0, NMEBoolean pre)
+{
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEEncodeCharFun encodeCharFun = pre
+			? outputFormat->encodeCharPreFun : outputFormat->encodeCharFun;
+	void *encodeCharData = pre
+			? outputFormat->encodeCharPreData : outputFormat->encodeCharData;
+	NMEEncodeCharTable const *table = pre
+			? &context->encodeCharPreTable : &context->encodeCharTable;
+	NMEInt end = context->srcIndex;
+	NMEInt n;
+	NMEErr err;
 	
-	// set up format
-	if (!outputFormat)
-		outputFormat = &NMEOutputFormatText;
-	context.fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
-	context.options = options;
-	context.eol = eol;
-	context.ctrlChar = outputFormat->ctrlChar;
-	context.xref = (options & kNMEProcessOptXRef) != 0;
-	setContext(context, 0, 0);
+	if (context->recorder)
+		return emitEvent(context, kEventText | (pre ? kEventFlagA : 0)
+					| eventSpanInline(context, i0))
+				&& emitEventSpan(context, i0, end)
+			? kNMEErrOk : kNMEErrNotEnoughMemory;
 	
-	// set up buffers
-	if (nmeTextLen > bufSize / 2)
-		return kNMEErrNotEnoughMemory;
-	context.src = buf;
-	context.srcLen = nmeTextLen;
-	for (i0 = 0; i0 < nmeTextLen; i0++)
-		buf[i0] = nmeText[i0];
-	context.dest = buf + bufSize / 2;
-	context.bufSize = bufSize / 2;
+	if (table->dict && (pre || !outputFormat->charHookFun))
+	{
+		// encode runs of characters, checking wordwrap when textWidth is reached
+		for (context->srcIndex = i0; context->srcIndex < end; )
+		{
+			CheckError(encodeCharRun(context->src, &context->srcIndex, end,
+					table, pre ? 0 : outputFormat->textWidth,
+					context));
+			if (!pre)
+				CheckError(checkWordwrap(context, outputFormat));
+		}
+		return kNMEErrOk;
+	}
 	
-	// set up parser state
-	context.outputFormat = outputFormat;
-	context.destLen = context.col = 0;
-	context.destLenUCS16 = 0;
-	commonLen = noAutoOrPluginLen = 0;
-	context.currentIndent = 0;
-	state = kNMEStateBetweenPar;
-	context.nesting = 0;
-	styleNesting = 0;
-	headingNum[0] = -1;
-	nextHeading(&headingFlags, headingNum, 1);
-	headingFlags = 0;
-	context.srcIndex = 0;
-	context.srcIndexOffset = 0;
-	context.srcLineNum = 1;
-	context.srcIndexForLineNum = 0;
+	if (!encodeCharFun && (pre || !outputFormat->charHookFun))
+	{
+		// copy characters which don't reach textWidth
+		n = end - i0;
+		if (!pre && outputFormat->textWidth > 0
+				&& n > outputFormat->textWidth - 1 - context->col)
+			n = outputFormat->textWidth - 1 - context->col > 0
+					? outputFormat->textWidth - 1 - context->col : 0;
+		if (!destHasRoom(context, n))
+			return kNMEErrNotEnoughMemory;
+		context->col += n;
+		for ( ; n > 0; n--, i0++)
+			context->dest[context->destLen++] = context->src[i0];
+	}
 	
-	// beginning of doc
-	if (!(options & kNMEProcessOptNoPreAndPost)
-			&& !NMEAddString(outputFormat->beginDoc, -1, context.ctrlChar, &context))
-		return kNMEErrNotEnoughMemory;
+	// encode characters one at a time
+	for (context->srcIndex = i0; context->srcIndex < end; )
+	{
+		if (!pre && outputFormat->charHookFun)
+			CheckError(outputFormat->charHookFun(context->srcIndex + context->srcIndexOffset,
+					context,
+					outputFormat->charHookData));
+		if (encodeCharFun)
+			CheckError(encodeCharFun(context->src, context->srcLen, &context->srcIndex,
+					context,
+					encodeCharData));
+		else
+		{
+			if (!destHasRoom(context, 1))
+				return kNMEErrNotEnoughMemory;
+			context->dest[context->destLen++] = context->src[context->srcIndex];
+			context->col++;
+			context->srcIndex++;
+		}
+		if (!pre)
+			CheckError(checkWordwrap(context, outputFormat));
+	}
+	
+	return kNMEErrOk;
+}
+
+/** Add the character of a kNMETokenChar token to dest, with encodeCharFun
+	or encodeCharPreFun if any (UTF-8 continuation bytes which follow are
+	consumed when events are recorded).
+	@param[in,out] context current context (character at srcIndex-1)
+	@param[in] i0 index in src of beginning of token
+	@param[in] pre TRUE for preformatted blocks (encodeCharPreFun and no char
+	hook), FALSE for paragraphs and headings
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addChar(NMEContext *context, NMEInt i0, NMEBoolean pre)
+{
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEEncodeCharFun encodeCharFun = pre
+			? outputFormat->encodeCharPreFun : outputFormat->encodeCharFun;
+	NMEInt n;
+	NMEErr err;
+	
+	if (context->recorder)
+	{
+		// character and UTF-8 continuation bytes, which encodeCharFun may consume
+		n = context->srcIndex - 1 - i0;
+		if ((context->src[context->srcIndex - 1] & 0xc0) == 0xc0)
+			while (context->srcIndex < context->srcLen
+					&& context->srcIndex - i0 < n + 4
+					&& (context->src[context->srcIndex] & 0xc0) == 0x80)
+				context->srcIndex++;
+		return emitEvent(context, kEventChar | (pre ? kEventFlagA : 0)
+					| eventSpanInline(context, i0))
+				&& emitEventSpan(context, i0, context->srcIndex)
+				&& emitEventNumber(context, n)
+			? kNMEErrOk : kNMEErrNotEnoughMemory;
+	}
+	
+	if (!pre && outputFormat->charHookFun)
+		CheckError(outputFormat->charHookFun(i0 + context->srcIndexOffset,
+				context,
+				outputFormat->charHookData));
+	if (encodeCharFun)
+	{
+		context->srcIndex--;
+		CheckError(encodeCharFun(context->src, context->srcLen, &context->srcIndex,
+				context,
+				pre ? outputFormat->encodeCharPreData : outputFormat->encodeCharData));
+	}
+	else
+	{
+		if (!destHasRoom(context, 1))
+			return kNMEErrNotEnoughMemory;
+		context->dest[context->destLen++] = context->src[context->srcIndex - 1];
+		context->col++;
+	}
+	return kNMEErrOk;
+}
+
+/** Add a space or a tab in preformatted text to dest, with encodeCharPreFun
+	if any (tabs are expanded to spaces).
+	@param[in,out] context current context
+	@param[in] tab TRUE for tab, FALSE for space
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addPreBlank(NMEContext *context, NMEBoolean tab)
+{
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEInt tmp, col;
+	NMEErr err;
+	
+	if (context->recorder)
+		return emitEvent(context, kEventPreBlank | (tab ? kEventFlagA : 0))
+				? kNMEErrOk : kNMEErrNotEnoughMemory;
+	
+	do
+	{
+		col = context->col;
+		if (outputFormat->encodeCharPreFun)
+		{
+			tmp = 0;
+			CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
+					context,
+					outputFormat->encodeCharPreData));
+		}
+		else
+		{
+			if (!destHasRoom(context, 1))
+				return kNMEErrNotEnoughMemory;
+			context->dest[context->destLen++] = ' ';
+			context->col++;
+		}
+	} while (tab && context->col % kTabWidth != 0
+			&& context->col != col);	// encoder which doesn't count columns
+	return kNMEErrOk;
+}
+
+/** Set the indenting of lines after wordwrap.
+	@param[in,out] context current context
+	@param[in] nesting list nesting (0 for no indenting)
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean setIndent(NMEContext *context, NMEInt nesting)
+{
+	context->currentIndent = nesting * context->outputFormat->indentSpaces;
+	return !context->recorder
+			|| (emitEvent(context, kEventIndent) && emitEventNumber(context, nesting));
+}
+
+/** Remove trailing spaces (but not tabs) from dest.
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean gobbleBackSpaces(NMEContext *context)
+{
+	if (context->recorder)
+		return emitEvent(context, kEventGobbleSpaces);
+	while (context->destLen > 0 && context->dest[context->destLen - 1] == ' ')
+		truncateDest(context, context->destLen - 1);
+	return TRUE;
+}
+
+/** Parse source code in context->src until its last context->srcTail bytes,
+	writing output to context->dest.
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr parseSource(NMEContext *context)
+{
+	/*
+	Output which must be processed again, be it for plugins or autoconvert,
+	is moved back to src before the input still to be processed. Processed
+	input is discarded, so that the cost is proportional to the length of
+	the output to be reprocessed:
+	src[0..i0-1]: processed input, can be discarded
+	src[i0..srcLen-1]: input still to be processed
+	dest[0..destLen0-1]: processed output
+	When having to consume src[i0..i-1] and replace it with dest[destLen0..destLen-1]
+	which must be processed again, the following steps occur:
+	- if i < destLen-destLen0, move src[i..srcLen-1] to make room for it
+	(this occurs only when the output is larger than all the input processed
+	until now)
+	- copy dest[destLen0..destLen-1] to src[i-destLen+destLen0..i-1]
+	- set i to i-destLen+destLen0
+	- set destLen to destLen0
+	*/
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEInt options = context->options;
+	NMEInt destLenTmp;	// temp. destLen used with plugins and autoconvert
+	NMEInt i0;	// value of srcIndex before parsing current token
+	NMEInt textEnd;	// end of src which can be parsed as kNMETokenText
+	NMEBoolean reparseOutput;	// TRUE if plugin's output must be parsed again
+	NMEToken token;	// next token
+	NMEInt headingLevel0;	// heading level before current token
+	NMEBoolean firstIteration;	// TRUE during first loop iteration, used with sublistInListItem
+	NMEErr err;
 	
 	// single pass main loop
-	while (context.srcIndex < context.srcLen)
+	while (context->srcIndex < context->srcLen - context->srcTail)
 	{
 		// check enough memory for worst case
-		if (context.destLen + kNMETokenTab >= context.bufSize)
+		if (!destHasRoom(context, kNMETokenTab + 1))
 			return kNMEErrNotEnoughMemory;
 		
 		// autoconvert
-		if (state != kNMEStatePre && state != kNMEStatePreAfterEol
-				&& context.srcIndex >= noAutoOrPluginLen
+		if (context->state != kNMEStatePre && context->state != kNMEStatePreAfterEol
+				&& context->srcIndex >= context->noAutoOrPluginLen
 				&& !(options & kNMEProcessOptNoPlugin)
-				&& outputFormat->autoconverts)
+				&& outputFormat->autoconverts
+				&& context->autoLinkEnd < 0
+				&& (context->srcIndex == 0
+					|| context->autoconvertTrigger[(unsigned char)context->src[context->srcIndex]]))
 		{
 			NMEInt k;
 			
 			for (k = 0; outputFormat->autoconverts[k].cb; k++)
 			{
-				destLenTmp = context.destLen;
-				if (outputFormat->autoconverts[k].cb(context.src, context.srcLen, &context.srcIndex,
-						&context,
+				if (context->srcIndex > 0
+						&& !isAutoconvertTrigger(&outputFormat->autoconverts[k],
+							context->src[context->srcIndex]))
+					continue;
+				destLenTmp = context->destLen;
+				i0 = context->srcIndex;
+				context->autoLinkBegin = context->autoLinkEnd = -1;
+				if (outputFormat->autoconverts[k].cb(context->src, context->srcLen, &context->srcIndex,
+						context,
 						outputFormat->autoconverts[k].userData))
 				{
-					noAutoOrPluginLen = context.destLen;
-					CheckError(swapBuffers(&context.src, &context.srcLen,
-							&context,
-							&commonLen,
-							destLenTmp));
+					if (context->autoLinkBegin >= 0)
+					{
+						// link reported by NMEAddAutoconvertLink: parse source
+						// until the link, then the link itself in the state machine
+						truncateDest(context, destLenTmp);
+						context->srcIndex = i0;
+						context->noAutoOrPluginLen = context->autoLinkEnd;
+					}
+					else
+					{
+						context->noAutoOrPluginLen = context->srcIndex;
+						CheckError(reinsertOutput(context, destLenTmp));
+					}
 					break;
 				}
+				context->autoLinkBegin = context->autoLinkEnd = -1;
 			}
 		}
 		
+		// plain text can be parsed as a single token until the next char where
+		// an autoconvert can match
+		textEnd = context->srcLen - context->srcTail;
+		if (context->state != kNMEStatePre && context->state != kNMEStatePreAfterEol
+				&& !(options & kNMEProcessOptNoPlugin)
+				&& outputFormat->autoconverts)
+		{
+			if (context->autoconvertNext <= context->srcIndex
+					|| context->autoconvertNext < context->noAutoOrPluginLen)
+				context->autoconvertNext = context->srcIndex + 1 > context->noAutoOrPluginLen
+						? context->srcIndex + 1 : context->noAutoOrPluginLen;
+			while (context->autoconvertNext < textEnd
+					&& !context->autoconvertTrigger[(unsigned char)context->src[context->autoconvertNext]])
+				context->autoconvertNext++;
+			if (textEnd > context->autoconvertNext)
+				textEnd = context->autoconvertNext;
+		}
+		
+		// link reported by NMEAddAutoconvertLink, unless skipped or in verbatim
+		if (context->autoLinkBegin >= 0
+				&& (context->srcIndex > context->autoLinkBegin
+					|| context->state == kNMEStatePre || context->state == kNMEStatePreAfterEol
+					|| (context->styleNesting > 0
+						&& context->styleStack[context->styleNesting - 1] == kNMEStyleVerbatim)))
+			context->autoLinkBegin = context->autoLinkEnd = -1;
+		if (context->autoLinkBegin >= 0 && textEnd > context->autoLinkBegin)
+			textEnd = context->autoLinkBegin;
+		
 		// parse token (sensitive to context)
-		i0 = context.srcIndex;
-		headingLevel0 = headingLevel;
-		if (!parseNextToken(context.src, context.srcLen, &context.srcIndex,
-				state,
-				styleNesting > 0 && styleStack[styleNesting - 1] == kNMEStyleVerbatim,
-				context.nesting, context.listNum,
-				styleStack, styleNesting,
+		i0 = context->tokenIndex = context->srcIndex;
+		headingLevel0 = context->headingLevel;
+		if (context->srcIndex == context->autoLinkEnd && context->autoLinkBegin < 0)
+		{
+			// end of link reported by NMEAddAutoconvertLink
+			token = kNMETokenLinkEnd;
+			context->autoLinkEnd = -1;
+		}
+		else if (context->srcIndex == context->autoLinkBegin)
+			token = kNMETokenLinkBegin;	// addLinkBegin resets autoLinkBegin
+		else if (!parseNextToken(context->src, context->srcLen, &context->srcIndex,
+				textEnd,
+				context->state,
+				context->styleNesting > 0 && context->styleStack[context->styleNesting - 1] == kNMEStyleVerbatim,
+				context->nesting, context->listNum,
+				context->styleStack, context->styleNesting,
 				outputFormat,
 				&token,
-				&headingLevel,
-				&itemNesting,
-				&newStyle,
+				&context->headingLevel,
+				&context->itemNesting,
+				&context->newStyle,
 				options))
 			break;	// nothing more on line: ignore
+		if (context->recorder && token == kNMETokenHeading
+				&& context->headingLevel > context->recorder->headingLevelMax)
+			context->recorder->headingLevelMax = context->headingLevel;
 		
 		// state machine
-		switch (state)
+		switch (context->state)
 		{
 			case kNMEStateBetweenPar:
 				switch (token)
 				{
 					case kNMETokenChar:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-						if (!NMEAddString(outputFormat->beginPar, -1,
-								context.ctrlChar, &context))
+						if (!addFormatString(context, beginPar))
 							return kNMEErrNotEnoughMemory;
-						if (outputFormat->charHookFun)
-							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
-									&context,
-									outputFormat->charHookData));
-						if (outputFormat->encodeCharFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharFun(context.src,
-									context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						CheckError(checkWordwrap(&context, outputFormat));
-						state = kNMEStatePar;
+						CheckError(addChar(context, i0, FALSE));
+						CheckError(checkWordwrap(context, outputFormat));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
@@ -3034,195 +4718,184 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						// ignore
 						break;
 					case kNMETokenHeading:
-						for (; headingLevel0 >= headingLevel; headingLevel0--)
-							if ((headingFlags >> headingLevel0 - 1) & 1)
+						for (; headingLevel0 >= context->headingLevel; headingLevel0--)
+							if ((context->headingFlags >> headingLevel0 - 1) & 1)
 								HOOK(divHookFun, headingLevel0, 0, FALSE, "=");
-						nextHeading(&headingFlags, headingNum, headingLevel);
-						context.level = headingLevel;
-						context.item = headingLevel <= kMaxNumberedHeadingLevels
-									&& options & (headingLevel == 1
+						nextHeading(&context->headingFlags, context->headingNum, context->headingLevel);
+						context->level = context->headingLevel;
+						context->item = context->headingLevel <= kMaxNumberedHeadingLevels
+									&& options & (context->headingLevel == 1
 											? kNMEProcessOptH1Num : kNMEProcessOptH2Num)
-								? headingNum[headingLevel - 1]
+								? context->headingNum[context->headingLevel - 1]
 								: 0;
-						HOOK(divHookFun, context.level, 0, TRUE, "=");
-						HOOK(parHookFun, context.level, context.item, TRUE, "=");
-						if (!NMEAddString(outputFormat->beginHeading, -1,
-								context.ctrlChar, &context))
+						HOOK(divHookFun, context->level, 0, TRUE, "=");
+						HOOK(parHookFun, context->level, context->item, TRUE, "=");
+						if (!addFormatString(context, beginHeading)
+								|| !beginHeadingRecord(context))
 							return kNMEErrNotEnoughMemory;
-						context.level = 0;
-						state = kNMEStateHeading;
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						context->level = 0;
+						context->state = kNMEStateHeading;
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						break;
 					case kNMETokenLineBreak:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-						if (!NMEAddString(outputFormat->beginPar, -1,
-									context.ctrlChar, &context)
-								|| !NMEAddString(outputFormat->lineBreak, -1,
-										context.ctrlChar, &context))
+						if (!addFormatString(context, beginPar)
+								|| !addFormatString(context, lineBreak))
 							return kNMEErrNotEnoughMemory;
-						state = kNMEStatePar;
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenPre:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "{{{");
-						if (!NMEAddString(outputFormat->beginPre, -1,
-									context.ctrlChar, &context)
-								/*|| !NMEAddString(outputFormat->beginPreLine, -1,
-										context.ctrlChar, &context)*/	)
+						if (!addFormatString(context, beginPre)
+								/*|| !addFormatString(context, beginPreLine)*/	)
 							return kNMEErrNotEnoughMemory;
-						state = kNMEStatePreAfterEol;
+						context->state = kNMEStatePreAfterEol;
 						// skip next eol
-						if (context.srcIndex < context.srcLen && context.src[context.srcIndex] == '\r')
-							context.srcIndex++;
-						if (context.srcIndex < context.srcLen && context.src[context.srcIndex] == '\n')
-							context.srcIndex++;
+						if (context->srcIndex < context->srcLen && context->src[context->srcIndex] == '\r')
+							context->srcIndex++;
+						if (context->srcIndex < context->srcLen && context->src[context->srcIndex] == '\n')
+							context->srcIndex++;
 						break;
 					case kNMETokenLI:
 						// begin list(s)
-						for (context.nesting = 0; context.nesting < itemNesting; context.nesting++)
+						for (context->nesting = 0; context->nesting < context->itemNesting; context->nesting++)
 						{
-							context.listNum[context.nesting]
-									= context.src[context.srcIndex - itemNesting + context.nesting] == '*'
+							context->listNum[context->nesting]
+									= context->src[context->srcIndex - context->itemNesting + context->nesting] == '*'
 										? kNMEListNumUL
-										: context.src[context.srcIndex - itemNesting + context.nesting] == ';'
+										: context->src[context->srcIndex - context->itemNesting + context->nesting] == ';'
 											? kNMEListNumDT
-											: context.src[context.srcIndex - itemNesting + context.nesting] == ':'
+											: context->src[context->srcIndex - context->itemNesting + context->nesting] == ':'
 												? kNMEListIndented
 												: 1;
-							setContext(context, context.nesting + 1, context.listNum[context.nesting]);
-							switch (context.listNum[context.nesting])
+							setContext(*context, context->nesting + 1, context->listNum[context->nesting]);
+							switch (context->listNum[context->nesting])
 							{
 								case kNMEListNumUL:
-									HOOK(divHookFun, context.level, 0, TRUE, "*");
-									if (!NMEAddString(outputFormat->beginUL, -1, context.ctrlChar, &context))
+									HOOK(divHookFun, context->level, 0, TRUE, "*");
+									if (!addFormatString(context, beginUL))
 										return kNMEErrNotEnoughMemory;
-									if (outputFormat->sublistInListItem && context.nesting + 1 < itemNesting)
-										if (!NMEAddString(outputFormat->beginULItem, -1, context.ctrlChar, &context))
+									if (sublistInListItem(context, context->nesting + 1 < context->itemNesting))
+										if (!addFormatString(context, beginULItem))
 											return kNMEErrNotEnoughMemory;
 									break;
 								case kNMEListNumDT:
 								case kNMEListNumDD:
-									HOOK(divHookFun, context.level, 0, TRUE, ";");
-									if (!NMEAddString(outputFormat->beginDL, -1, context.ctrlChar, &context))
+									HOOK(divHookFun, context->level, 0, TRUE, ";");
+									if (!addFormatString(context, beginDL))
 										return kNMEErrNotEnoughMemory;
-									if (outputFormat->sublistInListItem && context.nesting + 1 < itemNesting)
-										if (!NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+									if (sublistInListItem(context, context->nesting + 1 < context->itemNesting))
+										if (!addFormatString(context, beginDD))
 											return kNMEErrNotEnoughMemory;
 									break;
 								case kNMEListIndented:
-									HOOK(divHookFun, context.level, 0, TRUE, ":");
-									if (!NMEAddString(outputFormat->beginIndented, -1, context.ctrlChar, &context))
+									HOOK(divHookFun, context->level, 0, TRUE, ":");
+									if (!addFormatString(context, beginIndented))
 										return kNMEErrNotEnoughMemory;
 									// straight indenting, no nesting even if sublistInListItem
 									break;
 								default:	// ordered list
-									HOOK(divHookFun, context.level, 0, TRUE, "#");
-									if (!NMEAddString(outputFormat->beginOL, -1, context.ctrlChar, &context))
+									HOOK(divHookFun, context->level, 0, TRUE, "#");
+									if (!addFormatString(context, beginOL))
 										return kNMEErrNotEnoughMemory;
-									if (outputFormat->sublistInListItem && context.nesting + 1 < itemNesting)
-										if (!NMEAddString(outputFormat->beginOLItem, -1, context.ctrlChar, &context))
+									if (sublistInListItem(context, context->nesting + 1 < context->itemNesting))
+										if (!addFormatString(context, beginOLItem))
 											return kNMEErrNotEnoughMemory;
 									break;
 							}
-							context.level = 0;
+							context->level = 0;
 						}
 						// skip spaces
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						// begin item
-						context.currentIndent = context.nesting * outputFormat->indentSpaces;
-						setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-						HOOK(parHookFun, context.level, context.item, TRUE,
-								context.listNum[context.nesting - 1] == kNMEListNumUL ? "*"
-									: context.listNum[context.nesting - 1] == kNMEListNumDT ? ";"
-									: context.listNum[context.nesting - 1] == kNMEListIndented ? ":"
+						if (!setIndent(context, context->nesting))
+							return kNMEErrNotEnoughMemory;
+						setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+						HOOK(parHookFun, context->level, context->item, TRUE,
+								context->listNum[context->nesting - 1] == kNMEListNumUL ? "*"
+									: context->listNum[context->nesting - 1] == kNMEListNumDT ? ";"
+									: context->listNum[context->nesting - 1] == kNMEListIndented ? ":"
 									: "#");
-						if (!NMEAddString(context.listNum[context.nesting - 1] == kNMEListNumUL
-									? outputFormat->beginULItem
-								: context.listNum[context.nesting - 1] == kNMEListNumDT
-									? outputFormat->beginDT
-								: context.listNum[context.nesting - 1] == kNMEListIndented
-									? outputFormat->beginIndentedPar
-									: outputFormat->beginOLItem,
-								-1,
-								context.ctrlChar, &context))
+						if (!addTemplate(context, context->listNum[context->nesting - 1] == kNMEListNumUL
+									? &outputFormat->beginULItem
+								: context->listNum[context->nesting - 1] == kNMEListNumDT
+									? &outputFormat->beginDT
+								: context->listNum[context->nesting - 1] == kNMEListIndented
+									? &outputFormat->beginIndentedPar
+									: &outputFormat->beginOLItem))
 							return kNMEErrNotEnoughMemory;
-						setContext(context, 0, 0);
-						state = kNMEStatePar;
+						setContext(*context, 0, 0);
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenTableCell:
 					case kNMETokenTableHCell:
 						// start new table
-						if (context.nesting > 0)
-							switch (context.listNum[context.nesting - 1])
+						if (context->nesting > 0)
+							switch (context->listNum[context->nesting - 1])
 							{
 								case kNMEListNumUL:
-									if (!NMEAddString(outputFormat->beginULItem, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, beginULItem))
 										return kNMEErrNotEnoughMemory;
 									break;
 								case kNMEListNumDT:
 								case kNMEListNumDD:
-									if (!NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, beginDD))
 										return kNMEErrNotEnoughMemory;
 									break;
 								case kNMEListIndented:
-									if (!NMEAddString(outputFormat->beginIndentedPar, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, beginIndentedPar))
 										return kNMEErrNotEnoughMemory;
 									break;
 								default:	// ordered list
-									if (!NMEAddString(outputFormat->beginOLItem, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, beginOLItem))
 										return kNMEErrNotEnoughMemory;
 									break;
 							}
-						context.listNum[context.nesting++]
+						context->listNum[context->nesting++]
 								= token == kNMETokenTableCell
 									? kNMEListNumTableCell
 									: kNMEListNumTableHCell;
-						context.currentIndent = context.nesting * outputFormat->indentSpaces;
-						state = kNMEStatePar;
-						context.level = context.nesting - 1;
+						if (!setIndent(context, context->nesting))
+							return kNMEErrNotEnoughMemory;
+						context->state = kNMEStatePar;
+						context->level = context->nesting - 1;
 						HOOK(divHookFun, kNMEHookLevelPar, 0, TRUE, "|");
-						if (!NMEAddString(outputFormat->beginTable, -1,
-									context.ctrlChar, &context)
-								|| !NMEAddString(outputFormat->beginTableRow, -1,
-										context.ctrlChar, &context))
+						if (!addFormatString(context, beginTable)
+								|| !addFormatString(context, beginTableRow))
 							return kNMEErrNotEnoughMemory;
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE,
 								token == kNMETokenTableCell ? "|" : "|=");
-						if (!NMEAddString(token == kNMETokenTableCell
-									? outputFormat->beginTableCell
-									: outputFormat->beginTableHCell,
-								-1,
-								context.ctrlChar, &context))
+						if (!addTemplate(context, token == kNMETokenTableCell
+									? &outputFormat->beginTableCell
+									: &outputFormat->beginTableHCell))
 							return kNMEErrNotEnoughMemory;
-						context.level = 0;
+						context->level = 0;
 						break;
 					case kNMETokenHR:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "----");
-						if (!NMEAddString(outputFormat->horRule, -1,
-								context.ctrlChar, &context))
+						if (!addFormatString(context, horRule))
 							return kNMEErrNotEnoughMemory;
 						HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "----");
 						break;
 					case kNMETokenStyle:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-						if (!NMEAddString(outputFormat->beginPar, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, beginPar))
 							return kNMEErrNotEnoughMemory;
-						CheckError(processStyleTag(styleStack, &styleNesting,
-								newStyle,
+						CheckError(processStyleTag(context->styleStack, &context->styleNesting,
+								context->newStyle,
 								i0,
-								outputFormat, &context));
-						state = kNMEStatePar;
+								outputFormat, context));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenLinkBegin:
 					case kNMETokenImageBegin:
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-						if (!NMEAddString(outputFormat->beginPar, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, beginPar))
 							return kNMEErrNotEnoughMemory;
 						CheckError(addLinkBegin(token == kNMETokenImageBegin,
-								styleStack, &styleNesting,
-								i0, outputFormat, &context));
-						state = kNMEStatePar;
+								context->styleStack, &context->styleNesting,
+								i0, outputFormat, context));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenPlugin:
 					case kNMETokenPluginBlock:
@@ -3231,7 +4904,7 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						{
 							NMEInt pluginIndex;
 							
-							pluginIndex = findPlugin(context.src, context.srcLen, context.srcIndex,
+							pluginIndex = findPlugin(context->src, context->srcLen, context->srcIndex,
 									token == kNMETokenPlaceholder
 											|| token == kNMETokenPlaceholderBlock,
 									outputFormat);
@@ -3241,31 +4914,26 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 							{
 								// start a new paragraph
 								HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-								if (!NMEAddString(outputFormat->beginPar, -1,
-										context.ctrlChar, &context))
+								if (!addFormatString(context, beginPar))
 									return kNMEErrNotEnoughMemory;
-								state = kNMEStatePar;
+								context->state = kNMEStatePar;
 							}
-							destLenTmp = context.destLen;
+							destLenTmp = context->destLen;
 							CheckError(addPlugin(token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
-									options, outputFormat, &context,
+									pluginIndex,
+									options, outputFormat, context,
 									&reparseOutput));
 							if (reparseOutput)
-							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
-								// noAutoOrPluginLen = context.destLen;
-							}
+								CheckError(reinsertOutput(context, destLenTmp));
 						}
 						break;
 					case kNMETokenDD:
 					case kNMETokenLinkEnd:
 					case kNMETokenImageEnd:
+					case kNMETokenText:
 						// should never occur between paragraphs
 						return kNMEErrInternal;
 				}
@@ -3273,114 +4941,90 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 			case kNMEStatePar:
 				switch (token)
 				{
+					case kNMETokenText:
+						CheckError(addText(context, i0, FALSE));
+						break;
 					case kNMETokenChar:
-						if (outputFormat->charHookFun)
-							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
-									&context,
-									outputFormat->charHookData));
-						if (outputFormat->encodeCharFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(addChar(context, i0, FALSE));
+						CheckError(checkWordwrap(context, outputFormat));
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						// single space provided not last of line
-						if (context.srcIndex < context.srcLen && !isEol(context.src[context.srcIndex]))
+						if (context->srcIndex < context->srcLen && !isEol(context->src[context->srcIndex]))
 						{
-							if (!NMEAddString(outputFormat->space, -1,
-										context.ctrlChar, &context))
+							if (!addFormatString(context, space))
 								return kNMEErrNotEnoughMemory;
-							CheckError(checkWordwrap(&context, outputFormat));
+							CheckError(checkWordwrap(context, outputFormat));
 						}
 						break;
 					case kNMETokenLineBreak:
-						if (!NMEAddString(outputFormat->lineBreak, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, lineBreak))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						break;
 					case kNMETokenEOL:
-						state = kNMEStateParAfterEol;
+						context->state = kNMEStateParAfterEol;
 						break;
 					case kNMETokenDD:
-						context.level = context.nesting;
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						context->level = context->nesting;
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(FALSE, outputFormat, &context, i0));
-						context.listNum[context.nesting - 1] = kNMEListNumDD;
-						HOOK(parHookFun, context.level, context.item, TRUE, ";:");
-						if (!NMEAddString(outputFormat->beginDD, -1,
-								context.ctrlChar, &context))
+								outputFormat, context));
+						CheckError(addEndPar(FALSE, outputFormat, context, i0));
+						context->listNum[context->nesting - 1] = kNMEListNumDD;
+						HOOK(parHookFun, context->level, context->item, TRUE, ";:");
+						if (!addFormatString(context, beginDD))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						context.level = 0;
+						CheckError(checkWordwrap(context, outputFormat));
+						context->level = 0;
 						break;
 					case kNMETokenTableCell:
 					case kNMETokenTableHCell:
 						// gobble back spaces (keep tabs)
-						while (context.destLen > 0 && context.dest[context.destLen - 1] == ' ')
-						{
-							context.destLen--;
-							context.destLenUCS16--;
-						}
+						if (!gobbleBackSpaces(context))
+							return kNMEErrNotEnoughMemory;
 						// end last cell and begin new one
-						context.level = context.nesting;
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						context->level = context->nesting;
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						if (!NMEAddString(context.listNum[context.nesting - 1] == kNMEListNumTableCell
-									? outputFormat->endTableCell
-									: outputFormat->endTableHCell,
-								-1,
-								context.ctrlChar, &context))
+								outputFormat, context));
+						if (!addTemplate(context, context->listNum[context->nesting - 1] == kNMEListNumTableCell
+									? &outputFormat->endTableCell
+									: &outputFormat->endTableHCell))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE,
-								context.listNum[context.nesting - 1] == kNMEListNumTableCell
+								context->listNum[context->nesting - 1] == kNMEListNumTableCell
 									? "|" : "|=");
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE,
 								token == kNMETokenTableCell ? "|" : "|=");
-						if (!NMEAddString(token == kNMETokenTableCell
-									? outputFormat->beginTableCell
-									: outputFormat->beginTableHCell,
-								-1,
-								context.ctrlChar, &context))
+						if (!addTemplate(context, token == kNMETokenTableCell
+									? &outputFormat->beginTableCell
+									: &outputFormat->beginTableHCell))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						context.level = 0;
-						context.listNum[context.nesting - 1] = token == kNMETokenTableCell
+						CheckError(checkWordwrap(context, outputFormat));
+						context->level = 0;
+						context->listNum[context->nesting - 1] = token == kNMETokenTableCell
 								? kNMEListNumTableCell
 								: kNMEListNumTableHCell;
 						break;
 					case kNMETokenStyle:
 					case kNMETokenLinkEnd:
 					case kNMETokenImageEnd:
-						CheckError(processStyleTag(styleStack, &styleNesting,
+						CheckError(processStyleTag(context->styleStack, &context->styleNesting,
 								token == kNMETokenLinkEnd ? kNMEStyleLink
-									: token == kNMETokenImageEnd ? kNMEStyleImage : newStyle,
+									: token == kNMETokenImageEnd ? kNMEStyleImage : context->newStyle,
 								i0,
-								outputFormat, &context));
+								outputFormat, context));
 						break;
 					case kNMETokenLinkBegin:
 					case kNMETokenImageBegin:
 						CheckError(addLinkBegin(token == kNMETokenImageBegin,
-								styleStack, &styleNesting,
-								i0, outputFormat, &context));
+								context->styleStack, &context->styleNesting,
+								i0, outputFormat, context));
 						break;
 					case kNMETokenPlugin:
 					case kNMETokenPluginBlock:
@@ -3389,7 +5033,7 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						{
 							NMEInt pluginIndex;
 							
-							pluginIndex = findPlugin(context.src, context.srcLen, context.srcIndex,
+							pluginIndex = findPlugin(context->src, context->srcLen, context->srcIndex,
 									token == kNMETokenPlaceholder
 											|| token == kNMETokenPlaceholderBlock,
 									outputFormat);
@@ -3398,27 +5042,22 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 											& kNMEPluginOptBetweenPar)
 							{
 								// end paragraph
-								CheckError(flushStyleTags(styleStack, &styleNesting,
+								CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 											i0,
-											outputFormat, &context));
-								CheckError(addEndPar(TRUE, outputFormat, &context, i0));
-								state = kNMEStateBetweenPar;
+											outputFormat, context));
+								CheckError(addEndPar(TRUE, outputFormat, context, i0));
+								context->state = kNMEStateBetweenPar;
 							}
-							destLenTmp = context.destLen;
+							destLenTmp = context->destLen;
 							CheckError(addPlugin(token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
-									options, outputFormat, &context,
+									pluginIndex,
+									options, outputFormat, context,
 									&reparseOutput));
 							if (reparseOutput)
-							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
-								// noAutoOrPluginLen = context.destLen;
-							}
+								CheckError(reinsertOutput(context, destLenTmp));
 						}
 						break;
 					case kNMETokenHeading:
@@ -3434,451 +5073,422 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 				{
 					case kNMETokenChar:
 						if (options & kNMEProcessOptNoMultilinePar
-								|| (context.nesting > 0
-									&& (context.listNum[context.nesting - 1] == kNMEListNumTableCell
-										|| context.listNum[context.nesting - 1] == kNMEListNumTableHCell)))
+								|| (context->nesting > 0
+									&& (context->listNum[context->nesting - 1] == kNMEListNumTableCell
+										|| context->listNum[context->nesting - 1] == kNMEListNumTableHCell)))
 						{
 							// new paragraph
-							CheckError(flushStyleTags(styleStack, &styleNesting,
+							CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 									i0,
-									outputFormat, &context));
-							CheckError(addEndPar(TRUE, outputFormat, &context, i0));
+									outputFormat, context));
+							CheckError(addEndPar(TRUE, outputFormat, context, i0));
 							HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "p");
-							if (!NMEAddString(outputFormat->beginPar, -1,
-									context.ctrlChar, &context))
+							if (!addFormatString(context, beginPar))
 								return kNMEErrNotEnoughMemory;
-							context.currentIndent = 0;
-						}
-						else
-							if (!NMEAddString(outputFormat->space, -1,
-										context.ctrlChar, &context))
+							if (!setIndent(context, 0))
 								return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						if (outputFormat->charHookFun)
-							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
-									&context,
-									outputFormat->charHookData));
-						if (outputFormat->encodeCharFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharData));
 						}
 						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						state = kNMEStatePar;
+							if (!addFormatString(context, space))
+								return kNMEErrNotEnoughMemory;
+						CheckError(checkWordwrap(context, outputFormat));
+						CheckError(addChar(context, i0, FALSE));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
 						// ignore
 						break;
 					case kNMETokenEOL:
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(TRUE, outputFormat, &context, i0));
-						state = kNMEStateBetweenPar;
-						context.currentIndent = context.nesting * outputFormat->indentSpaces;
+								outputFormat, context));
+						CheckError(addEndPar(TRUE, outputFormat, context, i0));
+						context->state = kNMEStateBetweenPar;
+						if (!setIndent(context, context->nesting))
+							return kNMEErrNotEnoughMemory;
 						break;
 					case kNMETokenDD:
-						context.level = context.nesting;
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						context->level = context->nesting;
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(FALSE, outputFormat, &context, i0));
+								outputFormat, context));
+						CheckError(addEndPar(FALSE, outputFormat, context, i0));
 						// if not in innermost dl, end lists(s)
-						while (context.nesting > itemNesting)
+						while (context->nesting > context->itemNesting)
 						{
-							setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-							context.nesting--;
-							switch (context.listNum[context.nesting])
+							setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+							context->nesting--;
+							switch (context->listNum[context->nesting])
 							{
 								case kNMEListNumUL:
-									if (!NMEAddString(outputFormat->endUL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endUL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, "*");
+									HOOK(divHookFun, context->level, 0, FALSE, "*");
 									break;
 								case kNMEListNumDT:
 								case kNMEListNumDD:
-									if (!NMEAddString(outputFormat->endDL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endDL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, ";");
+									HOOK(divHookFun, context->level, 0, FALSE, ";");
 									break;
 								case kNMEListIndented:
-									if (!NMEAddString(outputFormat->endIndented, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endIndented))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, ":");
+									HOOK(divHookFun, context->level, 0, FALSE, ":");
 									break;
 								default:
-									if (!NMEAddString(outputFormat->endOL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endOL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, "#");
+									HOOK(divHookFun, context->level, 0, FALSE, "#");
 									break;
 							}
-							if (outputFormat->sublistInListItem && context.nesting > 0)
+							if (sublistInListItem(context, context->nesting > 0))
 							{
-								setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-								switch (context.listNum[context.nesting - 1])
+								setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+								switch (context->listNum[context->nesting - 1])
 								{
 									case kNMEListNumUL:
-										if (!NMEAddString(outputFormat->endULItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endULItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListNumDT:
 									case kNMEListNumDD:
-										if (!NMEAddString(outputFormat->endDD, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endDD))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListIndented:
 										// straight indenting, no nesting
 										break;
 									default:	// ordered list
-										if (!NMEAddString(outputFormat->endOLItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endOLItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 								}
 							}
 						}
-						setContext(context, context.nesting, 0);
-						if (context.listNum[context.nesting - 1] != kNMEListNumDT	// prev par wasn't DT
-								&& outputFormat->emptyDT)
+						setContext(*context, context->nesting, 0);
+						if (context->listNum[context->nesting - 1] != kNMEListNumDT	// prev par wasn't DT
+								&& (outputFormat->emptyDT || context->recorder))	// recorded for any format
 						{
-							if (!NMEAddString(outputFormat->emptyDT, -1,
-									context.ctrlChar, &context))
+							if (!addFormatString(context, emptyDT))
 								return kNMEErrNotEnoughMemory;
-							CheckError(checkWordwrap(&context, outputFormat));
+							CheckError(checkWordwrap(context, outputFormat));
 						}
 						// skip spaces
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						// begin DD
-						context.listNum[context.nesting - 1] = kNMEListNumDD;
-						HOOK(parHookFun, context.level, context.item, TRUE, ";:");
-						if (!NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+						context->listNum[context->nesting - 1] = kNMEListNumDD;
+						HOOK(parHookFun, context->level, context->item, TRUE, ";:");
+						if (!addFormatString(context, beginDD))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						context.level = 0;
-						state = kNMEStatePar;
+						CheckError(checkWordwrap(context, outputFormat));
+						context->level = 0;
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenLineBreak:
-						if (!NMEAddString(outputFormat->lineBreak, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, lineBreak))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						break;
 					case kNMETokenPre:
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(TRUE, outputFormat, &context, i0));
+								outputFormat, context));
+						CheckError(addEndPar(TRUE, outputFormat, context, i0));
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "{{{");
-						if (!NMEAddString(outputFormat->beginPre, -1,
-										context.ctrlChar, &context)
-								|| !NMEAddString(outputFormat->beginPreLine, -1,
-										context.ctrlChar, &context))
+						if (!addFormatString(context, beginPre)
+								|| !addFormatString(context, beginPreLine))
+							return kNMEErrNotEnoughMemory;
+						CheckError(checkWordwrap(context, outputFormat));
+						context->state = kNMEStatePreAfterEol;
+						if (!setIndent(context, 0))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						state = kNMEStatePreAfterEol;
-						context.currentIndent = 0;
 						// skip next eol
-						if (context.srcIndex < context.srcLen && context.src[context.srcIndex] == '\r')
-							context.srcIndex++;
-						if (context.srcIndex < context.srcLen && context.src[context.srcIndex] == '\n')
-							context.srcIndex++;
+						if (context->srcIndex < context->srcLen && context->src[context->srcIndex] == '\r')
+							context->srcIndex++;
+						if (context->srcIndex < context->srcLen && context->src[context->srcIndex] == '\n')
+							context->srcIndex++;
 						break;
 					case kNMETokenHeading:
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(TRUE, outputFormat, &context, i0));
-						for (; headingLevel0 >= headingLevel; headingLevel0--)
-							if ((headingFlags >> headingLevel0 - 1) & 1)
+								outputFormat, context));
+						CheckError(addEndPar(TRUE, outputFormat, context, i0));
+						for (; headingLevel0 >= context->headingLevel; headingLevel0--)
+							if ((context->headingFlags >> headingLevel0 - 1) & 1)
 								HOOK(divHookFun, headingLevel0, 0, FALSE, "=");
-						nextHeading(&headingFlags, headingNum, headingLevel);
-						context.level = headingLevel;
-						context.item = headingLevel <= kMaxNumberedHeadingLevels
-									&& options & (headingLevel == 1
+						nextHeading(&context->headingFlags, context->headingNum, context->headingLevel);
+						context->level = context->headingLevel;
+						context->item = context->headingLevel <= kMaxNumberedHeadingLevels
+									&& options & (context->headingLevel == 1
 											? kNMEProcessOptH1Num : kNMEProcessOptH2Num)
-								? headingNum[headingLevel - 1]
+								? context->headingNum[context->headingLevel - 1]
 								: 0;
-						HOOK(divHookFun, context.level, 0, TRUE, "=");
-						HOOK(parHookFun, context.level, context.item, TRUE, "=");
-						if (!NMEAddString(outputFormat->beginHeading, -1,
-								context.ctrlChar, &context))
+						HOOK(divHookFun, context->level, 0, TRUE, "=");
+						HOOK(parHookFun, context->level, context->item, TRUE, "=");
+						if (!addFormatString(context, beginHeading)
+								|| !beginHeadingRecord(context))
 							return kNMEErrNotEnoughMemory;
-						context.currentIndent = 0;
-						context.level = 0;
-						state = kNMEStateHeading;
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						if (!setIndent(context, 0))
+							return kNMEErrNotEnoughMemory;
+						context->level = 0;
+						context->state = kNMEStateHeading;
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						break;
 					case kNMETokenLI:
 						// end last paragraph or list item
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						if (!outputFormat->sublistInListItem
-								|| (context.nesting > 0
-									&& context.listNum[context.nesting - 1] == kNMEListIndented)
-								|| itemNesting <= context.nesting
-								|| context.nesting == 0)
-							CheckError(addEndPar(FALSE, outputFormat, &context, i0));
+								outputFormat, context));
+						if (!sublistInListItem(context, context->nesting > 0
+								&& context->listNum[context->nesting - 1] != kNMEListIndented
+								&& context->itemNesting > context->nesting))
+							CheckError(addEndPar(FALSE, outputFormat, context, i0));
 						// if new item less nested than current level, end lists(s)
-						while (context.nesting > itemNesting)
+						while (context->nesting > context->itemNesting)
 						{
-							setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-							context.nesting--;
-							switch (context.listNum[context.nesting])
+							setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+							context->nesting--;
+							switch (context->listNum[context->nesting])
 							{
 								case kNMEListNumUL:
-									if (!NMEAddString(outputFormat->endUL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endUL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, "*");
+									HOOK(divHookFun, context->level, 0, FALSE, "*");
 									break;
 								case kNMEListNumDT:
 								case kNMEListNumDD:
-									if (!NMEAddString(outputFormat->endDL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endDL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, ";");
+									HOOK(divHookFun, context->level, 0, FALSE, ";");
 									break;
 								case kNMEListIndented:
-									if (!NMEAddString(outputFormat->endIndented, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endIndented))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, ":");
+									HOOK(divHookFun, context->level, 0, FALSE, ":");
 									break;
 								default:
-									if (!NMEAddString(outputFormat->endOL, -1, context.ctrlChar, &context))
+									if (!addFormatString(context, endOL))
 										return kNMEErrNotEnoughMemory;
-									HOOK(divHookFun, context.level, 0, FALSE, "#");
+									HOOK(divHookFun, context->level, 0, FALSE, "#");
 									break;
 							}
-							if (outputFormat->sublistInListItem && context.nesting > 0)
+							if (sublistInListItem(context, context->nesting > 0))
 							{
-								setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-								switch (context.listNum[context.nesting - 1])
+								setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+								switch (context->listNum[context->nesting - 1])
 								{
 									case kNMEListNumUL:
-										if (!NMEAddString(outputFormat->endULItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endULItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListNumDT:
 									case kNMEListNumDD:
-										if (!NMEAddString(outputFormat->endDD, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endDD))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListIndented:
 										// straight indenting, no nesting
 										break;
 									default:	// ordered list
-										if (!NMEAddString(outputFormat->endOLItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, endOLItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 								}
 							}
 						}
-						setContext(context, 0, 0);
+						setContext(*context, 0, 0);
 						// if new item more nested than current level, begin list(s)
 						for (firstIteration = TRUE;
-								context.nesting < itemNesting;
-								context.nesting++, firstIteration = FALSE)
+								context->nesting < context->itemNesting;
+								context->nesting++, firstIteration = FALSE)
 						{
-							context.listNum[context.nesting]
-									= context.src[context.srcIndex - itemNesting + context.nesting] == '*'
+							context->listNum[context->nesting]
+									= context->src[context->srcIndex - context->itemNesting + context->nesting] == '*'
 										? kNMEListNumUL
-										: context.src[context.srcIndex - itemNesting + context.nesting] == ';'
+										: context->src[context->srcIndex - context->itemNesting + context->nesting] == ';'
 											? kNMEListNumDT
-											: context.src[context.srcIndex - itemNesting + context.nesting] == ':'
+											: context->src[context->srcIndex - context->itemNesting + context->nesting] == ':'
 												? kNMEListIndented
 												: 1;
-							context.level = context.nesting + 1;
-							HOOK(divHookFun, context.level, 0, TRUE,
-									context.listNum[context.nesting] == kNMEListNumUL ? "*"
-									: context.listNum[context.nesting] == kNMEListNumDT ? ";"
-									: context.listNum[context.nesting] == kNMEListIndented ? ":"
+							context->level = context->nesting + 1;
+							HOOK(divHookFun, context->level, 0, TRUE,
+									context->listNum[context->nesting] == kNMEListNumUL ? "*"
+									: context->listNum[context->nesting] == kNMEListNumDT ? ";"
+									: context->listNum[context->nesting] == kNMEListIndented ? ":"
 									: "#");
-							if (outputFormat->sublistInListItem && context.nesting > 0 && !firstIteration)
+							if (sublistInListItem(context, context->nesting > 0 && !firstIteration))
 							{
-								setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-								switch (context.listNum[context.nesting - 1])
+								setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+								switch (context->listNum[context->nesting - 1])
 								{
 									case kNMEListNumUL:
-										if (!NMEAddString(outputFormat->beginULItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginULItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListNumDT:
-										context.listNum[context.nesting - 1] = kNMEListNumDD;
+										context->listNum[context->nesting - 1] = kNMEListNumDD;
 										// fall through
 									case kNMEListNumDD:
-										if (!NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginDD))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListIndented:
 										// straight indenting, no nesting
 										break;
 									default:	// ordered list
-										if (!NMEAddString(outputFormat->beginOLItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginOLItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 								}
-								context.level = context.nesting + 1;
+								context->level = context->nesting + 1;
 							}
-							if (outputFormat->sublistInListItem
-									&& context.listNum[context.nesting - 1] == kNMEListNumDT)
+							if (sublistInListItem(context, context->nesting > 0
+									&& context->listNum[context->nesting - 1] == kNMEListNumDT))
 							{
 								// sublist must go in DD, not in DT
-								context.level--;
-								if (!NMEAddString(outputFormat->endDT, -1, context.ctrlChar, &context)
-										|| !NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+								context->level--;
+								if (!addFormatString(context, endDT)
+										|| !addFormatString(context, beginDD))
 									return kNMEErrNotEnoughMemory;
-								context.level++;
-								context.listNum[context.nesting - 1] = kNMEListNumDD;
+								context->level++;
+								context->listNum[context->nesting - 1] = kNMEListNumDD;
 							}
-							if (!NMEAddString(context.listNum[context.nesting] == kNMEListNumUL
-										? outputFormat->beginUL
-									: context.listNum[context.nesting] == kNMEListNumDT
-										? outputFormat->beginDL
-									: context.listNum[context.nesting] == kNMEListIndented
-										? outputFormat->beginIndented
-										: outputFormat->beginOL,
-									-1,
-									context.ctrlChar, &context))
+							if (!addTemplate(context, context->listNum[context->nesting] == kNMEListNumUL
+										? &outputFormat->beginUL
+									: context->listNum[context->nesting] == kNMEListNumDT
+										? &outputFormat->beginDL
+									: context->listNum[context->nesting] == kNMEListIndented
+										? &outputFormat->beginIndented
+										: &outputFormat->beginOL))
 								return kNMEErrNotEnoughMemory;
 						}
-						context.currentIndent = context.nesting * outputFormat->indentSpaces;
+						if (!setIndent(context, context->nesting))
+							return kNMEErrNotEnoughMemory;
 						// skip spaces
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						// replace DD with DT
-						if (context.listNum[context.nesting - 1] == kNMEListNumDD)
-							context.listNum[context.nesting - 1] = kNMEListNumDT;
+						if (context->listNum[context->nesting - 1] == kNMEListNumDD)
+							context->listNum[context->nesting - 1] = kNMEListNumDT;
 						// begin item
-						setContext(context, context.nesting, context.listNum[context.nesting - 1]);
-						HOOK(parHookFun, context.level, context.item, TRUE,
-								context.listNum[context.nesting - 1] == kNMEListNumUL ? "*"
-								: context.listNum[context.nesting - 1] == kNMEListNumDT ? ";"
-								: context.listNum[context.nesting - 1] == kNMEListIndented ? ":"
+						setContext(*context, context->nesting, context->listNum[context->nesting - 1]);
+						HOOK(parHookFun, context->level, context->item, TRUE,
+								context->listNum[context->nesting - 1] == kNMEListNumUL ? "*"
+								: context->listNum[context->nesting - 1] == kNMEListNumDT ? ";"
+								: context->listNum[context->nesting - 1] == kNMEListIndented ? ":"
 								: "#");
-						if (!NMEAddString(context.listNum[context.nesting - 1] == kNMEListNumUL
-									? outputFormat->beginULItem
-								: context.listNum[context.nesting - 1] == kNMEListNumDT
-									? outputFormat->beginDT
-								: context.listNum[context.nesting - 1] == kNMEListIndented
-									? outputFormat->beginIndentedPar
-									: outputFormat->beginOLItem,
-								-1,
-								context.ctrlChar, &context))
+						if (!addTemplate(context, context->listNum[context->nesting - 1] == kNMEListNumUL
+									? &outputFormat->beginULItem
+								: context->listNum[context->nesting - 1] == kNMEListNumDT
+									? &outputFormat->beginDT
+								: context->listNum[context->nesting - 1] == kNMEListIndented
+									? &outputFormat->beginIndentedPar
+									: &outputFormat->beginOLItem))
 							return kNMEErrNotEnoughMemory;
-						setContext(context, 0, 0);
-						state = kNMEStatePar;
+						setContext(*context, 0, 0);
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenTableCell:
 					case kNMETokenTableHCell:
 						// end last paragraph or list item
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						if (context.nesting == 0
-								|| (context.listNum[context.nesting - 1] != kNMEListNumTableCell
-									&& context.listNum[context.nesting - 1] != kNMEListNumTableHCell))
+								outputFormat, context));
+						if (context->nesting == 0
+								|| (context->listNum[context->nesting - 1] != kNMEListNumTableCell
+									&& context->listNum[context->nesting - 1] != kNMEListNumTableHCell))
 						{
 							// not in a table: force end of previous list if any
-							CheckError(addEndPar(TRUE, outputFormat, &context, i0));
+							CheckError(addEndPar(TRUE, outputFormat, context, i0));
 							// start new table
-							if (context.nesting > 0)
-								switch (context.listNum[context.nesting - 1])
+							if (context->nesting > 0)
+								switch (context->listNum[context->nesting - 1])
 								{
 									case kNMEListNumUL:
-										if (!NMEAddString(outputFormat->beginULItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginULItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListNumDT:
 									case kNMEListNumDD:
-										if (!NMEAddString(outputFormat->beginDD, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginDD))
 											return kNMEErrNotEnoughMemory;
 										break;
 									case kNMEListIndented:
-										if (!NMEAddString(outputFormat->beginIndentedPar, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginIndentedPar))
 											return kNMEErrNotEnoughMemory;
 										break;
 									default:	// ordered list
-										if (!NMEAddString(outputFormat->beginOLItem, -1, context.ctrlChar, &context))
+										if (!addFormatString(context, beginOLItem))
 											return kNMEErrNotEnoughMemory;
 										break;
 								}
-							context.nesting++;	// context.listNum set below
-							context.level = context.nesting - 1;
+							context->nesting++;	// context->listNum set below
+							context->level = context->nesting - 1;
 							HOOK(divHookFun, kNMEHookLevelPar, 0, TRUE, "|");
-							if (!NMEAddString(outputFormat->beginTable, -1,
-									context.ctrlChar, &context))
+							if (!addFormatString(context, beginTable))
 								return kNMEErrNotEnoughMemory;
 						}
 						else
-							CheckError(addEndPar(FALSE, outputFormat, &context, i0));	// alrdy in table
-						context.currentIndent = context.nesting * outputFormat->indentSpaces;
-						// set context.listNum type
-						context.listNum[context.nesting - 1] = token == kNMETokenTableCell
+							CheckError(addEndPar(FALSE, outputFormat, context, i0));	// alrdy in table
+						if (!setIndent(context, context->nesting))
+							return kNMEErrNotEnoughMemory;
+						// set context->listNum type
+						context->listNum[context->nesting - 1] = token == kNMETokenTableCell
 								? kNMEListNumTableCell
 								: kNMEListNumTableHCell;
 						// new row
-						context.level = context.nesting - 1;
-						if (!NMEAddString(outputFormat->beginTableRow, -1,
-								context.ctrlChar, &context))
+						context->level = context->nesting - 1;
+						if (!addFormatString(context, beginTableRow))
 							return kNMEErrNotEnoughMemory;
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE,
 								token == kNMETokenTableCell ? "|" : "|=");
-						if (!NMEAddString(token == kNMETokenTableCell
-										? outputFormat->beginTableCell
-										: outputFormat->beginTableHCell,
-									-1,
-									context.ctrlChar, &context))
+						if (!addTemplate(context, token == kNMETokenTableCell
+										? &outputFormat->beginTableCell
+										: &outputFormat->beginTableHCell))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						context.level = 0;
-						state = kNMEStatePar;
+						CheckError(checkWordwrap(context, outputFormat));
+						context->level = 0;
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenHR:
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						CheckError(addEndPar(TRUE, outputFormat, &context, i0));
+								outputFormat, context));
+						CheckError(addEndPar(TRUE, outputFormat, context, i0));
 						HOOK(parHookFun, kNMEHookLevelPar, 0, TRUE, "----");
-						if (!NMEAddString(outputFormat->horRule, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, horRule))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "----");
-						context.currentIndent = 0;
-						state = kNMEStateBetweenPar;
+						if (!setIndent(context, 0))
+							return kNMEErrNotEnoughMemory;
+						context->state = kNMEStateBetweenPar;
 						break;
 					case kNMETokenStyle:
 					case kNMETokenLinkEnd:
 					case kNMETokenImageEnd:
-						if (!NMEAddString(outputFormat->space, -1,
-								context.ctrlChar, &context))
+						if (!addFormatString(context, space))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						CheckError(processStyleTag(styleStack, &styleNesting,
+						CheckError(checkWordwrap(context, outputFormat));
+						CheckError(processStyleTag(context->styleStack, &context->styleNesting,
 								token == kNMETokenLinkEnd
 										? kNMEStyleLink
 								: token == kNMETokenImageEnd
 										? kNMEStyleImage
-										: newStyle,
+										: context->newStyle,
 								i0,
-								outputFormat, &context));
-						state = kNMEStatePar;
+								outputFormat, context));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenLinkBegin:
 					case kNMETokenImageBegin:
-						if (!NMEAddString(outputFormat->space, -1,
-									context.ctrlChar, &context))
+						if (!addFormatString(context, space))
 							return kNMEErrNotEnoughMemory;
 						CheckError(addLinkBegin(token == kNMETokenImageBegin,
-								styleStack, &styleNesting,
-								i0, outputFormat, &context));
-						state = kNMEStatePar;
+								context->styleStack, &context->styleNesting,
+								i0, outputFormat, context));
+						context->state = kNMEStatePar;
 						break;
 					case kNMETokenPlugin:
 					case kNMETokenPluginBlock:
@@ -3887,7 +5497,7 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 						{
 							NMEInt pluginIndex;
 							
-							pluginIndex = findPlugin(context.src, context.srcLen, context.srcIndex,
+							pluginIndex = findPlugin(context->src, context->srcLen, context->srcIndex,
 									token == kNMETokenPlaceholder
 											|| token == kNMETokenPlaceholderBlock,
 									outputFormat);
@@ -3896,126 +5506,79 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 											& kNMEPluginOptBetweenPar)
 							{
 								// end paragraph
-								CheckError(flushStyleTags(styleStack, &styleNesting,
+								CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 										i0,
-										outputFormat, &context));
-								CheckError(addEndPar(TRUE, outputFormat, &context, i0));
-								state = kNMEStateBetweenPar;
+										outputFormat, context));
+								CheckError(addEndPar(TRUE, outputFormat, context, i0));
+								context->state = kNMEStateBetweenPar;
 							}
 							else
 							{
 								// begin line (insert space)
-								if (!NMEAddString(outputFormat->space, -1,
-										context.ctrlChar, &context))
+								if (!addFormatString(context, space))
 									return kNMEErrNotEnoughMemory;
-								state = kNMEStatePar;
+								context->state = kNMEStatePar;
 							}
-							destLenTmp = context.destLen;
+							destLenTmp = context->destLen;
 							CheckError(addPlugin(token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
-									options, outputFormat, &context,
+									pluginIndex,
+									options, outputFormat, context,
 									&reparseOutput));
 							if (reparseOutput)
-							{
-								CheckError(swapBuffers(&context.src, &context.srcLen,
-										&context,
-										&commonLen,
-										destLenTmp));
-								// noAutoOrPluginLen = context.destLen;
-							}
+								CheckError(reinsertOutput(context, destLenTmp));
 						}
 						break;
+					case kNMETokenText:
+						// should never occur after the end of a line
+						return kNMEErrInternal;
 				}
 				break;
 			case kNMEStatePreAfterEol:
 				if (token == kNMETokenPre)	// end of pre
 				{
-					if (!NMEAddString(outputFormat->endPre, -1,
-							context.ctrlChar, &context))
+					if (!addFormatString(context, endPre))
 						return kNMEErrNotEnoughMemory;
 					HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
-					state = kNMEStateBetweenPar;
+					context->state = kNMEStateBetweenPar;
 					break;
 				}
 				// beginning of pre line
-				if (!NMEAddString(outputFormat->beginPreLine, -1,
-						context.ctrlChar, &context))
+				if (!addFormatString(context, beginPreLine))
 					return kNMEErrNotEnoughMemory;
-				state = kNMEStatePre;
+				context->state = kNMEStatePre;
 				
 				if (token == kNMETokenSpace)
 				{
 					// followed by spaces and three closing braces?
 					NMEInt k;
 					
-					for (k = context.srcIndex; k < context.srcLen && context.src[k] == ' '; k++)
+					for (k = context->srcIndex; k < context->srcLen && context->src[k] == ' '; k++)
 						;
-					if (k + 3 <= context.srcLen && context.src[k] == '}'
-							&& context.src[k + 1] == '}' && context.src[k + 2] == '}')
+					if (k + 3 <= context->srcLen && context->src[k] == '}'
+							&& context->src[k + 1] == '}' && context->src[k + 2] == '}')
 						break;	// yes: ignore first space
 				}				
 				// continue
 			case kNMEStatePre:
 				switch (token)
 				{
+					case kNMETokenText:
+						CheckError(addText(context, i0, TRUE));
+						break;
 					case kNMETokenChar:
-						if (outputFormat->encodeCharPreFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharPreFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharPreData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
+						CheckError(addChar(context, i0, TRUE));
 						break;
 					case kNMETokenSpace:
-						if (outputFormat->encodeCharPreFun)
-						{
-							NMEInt tmp = 0;
-							
-							CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
-									&context,
-									outputFormat->encodeCharPreData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = ' ';
-							context.destLenUCS16++;
-							context.col++;
-						}
-						break;
 					case kNMETokenTab:
-						do
-						{
-							if (outputFormat->encodeCharPreFun)
-							{
-								NMEInt tmp = 0;
-								
-								CheckError(outputFormat->encodeCharPreFun(" ", 1, &tmp,
-										&context,
-										outputFormat->encodeCharPreData));
-							}
-							else
-							{
-								context.dest[context.destLen++] = ' ';
-								context.destLenUCS16++;
-								context.col++;
-							}
-						} while (context.col % kTabWidth != 0);
+						CheckError(addPreBlank(context, token == kNMETokenTab));
 						break;
 					case kNMETokenEOL:
-						if (!NMEAddString(outputFormat->endPreLine, -1,
-								context.ctrlChar, &context))
+						if (!addFormatString(context, endPreLine))
 							return kNMEErrNotEnoughMemory;
-						state = kNMEStatePreAfterEol;
+						context->state = kNMEStatePreAfterEol;
 						break;
 					default:
 						// should never occur in preformatted blocks
@@ -4025,98 +5588,80 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 			case kNMEStateHeading:
 				switch (token)
 				{
+					case kNMETokenText:
+						CheckError(addText(context, i0, FALSE));
+						break;
 					case kNMETokenChar:
-						if (outputFormat->charHookFun)
-							CheckError(outputFormat->charHookFun(i0 + context.srcIndexOffset,
-									&context,
-									outputFormat->charHookData));
-						if (outputFormat->encodeCharFun)
-						{
-							context.srcIndex--;
-							CheckError(outputFormat->encodeCharFun(context.src, context.srcLen, &context.srcIndex,
-									&context,
-									outputFormat->encodeCharData));
-						}
-						else
-						{
-							context.dest[context.destLen++] = context.src[context.srcIndex - 1];
-							if (isFirstUTF8Byte(context.src[context.srcIndex - 1]))
-								context.destLenUCS16++;
-							context.col++;
-						}
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(addChar(context, i0, FALSE));
+						CheckError(checkWordwrap(context, outputFormat));
 						break;
 					case kNMETokenSpace:
 					case kNMETokenTab:
-						if (state == kNMEStatePar)	// pack multiple spaces for par
-							skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						if (context->state == kNMEStatePar)	// pack multiple spaces for par
+							skipBlanks(context->src, context->srcLen, &context->srcIndex);
 						// single space provided not last of line
-						if (context.srcIndex < context.srcLen && !isEol(context.src[context.srcIndex]))
+						if (context->srcIndex < context->srcLen && !isEol(context->src[context->srcIndex]))
 						{
-							if (!NMEAddString(outputFormat->space, -1,
-									context.ctrlChar, &context))
+							if (!addFormatString(context, space))
 								return kNMEErrNotEnoughMemory;
-							CheckError(checkWordwrap(&context, outputFormat));
+							CheckError(checkWordwrap(context, outputFormat));
 						}
 						break;
 					case kNMETokenHeading:
 						// end of heading
-						skipBlanks(context.src, context.srcLen, &context.srcIndex);
+						skipBlanks(context->src, context->srcLen, &context->srcIndex);
 					case kNMETokenEOL:
-						context.level = headingLevel;
-						CheckError(flushStyleTags(styleStack, &styleNesting,
+						context->level = context->headingLevel;
+						CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
 								i0,
-								outputFormat, &context));
-						if (!NMEAddString(outputFormat->endHeading, -1,
-									context.ctrlChar, &context))
+								outputFormat, context));
+						if (!addFormatString(context, endHeading)
+								|| !endHeadingRecord(context, i0))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
-						HOOK(parHookFun, context.level, 0, FALSE, "=");
-						context.level = 0;
-						state = kNMEStateBetweenPar;
+						CheckError(checkWordwrap(context, outputFormat));
+						HOOK(parHookFun, context->level, 0, FALSE, "=");
+						context->level = 0;
+						context->state = kNMEStateBetweenPar;
 						break;
 					case kNMETokenLineBreak:
-						if (!NMEAddString(outputFormat->lineBreak, -1,
-								context.ctrlChar, &context))
+						if (!addFormatString(context, lineBreak))
 							return kNMEErrNotEnoughMemory;
-						CheckError(checkWordwrap(&context, outputFormat));
+						CheckError(checkWordwrap(context, outputFormat));
 						break;
 					case kNMETokenStyle:
 					case kNMETokenLinkEnd:
 					case kNMETokenImageEnd:
-						CheckError(processStyleTag(styleStack, &styleNesting,
+						CheckError(processStyleTag(context->styleStack, &context->styleNesting,
 								token == kNMETokenLinkEnd
 									? kNMEStyleLink
 									: token == kNMETokenImageEnd
-										? kNMEStyleImage : newStyle,
+										? kNMEStyleImage : context->newStyle,
 								i0,
-								outputFormat, &context));
+								outputFormat, context));
 						break;
 					case kNMETokenLinkBegin:
 					case kNMETokenImageBegin:
 						CheckError(addLinkBegin(token == kNMETokenImageBegin,
-								styleStack, &styleNesting,
-								i0, outputFormat, &context));
+								context->styleStack, &context->styleNesting,
+								i0, outputFormat, context));
 						break;
 					case kNMETokenPlugin:
 					case kNMETokenPluginBlock:
 					case kNMETokenPlaceholder:
 					case kNMETokenPlaceholderBlock:
-						destLenTmp = context.destLen;
+						destLenTmp = context->destLen;
 						CheckError(addPlugin(token == kNMETokenPluginBlock
 										|| token == kNMETokenPlaceholderBlock,
 									token == kNMETokenPlaceholder
 										|| token == kNMETokenPlaceholderBlock,
-								options, outputFormat, &context,
+								findPlugin(context->src, context->srcLen, context->srcIndex,
+									token == kNMETokenPlaceholder
+										|| token == kNMETokenPlaceholderBlock,
+									outputFormat),
+								options, outputFormat, context,
 								&reparseOutput));
 						if (reparseOutput)
-						{
-							CheckError(swapBuffers(&context.src, &context.srcLen,
-									&context,
-									&commonLen,
-									destLenTmp));
-							// noAutoOrPluginLen = context.destLen;
-						}
+							CheckError(reinsertOutput(context, destLenTmp));
 						break;
 					case kNMETokenLI:
 					case kNMETokenDD:
@@ -4131,102 +5676,2935 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 		}
 	}
 	
+	return kNMEErrOk;
+}
+
+/** Flush pending constructs and add the end of document to output.
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr endSource(NMEContext *context)
+{
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEInt i0 = context->tokenIndex;	// used by HOOK
+	NMEErr err;
+	
 	// end: flush pending constructs
-	switch (state)
+	switch (context->state)
 	{
 		case kNMEStatePar:
 		case kNMEStateParAfterEol:
-			CheckError(flushStyleTags(styleStack, &styleNesting,
-					context.srcIndex,
-					outputFormat, &context));
-			CheckError(addEndPar(TRUE, outputFormat, &context, context.srcIndex));
+			CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
+					context->srcIndex,
+					outputFormat, context));
+			CheckError(addEndPar(TRUE, outputFormat, context, context->srcIndex));
 			break;
 		case kNMEStatePre:
-			if (!NMEAddString(outputFormat->endPreLine, -1,
-						context.ctrlChar, &context)
-					|| !NMEAddString(outputFormat->endPre, -1,
-						context.ctrlChar, &context))
+			if (!addFormatString(context, endPreLine)
+					|| !addFormatString(context, endPre))
 				return kNMEErrNotEnoughMemory;
 			HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
 			break;
 		case kNMEStatePreAfterEol:
-			if (!NMEAddString(outputFormat->endPre, -1,
-					context.ctrlChar, &context))
+			if (!addFormatString(context, endPre))
 				return kNMEErrNotEnoughMemory;
 			HOOK(parHookFun, kNMEHookLevelPar, 0, FALSE, "{{{");
 			break;
 		case kNMEStateHeading:
-			context.level = headingLevel;
-			CheckError(flushStyleTags(styleStack, &styleNesting,
-					context.srcIndex,
-					outputFormat, &context));
-			if (!NMEAddString(outputFormat->endHeading, -1,
-							context.ctrlChar, &context))
+			context->level = context->headingLevel;
+			CheckError(flushStyleTags(context->styleStack, &context->styleNesting,
+					context->srcIndex,
+					outputFormat, context));
+			if (!addFormatString(context, endHeading)
+					|| !endHeadingRecord(context, context->srcIndex))
 				return kNMEErrNotEnoughMemory;
-			CheckError(checkWordwrap(&context, outputFormat));
-			HOOK(parHookFun, context.level, 0, FALSE, "=");
-			context.level = 0;
+			CheckError(checkWordwrap(context, outputFormat));
+			HOOK(parHookFun, context->level, 0, FALSE, "=");
+			context->level = 0;
 			break;
 		default:
 			break;
 	}
 	
 	// end of doc
-	if (!(options & kNMEProcessOptNoPreAndPost)
-			&& !NMEAddString(outputFormat->endDoc, -1,
-					context.ctrlChar, &context))
+	if (!(context->options & kNMEProcessOptNoPreAndPost)
+			&& !addFormatString(context, endDoc))
 		return kNMEErrNotEnoughMemory;
-	if (context.destLen + 1 >= context.bufSize)
+	
+	return kNMEErrOk;
+}
+
+#undef HOOK
+
+/** Terminate output with a null byte and get its length.
+	@param[in,out] context current context
+	@param[out] output formatted text (in dest), followed by null byte
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	(may be NULL)
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr terminateOutput(NMEContext *context,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	if (!destHasRoom(context, 2))
 		return kNMEErrNotEnoughMemory;
-	context.dest[context.destLen] = '\0';
+	context->dest[context->destLen] = '\0';
 	
 	// set result
-	*output = context.dest;
-	*outputLen = context.destLen;
+	*output = context->dest;
+	*outputLen = context->destLen;
 	if (outputUCS16Len)
-		*outputUCS16Len = context.destLenUCS16;
+	{
+		countDestUCS16(context, context->destLen);
+		*outputUCS16Len = context->destLenUCS16;
+	}
 	return kNMEErrOk;
 }
 
-void NMEGetTempMemory(NMEContext const *context,
-		NMEText *addr,
-		NMEInt *len)
+/** Reverse bytes in place.
+	@param[in,out] p address of first byte
+	@param[in] n number of bytes
+*/
+static void reverseBytes(NMEText p, NMEInt n)
 {
-	*addr = context->src + context->srcLen;
-	*len = context->bufSize - context->srcLen;
+	NMEInt i;
+	NMEChar c;
+	
+	for (i = 0; i < n / 2; i++)
+	{
+		c = p[i];
+		p[i] = p[n - 1 - i];
+		p[n - 1 - i] = c;
+	}
 }
 
-void NMEGetFormat(NMEContext const *context,
-		NMEOutputFormat const **outputFormat,
-		NMEInt *options,
-		NMEInt *fontSize)
+/** Call the plugins with kNMEPluginOptDeferred recorded by addPlugin and
+	insert their output where they appeared.
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr callDeferredPlugins(NMEContext *context)
 {
-	if (outputFormat)
-		*outputFormat = context->outputFormat;
-	if (options)
-		*options = context->options;
-	if (fontSize)
-		*fontSize = context->fontSize;
+	NMEInt i, pos, end, shift, nameOffset, nameLen;
+	NMEPlugin const *plugin;
+	NMEErr err;
+	
+	context->deferredCall = TRUE;
+	for (i = shift = 0; i < context->deferredSlotsLen; i += kDeferredRecordSize)
+	{
+		// output added at the end of dest
+		end = context->destLen;
+		pos = getDeferredRecordNumber(context->deferredSlots + i, 0) + shift;
+		if (pos > end)
+			pos = end;
+		plugin = &context->outputFormat->plugins[getDeferredRecordNumber(context->deferredSlots + i, 1)];
+		nameOffset = getDeferredRecordNumber(context->deferredSlots + i, 2);
+		nameLen = getDeferredRecordNumber(context->deferredSlots + i, 3);
+		CheckError(plugin->cb(context->deferredText + nameOffset, nameLen,
+				context->deferredText + nameOffset + nameLen,
+				getDeferredRecordNumber(context->deferredSlots + i, 4),
+				context,
+				plugin->userData));
+		
+		// rotate dest[pos..] to move it to pos
+		if (context->destLenCountedUCS16 > pos)
+			countDestUCS16(context, pos);
+		reverseBytes(context->dest + pos, end - pos);
+		reverseBytes(context->dest + end, context->destLen - end);
+		reverseBytes(context->dest + pos, context->destLen - pos);
+		shift += context->destLen - end;
+	}
+	context->deferredCall = FALSE;
+	
+	return kNMEErrOk;
+}
+
+/** Convert the whole source code, once buffers have been set up.
+	@param[in,out] context current context
+	@param[out] output formatted text (in dest), followed by null byte
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	(may be NULL)
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr processSource(NMEContext *context,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEInt i;
+	NMEErr err;
+	
+	// plugins with kNMEPluginOptDeferred called at the end, with headings
+	// collected in buffers allocated by reallocFun
+	if (context->reallocFun && !context->recorder && context->outputFormat->plugins
+			&& !(context->options & kNMEProcessOptNoPlugin))
+		for (i = 0; context->outputFormat->plugins[i].cb; i++)
+			if (context->outputFormat->plugins[i].options & kNMEPluginOptDeferred)
+				context->deferPlugins = TRUE;
+	
+	// beginning of doc
+	if (!(context->options & kNMEProcessOptNoPreAndPost)
+			&& !addFormatString(context, beginDoc))
+		err = kNMEErrNotEnoughMemory;
+	else
+	{
+		// single pass on the whole source code
+		err = parseSource(context);
+		if (err == kNMEErrOk)
+			err = endSource(context);
+		if (err == kNMEErrOk && context->deferredSlotsLen > 0)
+			err = callDeferredPlugins(context);
+	}
+	
+	// free buffers of deferred plugins
+	if (context->headings)
+		context->reallocFun(context->headings, 0, context->reallocData);
+	if (context->deferredSlots)
+		context->reallocFun(context->deferredSlots, 0, context->reallocData);
+	if (context->deferredText)
+		context->reallocFun(context->deferredText, 0, context->reallocData);
+	context->deferPlugins = FALSE;
+	if (err != kNMEErrOk)
+		return err;
+	
+	return terminateOutput(context, output, outputLen, outputUCS16Len);
+}
+
+NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEText buf, NMEInt bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEContext context;
+	
+	initContext(&context, options, eol, outputFormat, fontSize);
+	
+	// parse nmeText in place and use the whole buf for output until
+	// plugin or autoconvert output must be reparsed
+	context.src = (NMEText)nmeText;
+	context.srcLen = context.srcSize = nmeTextLen;
+	context.srcInPlace = TRUE;
+	context.dest = buf;
+	context.bufSize = bufSize;
+	
+	return processSource(&context, output, outputLen, outputUCS16Len);
+}
+
+NMEErr NMEProcessAlloc(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEContext context;
+	NMEErr err;
+	
+	initContext(&context, options, eol, outputFormat, fontSize);
+	context.reallocFun = reallocFun;
+	context.reallocData = reallocData;
+	
+	// parse nmeText in place until plugin or autoconvert output must be
+	// reparsed, and allocate dest
+	context.src = (NMEText)nmeText;
+	context.srcLen = context.srcSize = nmeTextLen;
+	context.srcInPlace = TRUE;
+	context.bufSize = 2 * nmeTextLen + kAllocExtraSize;
+	context.dest = (NMEText)reallocFun(NULL, context.bufSize, reallocData);
+	if (!context.dest)
+		return kNMEErrNotEnoughMemory;
+	
+	err = processSource(&context, output, outputLen, outputUCS16Len);
+	
+	// keep only dest, which contains the output
+	if (!context.srcInPlace)
+		reallocFun(context.src, 0, reallocData);
+	if (err != kNMEErrOk)
+		reallocFun(context.dest, 0, reallocData);
+	return err;
+}
+
+/// Template fields of NMEOutputFormat (in NMEOutputFormatNull), ending with NULL
+static NMEConstText const *const templateFields[] =
+{
+	&NMEOutputFormatNull.space,
+	&NMEOutputFormatNull.beginDoc, &NMEOutputFormatNull.endDoc,
+	&NMEOutputFormatNull.beginHeading, &NMEOutputFormatNull.endHeading,
+	&NMEOutputFormatNull.beginPar, &NMEOutputFormatNull.endPar,
+	&NMEOutputFormatNull.lineBreak,
+	&NMEOutputFormatNull.beginPre, &NMEOutputFormatNull.endPre,
+	&NMEOutputFormatNull.beginPreLine, &NMEOutputFormatNull.endPreLine,
+	&NMEOutputFormatNull.beginUL, &NMEOutputFormatNull.endUL,
+	&NMEOutputFormatNull.beginULItem, &NMEOutputFormatNull.endULItem,
+	&NMEOutputFormatNull.beginOL, &NMEOutputFormatNull.endOL,
+	&NMEOutputFormatNull.beginOLItem, &NMEOutputFormatNull.endOLItem,
+	&NMEOutputFormatNull.beginDL, &NMEOutputFormatNull.endDL,
+	&NMEOutputFormatNull.beginDT, &NMEOutputFormatNull.endDT,
+	&NMEOutputFormatNull.emptyDT,
+	&NMEOutputFormatNull.beginDD, &NMEOutputFormatNull.endDD,
+	&NMEOutputFormatNull.beginIndented, &NMEOutputFormatNull.endIndented,
+	&NMEOutputFormatNull.beginIndentedPar, &NMEOutputFormatNull.endIndentedPar,
+	&NMEOutputFormatNull.beginTable, &NMEOutputFormatNull.endTable,
+	&NMEOutputFormatNull.beginTableRow, &NMEOutputFormatNull.endTableRow,
+	&NMEOutputFormatNull.beginTableHCell, &NMEOutputFormatNull.endTableHCell,
+	&NMEOutputFormatNull.beginTableCell, &NMEOutputFormatNull.endTableCell,
+	&NMEOutputFormatNull.horRule,
+	&NMEOutputFormatNull.beginBold, &NMEOutputFormatNull.endBold,
+	&NMEOutputFormatNull.beginItalic, &NMEOutputFormatNull.endItalic,
+	&NMEOutputFormatNull.beginUnderline, &NMEOutputFormatNull.endUnderline,
+	&NMEOutputFormatNull.beginSuperscript, &NMEOutputFormatNull.endSuperscript,
+	&NMEOutputFormatNull.beginSubscript, &NMEOutputFormatNull.endSubscript,
+	&NMEOutputFormatNull.beginCode, &NMEOutputFormatNull.endCode,
+	&NMEOutputFormatNull.beginLink, &NMEOutputFormatNull.endLink,
+	&NMEOutputFormatNull.sepLink,
+	&NMEOutputFormatNull.beginImage, &NMEOutputFormatNull.endImage,
+	&NMEOutputFormatNull.sepImage,
+	NULL
+};
+
+NMEErr NMECompileOutputFormat(NMEOutputFormat const *outputFormat,
+		NMEInt options,
+		NMEInt fontSize,
+		NMEText buf, NMEInt bufSize,
+		NMEOutputFormat *compiledOutputFormat)
+{
+	NMECompiledOutputFormat *compiled;
+	NMEExprTarget target;
+	NMEConstText str;
+	NMEInt align, i, ix, len, n, k;
+	
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	
+	// compiled templates at the beginning of buf, aligned for any member
+	align = (NMEInt)((sizeof(double) - (unsigned long)buf % sizeof(double))
+			% sizeof(double));
+	if (bufSize < align + (NMEInt)sizeof(NMECompiledOutputFormat))
+		return kNMEErrNotEnoughMemory;
+	compiled = (NMECompiledOutputFormat *)(buf + align);
+	compiled->fontSize = fontSize > 0 ? fontSize : outputFormat->defFontSize;
+	compiled->xref = (options & kNMEProcessOptXRef) != 0;
+	compiled->ctrlChar = outputFormat->ctrlChar;
+	for (i = 0; i < kTemplateCount; i++)
+		compiled->str[i] = NULL;
+	
+	target.context = NULL;
+	target.ops = compiled->ops;
+	target.opsLen = 0;
+	target.opsSize = 1 + (bufSize - align - (NMEInt)sizeof(NMECompiledOutputFormat))
+			/ (NMEInt)sizeof(NMEInt);
+	target.fontSize = compiled->fontSize;
+	target.xref = compiled->xref;
+	
+	for (i = 0; templateFields[i]; i++)
+	{
+		ix = (NMEInt)(templateFields[i] - &NMEOutputFormatNull.space);
+		str = (&outputFormat->space)[ix];
+		if (str)
+		{
+			for (len = 0; str[len]; len++)
+				;
+			compiled->str[ix] = str;
+			compiled->code[ix] = target.opsLen;
+			compileTemplate(str, 0, len, compiled->ctrlChar, &target);
+		}
+	}
+	if (target.opsLen > target.opsSize)
+		return kNMEErrNotEnoughMemory;
+	
+	// index plugins by name
+	compiled->plugins = outputFormat->plugins;
+	for (n = 0; outputFormat->plugins && outputFormat->plugins[n].name; n++)
+		;
+	for (compiled->pluginSlotCount = 1;
+			compiled->pluginSlotCount < 2 * n;
+			compiled->pluginSlotCount *= 2)
+		;
+	if (target.opsLen + compiled->pluginSlotCount + n + 1 > target.opsSize)
+		return kNMEErrNotEnoughMemory;
+	compiled->pluginSlots = target.opsLen;
+	for (i = 0; i < compiled->pluginSlotCount; i++)
+		compiled->ops[compiled->pluginSlots + i] = -1;
+	compiled->pluginPartial = target.opsLen + compiled->pluginSlotCount;
+	for (i = len = 0; i < n; i++)
+	{
+		NMEPlugin const *plugin = &outputFormat->plugins[i];
+		NMEInt *slot;
+		
+		if (plugin->options & kNMEPluginOptPartialName)
+			compiled->ops[compiled->pluginPartial + len++] = i;
+		
+		// add to hash table, unless a previous plugin matches the same tags
+		for (k = 0; plugin->name[k]; k++)
+			;
+		for (ix = (NMEInt)(pluginHash(plugin->name, k,
+					(plugin->options & kNMEPluginOptTripleAngleBrackets) != 0)
+					& (compiled->pluginSlotCount - 1));
+				*(slot = &compiled->ops[compiled->pluginSlots + ix]) >= 0
+					&& !pluginMatches(&outputFormat->plugins[*slot], plugin->name, k,
+							(plugin->options & kNMEPluginOptTripleAngleBrackets) != 0);
+				ix = (ix + 1) & (compiled->pluginSlotCount - 1))
+			;
+		if (*slot < 0)
+			*slot = i;
+	}
+	compiled->ops[compiled->pluginPartial + len++] = -1;
+	compiled->opsLen = compiled->pluginPartial + len;
+	
+	*compiledOutputFormat = *outputFormat;
+	compiledOutputFormat->compiled = compiled;
+	return kNMEErrOk;
+}
+
+/** Send output produced until now to the stream output function and
+	remove it from dest. Unless all is TRUE, the last line is kept in dest
+	so that it can still be wordwrapped.
+	@param[in,out] context current context
+	@param[in] all TRUE to send all output, FALSE to keep the last line
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr flushOutput(NMEContext *context, NMEBoolean all)
+{
+	NMEInt len, k;
+	NMEErr err;
+	
+	// find end of last complete line
+	len = context->destLen;
+	if (!all)
+		while (len > 0 && !isEol(context->dest[len - 1]))
+			len--;
+	
+	if (len > 0)
+	{
+		CheckError(context->streamOutputFun(context->dest, len,
+				context->streamOutputData));
+		if (context->destLenCountedUCS16 < len)
+			countDestUCS16(context, len);
+		context->destLenCountedUCS16 -= len;
+		context->wrapCheckedBegin -= len;
+		context->wrapCheckedEnd -= len;
+		for (k = len; k < context->destLen; k++)
+			context->dest[k - len] = context->dest[k];
+		context->destOffset += len;
+		context->destLen -= len;
+	}
+	return kNMEErrOk;
+}
+
+/** Update the indices in src of a context after the first n bytes of src
+	have been discarded (up to srcIndex at most; line number must be up to
+	date).
+	@param[in,out] context current context
+	@param[in] n number of bytes discarded
+*/
+static void shiftSource(NMEContext *context, NMEInt n)
+{
+	context->srcLen -= n;
+	context->srcIndexOffset += n;
+	context->noAutoOrPluginLen -= n;
+	if (context->noAutoOrPluginLen < 0)
+		context->noAutoOrPluginLen = 0;
+	context->reparsedEnd -= n;
+	if (context->reparsedEnd < 0)
+		context->reparsedEnd = 0;
+	context->autoconvertNext -= n;
+	if (context->autoconvertNext < 0)
+		context->autoconvertNext = 0;
+	if (context->autoLinkEnd >= 0)
+	{
+		if (context->autoLinkBegin >= 0)
+			context->autoLinkBegin -= n;
+		context->autoLinkEnd -= n;
+		context->autoLinkOffset -= n;
+		context->autoLinkTextOffset -= n;
+	}
+	context->srcIndex -= n;
+	context->srcIndexForLineNum = context->srcIndex;
+}
+
+/** Discard source code which has already been processed, moving input still
+	to be processed to the beginning of src (output must have been flushed).
+	@param[in,out] context current context
+*/
+static void compactSource(NMEContext *context)
+{
+	NMEInt k;
+	
+	updateLineNum(context);
+	for (k = 0; k < context->srcLen - context->srcIndex; k++)
+		context->src[k] = context->src[context->srcIndex + k];
+	shiftSource(context, context->srcIndex);
+}
+
+/** Find the next point in source code received by NMEProcessFeed where
+	parsing can stop without needing input which hasn't been received yet,
+	i.e. after the next empty line which isn't inside a plugin, once
+	autoconverts called at its eol can look ahead up to the next trigger.
+	Lines are scanned only once; the scan state is kept in context.
+	@param[in,out] context current context
+	@return index in src after the empty line, or -1 if none has been received
+*/
+static NMEInt nextBlockBoundary(NMEContext *context)
+{
+	NMEInt p, e, q, k;
+	
+	for (p = context->srcLen - context->scanTail; ; p = q)
+	{
+		// find complete line src[p..e-1] followed by eol src[e..q-1]
+		for (e = p; e < context->srcLen && !isEol(context->src[e]); e++)
+			;
+		if (e + 1 >= context->srcLen
+				&& (e >= context->srcLen || context->src[e] == '\r'))
+			return -1;	// incomplete line, or cannot tell if CR is followed by LF
+		q = context->src[e] == '\r' && context->src[e + 1] == '\n' ? e + 2 : e + 1;
+		context->scanTail = context->srcLen - q;
+		
+		// update pre and plugin state
+		for (k = p; k < e; )
+			if (context->scanPluginEndLen > 0)
+			{
+				// look for >> (or >>> for placeholders)
+				if ((k == p || !context->scanPluginBlock)
+						&& k + context->scanPluginEndLen <= e
+						&& context->src[k] == '>' && context->src[k + 1] == '>'
+						&& (context->scanPluginEndLen == 2 || context->src[k + 2] == '>'))
+				{
+					k += context->scanPluginEndLen;
+					context->scanPluginEndLen = 0;
+				}
+				else if (context->scanPluginBlock)
+					k = e;	// end of block plugin must begin a line
+				else
+					k++;
+			}
+			else if (context->scanPre)
+			{
+				// look for }}} at the beginning of a line
+				if (k == p && k + 3 <= e && context->src[k] == '}'
+						&& context->src[k + 1] == '}' && context->src[k + 2] == '}')
+				{
+					context->scanPre = FALSE;
+					k += 3;
+				}
+				else
+					k = e;
+			}
+			else if (k + 1 < e && context->src[k] == '<' && context->src[k + 1] == '<')
+			{
+				// beginning of plugin or placeholder
+				context->scanPluginEndLen = k + 2 < e && context->src[k + 2] == '<' ? 3 : 2;
+				k += context->scanPluginEndLen;
+				skipBlanks(context->src, e, &k);
+				context->scanPluginBlock = k >= e;
+			}
+			else
+			{
+				if (k == p)
+				{
+					// {{{ alone on a line?
+					skipBlanks(context->src, e, &k);
+					if (k + 3 <= e && context->src[k] == '{'
+							&& context->src[k + 1] == '{' && context->src[k + 2] == '{')
+					{
+						k += 3;
+						skipBlanks(context->src, e, &k);
+						if (k >= e)
+						{
+							context->scanPre = TRUE;
+							break;
+						}
+					}
+					k = p;
+				}
+				k++;
+			}
+		
+		// empty line outside plugins
+		if (e == p && context->scanPluginEndLen == 0)
+		{
+			if (context->outputFormat->autoconverts
+					&& !(context->options & kNMEProcessOptNoPlugin))
+			{
+				// wait for a trigger after it, so that the lookahead of
+				// autoconverts isn't cut by the end of input received yet
+				for (k = q; k < context->srcLen
+						&& !context->autoconvertTrigger[(unsigned char)context->src[k]]; k++)
+					;
+				if (k >= context->srcLen)
+				{
+					context->scanTail = context->srcLen - p;
+					return -1;
+				}
+			}
+			return q;
+		}
+	}
+}
+
+NMEErr NMEProcessBegin(NMEText buf, NMEInt bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEProcessOutputFun outputFun,
+		void *outputData,
+		NMEContext **context)
+{
+	NMEInt align;
+	NMEContext *c;
+	
+	// context at the beginning of buf, aligned for any member
+	align = (NMEInt)((sizeof(double) - (unsigned long)buf % sizeof(double))
+			% sizeof(double));
+	if (bufSize < align + (NMEInt)sizeof(NMEContext) + 2)
+		return kNMEErrNotEnoughMemory;
+	c = (NMEContext *)(buf + align);
+	buf += align + sizeof(NMEContext);
+	bufSize -= align + sizeof(NMEContext);
+	
+	initContext(c, options, eol, outputFormat, fontSize);
+	c->streamOutputFun = outputFun;
+	c->streamOutputData = outputData;
+	
+	// set up buffers
+	c->src = buf;
+	c->srcLen = 0;
+	c->srcSize = bufSize / 2;
+	c->dest = buf + bufSize / 2;
+	c->bufSize = bufSize / 2;
+	
+	// beginning of doc
+	if (!(options & kNMEProcessOptNoPreAndPost)
+			&& !addFormatString(c, beginDoc))
+		return kNMEErrNotEnoughMemory;
+	
+	*context = c;
+	return flushOutput(c, FALSE);
+}
+
+NMEErr NMEProcessFeed(NMEContext *context,
+		NMEConstText nmeText, NMEInt nmeTextLen)
+{
+	NMEInt n, k, boundary;
+	NMEErr err;
+	
+	while (nmeTextLen > 0)
+	{
+		// append input, first up to half of src (the remaining part is
+		// kept for plugins), then up to the whole src if no block fits
+		compactSource(context);
+		n = (context->srcLen < context->srcSize / 2
+					? context->srcSize / 2 : context->srcSize)
+				- context->srcLen;
+		if (n > nmeTextLen)
+			n = nmeTextLen;
+		if (n <= 0)
+			return kNMEErrNotEnoughMemory;	// block larger than buffer
+		for (k = 0; k < n; k++)
+			context->src[context->srcLen + k] = nmeText[k];
+		context->srcLen += n;
+		context->scanTail += n;
+		nmeText += n;
+		nmeTextLen -= n;
+		
+		// process all complete blocks
+		while ((boundary = nextBlockBoundary(context)) >= 0)
+		{
+			context->srcTail = context->srcLen - boundary;
+			CheckError(parseSource(context));
+			CheckError(flushOutput(context, FALSE));
+		}
+	}
+	
+	return kNMEErrOk;
+}
+
+NMEErr NMEProcessEnd(NMEContext *context,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEErr err;
+	
+	// process remaining input
+	context->srcTail = 0;
+	CheckError(parseSource(context));
+	CheckError(endSource(context));
+	CheckError(flushOutput(context, TRUE));
+	
+	// set result
+	if (outputLen)
+		*outputLen = context->destOffset;
+	if (outputUCS16Len)
+		*outputUCS16Len = context->destLenUCS16;
+	return kNMEErrOk;
+}
+
+/// Default minimum size of the chunks converted by NMEProcessParallel
+#define kParallelChunkSize (64 * 1024)
+
+/** Chunk of source code converted by NMEProcessParallel */
+typedef struct
+{
+	NMEContext context;	///< context of the conversion of the chunk
+	NMEInt begin;	///< index of the beginning of the chunk in nmeText
+	NMEInt end;	///< index of the end of the chunk in nmeText
+	NMEInt lineNum;	///< line number of begin
+	NMEInt headingNum[kMaxNumberedHeadingLevels];	///< heading numbers at begin (prescan)
+	NMEInt headingFlags;	///< headingFlags at begin (prescan)
+	NMEInt headingLevel;	///< headingLevel at begin (prescan)
+	NMEErr err;	///< result of the conversion
+} NMEParallelChunk;
+
+/** Data shared by the tasks of NMEProcessParallel */
+typedef struct
+{
+	NMEConstText nmeText;	///< source text with markup
+	NMEInt nmeTextLen;	///< source text length
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEConstText eol;	///< null-terminated string used for end-of-line
+	NMEOutputFormat const *outputFormat;	///< output format strings
+	NMEInt fontSize;	///< font size of plain text in points
+	NMEReallocFun reallocFun;	///< function used to allocate buffers
+	void *reallocData;	///< data passed to reallocFun
+	NMEParallelChunk *chunks;	///< chunks
+	NMEInt chunkCount;	///< number of chunks
+	NMEText output;	///< concatenated output
+} NMEParallelData;
+
+/** Scan a line for the cuts of NMEProcessParallel and NMEIncremental,
+	keeping track of preformatted blocks and plugins which cannot be cut.
+	@param[in] src source code
+	@param[in] p index in src of the beginning of the line
+	@param[in] e index in src of the end of the line (eol or end of src)
+	@param[in,out] pre TRUE in a preformatted block
+	@param[in,out] plugin TRUE in a plugin
+	@return index in src of the heading markup which begins the line, or -1
+*/
+static NMEInt scanLineForCut(NMEConstText src, NMEInt p, NMEInt e,
+		NMEBoolean *pre, NMEBoolean *plugin)
+{
+	NMEInt k = p;
+	
+	if (*plugin)
+	{
+		// look for >>
+		while (k + 1 < e && !(src[k] == '>' && src[k + 1] == '>'))
+			k++;
+		*plugin = k + 1 >= e;
+	}
+	else if (*pre)
+		// look for }}} at the beginning of the line
+		*pre = !(k + 3 <= e
+				&& src[k] == '}' && src[k + 1] == '}' && src[k + 2] == '}');
+	else if (e > p)
+	{
+		skipBlanks(src, e, &k);
+		if (k + 3 <= e && src[k] == '{' && src[k + 1] == '{' && src[k + 2] == '{')
+		{
+			// {{{ alone on the line
+			k += 3;
+			skipBlanks(src, e, &k);
+			*pre = k >= e;
+		}
+		else if (k + 1 < e && src[k] == '<' && src[k + 1] == '<')
+		{
+			// plugin without >> on the same line
+			for (k += 2; k + 1 < e && !(src[k] == '>' && src[k + 1] == '>'); k++)
+				;
+			*plugin = k + 1 >= e;
+		}
+		else if (k < e && src[k] == '=')
+			return k;
+	}
+	return -1;
+}
+
+/** Prescan of NMEProcessParallel: cut source code at empty lines outside
+	preformatted blocks and plugins, at least chunkSize bytes apart, with the
+	line number and a guess of the heading state at the beginning of each
+	chunk. Only markup at the beginning of lines is recognized; a wrong
+	guess is caught later, when the state at the end of the previous chunk
+	is checked.
+	@param[in,out] data data shared by the tasks (chunks and chunkCount are set;
+	chunks, initially NULL, is allocated with reallocFun)
+	@param[in] chunkSize minimum size of chunks
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean cutChunks(NMEParallelData *data, NMEInt chunkSize)
+{
+	NMEConstText src = data->nmeText;
+	NMEInt len = data->nmeTextLen;
+	NMEParallelChunk *chunk = NULL;
+	NMEParallelChunk *newChunks;
+	NMEInt size = 0;	// number of allocated chunks
+	NMEInt headingNum[kMaxNumberedHeadingLevels], headingFlags, headingLevel;
+	NMEInt p, e, q, k, lineNum;
+	NMEBoolean pre = FALSE, plugin = FALSE;
+	
+	// heading state like initContext
+	headingFlags = headingLevel = 0;
+	headingNum[0] = -1;
+	nextHeading(&headingFlags, headingNum, 1);
+	headingFlags = 0;
+	
+	for (data->chunkCount = 0, p = 0, lineNum = 1; p < len; p = q, lineNum++)
+	{
+		// line src[p..e-1] followed by eol src[e..q-1]
+		for (e = p; e < len && !isEol(src[e]); e++)
+			;
+		q = e + 1 < len && src[e] == '\r' && src[e + 1] == '\n' ? e + 2 : e + 1;
+		
+		// beginning of the first chunk, or cut after an empty line if
+		// the chunk is large enough
+		if (data->chunkCount == 0 || (e == p && !pre && !plugin
+				&& q - chunk->begin >= chunkSize && len - q >= chunkSize))
+		{
+			if (data->chunkCount >= size)
+			{
+				size = size > 0 ? 2 * size : 16;
+				newChunks = (NMEParallelChunk *)data->reallocFun(data->chunks,
+						size * sizeof(NMEParallelChunk), data->reallocData);
+				if (!newChunks)
+					return FALSE;
+				data->chunks = newChunks;
+			}
+			if (data->chunkCount > 0)
+				data->chunks[data->chunkCount - 1].end = q;
+			chunk = &data->chunks[data->chunkCount++];
+			chunk->begin = data->chunkCount > 1 ? q : 0;
+			chunk->lineNum = data->chunkCount > 1 ? lineNum + 1 : 1;
+			for (k = 0; k < kMaxNumberedHeadingLevels; k++)
+				chunk->headingNum[k] = headingNum[k];
+			chunk->headingFlags = headingFlags;
+			chunk->headingLevel = headingLevel;
+		}
+		
+		k = scanLineForCut(src, p, e, &pre, &plugin);
+		if (k >= 0)
+		{
+			// heading, like in parseNextToken
+			for (headingLevel = 0; k < e && src[k] == '='; k++, headingLevel++)
+				;
+			if (data->options & kNMEProcessOptNoH1 && headingLevel == 1)
+				headingLevel = 2;
+			if (headingLevel > data->outputFormat->maxHeadingLevel)
+				headingLevel = data->outputFormat->maxHeadingLevel;
+			if (headingLevel > 0)
+				nextHeading(&headingFlags, headingNum, headingLevel);
+		}
+	}
+	chunk->end = len;
+	return TRUE;
+}
+
+/** Set the source code of a context to parse nmeText in place from the eol
+	before a cut, so that autoconverts aren't called as if at the beginning
+	of the document.
+	@param[in,out] context context
+	@param[in] nmeText whole source text
+	@param[in] nmeTextLen length of nmeText
+	@param[in] begin index of the cut in nmeText
+	@param[in] lineNum line number of begin
+*/
+static void setSourceInPlace(NMEContext *context,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt begin, NMEInt lineNum)
+{
+	NMEInt offset = begin > 0 ? begin - 1 : 0;
+	
+	context->src = (NMEText)nmeText + offset;
+	context->srcLen = context->srcSize = nmeTextLen - offset;
+	context->srcInPlace = TRUE;
+	context->srcIndex = context->srcIndexForLineNum = begin - offset;
+	context->srcIndexOffset = offset;
+	context->srcLineNum = lineNum;
+	context->noAutoOrPluginLen = 0;
+	context->reparsedEnd = 0;
+	context->autoconvertNext = 0;
+}
+
+/** If src has been copied, parse nmeText in place again from the eol
+	before the current position (input still to be processed is unchanged),
+	so that the copy of the rest of the document can be freed now.
+	@param[in,out] context context
+	@param[in] nmeText whole source text
+*/
+static void parseInPlaceAgain(NMEContext *context, NMEConstText nmeText)
+{
+	NMEText src;
+	
+	if (!context->srcInPlace && context->srcIndex > 0)
+	{
+		src = context->src;
+		updateLineNum(context);
+		shiftSource(context, context->srcIndex - 1);
+		context->src = (NMEText)nmeText + context->srcIndexOffset;
+		context->srcSize = context->srcLen;
+		context->srcInPlace = TRUE;
+		context->reallocFun(src, 0, context->reallocData);
+	}
+}
+
+/** Convert a chunk for NMEProcessParallel from the state of its context,
+	which parses nmeText in place; the output is allocated.
+	@param[in] data data shared by the tasks
+	@param[in] i chunk index
+	@param[in] line beginning of the current output line (can be NULL if lineLen is 0)
+	@param[in] lineLen length of line
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertChunk(NMEParallelData const *data, NMEInt i,
+		NMEConstText line, NMEInt lineLen)
+{
+	NMEParallelChunk *chunk = &data->chunks[i];
+	NMEContext *context = &chunk->context;
+	NMEErr err;
+	
+	context->bufSize = 2 * (chunk->end - chunk->begin) + lineLen + kAllocExtraSize;
+	context->dest = (NMEText)data->reallocFun(NULL, context->bufSize,
+			data->reallocData);
+	if (!context->dest)
+		return kNMEErrNotEnoughMemory;
+	for (context->destLen = 0; context->destLen < lineLen; context->destLen++)
+		context->dest[context->destLen] = line[context->destLen];
+	context->destLenCountedUCS16 = 0;
+	context->wrapCheckedBegin = context->wrapCheckedEnd = 0;
+	
+	// beginning of doc in the first chunk, end of doc in the last one
+	if (i == 0 && !(context->options & kNMEProcessOptNoPreAndPost)
+			&& !addFormatString(context, beginDoc))
+		return kNMEErrNotEnoughMemory;
+	context->srcTail = context->srcIndexOffset + context->srcLen - chunk->end;
+	CheckError(parseSource(context));
+	if (i == data->chunkCount - 1)
+		CheckError(endSource(context));
+	countDestUCS16(context, context->destLen);
+	
+	parseInPlaceAgain(context, data->nmeText);
+	
+	return kNMEErrOk;
+}
+
+/** Task of NMEProcessParallel: convert a chunk from the state found by
+	the prescan.
+	@param[in] i chunk index
+	@param[in,out] taskData data shared by the tasks (NMEParallelData)
+*/
+static void convertChunkTask(NMEInt i, void *taskData)
+{
+	NMEParallelData *data = (NMEParallelData *)taskData;
+	NMEParallelChunk *chunk = &data->chunks[i];
+	NMEContext *context = &chunk->context;
+	NMEInt k;
+	
+	initContext(context, data->options, data->eol, data->outputFormat,
+			data->fontSize);
+	context->reallocFun = data->reallocFun;
+	context->reallocData = data->reallocData;
+	
+	setSourceInPlace(context, data->nmeText, data->nmeTextLen,
+			chunk->begin, chunk->lineNum);
+	
+	// the item number isn't reset after lists and headings: mark it as
+	// unknown until it's set (if i > 0)
+	if (i > 0)
+		context->item = -1;
+	
+	for (k = 0; k < kMaxNumberedHeadingLevels; k++)
+		context->headingNum[k] = chunk->headingNum[k];
+	context->headingFlags = chunk->headingFlags;
+	context->headingLevel = chunk->headingLevel;
+	
+	chunk->err = convertChunk(data, i, NULL, 0);
+}
+
+/** Task of NMEProcessParallel: copy the output of a chunk to its place
+	in the concatenated output (where the output of the first chunk is already).
+	@param[in] i chunk index
+	@param[in,out] taskData data shared by the tasks (NMEParallelData)
+*/
+static void copyChunkTask(NMEInt i, void *taskData)
+{
+	NMEParallelData *data = (NMEParallelData *)taskData;
+	NMEContext const *context = &data->chunks[i].context;
+	NMEInt k;
+	
+	if (i > 0)
+		for (k = 0; k < context->destLen; k++)
+			data->output[context->destOffset + k] = context->dest[k];
+}
+
+/** Check that the parser has reached a cut between paragraphs, with no
+	state which would prevent the conversion of the source code after it
+	from starting there (except for heading numbers and item number).
+	@param[in] context context
+	@param[in] cut index of the cut in the original source text
+	@return TRUE if the conversion can continue from a state at cut
+*/
+static NMEBoolean isCleanCut(NMEContext const *context, NMEInt cut)
+{
+	return context->srcIndexOffset + context->srcIndex == cut
+			&& context->noAutoOrPluginLen <= context->srcIndex
+			&& context->reparsedEnd <= context->srcIndex
+			&& context->autoLinkEnd < 0
+			&& context->state == kNMEStateBetweenPar
+			&& context->nesting == 0
+			&& context->styleNesting == 0
+			&& context->currentIndent == 0
+			&& (context->col == 0 || context->outputFormat->textWidth <= 0)
+			&& context->level == 0;
+}
+
+/** Check that the state at the end of a chunk converted by
+	NMEProcessParallel is the state the next chunk was converted from.
+	@param[in] context context at the end of the chunk
+	@param[in] next next chunk
+	@return TRUE if the conversion of next is valid, FALSE if it must be
+	converted again from context
+*/
+static NMEBoolean chunkStateMatches(NMEContext const *context,
+		NMEParallelChunk const *next)
+{
+	NMEInt k;
+	
+	if (!isCleanCut(context, next->begin)
+			|| context->headingFlags != next->headingFlags
+			|| context->headingLevel != next->headingLevel
+			|| next->context.stateUsed
+				& (kStateUsedOutputIndex | kStateUsedItemBefore))
+		return FALSE;
+	for (k = 0; k < kMaxNumberedHeadingLevels; k++)
+		if (context->headingNum[k] != next->headingNum[k])
+			return FALSE;
+	return TRUE;
+}
+
+NMEErr NMEProcessParallel(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt chunkSize,
+		NMERunTasksFun runTasks,
+		void *runTasksData,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEParallelData data;
+	NMEParallelChunk *chunk;
+	NMEContext *prev;
+	NMEInt i, len, ucs16Len, lineLen;
+	NMEErr err;
+	
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	if (chunkSize <= 0)
+		chunkSize = kParallelChunkSize;
+	
+	// serial conversion for small documents, or if hooks must be called in order
+	if (!runTasks || nmeTextLen < 2 * chunkSize
+			|| outputFormat->charHookFun || outputFormat->divHookFun
+			|| outputFormat->parHookFun || outputFormat->spanHookFun)
+		return NMEProcessAlloc(nmeText, nmeTextLen,
+				options, eol, outputFormat, fontSize,
+				reallocFun, reallocData,
+				output, outputLen, outputUCS16Len);
+	
+	data.nmeText = nmeText;
+	data.nmeTextLen = nmeTextLen;
+	data.options = options;
+	data.eol = eol;
+	data.outputFormat = outputFormat;
+	data.fontSize = fontSize;
+	data.reallocFun = reallocFun;
+	data.reallocData = reallocData;
+	data.chunks = NULL;
+	
+	// prescan, then conversion of all chunks at once
+	if (!cutChunks(&data, chunkSize))
+	{
+		if (data.chunks)
+			reallocFun(data.chunks, 0, reallocData);
+		return kNMEErrNotEnoughMemory;
+	}
+	for (i = 0; i < data.chunkCount; i++)
+	{
+		data.chunks[i].context.dest = NULL;
+		data.chunks[i].context.srcInPlace = TRUE;
+		data.chunks[i].err = kNMEErrOk;
+	}
+	err = runTasks(data.chunkCount, convertChunkTask, &data, runTasksData);
+	
+	// check the state at each cut and convert the next chunk again from
+	// the actual state if it was wrong
+	len = ucs16Len = 0;
+	for (i = 0; err == kNMEErrOk && i < data.chunkCount; i++)
+	{
+		chunk = &data.chunks[i];
+		if (i > 0 && !chunkStateMatches(&chunk[-1].context, chunk))
+		{
+			if (chunk->context.dest)
+				reallocFun(chunk->context.dest, 0, reallocData);
+			if (!chunk->context.srcInPlace)
+				reallocFun(chunk->context.src, 0, reallocData);
+			
+			// move the current output line of the previous chunk to this
+			// one, where wordwrap can still change it
+			prev = &chunk[-1].context;
+			for (lineLen = 0;
+					lineLen < prev->destLen
+						&& !isEol(prev->dest[prev->destLen - lineLen - 1]);
+					lineLen++)
+				;
+			len -= lineLen;
+			ucs16Len -= prev->destLenUCS16;
+			truncateDest(prev, prev->destLen - lineLen);
+			ucs16Len += prev->destLenUCS16;
+			
+			chunk->context = *prev;
+			prev->srcInPlace = TRUE;	// src now belongs to chunk
+			chunk->context.destOffset = len;
+			chunk->context.destLenUCS16 = ucs16Len;
+			chunk->err = convertChunk(&data, i,
+					prev->dest + prev->destLen, lineLen);
+			chunk->context.destLenUCS16 -= ucs16Len;
+		}
+		err = chunk->err;
+		chunk->context.destOffset = len;
+		len += chunk->context.destLen;
+		ucs16Len += chunk->context.destLenUCS16;
+	}
+	
+	// concatenate output after the output of the first chunk
+	if (err == kNMEErrOk)
+	{
+		data.output = (NMEText)reallocFun(data.chunks[0].context.dest, len + 1,
+				reallocData);
+		if (!data.output)
+			err = kNMEErrNotEnoughMemory;
+		else
+		{
+			data.chunks[0].context.dest = NULL;
+			err = runTasks(data.chunkCount, copyChunkTask, &data, runTasksData);
+			if (err == kNMEErrOk)
+			{
+				data.output[len] = '\0';
+				*output = data.output;
+				*outputLen = len;
+				if (outputUCS16Len)
+					*outputUCS16Len = ucs16Len;
+			}
+			else
+				reallocFun(data.output, 0, reallocData);
+		}
+	}
+	
+	for (i = 0; i < data.chunkCount; i++)
+	{
+		if (data.chunks[i].context.dest)
+			reallocFun(data.chunks[i].context.dest, 0, reallocData);
+		if (!data.chunks[i].context.srcInPlace)
+			reallocFun(data.chunks[i].context.src, 0, reallocData);
+	}
+	reallocFun(data.chunks, 0, reallocData);
+	return err;
+}
+
+/** Worker of NMEProcessBatch */
+typedef struct
+{
+	NMEInt first;	///< next document of the worker (queue[w+first*workerCount])
+	NMEInt last;	///< end of the documents of the worker (same indexing)
+	NMEText buf;	///< buffer reused for the output of all documents
+	NMEInt bufSize;	///< size of buf
+} NMEBatchWorker;
+
+/** Data shared by the workers of NMEProcessBatch */
+typedef struct
+{
+	NMEBatchDoc *docs;	///< documents
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEConstText eol;	///< null-terminated string used for end-of-line
+	NMEOutputFormat const *outputFormat;	///< output format strings
+	NMEInt fontSize;	///< font size of plain text in points
+	NMEReallocFun reallocFun;	///< function used to allocate buffers
+	void *reallocData;	///< data passed to reallocFun
+	NMELockFun lockFun;	///< function which locks workers and queue (NULL if single worker)
+	void *lockData;	///< data passed to lockFun
+	NMEBatchWorker *workers;	///< workers
+	NMEInt workerCount;	///< number of workers
+	NMEInt *queue;	///< indices of documents sorted by decreasing size
+} NMEBatchData;
+
+/** Convert a document of NMEProcessBatch in the buffer of a worker, then
+	copy the output to a new buffer.
+	@param[in] data data shared by the workers
+	@param[in,out] worker worker (buf and bufSize are updated)
+	@param[in,out] doc document
+*/
+static void convertBatchDoc(NMEBatchData const *data,
+		NMEBatchWorker *worker,
+		NMEBatchDoc *doc)
+{
+	NMEContext context;
+	NMEText output;
+	NMEInt k;
+	
+	initContext(&context, data->options, data->eol, data->outputFormat,
+			data->fontSize);
+	context.reallocFun = data->reallocFun;
+	context.reallocData = data->reallocData;
+	context.src = (NMEText)doc->nmeText;
+	context.srcLen = context.srcSize = doc->nmeTextLen;
+	context.srcInPlace = TRUE;
+	if (!worker->buf)
+	{
+		worker->bufSize = 2 * doc->nmeTextLen + kAllocExtraSize;
+		worker->buf = (NMEText)data->reallocFun(NULL, worker->bufSize,
+				data->reallocData);
+		if (!worker->buf)
+		{
+			doc->err = kNMEErrNotEnoughMemory;
+			return;
+		}
+	}
+	context.dest = worker->buf;
+	context.bufSize = worker->bufSize;
+	
+	doc->err = processSource(&context, &output, &doc->outputLen,
+			&doc->outputUCS16Len);
+	
+	// keep dest (possibly enlarged) for the next document
+	worker->buf = context.dest;
+	worker->bufSize = context.bufSize;
+	if (!context.srcInPlace)
+		data->reallocFun(context.src, 0, data->reallocData);
+	if (doc->err != kNMEErrOk)
+		return;
+	
+	doc->output = (NMEText)data->reallocFun(NULL, doc->outputLen + 1,
+			data->reallocData);
+	if (!doc->output)
+	{
+		doc->err = kNMEErrNotEnoughMemory;
+		return;
+	}
+	for (k = 0; k <= doc->outputLen; k++)
+		doc->output[k] = output[k];
+}
+
+/** Task of NMEProcessBatch: worker which converts its own documents, then
+	steals documents from the other workers until there is none left.
+	@param[in] w worker index
+	@param[in,out] taskData data shared by the workers (NMEBatchData)
+*/
+static void batchWorkerTask(NMEInt w, void *taskData)
+{
+	NMEBatchData *data = (NMEBatchData *)taskData;
+	NMEBatchWorker *worker = &data->workers[w];
+	NMEInt d, v, victim, n = data->workerCount;
+	
+	for (;;)
+	{
+		if (data->lockFun)
+			data->lockFun(TRUE, data->lockData);
+		if (worker->first < worker->last)
+			d = data->queue[w + n * worker->first++];
+		else
+		{
+			// steal the last document of the worker which has the most left
+			for (victim = -1, v = 0; v < n; v++)
+				if (data->workers[v].last > data->workers[v].first
+						&& (victim < 0
+							|| data->workers[v].last - data->workers[v].first
+								> data->workers[victim].last - data->workers[victim].first))
+					victim = v;
+			d = victim >= 0
+					? data->queue[victim + n * --data->workers[victim].last]
+					: -1;
+		}
+		if (data->lockFun)
+			data->lockFun(FALSE, data->lockData);
+		
+		if (d < 0)
+			return;
+		convertBatchDoc(data, worker, &data->docs[d]);
+	}
+}
+
+NMEErr NMEProcessBatch(NMEBatchDoc *docs, NMEInt docCount,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt workerCount,
+		NMERunTasksFun runTasks,
+		void *runTasksData,
+		NMELockFun lockFun,
+		void *lockData,
+		NMEReallocFun reallocFun,
+		void *reallocData)
+{
+	NMEBatchData data;
+	NMEInt i, j, k, gap, w;
+	NMEErr err;
+	
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	
+	// single worker if it cannot be run concurrently, or if hooks must be
+	// called for one document at a time
+	if (!runTasks || !lockFun
+			|| outputFormat->charHookFun || outputFormat->divHookFun
+			|| outputFormat->parHookFun || outputFormat->spanHookFun)
+		workerCount = 1;
+	else if (workerCount > docCount)
+		workerCount = docCount;
+	if (workerCount < 1)
+		workerCount = 1;
+	
+	data.docs = docs;
+	data.options = options;
+	data.eol = eol;
+	data.outputFormat = outputFormat;
+	data.fontSize = fontSize;
+	data.reallocFun = reallocFun;
+	data.reallocData = reallocData;
+	data.lockFun = workerCount > 1 ? lockFun : NULL;
+	data.lockData = lockData;
+	data.workerCount = workerCount;
+	data.workers = (NMEBatchWorker *)reallocFun(NULL,
+			workerCount * sizeof(NMEBatchWorker), reallocData);
+	data.queue = (NMEInt *)reallocFun(NULL,
+			(docCount > 0 ? docCount : 1) * sizeof(NMEInt), reallocData);
+	if (!data.workers || !data.queue)
+	{
+		if (data.workers)
+			reallocFun(data.workers, 0, reallocData);
+		if (data.queue)
+			reallocFun(data.queue, 0, reallocData);
+		return kNMEErrNotEnoughMemory;
+	}
+	
+	// sort documents by decreasing size (shell sort)
+	for (i = 0; i < docCount; i++)
+	{
+		data.queue[i] = i;
+		docs[i].output = NULL;
+		docs[i].outputLen = docs[i].outputUCS16Len = 0;
+		docs[i].err = kNMEErrOk;
+	}
+	for (gap = docCount / 2; gap > 0; gap /= 2)
+		for (i = gap; i < docCount; i++)
+			for (j = i - gap;
+					j >= 0 && docs[data.queue[j]].nmeTextLen
+						< docs[data.queue[j + gap]].nmeTextLen;
+					j -= gap)
+			{
+				k = data.queue[j];
+				data.queue[j] = data.queue[j + gap];
+				data.queue[j + gap] = k;
+			}
+	
+	// deal documents to workers, largest first: worker w gets sorted
+	// documents w, w+workerCount, w+2*workerCount etc.
+	for (w = 0; w < workerCount; w++)
+	{
+		data.workers[w].first = 0;
+		data.workers[w].last = (docCount - w + workerCount - 1) / workerCount;
+		data.workers[w].buf = NULL;
+		data.workers[w].bufSize = 0;
+	}
+	
+	if (workerCount > 1)
+		err = runTasks(workerCount, batchWorkerTask, &data, runTasksData);
+	else
+	{
+		batchWorkerTask(0, &data);
+		err = kNMEErrOk;
+	}
+	
+	for (w = 0; w < workerCount; w++)
+		if (data.workers[w].buf)
+			reallocFun(data.workers[w].buf, 0, reallocData);
+	reallocFun(data.workers, 0, reallocData);
+	reallocFun(data.queue, 0, reallocData);
+	
+	// keep no output if the batch failed
+	if (err != kNMEErrOk)
+		for (i = 0; i < docCount; i++)
+			if (docs[i].output)
+			{
+				reallocFun(docs[i].output, 0, reallocData);
+				docs[i].output = NULL;
+			}
+	return err;
+}
+
+/// Default minimum size of the blocks of NMEIncremental
+#define kIncrementalBlockSize 1024
+
+/** Block of source code converted by NMEIncrementalUpdate */
+typedef struct
+{
+	NMEContext context;	///< context at the beginning of the block (item in itemBefore)
+	NMEInt begin;	///< index of the beginning of the block in the source text
+	NMEInt end;	///< index of the end of the block in the source text
+	NMEInt lineNum;	///< line number of begin
+	NMEInt outputOffset;	///< index of the output of the block in the output
+	NMEInt outputUCS16Offset;	///< outputOffset in 16-bit unicode characters
+	NMEInt outputLen;	///< length of the output of the block
+	NMEInt outputUCS16Len;	///< outputLen in 16-bit unicode characters
+	NMEInt stateUsed;	///< kStateUsed flags of the conversion of the block
+	NMEInt itemEnd;	///< item at the end of the block, or -1 if not set in the block
+	NMEBoolean rendered;	///< TRUE if the output is in rendered, FALSE if in the previous output
+	NMEInt copyOffset;	///< index of the output in rendered or in the previous output
+} NMEIncrementalBlock;
+
+struct NMEIncrementalStruct
+{
+	NMEInt options;	///< kNMEProcessOptDefault or sum of options
+	NMEConstText eol;	///< null-terminated string used for end-of-line
+	NMEOutputFormat const *outputFormat;	///< output format strings
+	NMEInt fontSize;	///< font size of plain text in points
+	NMEInt blockSize;	///< minimum size of blocks
+	NMEReallocFun reallocFun;	///< function used to allocate buffers
+	void *reallocData;	///< data passed to reallocFun
+	
+	NMEIncrementalBlock **blocks;	///< blocks of the last conversion
+	NMEInt blockCount;	///< number of blocks
+	NMEInt srcLen;	///< length of the last source text, or -1 if blocks aren't valid
+	NMEText output;	///< last output, followed by null byte
+	NMEInt outputSize;	///< size of output
+	NMEInt outputLen;	///< length of output
+	NMEInt outputUCS16Len;	///< length of output in 16-bit unicode characters
+	NMEText rendered;	///< output of the blocks converted during the last update
+	NMEInt renderedSize;	///< size of rendered
+};
+
+/** Find where the next block of NMEIncremental can be cut: after the first
+	empty line outside preformatted blocks and plugins.
+	@param[in] src source code
+	@param[in] len length of src
+	@param[in] p index in src of the beginning of a line where to start
+	@param[in] minEnd minimum index of the cut
+	@return index in src of the cut, or len if there is none
+*/
+static NMEInt nextBlockCut(NMEConstText src, NMEInt len,
+		NMEInt p, NMEInt minEnd)
+{
+	NMEInt e, q;
+	NMEBoolean pre = FALSE, plugin = FALSE;
+	
+	for (; p < len; p = q)
+	{
+		// line src[p..e-1] followed by eol src[e..q-1]
+		for (e = p; e < len && !isEol(src[e]); e++)
+			;
+		q = e + 1 < len && src[e] == '\r' && src[e + 1] == '\n' ? e + 2 : e + 1;
+		if (e == p && !pre && !plugin && q >= minEnd && q < len)
+			return q;
+		(void)scanLineForCut(src, p, e, &pre, &plugin);
+	}
+	return len;
+}
+
+/** Convert a block for NMEIncrementalUpdate from the state of the context,
+	until a cut where the state is clean or the end of the source code.
+	@param[in] incremental incremental conversion
+	@param[in,out] context context, which parses nmeText in place at the
+	beginning of the block and whose dest is rendered
+	@param[in] nmeText source text
+	@param[in] nmeTextLen length of nmeText
+	@param[out] block block
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertBlock(NMEIncremental const *incremental,
+		NMEContext *context,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEIncrementalBlock *block)
+{
+	NMEInt q;
+	NMEErr err;
+	
+	// state at the beginning, with the item number marked as unknown
+	block->begin = context->srcIndexOffset + context->srcIndex;
+	updateLineNum(context);
+	block->lineNum = context->srcLineNum;
+	if (context->item >= 0)
+	{
+		context->itemBefore = context->item;
+		context->item = -1;
+	}
+	context->stateUsed = 0;
+	block->context = *context;
+	
+	block->rendered = TRUE;
+	block->copyOffset = context->destLen;
+	block->outputOffset = context->destOffset + context->destLen;
+	countDestUCS16(context, context->destLen);
+	block->outputUCS16Offset = context->destLenUCS16;
+	
+	if (block->begin == 0 && !(context->options & kNMEProcessOptNoPreAndPost)
+			&& !addFormatString(context, beginDoc))
+		return kNMEErrNotEnoughMemory;
+	for (q = block->begin; ; )
+	{
+		q = nextBlockCut(nmeText, nmeTextLen, q,
+				block->begin + incremental->blockSize);
+		context->srcTail = context->srcIndexOffset + context->srcLen - q;
+		CheckError(parseSource(context));
+		if (q >= nmeTextLen)
+		{
+			CheckError(endSource(context));
+			break;
+		}
+		else if (isCleanCut(context, q))
+			break;
+	}
+	
+	block->end = q;
+	block->outputLen = context->destLen - block->copyOffset;
+	countDestUCS16(context, context->destLen);
+	block->outputUCS16Len = context->destLenUCS16 - block->outputUCS16Offset;
+	block->stateUsed = context->stateUsed;
+	block->itemEnd = context->item;
+	return kNMEErrOk;
+}
+
+/** Check if an old block can be moved instead of being converted again
+	(not to or from the beginning, where the output has the prologue).
+	@param[in] block old block
+	@param[in] delta difference between new and old input index
+	@param[in] lineDelta difference between new and old line number
+	@param[in] outputOffset new output index
+	@param[in] outputUCS16Offset new output index in 16-bit unicode characters
+	@param[in] item item number at the beginning of the block
+	@return TRUE if the output of the block is unchanged
+*/
+static NMEBoolean blockOutputUnchanged(NMEIncrementalBlock const *block,
+		NMEInt delta, NMEInt lineDelta,
+		NMEInt outputOffset, NMEInt outputUCS16Offset,
+		NMEInt item)
+{
+	return !(delta != 0 && (block->begin == 0 || block->begin + delta == 0))
+			&& !(block->stateUsed & kStateUsedInputIndex && delta != 0)
+			&& !(block->stateUsed & kStateUsedLineNum && lineDelta != 0)
+			&& !(block->stateUsed & kStateUsedOutputIndex
+				&& (outputOffset != block->outputOffset
+					|| outputUCS16Offset != block->outputUCS16Offset))
+			&& !(block->stateUsed & kStateUsedItemBefore
+				&& item != block->context.itemBefore);
+}
+
+/** Move bytes in a buffer, like memmove.
+	@param[out] dest destination
+	@param[in] src source (can overlap dest)
+	@param[in] n number of bytes
+*/
+static void moveBytes(NMEText dest, NMEConstText src, NMEInt n)
+{
+	NMEInt i;
+	
+	if (dest > src)
+		for (i = n - 1; i >= 0; i--)
+			dest[i] = src[i];
+	else if (dest < src)
+		for (i = 0; i < n; i++)
+			dest[i] = src[i];
+}
+
+/** Check if the output of two successive blocks is moved together, i.e. if
+	both are in the previous output and stay contiguous.
+	@param[in] block first block
+	@param[in] next next block
+	@return TRUE if the output of both blocks can be moved at once
+*/
+static NMEBoolean blocksMovedTogether(NMEIncrementalBlock const *block,
+		NMEIncrementalBlock const *next)
+{
+	return !block->rendered && !next->rendered
+			&& block->copyOffset + block->outputLen == next->copyOffset
+			&& block->outputOffset + block->outputLen == next->outputOffset;
+}
+
+/** Free an array of blocks (NULL elements are skipped).
+	@param[in] incremental incremental conversion
+	@param[in] blocks array of blocks (can be NULL)
+	@param[in] blockCount number of elements in blocks
+*/
+static void freeBlocks(NMEIncremental const *incremental,
+		NMEIncrementalBlock **blocks, NMEInt blockCount)
+{
+	NMEInt k;
+	
+	if (blocks)
+	{
+		for (k = 0; k < blockCount; k++)
+			if (blocks[k])
+				incremental->reallocFun(blocks[k], 0, incremental->reallocData);
+		incremental->reallocFun(blocks, 0, incremental->reallocData);
+	}
+}
+
+NMEErr NMEIncrementalBegin(NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt blockSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEIncremental **incremental)
+{
+	NMEIncremental *inc;
+	
+	inc = (NMEIncremental *)reallocFun(NULL, sizeof(NMEIncremental), reallocData);
+	if (!inc)
+		return kNMEErrNotEnoughMemory;
+	inc->options = options;
+	inc->eol = eol;
+	inc->outputFormat = outputFormat ? outputFormat : &NMEOutputFormatText;
+	inc->fontSize = fontSize;
+	inc->blockSize = blockSize > 0 ? blockSize : kIncrementalBlockSize;
+	inc->reallocFun = reallocFun;
+	inc->reallocData = reallocData;
+	inc->blocks = NULL;
+	inc->blockCount = 0;
+	inc->srcLen = -1;
+	inc->output = NULL;
+	inc->outputSize = inc->outputLen = inc->outputUCS16Len = 0;
+	inc->rendered = NULL;
+	inc->renderedSize = 0;
+	*incremental = inc;
+	return kNMEErrOk;
+}
+
+NMEErr NMEIncrementalUpdate(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt editIndex, NMEInt deletedLen, NMEInt insertedLen,
+		NMEConstText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEOutputFormat const *outputFormat = incremental->outputFormat;
+	NMEReallocFun reallocFun = incremental->reallocFun;
+	void *reallocData = incremental->reallocData;
+	NMEIncrementalBlock **oldBlocks = incremental->blocks;
+	NMEInt oldCount = incremental->blockCount;
+	NMEIncrementalBlock **blocks, **newBlocks, *block, *old;
+	NMEInt blockCount, size, renderedLen, delta, lineDelta, item;
+	NMEInt i, k, m, pos, len, ucs16Len;
+	NMEContext context;
+	NMEBoolean contextValid;
+	NMEText newOutput;
+	NMEErr err = kNMEErrOk;
+	
+	// hooks must be called for the whole document in order
+	if (outputFormat->charHookFun || outputFormat->divHookFun
+			|| outputFormat->parHookFun || outputFormat->spanHookFun)
+	{
+		freeBlocks(incremental, oldBlocks, oldCount);
+		incremental->blocks = NULL;
+		incremental->blockCount = 0;
+		incremental->srcLen = -1;
+		CheckError(NMEProcessAlloc(nmeText, nmeTextLen,
+				incremental->options, incremental->eol, outputFormat,
+				incremental->fontSize, reallocFun, reallocData,
+				&newOutput, &len, &ucs16Len));
+		if (incremental->output)
+			reallocFun(incremental->output, 0, reallocData);
+		incremental->output = newOutput;
+		incremental->outputSize = len + 1;
+		incremental->outputLen = len;
+		incremental->outputUCS16Len = ucs16Len;
+		*output = newOutput;
+		*outputLen = len;
+		if (outputUCS16Len)
+			*outputUCS16Len = ucs16Len;
+		return kNMEErrOk;
+	}
+	
+	// no block of the previous conversion can be used if the edit isn't
+	// consistent with it
+	if (incremental->srcLen < 0 || editIndex < 0
+			|| deletedLen < 0 || insertedLen < 0
+			|| editIndex + deletedLen > incremental->srcLen
+			|| nmeTextLen != incremental->srcLen - deletedLen + insertedLen)
+	{
+		oldCount = 0;
+		editIndex = deletedLen = insertedLen = 0;
+	}
+	delta = insertedLen - deletedLen;
+	
+	size = oldCount + 16;
+	blocks = (NMEIncrementalBlock **)reallocFun(NULL,
+			size * sizeof(NMEIncrementalBlock *), reallocData);
+	if (!blocks)
+		return kNMEErrNotEnoughMemory;
+	
+	// keep the blocks before the block of the edit
+	for (k = 0; k + 1 < oldCount && oldBlocks[k + 1]->begin <= editIndex; k++)
+		;
+	
+	// autoconverts are called at the eol before the block, when the previous
+	// one is parsed, and look ahead up to the next trigger: if the edit is
+	// before it, the previous block must be converted again too
+	if (k > 0 && outputFormat->autoconverts
+			&& !(incremental->options & kNMEProcessOptNoPlugin))
+	{
+		for (i = oldBlocks[k]->begin;
+				i < editIndex
+					&& !oldBlocks[k]->context.autoconvertTrigger[(unsigned char)nmeText[i]];
+				i++)
+			;
+		if (i >= editIndex)
+			k--;
+	}
+	
+	len = ucs16Len = 0;
+	for (blockCount = 0; blockCount < k; blockCount++)
+	{
+		block = blocks[blockCount] = oldBlocks[blockCount];
+		oldBlocks[blockCount] = NULL;
+		block->rendered = FALSE;
+		block->copyOffset = block->outputOffset;
+		len += block->outputLen;
+		ucs16Len += block->outputUCS16Len;
+	}
+	
+	// convert from the state at the beginning of the block of the edit
+	if (k < oldCount)
+	{
+		context = oldBlocks[k]->context;
+		setSourceInPlace(&context, nmeText, nmeTextLen,
+				oldBlocks[k]->begin, oldBlocks[k]->lineNum);
+	}
+	else
+	{
+		initContext(&context, incremental->options, incremental->eol,
+				outputFormat, incremental->fontSize);
+		context.reallocFun = reallocFun;
+		context.reallocData = reallocData;
+		setSourceInPlace(&context, nmeText, nmeTextLen, 0, 1);
+	}
+	renderedLen = 0;
+	context.dest = incremental->rendered;
+	context.bufSize = incremental->renderedSize;
+	context.destLen = 0;
+	context.destOffset = len;
+	context.destLenUCS16 = ucs16Len;
+	context.destLenCountedUCS16 = 0;
+	context.wrapCheckedBegin = context.wrapCheckedEnd = 0;
+	contextValid = TRUE;
+	lineDelta = item = 0;
+	
+	for (m = k; err == kNMEErrOk; )
+	{
+		// old block which begins at the same place after the edit, with the
+		// same state
+		pos = context.srcIndexOffset + context.srcIndex;
+		old = NULL;
+		if (!contextValid)
+		{
+			pos = blocks[blockCount - 1]->end;
+			old = oldBlocks[m];
+		}
+		else if (pos >= editIndex + insertedLen)
+		{
+			while (m < oldCount && oldBlocks[m]->begin + delta < pos)
+				m++;
+			if (m < oldCount && oldBlocks[m]->begin + delta == pos)
+			{
+				old = oldBlocks[m];
+				if (context.options & (kNMEProcessOptH1Num | kNMEProcessOptH2Num))
+					for (i = 0; old && i < kMaxNumberedHeadingLevels; i++)
+						if (context.headingNum[i] != old->context.headingNum[i])
+							old = NULL;
+				item = context.item >= 0 ? context.item : context.itemBefore;
+				updateLineNum(&context);
+				lineDelta = context.srcLineNum - oldBlocks[m]->lineNum;
+			}
+		}
+		
+		if (old && blockOutputUnchanged(old, delta, lineDelta, len, ucs16Len, item))
+		{
+			// move the old block
+			if (contextValid && !context.srcInPlace)
+			{
+				reallocFun(context.src, 0, reallocData);
+				context.srcInPlace = TRUE;
+			}
+			contextValid = FALSE;
+			block = old;
+			oldBlocks[m++] = NULL;
+			block->rendered = FALSE;
+			block->copyOffset = block->outputOffset;
+			block->begin += delta;
+			block->end += delta;
+			block->lineNum += lineDelta;
+			block->outputOffset = len;
+			block->outputUCS16Offset = ucs16Len;
+			block->context.itemBefore = item;
+			if (block->itemEnd >= 0)
+				item = block->itemEnd;
+		}
+		else
+		{
+			if (!contextValid)
+			{
+				// state at the beginning of the old block
+				context = old->context;
+				context.itemBefore = item;
+				setSourceInPlace(&context, nmeText, nmeTextLen,
+						pos, old->lineNum + lineDelta);
+				context.dest = incremental->rendered;
+				context.bufSize = incremental->renderedSize;
+				context.destLen = renderedLen;
+				context.destOffset = len - renderedLen;
+				context.destLenUCS16 = ucs16Len;
+				context.destLenCountedUCS16 = renderedLen;
+				// output before isn't contiguous: wordwrap mustn't look at it
+				context.wrapCheckedBegin = 0;
+				context.wrapCheckedEnd = renderedLen;
+				contextValid = TRUE;
+			}
+			
+			// convert a new block
+			block = (NMEIncrementalBlock *)reallocFun(NULL,
+					sizeof(NMEIncrementalBlock), reallocData);
+			if (!block)
+				err = kNMEErrNotEnoughMemory;
+			else
+			{
+				err = convertBlock(incremental, &context, nmeText, nmeTextLen, block);
+				incremental->rendered = context.dest;
+				incremental->renderedSize = context.bufSize;
+				renderedLen = context.destLen;
+				if (err != kNMEErrOk)
+				{
+					reallocFun(block, 0, reallocData);
+					block = NULL;
+				}
+			}
+		}
+		
+		if (block)
+		{
+			if (blockCount >= size)
+			{
+				size *= 2;
+				newBlocks = (NMEIncrementalBlock **)reallocFun(blocks,
+						size * sizeof(NMEIncrementalBlock *), reallocData);
+				if (!newBlocks)
+				{
+					reallocFun(block, 0, reallocData);
+					err = kNMEErrNotEnoughMemory;
+					break;
+				}
+				blocks = newBlocks;
+			}
+			blocks[blockCount++] = block;
+			len += block->outputLen;
+			ucs16Len += block->outputUCS16Len;
+			if (block->end >= nmeTextLen)
+				break;
+		}
+	}
+	if (contextValid && !context.srcInPlace)
+		reallocFun(context.src, 0, reallocData);
+	
+	// splice the output in place: runs of blocks moved to the right from the
+	// last one and runs of blocks moved to the left from the first one, so
+	// that the previous output of a block isn't overwritten before it's
+	// moved, then new blocks (moving the output after the edit takes time
+	// linear in its size, but much less than converting it again)
+	if (err == kNMEErrOk && len + 1 > incremental->outputSize)
+	{
+		newOutput = (NMEText)reallocFun(incremental->output, len + 1, reallocData);
+		if (!newOutput)
+			err = kNMEErrNotEnoughMemory;
+		else
+		{
+			incremental->output = newOutput;
+			incremental->outputSize = len + 1;
+		}
+	}
+	if (err == kNMEErrOk)
+	{
+		newOutput = incremental->output;
+		for (k = blockCount - 1; k >= 0; k = i - 1)
+		{
+			// run of blocks i..k
+			for (i = k; i > 0 && blocksMovedTogether(blocks[i - 1], blocks[i]); i--)
+				;
+			block = blocks[i];
+			if (!block->rendered && block->outputOffset > block->copyOffset)
+				moveBytes(newOutput + block->outputOffset,
+						newOutput + block->copyOffset,
+						blocks[k]->outputOffset + blocks[k]->outputLen
+							- block->outputOffset);
+		}
+		for (k = 0; k < blockCount; k = i + 1)
+		{
+			// run of blocks k..i
+			for (i = k; i + 1 < blockCount && blocksMovedTogether(blocks[i], blocks[i + 1]); i++)
+				;
+			block = blocks[k];
+			if (!block->rendered && block->outputOffset < block->copyOffset)
+				moveBytes(newOutput + block->outputOffset,
+						newOutput + block->copyOffset,
+						blocks[i]->outputOffset + blocks[i]->outputLen
+							- block->outputOffset);
+		}
+		for (k = 0; k < blockCount; k++)
+		{
+			block = blocks[k];
+			if (block->rendered)
+			{
+				moveBytes(newOutput + block->outputOffset,
+						incremental->rendered + block->copyOffset,
+						block->outputLen);
+				block->rendered = FALSE;
+			}
+		}
+		newOutput[len] = '\0';
+		incremental->outputLen = len;
+		incremental->outputUCS16Len = ucs16Len;
+	}
+	
+	// replace the blocks (moved blocks have been removed from oldBlocks)
+	freeBlocks(incremental, oldBlocks, incremental->blockCount);
+	if (err == kNMEErrOk)
+	{
+		incremental->blocks = blocks;
+		incremental->blockCount = blockCount;
+		incremental->srcLen = nmeTextLen;
+		*output = incremental->output;
+		*outputLen = incremental->outputLen;
+		if (outputUCS16Len)
+			*outputUCS16Len = incremental->outputUCS16Len;
+	}
+	else
+	{
+		// convert everything next time
+		freeBlocks(incremental, blocks, blockCount);
+		incremental->blocks = NULL;
+		incremental->blockCount = 0;
+		incremental->srcLen = -1;
+	}
+	return err;
+}
+
+void NMEIncrementalEnd(NMEIncremental *incremental)
+{
+	NMEReallocFun reallocFun = incremental->reallocFun;
+	void *reallocData = incremental->reallocData;
+	
+	freeBlocks(incremental, incremental->blocks, incremental->blockCount);
+	if (incremental->output)
+		reallocFun(incremental->output, 0, reallocData);
+	if (incremental->rendered)
+		reallocFun(incremental->rendered, 0, reallocData);
+	reallocFun(incremental, 0, reallocData);
+}
+
+/** Record the call of a hook of the output format used by NMEProcessEvents.
+	@param[in] event kEventDivHook, kEventParHook or kEventSpanHook
+	@param[in] level div or par level
+	@param[in] item item number
+	@param[in] enter TRUE when entering construct, FALSE when exiting
+	@param[in] markup null-terminated markup
+	@param[in] srcIndex current index in source code
+	@param[in] srcLineNumber current line number in source code
+	@param[in,out] context current context (context->recorder not NULL)
+	@return error code
+*/
+static NMEErr recordHook(NMEInt event,
+		NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex, NMEInt srcLineNumber,
+		NMEContext *context)
+{
+	NMEEventRecorder *recorder = context->recorder;
+	NMEInt k;
+	
+	if (!recordState(context)
+			|| !emitEvent(context, event | (enter ? kEventFlagA : 0))
+			|| !emitEventNumber(context, level)
+			|| !emitEventNumber(context, item)
+			|| !emitEventNumber(context, srcIndex)
+			|| !emitEventNumber(context, srcLineNumber))
+		return kNMEErrNotEnoughMemory;
+	for (k = 0; ; k++)
+	{
+		if (!growBuffer(context, &recorder->events, &recorder->eventsSize,
+				recorder->eventsLen + 1))
+			return kNMEErrNotEnoughMemory;
+		recorder->events[recorder->eventsLen++] = markup[k];
+		if (!markup[k])
+			return kNMEErrOk;
+	}
+}
+
+/// divHookFun of the output format used by NMEProcessEvents
+static NMEErr recordDivHook(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex, NMEInt srcLineNumber,
+		NMEContext *context, void *data)
+{
+	(void)data;
+	return recordHook(kEventDivHook, level, item, enter, markup,
+			srcIndex, srcLineNumber, context);
+}
+
+/// parHookFun of the output format used by NMEProcessEvents
+static NMEErr recordParHook(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex, NMEInt srcLineNumber,
+		NMEContext *context, void *data)
+{
+	(void)data;
+	return recordHook(kEventParHook, level, item, enter, markup,
+			srcIndex, srcLineNumber, context);
+}
+
+/// spanHookFun of the output format used by NMEProcessEvents
+static NMEErr recordSpanHook(NMEInt level, NMEInt item, NMEBoolean enter,
+		NMEConstText markup,
+		NMEInt srcIndex, NMEInt srcLineNumber,
+		NMEContext *context, void *data)
+{
+	(void)data;
+	return recordHook(kEventSpanHook, level, item, enter, markup,
+			srcIndex, srcLineNumber, context);
+}
+
+/** Set up a context which parses NME text in place and records events
+	instead of writing output.
+	@param[out] context context
+	@param[out] recordingFormat output format whose hooks record their calls
+	(must remain valid as long as context is used)
+	@param[out] recorder recorder (must remain valid as long as context is used)
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen length of nmeText
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] outputFormat format used for parsing, or NULL for default
+	@param[in] eventsSize initial size of recorder->events
+	@param[in] reallocFun function used to allocate and enlarge buffers
+	@param[in,out] reallocData value passed to reallocFun
+	@return error code (kNMEErrOk for success; in case of error, no memory
+	remains allocated)
+*/
+static NMEErr beginRecording(NMEContext *context,
+		NMEOutputFormat *recordingFormat,
+		NMEEventRecorder *recorder,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEInt eventsSize,
+		NMEReallocFun reallocFun,
+		void *reallocData)
+{
+	// output format whose hooks record their calls
+	*recordingFormat = outputFormat ? *outputFormat : NMEOutputFormatText;
+	recordingFormat->divHookFun = recordDivHook;
+	recordingFormat->parHookFun = recordParHook;
+	recordingFormat->spanHookFun = recordSpanHook;
+	recordingFormat->charHookFun = NULL;
+	
+	initContext(context, options, "\n", recordingFormat, 0);
+	context->reallocFun = reallocFun;
+	context->reallocData = reallocData;
+	
+	recorder->eventsSize = eventsSize;
+	recorder->events = (NMEText)reallocFun(NULL, recorder->eventsSize, reallocData);
+	if (!recorder->events)
+		return kNMEErrNotEnoughMemory;
+	recorder->eventsLen = 0;
+	recorder->lastEvent = 0;
+	recorder->mappedBegin = 0;
+	recorder->flags = 0;
+	recorder->headingLevelMax = 0;
+	recorder->inputIndex = 0;
+	recorder->lineNum = 1;
+	recorder->level = 0;
+	recorder->item = 0;
+	recorder->nesting = 0;
+	context->recorder = recorder;
+	
+	// parse nmeText in place; dest only receives the output of plugins and
+	// autoconverts which is parsed again
+	context->src = (NMEText)nmeText;
+	context->srcLen = context->srcSize = nmeTextLen;
+	context->srcInPlace = TRUE;
+	context->bufSize = kAllocExtraSize;
+	context->dest = (NMEText)reallocFun(NULL, context->bufSize, reallocData);
+	if (!context->dest)
+	{
+		reallocFun(recorder->events, 0, reallocData);
+		return kNMEErrNotEnoughMemory;
+	}
+	return kNMEErrOk;
+}
+
+/** Free the buffers of a context set up by beginRecording, except for the
+	events.
+	@param[in,out] context context
+*/
+static void endRecording(NMEContext *context)
+{
+	if (!context->srcInPlace)
+		context->reallocFun(context->src, 0, context->reallocData);
+	context->reallocFun(context->dest, 0, context->reallocData);
+}
+
+NMEErr NMEProcessEvents(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *events,
+		NMEInt *eventsLen)
+{
+	NMEContext context;
+	NMEOutputFormat recordingFormat;
+	NMEEventRecorder recorder;
+	NMEText output;
+	NMEInt outputLen, i;
+	NMEErr err;
+	
+	CheckError(beginRecording(&context, &recordingFormat, &recorder,
+			nmeText, nmeTextLen, options, outputFormat,
+			nmeTextLen / 2 + kAllocExtraSize,
+			reallocFun, reallocData));
+	recorder.eventsLen = kEventsHeaderSize;	// room for the header
+	
+	err = processSource(&context, &output, &outputLen, NULL);
+	endRecording(&context);
+	if (err != kNMEErrOk)
+	{
+		reallocFun(recorder.events, 0, reallocData);
+		return err;
+	}
+	
+	// header
+	recorder.events[0] = 'N';
+	recorder.events[1] = 'M';
+	recorder.events[2] = 'E';
+	recorder.events[3] = 'e';
+	recorder.events[4] = kEventsVersion;
+	recorder.events[5] = (NMEChar)(recorder.flags
+			| (recordingFormat.sublistInListItem ? kEventsSublistInListItem : 0)
+			| (recordingFormat.noStyleInAlt ? kEventsNoStyleInAlt : 0));
+	recorder.events[6] = (NMEChar)recordingFormat.maxHeadingLevel;
+	recorder.events[7] = (NMEChar)recorder.headingLevelMax;
+	for (i = 0; i < 4; i++)
+	{
+		recorder.events[8 + i] = (NMEChar)(options >> 8 * i);
+		recorder.events[12 + i] = (NMEChar)(nmeTextLen >> 8 * i);
+	}
+	
+	*events = recorder.events;
+	*eventsLen = recorder.eventsLen;
+	return kNMEErrOk;
+}
+
+/** Read a number written by emitEventNumber.
+	@param[in,out] p address of pointer to number, moved after it
+	@param[in] end end of events
+	@param[out] n number
+	@return TRUE for success, FALSE if events end before the number
+*/
+static NMEBoolean readEventNumber(NMEConstText *p, NMEConstText end, NMEInt *n)
+{
+	unsigned long u = 0;
+	NMEInt shift;
+	
+	for (shift = 0; *p < end && shift < 35; shift += 7)
+	{
+		u |= (unsigned long)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+		{
+			*n = u & 1 ? -(NMEInt)(u >> 1) - 1 : (NMEInt)(u >> 1);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/** Read a span written by emitEventSpan.
+	@param[in] event first byte of event
+	@param[in,out] p address of pointer to span, moved after it
+	@param[in] end end of events
+	@param[in] nmeText caller's input
+	@param[in] nmeTextLen length of nmeText
+	@param[out] text span, in nmeText or in events if event has kEventInline
+	@param[out] len length of the span
+	@param[out] inputIndex index of the span in the caller's input
+	@return TRUE for success, FALSE if events are invalid
+*/
+static NMEBoolean readEventText(NMEInt event,
+		NMEConstText *p, NMEConstText end,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEConstText *text, NMEInt *len, NMEInt *inputIndex)
+{
+	if (!readEventNumber(p, end, len) || *len < 0
+			|| !readEventNumber(p, end, inputIndex))
+		return FALSE;
+	if (event & kEventInline)
+	{
+		// span copied in events
+		if (*len > end - *p)
+			return FALSE;
+		*text = *p;
+		*p += *len;
+	}
+	else
+	{
+		// span in caller's input
+		if (*inputIndex < 0 || *inputIndex > nmeTextLen - *len)
+			return FALSE;
+		*text = nmeText + *inputIndex;
+	}
+	return TRUE;
+}
+
+/** Read a span written by emitEventSpan and make context->src the text
+	which contains it, either the caller's input or the events themselves.
+	@param[in] event first byte of event
+	@param[in,out] p address of pointer to span, moved after it
+	@param[in] end end of events
+	@param[in] nmeText caller's input
+	@param[in] nmeTextLen length of nmeText
+	@param[in,out] context current context
+	@param[out] begin index of the beginning of the span in context->src
+	@param[out] len length of the span
+	@return TRUE for success, FALSE if events are invalid
+*/
+static NMEBoolean readEventSpan(NMEInt event,
+		NMEConstText *p, NMEConstText end,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEContext *context,
+		NMEInt *begin, NMEInt *len)
+{
+	NMEConstText text;
+	NMEInt inputIndex;
+	
+	if (!readEventText(event, p, end, nmeText, nmeTextLen,
+			&text, len, &inputIndex))
+		return FALSE;
+	if (event & kEventInline)
+	{
+		context->src = (NMEText)text;
+		context->srcLen = *len;
+		*begin = 0;
+	}
+	else
+	{
+		context->src = (NMEText)nmeText;
+		context->srcLen = nmeTextLen;
+		*begin = inputIndex;
+	}
+	context->srcIndexOffset = inputIndex - *begin;
+	return TRUE;
+}
+
+/** Check whether events recorded by NMEProcessEvents can be rendered with
+	an output format, i.e. whether the fields of the output format which
+	change the parsing would not have changed it.
+	@param[in] events events (at least kEventsHeaderSize bytes)
+	@param[in] outputFormat output format
+	@return TRUE if events can be rendered, FALSE if source must be parsed again
+*/
+static NMEBoolean eventsMatchFormat(NMEConstText events,
+		NMEOutputFormat const *outputFormat)
+{
+	NMEInt flags = (unsigned char)events[5];
+	NMEInt maxHeadingLevel = (unsigned char)events[6];
+	NMEInt headingLevelMax = (unsigned char)events[7];
+	
+	if ((flags & kEventsUsedSublist)
+			&& !(flags & kEventsSublistInListItem) != !outputFormat->sublistInListItem)
+		return FALSE;
+	if ((flags & kEventsUsedNoStyleInAlt)
+			&& !(flags & kEventsNoStyleInAlt) != !outputFormat->noStyleInAlt)
+		return FALSE;
+	
+	// headings clamped to maxHeadingLevel must be clamped the same way
+	return headingLevelMax < maxHeadingLevel
+			? headingLevelMax <= outputFormat->maxHeadingLevel
+			: outputFormat->maxHeadingLevel == maxHeadingLevel;
+}
+
+/** Replay events recorded by NMEProcessEvents.
+	@param[in,out] context current context, with the output format to render
+	@param[in] p events after the header
+	@param[in] end end of events
+	@param[in] nmeText caller's input
+	@param[in] nmeTextLen length of nmeText
+	@return error code (kNMEErrBadMarkup if events are invalid)
+*/
+static NMEErr renderEvents(NMEContext *context,
+		NMEConstText p, NMEConstText end,
+		NMEConstText nmeText, NMEInt nmeTextLen)
+{
+	NMEOutputFormat const *outputFormat = context->outputFormat;
+	NMEConstText linkSrc = nmeText;	// text which contains the current link
+	NMEInt linkSrcLen = nmeTextLen, linkSrcIndexOffset = 0;
+	NMEConstText markup;
+	NMEProcessHookFun hookFun;
+	NMEBoolean isTemplate[kTemplateCount];
+	NMEInt inputIndex = 0;
+	NMEInt event, n, begin, len, i0, k;
+	NMEInt linkOff, linkLen, textOff, textLen, level, item, hookIndex, hookLine;
+	NMEErr err;
+	
+	// slots of NMEOutputFormat which are templates
+	for (k = 0; k < kTemplateCount; k++)
+		isTemplate[k] = FALSE;
+	for (k = 0; templateFields[k]; k++)
+		isTemplate[templateFields[k] - &NMEOutputFormatNull.space] = TRUE;
+	
+	while (p < end)
+	{
+		event = (unsigned char)*p++;
+		switch (event & kEventKindMask)
+		{
+			case kEventTemplate:
+				if (!readEventNumber(&p, end, &n)
+						|| n < 0 || n >= kTemplateCount || !isTemplate[n])
+					return kNMEErrBadMarkup;
+				if (!addTemplate(context, &outputFormat->space + n))
+					return kNMEErrNotEnoughMemory;
+				break;
+			case kEventWordwrap:
+				CheckError(checkWordwrap(context, outputFormat));
+				break;
+			case kEventText:
+				if (!readEventSpan(event, &p, end, nmeText, nmeTextLen, context,
+						&begin, &len))
+					return kNMEErrBadMarkup;
+				context->srcIndex = begin + len;
+				CheckError(addText(context, begin, (event & kEventFlagA) != 0));
+				break;
+			case kEventChar:
+				if (!readEventSpan(event, &p, end, nmeText, nmeTextLen, context,
+							&begin, &len)
+						|| !readEventNumber(&p, end, &n) || n < 0 || n >= len)
+					return kNMEErrBadMarkup;
+				context->srcIndex = begin + n + 1;
+				CheckError(addChar(context, begin, (event & kEventFlagA) != 0));
+				// UTF-8 continuation bytes not consumed by encodeCharFun
+				if (context->srcIndex < begin + len)
+				{
+					i0 = context->srcIndex;
+					context->srcIndex = begin + len;
+					CheckError(addText(context, i0, (event & kEventFlagA) != 0));
+				}
+				break;
+			case kEventPreBlank:
+				CheckError(addPreBlank(context, (event & kEventFlagA) != 0));
+				break;
+			case kEventGobbleSpaces:
+				if (!gobbleBackSpaces(context))
+					return kNMEErrNotEnoughMemory;
+				break;
+			case kEventIndent:
+				if (!readEventNumber(&p, end, &n) || n < 0 || n > kMaxNesting)
+					return kNMEErrBadMarkup;
+				if (!setIndent(context, n))
+					return kNMEErrNotEnoughMemory;
+				break;
+			case kEventLinkBegin:
+				if (!readEventSpan(event, &p, end, nmeText, nmeTextLen, context,
+							&begin, &len)
+						|| !readEventNumber(&p, end, &linkOff)
+						|| !readEventNumber(&p, end, &linkLen)
+						|| !readEventNumber(&p, end, &textOff)
+						|| !readEventNumber(&p, end, &textLen)
+						|| linkOff < 0 || linkLen < 0 || linkOff > len - linkLen
+						|| textOff < 0 || textLen < 0 || textOff > len - textLen)
+					return kNMEErrBadMarkup;
+				context->linkOffset = begin + linkOff;
+				context->linkLength = linkLen;
+				CheckError(addLinkBeginOutput((event & kEventFlagA) != 0,
+						(event & kEventFlagB) != 0,
+						begin + textOff, textLen,
+						outputFormat, context));
+				// keep link for kEventLinkEnd
+				linkSrc = context->src;
+				linkSrcLen = context->srcLen;
+				linkSrcIndexOffset = context->srcIndexOffset;
+				break;
+			case kEventLinkEnd:
+				context->src = (NMEText)linkSrc;
+				context->srcLen = linkSrcLen;
+				context->srcIndexOffset = linkSrcIndexOffset;
+				CheckError(addLinkAfterText(event & kEventFlagA
+							? kNMEStyleImage : kNMEStyleLink,
+						outputFormat, context));
+				break;
+			case kEventPlugin:
+				if (!readEventNumber(&p, end, &n) || n < 0
+						|| !readEventSpan(event, &p, end, nmeText, nmeTextLen, context,
+							&begin, &len)
+						|| !readEventNumber(&p, end, &linkOff)
+						|| !readEventNumber(&p, end, &linkLen)
+						|| !readEventNumber(&p, end, &textOff)
+						|| !readEventNumber(&p, end, &textLen)
+						|| linkOff < 0 || linkLen < 0 || linkOff > len - linkLen
+						|| textOff < 0 || textLen < 0 || textOff > len - textLen)
+					return kNMEErrBadMarkup;
+				// plugin with the same index in the output format, if any
+				for (k = 0; outputFormat->plugins && k <= n
+						&& outputFormat->plugins[k].name; k++)
+					;
+				if (k > n)
+				{
+					context->srcIndex = begin + len;
+					CheckError(outputFormat->plugins[n].cb(context->src + begin + linkOff,
+							linkLen,
+							context->src + begin + textOff, textLen,
+							context,
+							outputFormat->plugins[n].userData));
+					// source copied by NMEGetTempMemory
+					if (!context->srcInPlace)
+					{
+						context->reallocFun(context->src, 0, context->reallocData);
+						context->srcInPlace = TRUE;
+					}
+				}
+				break;
+			case kEventDivHook:
+			case kEventParHook:
+			case kEventSpanHook:
+				if (!readEventNumber(&p, end, &level)
+						|| !readEventNumber(&p, end, &item)
+						|| !readEventNumber(&p, end, &hookIndex)
+						|| !readEventNumber(&p, end, &hookLine))
+					return kNMEErrBadMarkup;
+				markup = p;
+				for (k = 0; p + k < end && p[k]; k++)
+					;
+				if (p + k >= end)
+					return kNMEErrBadMarkup;
+				p += k + 1;
+				hookFun = (event & kEventKindMask) == kEventDivHook ? outputFormat->divHookFun
+						: (event & kEventKindMask) == kEventParHook ? outputFormat->parHookFun
+						: outputFormat->spanHookFun;
+				if (hookFun)
+					CheckError(hookFun(level, item, (event & kEventFlagA) != 0,
+							markup, hookIndex, hookLine,
+							context, outputFormat->hookData));
+				break;
+			case kEventInputIndex:
+				if (!readEventNumber(&p, end, &n))
+					return kNMEErrBadMarkup;
+				inputIndex += n;
+				if (inputIndex < 0 || inputIndex > nmeTextLen)
+					return kNMEErrBadMarkup;
+				break;
+			case kEventLineNum:
+				if (!readEventNumber(&p, end, &n))
+					return kNMEErrBadMarkup;
+				context->srcLineNum += n;
+				break;
+			case kEventLevel:
+				if (!readEventNumber(&p, end, &n))
+					return kNMEErrBadMarkup;
+				context->level = n;
+				break;
+			case kEventItem:
+				if (!readEventNumber(&p, end, &n))
+					return kNMEErrBadMarkup;
+				context->item = n;
+				break;
+			case kEventList:
+				if (!readEventNumber(&p, end, &n) || n < 0 || n > kMaxNesting)
+					return kNMEErrBadMarkup;
+				context->nesting = n;
+				for (k = 0; k < n; k++)
+					if (!readEventNumber(&p, end, &context->listNum[k]))
+						return kNMEErrBadMarkup;
+				break;
+			default:
+				return kNMEErrBadMarkup;
+		}
+		
+		// back to the caller's input at the current input index
+		context->src = (NMEText)nmeText;
+		context->srcLen = nmeTextLen;
+		context->srcIndexOffset = 0;
+		context->srcIndex = context->srcIndexForLineNum = inputIndex;
+	}
+	return kNMEErrOk;
+}
+
+NMEErr NMERenderEvents(NMEConstText events, NMEInt eventsLen,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len)
+{
+	NMEContext context;
+	NMEInt options, srcLen, i;
+	NMEErr err;
+	
+	// check header
+	if (eventsLen < kEventsHeaderSize
+			|| events[0] != 'N' || events[1] != 'M'
+			|| events[2] != 'E' || events[3] != 'e'
+			|| events[4] != kEventsVersion)
+		return kNMEErrBadMarkup;
+	for (options = srcLen = 0, i = 3; i >= 0; i--)
+	{
+		options = options << 8 | (unsigned char)events[8 + i];
+		srcLen = srcLen << 8 | (unsigned char)events[12 + i];
+	}
+	if (srcLen != nmeTextLen)
+		return kNMEErrBadMarkup;
+	
+	if (!outputFormat)
+		outputFormat = &NMEOutputFormatText;
+	
+	// parse again if the output format would have changed the parsing
+	if (!eventsMatchFormat(events, outputFormat))
+		return NMEProcessAlloc(nmeText, nmeTextLen, options, eol, outputFormat,
+				fontSize, reallocFun, reallocData,
+				output, outputLen, outputUCS16Len);
+	
+	initContext(&context, options, eol, outputFormat, fontSize);
+	context.reallocFun = reallocFun;
+	context.reallocData = reallocData;
+	context.src = (NMEText)nmeText;
+	context.srcLen = context.srcSize = nmeTextLen;
+	context.srcInPlace = TRUE;
+	context.bufSize = 2 * nmeTextLen + kAllocExtraSize;
+	context.dest = (NMEText)reallocFun(NULL, context.bufSize, reallocData);
+	if (!context.dest)
+		return kNMEErrNotEnoughMemory;
+	
+	err = renderEvents(&context, events + kEventsHeaderSize, events + eventsLen,
+			nmeText, nmeTextLen);
+	if (err == kNMEErrOk)
+		err = terminateOutput(&context, output, outputLen, outputUCS16Len);
+	if (err != kNMEErrOk)
+		reallocFun(context.dest, 0, reallocData);
+	return err;
+}
+
+/// Minimum size of the blocks parsed at once by NMENextEvent
+#define kParserBlockSize 256
+
+/** Pull parser created by NMEParserOpen */
+struct NMEParserStruct
+{
+	NMEContext context;	///< context which records the events of a block
+	NMEOutputFormat recordingFormat;	///< output format whose hooks record their calls
+	NMEEventRecorder recorder;	///< events of the current block
+	NMEConstText nmeText;	///< source text with markup
+	NMEInt nmeTextLen;	///< length of nmeText
+	NMEInt parsedEnd;	///< index in nmeText of the end of the blocks parsed so far
+	NMEBoolean ended;	///< TRUE once the end of the source code has been parsed
+	NMEInt next;	///< index in recorder.events of the next event to decode
+	NMEInt inputIndex;	///< input index of the last decoded event
+	NMEInt lineNum;	///< line number of the last decoded event
+	NMEEventKind lastKind;	///< kind of the last event returned by NMENextEvent
+};
+
+NMEErr NMEParserOpen(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEParser **parser)
+{
+	NMEParser *p;
+	NMEErr err;
+	
+	p = (NMEParser *)reallocFun(NULL, sizeof(NMEParser), reallocData);
+	if (!p)
+		return kNMEErrNotEnoughMemory;
+	err = beginRecording(&p->context, &p->recordingFormat, &p->recorder,
+			nmeText, nmeTextLen, options, outputFormat,
+			kAllocExtraSize,
+			reallocFun, reallocData);
+	if (err != kNMEErrOk)
+	{
+		reallocFun(p, 0, reallocData);
+		return err;
+	}
+	p->nmeText = nmeText;
+	p->nmeTextLen = nmeTextLen;
+	p->parsedEnd = 0;
+	p->ended = FALSE;
+	p->next = 0;
+	p->inputIndex = 0;
+	p->lineNum = 1;
+	p->lastKind = kNMEEventEnd;
+	*parser = p;
+	return kNMEErrOk;
+}
+
+/** Replace the events of the current block with those of the next one.
+	@param[in,out] parser parser
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr parseNextBlock(NMEParser *parser)
+{
+	NMEContext *context = &parser->context;
+	NMEInt q;
+	NMEErr err;
+	
+	parser->recorder.eventsLen = 0;
+	parser->next = 0;
+	if (parser->parsedEnd >= parser->nmeTextLen)
+	{
+		// flush pending constructs
+		CheckError(endSource(context));
+		parser->ended = TRUE;
+		return kNMEErrOk;
+	}
+	
+	q = nextBlockCut(parser->nmeText, parser->nmeTextLen, parser->parsedEnd,
+			parser->parsedEnd + kParserBlockSize);
+	context->srcTail = context->srcIndexOffset + context->srcLen - q;
+	CheckError(parseSource(context));
+	parser->parsedEnd = q;
+	return kNMEErrOk;
+}
+
+/** Decode the next event recorded for the current block.
+	@param[in,out] parser parser
+	@param[out] event event (kind is kNMEEventEnd for events which aren't
+	reported by NMENextEvent)
+	@return error code (kNMEErrOk for success, kNMEErrInternal if events are
+	invalid)
+*/
+static NMEErr decodeParserEvent(NMEParser *parser, NMEEvent *event)
+{
+	NMEConstText p = parser->recorder.events + parser->next;
+	NMEConstText end = parser->recorder.events + parser->recorder.eventsLen;
+	NMEInt kind, n, len, k, linkOff, linkLen, textOff, textLen;
+	NMEConstText text;
+	NMEBoolean ok = TRUE;
+	
+	kind = (unsigned char)*p++;
+	event->srcIndex = parser->inputIndex;
+	event->kind = kNMEEventEnd;
+	event->level = event->item = 0;
+	event->markup = NULL;
+	event->text = event->link = event->data = NULL;
+	event->textLen = event->linkLen = event->dataLen = 0;
+	event->flag = (kind & kEventFlagA) != 0;
+	switch (kind & kEventKindMask)
+	{
+		case kEventTemplate:
+			ok = readEventNumber(&p, end, &n);
+			if (!ok)
+				break;
+			if (n == &NMEOutputFormatNull.space - &NMEOutputFormatNull.space)
+			{
+				event->kind = kNMEEventText;
+				event->text = " ";
+				event->textLen = 1;
+			}
+			else if (n == &NMEOutputFormatNull.lineBreak - &NMEOutputFormatNull.space
+					|| n == &NMEOutputFormatNull.endPreLine - &NMEOutputFormatNull.space)
+				event->kind = kNMEEventLineBreak;
+			break;
+		case kEventText:
+			ok = readEventText(kind, &p, end, parser->nmeText, parser->nmeTextLen,
+					&event->text, &event->textLen, &event->srcIndex);
+			event->kind = kNMEEventText;
+			break;
+		case kEventChar:
+			// character without its markup (escape character)
+			ok = readEventText(kind, &p, end, parser->nmeText, parser->nmeTextLen,
+						&text, &len, &event->srcIndex)
+					&& readEventNumber(&p, end, &n) && n >= 0 && n < len;
+			if (!ok)
+				break;
+			event->kind = kNMEEventText;
+			event->text = text + n;
+			event->textLen = len - n;
+			break;
+		case kEventPreBlank:
+			event->kind = kNMEEventText;
+			event->text = kind & kEventFlagA ? "\t" : " ";
+			event->textLen = 1;
+			event->flag = TRUE;
+			break;
+		case kEventIndent:
+			ok = readEventNumber(&p, end, &n);
+			break;
+		case kEventLinkBegin:
+			ok = readEventText(kind, &p, end, parser->nmeText, parser->nmeTextLen,
+						&text, &len, &event->srcIndex)
+					&& readEventNumber(&p, end, &linkOff)
+					&& readEventNumber(&p, end, &linkLen)
+					&& readEventNumber(&p, end, &textOff)
+					&& readEventNumber(&p, end, &textLen);
+			if (!ok)
+				break;
+			event->kind = kNMEEventLink;
+			event->link = text + linkOff;
+			event->linkLen = linkLen;
+			if (kind & kEventFlagB)
+			{
+				// text which isn't parsed (e.g. alternate text of images)
+				event->text = text + textOff;
+				event->textLen = textLen;
+			}
+			break;
+		case kEventPlugin:
+			ok = readEventNumber(&p, end, &n)
+					&& readEventText(kind, &p, end, parser->nmeText, parser->nmeTextLen,
+						&text, &len, &event->srcIndex)
+					&& readEventNumber(&p, end, &linkOff)
+					&& readEventNumber(&p, end, &linkLen)
+					&& readEventNumber(&p, end, &textOff)
+					&& readEventNumber(&p, end, &textLen);
+			if (!ok)
+				break;
+			event->kind = kNMEEventPlugin;
+			event->text = text + linkOff;
+			event->textLen = linkLen;
+			event->data = text + textOff;
+			event->dataLen = textLen;
+			break;
+		case kEventDivHook:
+		case kEventParHook:
+		case kEventSpanHook:
+			ok = readEventNumber(&p, end, &event->level)
+					&& readEventNumber(&p, end, &event->item)
+					&& readEventNumber(&p, end, &event->srcIndex)
+					&& readEventNumber(&p, end, &parser->lineNum);
+			event->kind = (kind & kEventKindMask) == kEventDivHook
+						? kNMEEventEnterDiv
+					: (kind & kEventKindMask) == kEventParHook
+						? kNMEEventEnterPar : kNMEEventEnterSpan;
+			if (!(kind & kEventFlagA))
+				event->kind++;	// kNMEEventExitDiv etc.
+			event->markup = p;
+			while (p < end && *p)
+				p++;
+			p++;
+			break;
+		case kEventInputIndex:
+			ok = readEventNumber(&p, end, &n);
+			parser->inputIndex += n;
+			break;
+		case kEventLineNum:
+			ok = readEventNumber(&p, end, &n);
+			parser->lineNum += n;
+			break;
+		case kEventLevel:
+		case kEventItem:
+			ok = readEventNumber(&p, end, &n);
+			break;
+		case kEventList:
+			ok = readEventNumber(&p, end, &n);
+			for (k = 0; ok && k < n; k++)
+				ok = readEventNumber(&p, end, &len);
+			break;
+	}
+	event->srcLineNumber = parser->lineNum;
+	parser->next = (NMEInt)(p - parser->recorder.events);
+	return ok && p <= end ? kNMEErrOk : kNMEErrInternal;
+}
+
+NMEErr NMENextEvent(NMEParser *parser, NMEEvent *event)
+{
+	NMEEvent next;
+	NMEInt nextIndex, inputIndex, lineNum;
+	NMEErr err;
+	
+	for (;;)
+	{
+		// next block if all the events of the current one have been decoded
+		while (parser->next >= parser->recorder.eventsLen)
+		{
+			if (parser->ended)
+			{
+				event->kind = kNMEEventEnd;
+				event->srcIndex = parser->nmeTextLen;
+				event->srcLineNumber = parser->lineNum;
+				parser->lastKind = kNMEEventEnd;
+				return kNMEErrOk;
+			}
+			CheckError(parseNextBlock(parser));
+		}
+		
+		CheckError(decodeParserEvent(parser, event));
+		if (event->kind != kNMEEventEnd)
+			break;
+	}
+	parser->lastKind = event->kind;
+	
+	// merge text which follows in the same block without any gap
+	while (event->kind == kNMEEventText)
+	{
+		nextIndex = parser->next;
+		inputIndex = parser->inputIndex;
+		lineNum = parser->lineNum;
+		do
+		{
+			if (parser->next >= parser->recorder.eventsLen)
+				return kNMEErrOk;
+			CheckError(decodeParserEvent(parser, &next));
+		} while (next.kind == kNMEEventEnd);
+		if (next.kind != kNMEEventText || next.flag != event->flag
+				|| next.text != event->text + event->textLen)
+		{
+			// not text: decode it again next time
+			parser->next = nextIndex;
+			parser->inputIndex = inputIndex;
+			parser->lineNum = lineNum;
+			return kNMEErrOk;
+		}
+		event->textLen += next.textLen;
+	}
+	return kNMEErrOk;
+}
+
+NMEErr NMESkipEvents(NMEParser *parser)
+{
+	NMEEvent event;
+	NMEEventKind enter = parser->lastKind;
+	NMEInt depth;
+	NMEErr err;
+	
+	if (enter != kNMEEventEnterDiv && enter != kNMEEventEnterPar
+			&& enter != kNMEEventEnterSpan)
+		return kNMEErrOk;	// not the beginning of a construct
+	for (depth = 1; depth > 0; )
+	{
+		CheckError(NMENextEvent(parser, &event));
+		if (event.kind == enter)
+			depth++;
+		else if (event.kind == enter + 1)
+			depth--;	// kNMEEventExitDiv etc.
+		else if (event.kind == kNMEEventEnd)
+			break;
+	}
+	return kNMEErrOk;
+}
+
+void NMEParserClose(NMEParser *parser)
+{
+	NMEReallocFun reallocFun = parser->context.reallocFun;
+	void *reallocData = parser->context.reallocData;
+	
+	endRecording(&parser->context);
+	reallocFun(parser->recorder.events, 0, reallocData);
+	reallocFun(parser, 0, reallocData);
+}
+
+void NMEGetTempMemory(NMEContext const *context,
+		NMEText *addr,
+		NMEInt *len)
+{
+	// temporary memory follows source code, which must be copied if it is
+	// still parsed in place
+	if (copySourceToBuffer((NMEContext *)context) != kNMEErrOk)
+	{
+		*addr = NULL;
+		*len = 0;
+		return;
+	}
+	*addr = context->src + context->srcLen;
+	*len = context->srcSize - context->srcLen;
+}
+
+void NMEGetReallocFun(NMEContext const *context,
+		NMEReallocFun *reallocFun,
+		void **reallocData)
+{
+	*reallocFun = context->reallocFun;
+	*reallocData = context->reallocData;
+}
+
+void NMEGetFormat(NMEContext const *context,
+		NMEOutputFormat const **outputFormat,
+		NMEInt *options,
+		NMEInt *fontSize)
+{
+	if (outputFormat)
+		*outputFormat = context->outputFormat;
+	if (options)
+		*options = context->options;
+	if (fontSize)
+		*fontSize = context->fontSize;
+}
+
+NMEInt NMEHeadingCount(NMEContext const *context)
+{
+	return context->deferredCall ? context->headingsLen / kDeferredRecordSize : -1;
+}
+
+void NMEGetHeading(NMEContext const *context,
+		NMEInt i,
+		NMEInt *level,
+		NMEInt *item,
+		NMEInt *inputIndex,
+		NMEConstText *text,
+		NMEInt *textLen)
+{
+	NMEConstText rec = context->headings + i * kDeferredRecordSize;
+	
+	*level = getDeferredRecordNumber(rec, 0);
+	*item = getDeferredRecordNumber(rec, 1);
+	*inputIndex = getDeferredRecordNumber(rec, 2);
+	*text = context->deferredText + getDeferredRecordNumber(rec, 3);
+	*textLen = getDeferredRecordNumber(rec, 4);
 }
 
 NMEInt NMECurrentInputIndex(NMEContext const *context)
 {
-	return context->srcIndex;
+	((NMEContext *)context)->stateUsed |= kStateUsedInputIndex;	// flag, not state
+	return context->srcIndexOffset + context->srcIndex;
 }
 
 NMEInt NMECurrentOutputIndex(NMEContext const *context)
 {
-	return context->destLen;
+	((NMEContext *)context)->stateUsed |= kStateUsedOutputIndex;	// flag, not state
+	return context->destOffset + context->destLen;
 }
 
 NMEInt NMECurrentOutputIndexUCS16(NMEContext const *context)
 {
+	// bring the lazy count up to date (cache update, context not const)
+	((NMEContext *)context)->stateUsed |= kStateUsedOutputIndex;
+	countDestUCS16((NMEContext *)context, context->destLen);
 	return context->destLenUCS16;
 }
 
 void NMECurrentLink(NMEContext const *context,
 		NMEInt *linkOffset, NMEInt *linkLength)
 {
+	((NMEContext *)context)->stateUsed |= kStateUsedInputIndex;	// flag, not state
 	*linkOffset = context->srcIndexOffset + context->linkOffset;
 	*linkLength = context->linkLength;
 }
@@ -4243,16 +8621,10 @@ void NMECurrentOutput(NMEContext const *context,
 NMEConstText NMECurrentListNesting(NMEContext const *context)
 {
 	NMEInt i;
-	static NMEChar str[kMaxNesting + 1];
+	NMEChar *str = ((NMEContext *)context)->listNestingStr;	// cache, not state
 	
 	for (i = 0; i < context->nesting; i++)
-		str[i] = context->listNum[i] == kNMEListNumUL ? '*'
-				: context->listNum[i] == kNMEListNumDT ? ';'
-				: context->listNum[i] == kNMEListNumDD ? ':'
-				: context->listNum[i] == kNMEListIndented ? ':'
-				: context->listNum[i] == kNMEListNumTableCell ? '|'
-				: context->listNum[i] == kNMEListNumTableHCell ? '|'
-				: '#';
+		str[i] = listNestingChar(context->listNum[i]);
 	str[i] = '\0';
 	return str;
 }
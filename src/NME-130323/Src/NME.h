@@ -68,6 +68,8 @@ A command-line tool uses both NME and NE to quickly convert text files to electr
  *	  of CamelCase words (aka wiki words, i.e. words with mixed lowercase and
  *	  uppercase letters used in some wikis as page names) and/or URL to links
  *	  without requiring the double-bracket markup
+ *	- NMEStdAlloc.h: optional function NMEReallocStd, which allocates memory
+ *	  for NMEProcessAlloc and other functions with the standard C library
  *	- NMEMain.c: source code of a command-line application which filters
  *	  input text with NME markup, with support for many options
  *
@@ -79,37 +81,70 @@ A command-line tool uses both NME and NE to quickly convert text files to electr
  *
  *	@code
  *	#include "NME.h"
- *
+ *	#include "NMEStdAlloc.h"	// NMEReallocStd, based on realloc and free
+ *	
  *	NMEText input;
  *	NMEInt inputLength;
  *	(read source of length inputLength into input)
- *	NMEInt size = ...; // buffer size, typically initialized to 2x inputLength
- *	NMEText buf;
- *	buf = malloc(size);
  *	NMEText output;
  *	NMEInt outputLength;
  *	NMEErr err;
- *	for (;;)
- *	{
- *		err = NMEProcess(input, inputLength,
- *			buf, size,
- *			kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0,
- *			&output, &outputLength, NULL);
- *		if (err == kNMEErrNotEnoughMemory) // unlikely
- *		{
- *			(increase size)
- *			(realloc buf)
- *		}
- *		else
- *			break;
- *	}
+ *	err = NMEProcessAlloc(input, inputLength,
+ *		kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0,
+ *		NMEReallocStd, NULL,
+ *		&output, &outputLength, NULL);
  *	if (err == kNMEErrOk)
+ *	{
  *		(write outputLength first bytes of output[])
+ *		free(output); // after output has been used or copied
+ *	}
  *	else
  *		(handle error)
- *	free(buf); // after output has been used or copied
  *	@endcode
  *
+ *	Alternatively, NMEProcess converts text in a buffer provided by the
+ *	caller, without any memory allocation; it fails with
+ *	kNMEErrNotEnoughMemory if the buffer is too small.
+ *
+ *	Large documents can be converted with bounded memory by feeding
+ *	them in chunks; output is received by a callback after each block:
+ *
+ *	@code
+ *	NMEErr output(NMEConstText str, NMEInt len, void *data)
+ *	{
+ *		(write len bytes of str)
+ *		return kNMEErrOk;
+ *	}
+ *	
+ *	NMEContext *context;
+ *	err = NMEProcessBegin(buf, size,
+ *		kNMEProcessOptDefault, "\n", &NMEOutputFormatHTML, 0,
+ *		output, NULL, &context);
+ *	while (err == kNMEErrOk && (more input))
+ *		err = NMEProcessFeed(context, chunk, chunkLength);
+ *	if (err == kNMEErrOk)
+ *		err = NMEProcessEnd(context, NULL, NULL);
+ *	@endcode
+ *
+ *	@section Threads Thread safety
+ *
+ *	NME has no global or static state: everything which changes during
+ *	a conversion is stored in the context, in the buffer passed to
+ *	NMEProcess or NMEProcessBegin or allocated by NMEProcessAlloc.
+ *	Conversions can run concurrently in different threads, provided that:
+ *	- each conversion has its own buffer (and its own context for
+ *	  streaming); a context must not be used by two threads at once
+ *	- shared data are only read: output formats (including output formats
+ *	  compiled once with NMECompileOutputFormat), NMEEncodeCharDict,
+ *	  tables of plugins, autoconverts and interwikis
+ *	- callbacks which share data through userData, hookData and the like
+ *	  synchronize access themselves; callbacks are called from the thread
+ *	  which performs the conversion
+ *
+ *	Strings returned by accessors such as NMECurrentListNesting are
+ *	stored in the context. The plugins and autoconverts provided with NME
+ *	(NMEPlugin*.c, NMEAutolink.c) have no static state either.
+ *
  *	@section Security Security
  *
  *	Inline images are subject to cross site scripting if links to
@@ -352,8 +387,13 @@ enum
 			"<<" **/
 	kNMEPluginOptReparseOutput = 0x2,	///< if set, output should be parsed again
 	kNMEPluginOptBetweenPar = 0x4,	///< if set, forced outside paragraphs or lists
-	kNMEPluginOptTripleAngleBrackets = 0x8	/**< if set, used with triple angle brackets
+	kNMEPluginOptTripleAngleBrackets = 0x8,	/**< if set, used with triple angle brackets
 		(placeholders) */
+	kNMEPluginOptDeferred = 0x10	/**< if set, called at the end of NMEProcess,
+		NMEProcessAlloc or NMEProcessBatch with reallocFun, once all headings
+		are known (see NMEHeadingCount), and its output is inserted where the
+		plugin appears; called in place (with NMEHeadingCount returning -1)
+		when the conversion cannot defer it; ignored with kNMEPluginOptReparseOutput */
 };
 
 /// Structure for plugins
@@ -368,14 +408,15 @@ typedef struct
 /// End-of-table marker for table of plugins
 #define NMEPluginTableEnd {NULL, kNMEPluginOptDefault, NULL, NULL}
 
-/** Callback for autoconvert
+/** Callback for autoconvert. On conversion, it either adds NME markup
+	to the output with NMEAddString and sets *i to the next token (the
+	markup is then parsed as if it had replaced the converted source),
+	or reports a link with NMEAddAutoconvertLink and leaves *i unchanged
+	(the link is formatted directly, without reparsing).
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
 	@param[in,out] i index in src (token to parse on input, next token on output)
-	@param[in] eol null-terminated string used for end-of-line
-	@param[out] dest result (formatted text)
-	@param[in] destSize maximum size of dest
-	@param[in,out] destLen formatted text length
+	@param[in,out] context current context
 	@param[in] userData pointer passed from the parser, as specified in NMEAutoconvert
 	@return TRUE for conversion, else FALSE
 */
@@ -389,6 +430,9 @@ typedef struct
 {
 	NMEAutoconvertFun cb;	///< callback
 	void *userData;	///< pointer passed to cb
+	NMEConstText triggers;	/**< null-terminated set of characters src[*i] where
+		cb can return TRUE, besides the beginning of src (NULL if anywhere); the
+		parser calls cb only there and parses the text in between at once */
 } NMEAutoconvert;
 
 /**	Callback for application-specific variables with uppercase name
@@ -399,8 +443,8 @@ typedef struct
 */
 typedef NMEInt (*NMEGetVarFun)(NMEChar name, void *userData);
 
-/// End-of-table marker for table of interwikis
-#define NMEAutoconvertTableEnd {NULL, NULL}
+/// End-of-table marker for table of autoconverts
+#define NMEAutoconvertTableEnd {NULL, NULL, NULL}
 
 /// Structure for interwiki
 typedef struct
@@ -412,6 +456,9 @@ typedef struct
 /// End-of-table marker for table of interwikis
 #define NMEInterwikiTableEnd {NULL, NULL}
 
+/// Output format templates compiled by NMECompileOutputFormat (opaque)
+typedef struct NMECompiledOutputFormatStruct NMECompiledOutputFormat;
+
 /** Structure of output format fragments used by NMEProcess.
 	All strings may contain control sequences which are processed before
 	being copied to the output. There are three kinds of control sequences:
@@ -447,7 +494,8 @@ typedef struct
 	- o current offset in source code (can be used as a unique identifier for
 	  hyperlinks)
 	- L current line number in source code (can be useful for debugging)
-	- p current offset in output
+	- p current offset in output (from the beginning of the document when
+	  streaming with NMEProcessFeed)
 	- x 1 if headings should have labels for hyperlinks, else 0
 	
 	Operators by increasing priority:
@@ -554,6 +602,8 @@ typedef struct
 	NMEAutoconvert const *autoconverts;	///< array of autoconverts, terminated by cb=NULL (NULL if none)
 	NMEGetVarFun getVarFun;	///< function which gets custom variable values ('A'-'Z') in expressions
 	void *getVarData;	///< data passed to getVarFun
+	NMECompiledOutputFormat const *compiled;	/**< templates compiled by
+		NMECompileOutputFormat (NULL if none) */
 } NMEOutputFormat;
 
 /** Structure for elements of table used by NMEEncodeCharFunDict.
@@ -583,6 +633,39 @@ extern NMEEncodeCharDict const NMEXMLCharDict[];
 NMEErr NMEEncodeCharFunDict(NMEConstText src, NMEInt srcLen, NMEInt *srcIx,
 		NMEContext *context, void *data);
 
+/** Substitution table compiled by NMECompileEncodeCharDict from a table of
+	type NMEEncodeCharDict[], for escaping runs of characters with
+	NMEEncodeCharRange.
+*/
+typedef struct
+{
+	NMEEncodeCharDict const *dict;	///< substitution table
+	unsigned char ix[256];	/**< for each byte, 0 if copied unmodified,
+		1 + index in dict of its replacement, or 255 if it needs NMEEncodeCharFunDict */
+} NMEEncodeCharTable;
+
+/** Compile a table of character substitutions for NMEEncodeCharRange. The
+	contexts created by NMEProcess and related functions compile the tables
+	of encoders NMEEncodeCharFunDict themselves.
+	@param[in] dict substitution table ending with {0,NULL}
+	@param[out] table compiled table (dict must remain valid while it's used)
+*/
+void NMECompileEncodeCharDict(NMEEncodeCharDict const *dict,
+		NMEEncodeCharTable *table);
+
+/** Add characters to the output, replacing those listed in a compiled
+	substitution table with strings, like NMEEncodeCharFunDict applied to each
+	character but with runs of characters which aren't replaced copied at once.
+	@param[in] src input characters
+	@param[in] srcLen number of characters to encode
+	@param[in] table compiled substitution table
+	@param[in,out] context context for embedded expressions
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEEncodeCharRange(NMEConstText src, NMEInt srcLen,
+		NMEEncodeCharTable const *table,
+		NMEContext *context);
+
 /// Format strings for plain text output
 extern NMEOutputFormat const NMEOutputFormatText;
 
@@ -615,6 +698,10 @@ extern NMEOutputFormat const NMEOutputFormatMan;
 
 /** Transform text by interpreting markup.
 	This is the main and only required extern function of the parser.
+	nmeText is parsed in place and the whole buffer is used for output;
+	nmeText is copied to the first half of buf only when the output of a
+	plugin or autoconvert function must be reparsed, or when temporary
+	memory is requested.
 	@param[in] nmeText source text with markup
 	@param[in] nmeTextLen source text length
 	@param[out] buf buffer used during conversion
@@ -627,7 +714,8 @@ extern NMEOutputFormat const NMEOutputFormatMan;
 	@param[out] output formatted text (in buf), followed by null byte
 	@param[out] outputLen formatted text length, excluding final null byte
 	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
-	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	assuming input is in UTF-8,	excluding final null byte (may be NULL; counted
+	only if requested, with 4-byte sequences as surrogate pairs)
 	@return error code (kNMEErrOk for success)
 	@bug Links are copied verbatim, without processing the escape character
 	(this means that pipes and double-closing-brackets cannot be included
@@ -643,18 +731,542 @@ NMEErr NMEProcess(NMEConstText nmeText, NMEInt nmeTextLen,
 		NMEInt *outputLen,
 		NMEInt *outputUCS16Len);
 
+/** Function which allocates, resizes or frees memory for NMEProcessAlloc,
+	with the semantics of realloc.
+	@param[in] ptr memory block to resize or free, or NULL to allocate a new one
+	@param[in] size new size in bytes, or 0 to free ptr
+	@param[in,out] data value passed to NMEProcessAlloc
+	@return address of the memory block (contents up to the smallest of the
+	old and new sizes are preserved), or NULL if it cannot be allocated or
+	if it has been freed
+*/
+typedef void *(*NMEReallocFun)(void *ptr, NMEInt size, void *data);
+
+/** Transform text by interpreting markup, like NMEProcess, with buffers
+	allocated and enlarged as needed by reallocFun, so that conversion
+	is performed in a single pass whatever the size of the output.
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] reallocFun function used to allocate, enlarge and free buffers
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] output formatted text, followed by null byte (allocated by
+	reallocFun; must be freed by the caller)
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL; counted
+	only if requested, with 4-byte sequences as surrogate pairs)
+	@return error code (kNMEErrOk for success; in case of error, no memory
+	remains allocated)
+*/
+NMEErr NMEProcessAlloc(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Compile the template strings of an output format, so that their
+	control sequences aren't parsed again each time they're output.
+	Templates are split into literal runs and expressions, which are
+	compiled to a compact bytecode; since parameters s and x are fixed
+	for a whole conversion, they're replaced with their value and
+	constant subexpressions are folded. Plugins are indexed by name in a hash
+	table, so that plugin tags don't require a search in the whole plugin
+	array (the index is used only while the plugins field of the compiled
+	output format is unchanged). The result is a copy of outputFormat
+	which refers to the compiled templates and can be passed to NMEProcess,
+	NMEProcessAlloc or NMEProcessBegin as many times as needed with the
+	same options and fontSize; otherwise, or for templates which have been
+	replaced in the compiled output format (e.g. by hooks), the original
+	template strings are used.
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] options options passed to NMEProcess (only kNMEProcessOptXRef
+	matters)
+	@param[in] fontSize font size passed to NMEProcess
+	@param[out] buf buffer for the compiled templates (must remain valid and
+	unchanged while compiledOutputFormat is used)
+	@param[in] bufSize size of buf (a few kilobytes are enough for the
+	predefined output formats)
+	@param[out] compiledOutputFormat copy of outputFormat with compiled templates
+	@return error code (kNMEErrOk for success, kNMEErrNotEnoughMemory if
+	buf is too small)
+*/
+NMEErr NMECompileOutputFormat(NMEOutputFormat const *outputFormat,
+		NMEInt options,
+		NMEInt fontSize,
+		NMEText buf, NMEInt bufSize,
+		NMEOutputFormat *compiledOutputFormat);
+
+/** Function which receives output from NMEProcessBegin, NMEProcessFeed
+	and NMEProcessEnd.
+	@param[in] output formatted text (not null-terminated, valid only during the call)
+	@param[in] outputLen length of output in bytes
+	@param[in,out] data value passed to NMEProcessBegin
+	@return error code (kNMEErrOk for success)
+*/
+typedef NMEErr (*NMEProcessOutputFun)(NMEConstText output, NMEInt outputLen,
+		void *data);
+
+/** Begin converting text with markup which is provided in chunks by
+	NMEProcessFeed (streaming alternative to NMEProcess). Output is sent
+	to outputFun as soon as each block of input (paragraphs, lists, etc.
+	ending with an empty line) has been converted, so that memory is bounded
+	by the size of the largest block instead of the whole document.
+	@param[out] buf buffer used during conversion (context and
+	source and output of the current block)
+	@param[in] bufSize size of buf (a block and its output should fit in
+	less than bufSize/4 bytes each, plus temporary memory used by plugins)
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] outputFun function called with each piece of output
+	@param[in,out] outputData value passed to outputFun
+	@param[out] context context (in buf) to be passed to NMEProcessFeed
+	and NMEProcessEnd
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEProcessBegin(NMEText buf, NMEInt bufSize,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEProcessOutputFun outputFun,
+		void *outputData,
+		NMEContext **context);
+
+/** Convert a chunk of text with markup, after NMEProcessBegin. Chunks can
+	be split anywhere, even in the middle of UTF-8 sequences or of words
+	converted by autoconverts; what follows the last empty line (or, with
+	autoconverts, the last empty line followed by one of their triggers)
+	is kept until more input is received.
+	@param[in,out] context context obtained by NMEProcessBegin
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@return error code (kNMEErrOk for success; kNMEErrNotEnoughMemory if
+	a block is too large for the buffer given to NMEProcessBegin)
+*/
+NMEErr NMEProcessFeed(NMEContext *context,
+		NMEConstText nmeText, NMEInt nmeTextLen);
+
+/** Convert remaining input and send the end of document to outputFun,
+	after the last call to NMEProcessFeed.
+	@param[in,out] context context obtained by NMEProcessBegin
+	(cannot be used anymore after NMEProcessEnd)
+	@param[out] outputLen total formatted text length (may be NULL)
+	@param[out] outputUCS16Len total formatted text length in 16-bit unicode
+	characters assuming input is in UTF-8 (may be NULL)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEProcessEnd(NMEContext *context,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Task called by NMERunTasksFun.
+	@param[in] i task index, between 0 and taskCount-1
+	@param[in,out] taskData value passed to NMERunTasksFun
+*/
+typedef void (*NMETaskFun)(NMEInt i, void *taskData);
+
+/** Function which runs tasks for NMEProcessParallel and NMEProcessBatch,
+	typically on a pool of threads: task(i, taskData) must be called once
+	for each i between 0 and taskCount-1, in any order and possibly
+	concurrently.
+	@param[in] taskCount number of tasks
+	@param[in] task function to call for each task
+	@param[in,out] taskData value to pass to task
+	@param[in,out] runTasksData value passed to NMEProcessParallel or
+	NMEProcessBatch
+	@return error code (kNMEErrOk for success, once all tasks have been
+	completed)
+*/
+typedef NMEErr (*NMERunTasksFun)(NMEInt taskCount,
+		NMETaskFun task, void *taskData,
+		void *runTasksData);
+
+/** Transform text by interpreting markup, like NMEProcessAlloc, with
+	large documents split in chunks which are converted concurrently
+	by runTasks. Chunks are cut at empty lines outside preformatted blocks
+	and plugins, like blocks of NMEProcessFeed; a fast prescan guesses the
+	heading numbers at each cut. The state at the end of each chunk is
+	then checked against the state the next chunk was converted with, and
+	the latter is converted again from the right state if they differ (e.g.
+	in a list or a table with empty lines, or if the output index is used
+	by templates or plugins), so that the output is always the same as with
+	NMEProcessAlloc. Conversion is serial if the document is smaller than
+	two chunks, if runTasks is NULL or if the output format has hooks.
+	Plugins and autoconverts are called from the threads of runTasks;
+	like with NMEProcessFeed, NMECurrentOutput provides only the output
+	of the current chunk.
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen source text length
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] chunkSize minimum size of chunks in bytes (nonpositive -> default)
+	@param[in] runTasks function which runs the conversion of the chunks
+	(NULL for serial conversion)
+	@param[in,out] runTasksData value passed to runTasks
+	@param[in] reallocFun function used to allocate, enlarge and free buffers
+	(must be thread-safe)
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] output formatted text, followed by null byte (allocated by
+	reallocFun; must be freed by the caller)
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	@return error code (kNMEErrOk for success; in case of error, no memory
+	remains allocated)
+*/
+NMEErr NMEProcessParallel(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt chunkSize,
+		NMERunTasksFun runTasks,
+		void *runTasksData,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Function which locks or unlocks a mutex shared by the tasks of
+	NMEProcessBatch.
+	@param[in] lock TRUE to lock, FALSE to unlock
+	@param[in,out] lockData value passed to NMEProcessBatch
+*/
+typedef void (*NMELockFun)(NMEBoolean lock, void *lockData);
+
+/// Document converted by NMEProcessBatch
+typedef struct
+{
+	NMEConstText nmeText;	///< source text with markup
+	NMEInt nmeTextLen;	///< source text length
+	NMEText output;	///< formatted text, followed by null byte (allocated by reallocFun; NULL if err != kNMEErrOk)
+	NMEInt outputLen;	///< formatted text length, excluding final null byte
+	NMEInt outputUCS16Len;	///< formatted text length in 16-bit unicode characters
+	NMEErr err;	///< result of the conversion
+} NMEBatchDoc;
+
+/** Transform many independent documents by interpreting markup, like
+	NMEProcessAlloc for each of them, with workerCount workers run
+	concurrently by runTasks. Each worker converts documents in a buffer
+	which is reused from one document to the next, then copies the output
+	to a buffer of the right size. Documents are dealt to workers largest
+	first; a worker whose documents are all done steals the last one of
+	the worker which has the most left, so that a few large documents
+	don't leave other workers idle. A single worker is used if runTasks or
+	lockFun is NULL, or if the output format has hooks. Plugins and
+	autoconverts are called from the threads of runTasks.
+	@param[in,out] docs documents (nmeText and nmeTextLen must be set; other
+	fields are set by NMEProcessBatch)
+	@param[in] docCount number of documents
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] workerCount number of workers (typically the number of threads
+	of runTasks)
+	@param[in] runTasks function which runs the workers
+	@param[in,out] runTasksData value passed to runTasks
+	@param[in] lockFun function which locks the queues of documents
+	@param[in,out] lockData value passed to lockFun
+	@param[in] reallocFun function used to allocate, enlarge and free buffers
+	(must be thread-safe)
+	@param[in,out] reallocData value passed to reallocFun
+	@return error code of the batch itself (kNMEErrOk for success; errors of
+	documents are in docs[i].err; in case of error, no memory remains
+	allocated)
+*/
+NMEErr NMEProcessBatch(NMEBatchDoc *docs, NMEInt docCount,
+		NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt workerCount,
+		NMERunTasksFun runTasks,
+		void *runTasksData,
+		NMELockFun lockFun,
+		void *lockData,
+		NMEReallocFun reallocFun,
+		void *reallocData);
+
+/** Opaque structure for NMEIncrementalUpdate, with the conversion of the
+	last version of a document
+*/
+typedef struct NMEIncrementalStruct NMEIncremental;
+
+/** Create a cache for converting successive versions of a document with
+	NMEIncrementalUpdate, typically for a live preview in an editor.
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] eol null-terminated string used for end-of-line (must remain
+	valid until NMEIncrementalEnd)
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText; must remain valid until NMEIncrementalEnd)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] blockSize minimum size of blocks in bytes (nonpositive -> default)
+	@param[in] reallocFun function used to allocate, enlarge and free buffers
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] incremental cache (to be freed with NMEIncrementalEnd)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEIncrementalBegin(NMEInt options,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEInt blockSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEIncremental **incremental);
+
+/** Convert a new version of a document after an edit, like NMEProcessAlloc,
+	converting again only the blocks affected by the edit. The cache keeps
+	the source range, the output range and the state of the parser at the
+	beginning of each block of the previous conversion; blocks are cut at
+	empty lines outside preformatted blocks and plugins, at least blockSize
+	bytes apart. Conversion starts from the block before the edit and stops
+	at the first cut after the edit where the state matches the state of the
+	previous conversion (including heading numbers if they are displayed).
+	Following blocks are converted again only if their output depends on
+	their position (output index, input index or line number in templates,
+	plugins or autoconverts); otherwise their output is just moved, at once
+	for contiguous blocks. Since the output is returned as a single
+	contiguous text, moving it takes time linear in the size of the output
+	after the edit, but much less than converting it again. The
+	output is always the same as with NMEProcessAlloc, provided plugins
+	depend only on their own input. The whole document is converted the
+	first time, if editIndex is negative, or if the output format has hooks.
+	@param[in,out] incremental cache created by NMEIncrementalBegin
+	@param[in] nmeText new version of the source text with markup
+	@param[in] nmeTextLen length of nmeText
+	@param[in] editIndex index of the edit in the previous version and in
+	nmeText (-1 to convert everything)
+	@param[in] deletedLen number of bytes of the previous version replaced
+	at editIndex
+	@param[in] insertedLen number of bytes of nmeText which replace them
+	@param[out] output formatted text, followed by null byte (valid until the
+	next call to NMEIncrementalUpdate or NMEIncrementalEnd)
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	@return error code (kNMEErrOk for success; in case of error, the next
+	call converts the whole document)
+*/
+NMEErr NMEIncrementalUpdate(NMEIncremental *incremental,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt editIndex, NMEInt deletedLen, NMEInt insertedLen,
+		NMEConstText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/** Free a cache created by NMEIncrementalBegin.
+	@param[in] incremental cache
+*/
+void NMEIncrementalEnd(NMEIncremental *incremental);
+
+/** Parse NME text once into a compact binary stream of events, which can be
+	cached and rendered to any output format with NMERenderEvents without
+	parsing the source text again. Events are the calls to divHookFun,
+	parHookFun and spanHookFun (level, item, markup, input index and line
+	number), the templates and character ranges of the output, links, and
+	plugins whose output isn't parsed again; character ranges refer to
+	nmeText, except for those which come from the output of plugins and
+	autoconverts which is parsed again and which are copied in the events.
+	Autoconverts, plugins with kNMEPluginOptReparseOutput and the fields of
+	outputFormat which change the parsing (sublistInListItem, noStyleInAlt
+	and maxHeadingLevel) are those of outputFormat; other plugins are
+	executed by NMERenderEvents.
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen length of nmeText
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] outputFormat format used for parsing, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] reallocFun function used to allocate and enlarge the events
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] events events (to be freed with reallocFun)
+	@param[out] eventsLen length of events in bytes
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEProcessEvents(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *events,
+		NMEInt *eventsLen);
+
+/** Render events recorded by NMEProcessEvents, with the same result as
+	NMEProcessAlloc with the options given to NMEProcessEvents. Hooks are
+	called with the recorded arguments; plugins which were executed by
+	NMEProcessEvents are replaced with the plugin with the same index in
+	outputFormat->plugins, if any. If outputFormat would have changed the
+	parsing (different sublistInListItem or noStyleInAlt where it matters,
+	or headings clamped differently with maxHeadingLevel), nmeText is
+	converted with NMEProcessAlloc instead.
+	@param[in] events events recorded by NMEProcessEvents for nmeText
+	@param[in] eventsLen length of events in bytes
+	@param[in] nmeText source text with markup
+	@param[in] nmeTextLen length of nmeText
+	@param[in] eol null-terminated string used for end-of-line
+	@param[in] outputFormat format strings, or NULL for default
+	(NMEOutputFormatText)
+	@param[in] fontSize font size of plain text in points (nonpositive -> default)
+	@param[in] reallocFun function used to allocate and enlarge the output
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] output formatted text, followed by null byte (to be freed
+	with reallocFun)
+	@param[out] outputLen formatted text length, excluding final null byte
+	@param[out] outputUCS16Len formatted text length in 16-bit unicode characters
+	assuming input is in UTF-8,	excluding final null byte (may be NULL)
+	@return error code (kNMEErrOk for success, kNMEErrBadMarkup if events
+	are invalid or don't match nmeTextLen)
+*/
+NMEErr NMERenderEvents(NMEConstText events, NMEInt eventsLen,
+		NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEConstText eol,
+		NMEOutputFormat const *outputFormat,
+		NMEInt fontSize,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEText *output,
+		NMEInt *outputLen,
+		NMEInt *outputUCS16Len);
+
+/// Kinds of events returned by NMENextEvent
+typedef enum
+{
+	kNMEEventEnd = 0,	///< end of document
+	kNMEEventEnterDiv,	///< beginning of div (see divHookFun)
+	kNMEEventExitDiv,	///< end of div
+	kNMEEventEnterPar,	///< beginning of paragraph or heading (see parHookFun)
+	kNMEEventExitPar,	///< end of paragraph or heading
+	kNMEEventEnterSpan,	///< beginning of span (see spanHookFun)
+	kNMEEventExitSpan,	///< end of span
+	kNMEEventText,	///< run of text, not encoded
+	kNMEEventLineBreak,	///< forced line break or end of preformatted line
+	kNMEEventLink,	///< target of link or image, after its kNMEEventEnterSpan
+	kNMEEventPlugin	///< plugin whose output isn't parsed again (not executed)
+} NMEEventKind;
+
+/// Event returned by NMENextEvent
+typedef struct
+{
+	NMEEventKind kind;	///< kind of event
+	NMEInt level;	/**< heading or list level, kNMEHookLevelPar or
+		kNMEHookLevelSpan (kNMEEventEnterDiv etc.) */
+	NMEInt item;	///< list item or heading counter (kNMEEventEnterDiv etc.)
+	NMEConstText markup;	///< null-terminated markup (kNMEEventEnterDiv etc.)
+	NMEConstText text;	/**< text (kNMEEventText), unparsed link text such as
+		the alternate text of images or NULL (kNMEEventLink), or plugin name
+		(kNMEEventPlugin) */
+	NMEInt textLen;	///< length of text
+	NMEConstText link;	///< link target (kNMEEventLink)
+	NMEInt linkLen;	///< length of link
+	NMEConstText data;	///< plugin data (kNMEEventPlugin)
+	NMEInt dataLen;	///< length of data
+	NMEBoolean flag;	/**< TRUE for preformatted text (kNMEEventText) or for
+		images (kNMEEventLink) */
+	NMEInt srcIndex;	///< current index in source code
+	NMEInt srcLineNumber;	///< line number of the last kNMEEventEnterDiv etc.
+} NMEEvent;
+
+/** Opaque structure for NMENextEvent */
+typedef struct NMEParserStruct NMEParser;
+
+/** Create a pull parser which returns the constructs of NME text one at a
+	time with NMENextEvent, as an alternative to hooks. The source text is
+	parsed block by block (paragraphs separated by empty lines) as events
+	are requested, so that memory doesn't depend on the size of the whole
+	document (except when the output of plugins or autoconverts must be
+	parsed again) and the caller can stop at any time.
+	@param[in] nmeText source text with markup (must remain valid until
+	NMEParserClose)
+	@param[in] nmeTextLen length of nmeText
+	@param[in] options kNMEProcessOptDefault or sum of options
+	@param[in] outputFormat format used for parsing (autoconverts, plugins
+	with kNMEPluginOptReparseOutput and fields which change the parsing), or
+	NULL for default (NMEOutputFormatText; must remain valid until NMEParserClose)
+	@param[in] reallocFun function used to allocate, enlarge and free buffers
+	@param[in,out] reallocData value passed to reallocFun
+	@param[out] parser parser (to be freed with NMEParserClose)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMEParserOpen(NMEConstText nmeText, NMEInt nmeTextLen,
+		NMEInt options,
+		NMEOutputFormat const *outputFormat,
+		NMEReallocFun reallocFun,
+		void *reallocData,
+		NMEParser **parser);
+
+/** Get the next event of a pull parser. Text is reported as it appears in
+	the source code, without markup and without encoding; spaces between
+	words are reported as separate events. Strings of the event are in the
+	source text or remain valid until the next call to NMENextEvent.
+	@param[in,out] parser parser created by NMEParserOpen
+	@param[out] event event (kNMEEventEnd at the end of the document, then
+	for all subsequent calls)
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMENextEvent(NMEParser *parser, NMEEvent *event);
+
+/** Skip the events of a pull parser until the end of the construct whose
+	beginning (kNMEEventEnterDiv, kNMEEventEnterPar or kNMEEventEnterSpan)
+	was the last event, included.
+	@param[in,out] parser parser created by NMEParserOpen
+	@return error code (kNMEErrOk for success)
+*/
+NMEErr NMESkipEvents(NMEParser *parser);
+
+/** Free a pull parser created by NMEParserOpen.
+	@param[in] parser parser
+*/
+void NMEParserClose(NMEParser *parser);
+
 /** Add a string to output, converting eol and embedded expressions.
 	@param[in] str string to append
 	@param[in] strLen length of str in bytes, or -1 for null-terminated string
 	@param[in] ctrlChar control character for embedded expressions
 	@param[in,out] context current context
-	@return TRUE for success, FALSE for failure (not enough space)
+	@return TRUE for success, FALSE for failure (not enough space and buffer
+	cannot be enlarged)
 */
 NMEBoolean NMEAddString(NMEConstText str,
 		NMEInt strLen,
 		NMEChar ctrlChar,
 		NMEContext *context);
 
+/** Report a link from an autoconvert callback, instead of adding NME markup
+	to be parsed again. Source text from the current token to the link is
+	parsed as usual; then the link is written with beginLink, sepLink and
+	endLink as if the link target and text were enclosed in double brackets
+	(link text is written verbatim), and parsing continues after the link.
+	@param[in] linkOffset index in src of the link target
+	@param[in] linkLength length of the link target
+	@param[in] textOffset index in src of the link text
+	@param[in] textLength length of the link text
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if the link isn't in src from the current token
+*/
+NMEBoolean NMEAddAutoconvertLink(NMEInt linkOffset, NMEInt linkLength,
+		NMEInt textOffset, NMEInt textLength,
+		NMEContext *context);
+
 /**	Copy a raw string to output, without any conversion.
 	@param[in] str string to append
 	@param[in] strLen length of str in bytes, or -1 for null-terminated string
@@ -683,7 +1295,8 @@ NMEErr NMECopySource(NMEInt length,
 void NMEResetOutput(NMEContext *context);
 
 /** Get temporary memory which can be used in plugin, autolink and
-	hook functions.
+	hook functions. If the source code was parsed in place, it is copied
+	first, which can move the output (see NMECurrentOutput).
 	@param[in] context current context
 	@param[out] addr memory address
 	@param[out] len number of bytes
@@ -692,6 +1305,18 @@ void NMEGetTempMemory(NMEContext const *context,
 		NMEText *addr,
 		NMEInt *len);
 
+/** Get the function used to enlarge buffers by NMEProcessAlloc, which
+	can be used in plugin functions to allocate memory larger than what
+	NMEGetTempMemory provides (e.g. for a nested call to NMEProcessAlloc).
+	@param[in] context current context
+	@param[out] reallocFun function passed to NMEProcessAlloc, or NULL
+	for fixed buffers (NMEProcess, NMEProcessBegin)
+	@param[out] reallocData value passed to NMEProcessAlloc
+*/
+void NMEGetReallocFun(NMEContext const *context,
+		NMEReallocFun *reallocFun,
+		void **reallocData);
+
 /** Get current output format and options.
 	@param[in] context current context
 	@param[out] outputFormat output format (not set if pointer is null)
@@ -703,9 +1328,36 @@ void NMEGetFormat(NMEContext const *context,
 		NMEInt *options,
 		NMEInt *fontSize);
 
+/** Get the number of headings of the whole document, for a plugin with
+	kNMEPluginOptDeferred.
+	@param[in] context current context
+	@return number of headings, or -1 if they are unknown because the plugin
+	is called in place
+*/
+NMEInt NMEHeadingCount(NMEContext const *context);
+
+/** Get a heading of the whole document, for a plugin with kNMEPluginOptDeferred.
+	@param[in] context current context
+	@param[in] i heading index, from 0 to NMEHeadingCount(context)-1
+	@param[out] level heading level (1=top-level heading)
+	@param[out] item heading number, or 0 if headings of this level aren't numbered
+	@param[out] inputIndex input index at the beginning of the heading (value of
+	%{o} in beginHeading)
+	@param[out] text heading text in NME source code, without the heading markup
+	(not null-terminated)
+	@param[out] textLen length of text
+*/
+void NMEGetHeading(NMEContext const *context,
+		NMEInt i,
+		NMEInt *level,
+		NMEInt *item,
+		NMEInt *inputIndex,
+		NMEConstText *text,
+		NMEInt *textLen);
+
 /**	Accessor for input index.
 	@param[in] context current context
-	@return current input index
+	@return current input index in NME source text
 */
 NMEInt NMECurrentInputIndex(NMEContext const *context);
 
@@ -715,7 +1367,9 @@ NMEInt NMECurrentInputIndex(NMEContext const *context);
 */
 NMEInt NMECurrentOutputIndex(NMEContext const *context);
 
-/** Accessor for output index in unicode characters, assuming UTF-8 input.
+/** Accessor for output index in unicode characters, assuming UTF-8 input
+	(16-bit units, with 4-byte sequences as surrogate pairs; output added
+	since the previous call is counted now).
 	@param[in] context current context
 	@return current output index
 */
@@ -731,7 +1385,10 @@ void NMECurrentLink(NMEContext const *context,
 		NMEInt *linkOffset, NMEInt *linkLength);
 
 /** Accessor for output produced until now (provides context which can be used
-	to decide if a character should be escaped).
+	to decide if a character should be escaped). With NMEProcessFeed, output
+	begins after the output of the previous blocks which has already been
+	sent to the output function. With NMEProcessAlloc, output may move when
+	more output is added.
 	@param[in] context current context
 	@param[out] output address of output (not provided if NULL)
 	@param[out] outputLength current length of output in bytes (not provided if NULL)
@@ -741,7 +1398,8 @@ void NMECurrentOutput(NMEContext const *context,
 
 /**	Accessor for current list nesting as a string of NME markup characters.
 	@param[in] context current context
-	@return string (constant, valid until next call)
+	@return string (constant, stored in context as a cache which isn't part
+	of the conversion state, and valid until next call with the same context)
 */
 NMEConstText NMECurrentListNesting(NMEContext const *context);
 
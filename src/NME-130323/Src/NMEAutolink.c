@@ -38,25 +38,60 @@ NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 				// find end of sequence of letters
 				for (; i1 + j < srcLen && isAlpha(src[i1 + j]); j++)
 					;
-				// copy link, including initial blank if any, if there is enough space
-				NMEAddString(&src[*i], i1 - *i, '\0', context);	// blank
-				NMEAddString("[[", -1, '\0', context);
-				NMEAddString(&src[i1], j, '\0', context);
-				NMEAddString("]]", -1, '\0', context);
-				*i = i1 + j;
-				return TRUE;
+				// report link (initial blank, if any, is parsed as usual)
+				return NMEAddAutoconvertLink(i1, j, i1, j, context);
 			}
 	
 	return FALSE;
 }
 
+NMEBoolean NMEAutoconvertURLCompilePrefixes(NMEConstText const prefixes[],
+		NMEAutoconvertURLPrefixes *automaton)
+{
+	NMEInt j, k, state, next;
+	
+	automaton->stateCount = 1;
+	automaton->ch[0] = '\0';
+	automaton->child[0] = automaton->sibling[0] = 0;
+	automaton->final[0] = FALSE;
+	
+	for (j = 0; prefixes[j]; j++)
+	{
+		for (k = 0, state = 0; prefixes[j][k]; k++, state = next)
+		{
+			// find child state for prefixes[j][k], or add it
+			for (next = automaton->child[state];
+					next > 0 && automaton->ch[next] != prefixes[j][k];
+					next = automaton->sibling[next])
+				;
+			if (next == 0)
+			{
+				if (automaton->stateCount >= kNMEAutoconvertURLMaxStates)
+					return FALSE;
+				next = automaton->stateCount++;
+				automaton->ch[next] = prefixes[j][k];
+				automaton->child[next] = 0;
+				automaton->sibling[next] = automaton->child[state];
+				automaton->final[next] = FALSE;
+				automaton->child[state] = next;
+			}
+		}
+		if (k > 0)
+			automaton->final[state] = TRUE;
+	}
+	
+	return TRUE;
+}
+
 NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
 		NMEInt *i,
 		NMEContext *context,
 		void *userData)
 {
-	NMEInt i1, j, k, p;
-	static char const * const prefix[] =
+	NMEInt i1, j, k, p, state;
+	NMEAutoconvertURLPrefixes const *automaton
+			= (NMEAutoconvertURLPrefixes const *)userData;
+	static NMEConstText const prefix[] =
 	{
 		"http://", "https://", "ftp://", "mailto:", NULL
 	};
@@ -70,39 +105,51 @@ NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
 	else
 		i1 = *i + 1;
 	
-	// find prefix
-	for (j = 0; prefix[j]; j++)
+	// find end of URL candidate: next blank/control, double-quote, or vertical
+	// bar (separator between link and link text in markup)
+	for (p = 0; i1 + p < srcLen && src[i1 + p] != '"' && src[i1 + p] != '|'
+			&& !(src[i1 + p] >= '\0' && src[i1 + p] <= ' '); p++)
+		;
+	
+	if (automaton)
 	{
-		for (k = 0; prefix[j][k] && i1 + k < srcLen && src[i1 + k] == prefix[j][k]; k++)
-			;
-		if (prefix[j][k])
-			continue;	// end of prefix not reached
-		
-		// continue until next blank/control or double-quote
-		for (p = k; i1 + p < srcLen && src[i1 + p] != '"'
-				&& !(src[i1 + p] >= '\0' && src[i1 + p] <= ' '); p++)
-			;
-		
-		// give up if nothing more than prefix
-		if (p == k)
-			continue;
-		
-		// remove trailing punctuation character
-		for (j = 0; punctuation[j]; j++)
-			if (src[i1 + p - 1] == punctuation[j])
-			{
-				p--;
+		// find shortest prefix followed by at least one character
+		for (k = 0, state = 0; k < p - 1; k++)
+		{
+			for (state = automaton->child[state];
+					state > 0 && automaton->ch[state] != src[i1 + k];
+					state = automaton->sibling[state])
+				;
+			if (state == 0)
+				return FALSE;	// no prefix
+			if (automaton->final[state])
 				break;
-			}
-		
-		// copy link, including blank src[*i] if any
-		NMEAddString(&src[*i], i1 - *i, '\0', context);	// blank
-		NMEAddString("[[", -1, '\0', context);
-		NMEAddString(&src[i1], p, '\0', context);
-		NMEAddString("]]", -1, '\0', context);
-		*i = i1 + p;
-		return TRUE;
+		}
+		if (k >= p - 1)
+			return FALSE;	// end of candidate reached before end of prefix
+	}
+	else
+	{
+		// find default prefix followed by at least one character
+		for (j = 0; prefix[j]; j++)
+		{
+			for (k = 0; prefix[j][k] && k < p && src[i1 + k] == prefix[j][k]; k++)
+				;
+			if (!prefix[j][k] && k < p)
+				break;
+		}
+		if (!prefix[j])
+			return FALSE;
 	}
 	
-	return FALSE;
+	// remove trailing punctuation character
+	for (j = 0; punctuation[j]; j++)
+		if (src[i1 + p - 1] == punctuation[j])
+		{
+			p--;
+			break;
+		}
+	
+	// report link (blank src[*i], if any, is parsed as usual)
+	return NMEAddAutoconvertLink(i1, p, i1, p, context);
 }
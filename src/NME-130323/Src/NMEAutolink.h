@@ -25,6 +25,27 @@
  *	f.autoconverts = autoconverts;
  *	... NMEProcess(..., &f, ...);
  *	@endcode
+ *	Both autoconverts match only at the beginning of the source text or after
+ *	a blank; their entries declare blanks as triggers (NMEAutolinkTriggers)
+ *	so that the parser doesn't call them anywhere else.
+ *
+ *	To recognize other URL prefixes, compile them once with
+ *	NMEAutoconvertURLCompilePrefixes and add
+ *	NMEAutoconvertURLPrefixesEntry(&automaton) instead of
+ *	NMEAutoconvertURLEntry:
+ *	@code
+ *	static NMEConstText const prefixes[] =
+ *	{
+ *		"http://", "https://", "ftp://", "mailto:", "doc:", NULL
+ *	};
+ *	NMEAutoconvertURLPrefixes automaton;
+ *	NMEAutoconvert autoconverts[] =
+ *	{
+ *		NMEAutoconvertURLPrefixesEntry(&automaton),
+ *		NMEAutoconvertTableEnd
+ *	};
+ *	NMEAutoconvertURLCompilePrefixes(prefixes, &automaton);
+ *	@endcode
  */
  
 /* License: new BSD license (see NME.h) */
@@ -38,6 +59,26 @@ extern "C" {
 
 #include "NME.h"
 
+/// Characters where autoconverts of NMEAutolink can match (blanks)
+#define NMEAutolinkTriggers " \t\r\n"
+
+/// Maximum number of states of NMEAutoconvertURLPrefixes
+#define kNMEAutoconvertURLMaxStates 256
+
+/** Automaton which recognizes URL prefixes for NMEAutoconvertURL. Since
+	prefixes are anchored at the beginning of words, it's the trie (goto
+	function) of the prefixes: state 0 is the initial state and the other
+	states are stored as a list of children for each state.
+*/
+typedef struct
+{
+	NMEInt stateCount;	///< number of states
+	NMEChar ch[kNMEAutoconvertURLMaxStates];	///< character leading to each state
+	short child[kNMEAutoconvertURLMaxStates];	///< first child state (0 = none)
+	short sibling[kNMEAutoconvertURLMaxStates];	///< next state with same parent (0 = none)
+	NMEBoolean final[kNMEAutoconvertURLMaxStates];	///< TRUE at the end of a prefix
+} NMEAutoconvertURLPrefixes;
+
 /** Autoconvert implementation for camelCase words
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
@@ -53,14 +94,15 @@ NMEBoolean NMEAutoconvertCamelCase(NMEConstText src, NMEInt srcLen,
 
 /// NMEAutoconvertCamelCase entry for table of NMEAutoconvert
 #define NMEAutoconvertCamelCaseEntry \
-	{NMEAutoconvertCamelCase, NULL}
+	{NMEAutoconvertCamelCase, NULL, NMEAutolinkTriggers}
 
 /** Autoconvert implementation for URLs
 	@param[in] src source text with markup
 	@param[in] srcLen source text length
 	@param[in,out] i index in src (token to parse on input, next token on output)
 	@param[in,out] context current context
-	@param[in] userData pointer passed from the parser, as specified in NMEAutoconvert
+	@param[in] userData pointer to NMEAutoconvertURLPrefixes, or NULL for
+	http://, https://, ftp:// and mailto:
 	@return TRUE for conversion, else FALSE
 */
 NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
@@ -70,7 +112,20 @@ NMEBoolean NMEAutoconvertURL(NMEConstText src, NMEInt srcLen,
 
 /// NMEAutoconvertURL entry for table of NMEAutoconvert
 #define NMEAutoconvertURLEntry \
-	{NMEAutoconvertURL, NULL}
+	{NMEAutoconvertURL, NULL, NMEAutolinkTriggers}
+
+/** Compile URL prefixes for NMEAutoconvertURL
+	@param[in] prefixes NULL-terminated array of prefixes
+	@param[out] automaton compiled prefixes
+	@return TRUE for success, FALSE if there are too many states
+*/
+NMEBoolean NMEAutoconvertURLCompilePrefixes(NMEConstText const prefixes[],
+		NMEAutoconvertURLPrefixes *automaton);
+
+/// NMEAutoconvertURL entry with prefixes compiled in automaton (pointer to
+/// NMEAutoconvertURLPrefixes) for table of NMEAutoconvert
+#define NMEAutoconvertURLPrefixesEntry(automaton) \
+	{NMEAutoconvertURL, (void *)(automaton), NMEAutolinkTriggers}
 
 #ifdef __cplusplus
 }
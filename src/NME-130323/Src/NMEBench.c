@@ -0,0 +1,303 @@
+/**
+ *	@file NMEBench.c
+ *	@brief Benchmark for Nyctergatis Markup Engine.
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	@section nmebenchUsage nmebench Usage
+ *	This program converts generated documents to HTML with URL autoconvert
+ *	and displays the time per autolink for an increasing number of links,
+ *	which should stay constant (conversion time linear in the size of the
+ *	document). With option --incremental, it also displays the time to
+ *	convert the document again with NMEIncrementalUpdate after a single
+ *	character has been inserted or deleted in the middle; it's dominated by
+ *	moving the output after the edit, which grows linearly with the size of
+ *	the document but stays much smaller than the conversion time. With option --events, it also displays the time
+ *	per autolink to render the document from events recorded once with
+ *	NMEProcessEvents. It can be called as follows:
+ *	@code
+ *	./nmebench options
+ *	@endcode
+ *	Here is the list of options it supports:
+ *	- \c --compile        compile output format templates once with
+ *	NMECompileOutputFormat
+ *	- \c --events         also measure rendering from events with NMERenderEvents
+ *	- \c --help           help message
+ *	- \c --incremental    also measure incremental conversion after an edit
+ *	- \c --links \e n     number of links of the largest document (default: 64000)
+ *	- \c --steps \e n     number of documents, each with twice as many links
+ *	as the previous one (default: 5)
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#include "NME.h"
+#include "NMEStdAlloc.h"
+#include "NMEAutolink.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/// Minimum duration of measurements in clock ticks
+#define kMinDuration (CLOCKS_PER_SEC / 2)
+
+/** Generate a document with bare URLs, 4 per line, with paragraphs of 5 lines.
+	@param[in] links number of URLs
+	@param[out] len length of document
+	@return document (to be freed with free), or NULL if not enough memory
+*/
+static NMEText makeDoc(int links, NMEInt *len)
+{
+	NMEText doc;
+	int i;
+	
+	doc = malloc(64 * links + 1);
+	if (!doc)
+		return NULL;
+	for (i = 0, *len = 0; i < links; i++)
+		*len += sprintf(doc + *len, "see http://www.example.com/%d%s",
+				i, i % 20 == 19 ? "\n\n" : i % 4 == 3 ? "\n" : " ");
+	return doc;
+}
+
+/** Measure the time to convert a document again with NMEIncrementalUpdate
+	after alternately inserting and deleting a character in the middle, and
+	check the result against NMEProcessAlloc.
+	@param[in,out] doc document (must have room for one more character)
+	@param[in] docLen length of document
+	@param[in] outputFormat output format
+	@return time per update in seconds, or -1 for error
+*/
+static double timeIncremental(NMEText doc, NMEInt docLen,
+		NMEOutputFormat const *outputFormat)
+{
+	NMEIncremental *incremental;
+	NMEConstText output;
+	NMEText ref;
+	NMEInt outputLen, refLen, mid, i;
+	int count;
+	NMEBoolean same = TRUE;
+	clock_t t0, t = 0;
+	NMEErr err;
+	
+	err = NMEIncrementalBegin(kNMEProcessOptDefault, "\n", outputFormat, 0, 0,
+			NMEReallocStd, NULL, &incremental);
+	if (err == kNMEErrOk)
+		err = NMEIncrementalUpdate(incremental, doc, docLen, -1, 0, 0,
+				&output, &outputLen, NULL);
+	
+	mid = docLen / 2;
+	t0 = clock();
+	for (count = 0; err == kNMEErrOk; )
+	{
+		if (count % 2 == 0)
+		{
+			for (i = docLen; i > mid; i--)
+				doc[i] = doc[i - 1];
+			doc[mid] = 'x';
+			docLen++;
+		}
+		else
+		{
+			for (i = mid; i < docLen - 1; i++)
+				doc[i] = doc[i + 1];
+			docLen--;
+		}
+		err = NMEIncrementalUpdate(incremental, doc, docLen,
+				mid, count % 2, 1 - count % 2,
+				&output, &outputLen, NULL);
+		count++;
+		t = clock() - t0;
+		if (t >= kMinDuration && count % 2 == 0)
+			break;
+	}
+	
+	// check the last output
+	if (err == kNMEErrOk)
+	{
+		err = NMEProcessAlloc(doc, docLen,
+				kNMEProcessOptDefault, "\n", outputFormat, 0,
+				NMEReallocStd, NULL,
+				&ref, &refLen, NULL);
+		if (err == kNMEErrOk)
+		{
+			same = refLen == outputLen && !memcmp(ref, output, refLen);
+			free((void *)ref);
+		}
+	}
+	NMEIncrementalEnd(incremental);
+	if (err != kNMEErrOk || !same)
+		return -1;
+	
+	return (double)t / CLOCKS_PER_SEC / count;
+}
+
+/** Measure the time to render a document with NMERenderEvents from events
+	recorded once with NMEProcessEvents, and check the result against
+	NMEProcessAlloc.
+	@param[in] doc document
+	@param[in] docLen length of document
+	@param[in] outputFormat output format
+	@return time per rendering in seconds, or -1 for error
+*/
+static double timeEvents(NMEConstText doc, NMEInt docLen,
+		NMEOutputFormat const *outputFormat)
+{
+	NMEText events, output = NULL, ref;
+	NMEInt eventsLen, outputLen, refLen;
+	int count;
+	NMEBoolean same = TRUE;
+	clock_t t0, t;
+	NMEErr err;
+	
+	err = NMEProcessEvents(doc, docLen, kNMEProcessOptDefault, outputFormat,
+			NMEReallocStd, NULL, &events, &eventsLen);
+	if (err != kNMEErrOk)
+		return -1;
+	
+	t0 = clock();
+	count = 0;
+	do
+	{
+		if (output)
+			free((void *)output);
+		err = NMERenderEvents(events, eventsLen, doc, docLen,
+				"\n", outputFormat, 0,
+				NMEReallocStd, NULL,
+				&output, &outputLen, NULL);
+		count++;
+		t = clock() - t0;
+	} while (err == kNMEErrOk && t < kMinDuration);
+	free((void *)events);
+	
+	// check the last output
+	if (err == kNMEErrOk)
+	{
+		err = NMEProcessAlloc(doc, docLen,
+				kNMEProcessOptDefault, "\n", outputFormat, 0,
+				NMEReallocStd, NULL,
+				&ref, &refLen, NULL);
+		if (err == kNMEErrOk)
+		{
+			same = refLen == outputLen && !memcmp(ref, output, refLen);
+			free((void *)ref);
+		}
+		free((void *)output);
+	}
+	if (err != kNMEErrOk || !same)
+		return -1;
+	
+	return (double)t / CLOCKS_PER_SEC / count;
+}
+
+/// Application entry point
+int main(int argc, char **argv)
+{
+	int i, links = 64000, steps = 5, n, count;
+	double tIncremental, tEvents;
+	NMEText doc, output;
+	NMEInt docLen, outputLen;
+	NMEOutputFormat outputFormat;
+	NMEChar compiledFormatBuf[8192];
+	NMEBoolean compile = FALSE, incremental = FALSE, events = FALSE;
+	NMEAutoconvert const autoconverts[] =
+	{
+		NMEAutoconvertURLEntry,
+		NMEAutoconvertTableEnd
+	};
+	clock_t t0, t;
+	NMEErr err;
+	
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--compile"))
+			compile = TRUE;
+		else if (!strcmp(argv[i], "--events"))
+			events = TRUE;
+		else if (!strcmp(argv[i], "--incremental"))
+			incremental = TRUE;
+		else if (!strcmp(argv[i], "--links") && i + 1 < argc)
+			links = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--steps") && i + 1 < argc)
+			steps = strtol(argv[++i], NULL, 0);
+		else
+		{
+			if (strcmp(argv[i], "--help"))
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+			fprintf(stderr, "Usage: %s [options]\n"
+					"Benchmark for Nyctergatis Markup Engine.\n"
+					"--compile         compile output format templates\n"
+					"--events          also measure rendering from events\n"
+					"--help            display this help message and exit\n"
+					"--incremental     also measure incremental conversion after an edit\n"
+					"--links n         number of links of the largest document\n"
+					"--steps n         number of documents, each with twice as many links\n"
+					"                  as the previous one\n",
+				argv[0]);
+			exit(0);
+		}
+	
+	outputFormat = NMEOutputFormatHTML;
+	outputFormat.autoconverts = autoconverts;
+	if (compile
+			&& NMECompileOutputFormat(&outputFormat, kNMEProcessOptDefault, 0,
+					compiledFormatBuf, sizeof(compiledFormatBuf),
+					&outputFormat) != kNMEErrOk)
+		exit(1);
+	
+	printf("   links    bytes  us/link%s%s\n",
+			events ? " us/link(events)" : "",
+			incremental ? "  us/edit" : "");
+	for (n = links >> (steps - 1); steps > 0; steps--, n *= 2)
+	{
+		doc = makeDoc(n, &docLen);
+		if (!doc)
+			exit(1);
+		
+		// convert as many times as required for kMinDuration
+		t0 = clock();
+		count = 0;
+		do
+		{
+			err = NMEProcessAlloc(doc, docLen,
+					kNMEProcessOptDefault, "\n", &outputFormat, 0,
+					NMEReallocStd, NULL,
+					&output, &outputLen, NULL);
+			if (err != kNMEErrOk)
+			{
+				printf("Error %d\n", err);
+				exit(1);
+			}
+			free((void *)output);
+			count++;
+			t = clock() - t0;
+		} while (t < kMinDuration);
+		
+		printf("%8d %8d %8.3f", n, (int)docLen,
+				1e6 * t / CLOCKS_PER_SEC / count / n);
+		if (events)
+		{
+			tEvents = timeEvents(doc, docLen, &outputFormat);
+			if (tEvents < 0)
+			{
+				printf("\nRendering from events failed\n");
+				exit(1);
+			}
+			printf(" %15.3f", 1e6 * tEvents / n);
+		}
+		if (incremental)
+		{
+			tIncremental = timeIncremental(doc, docLen, &outputFormat);
+			if (tIncremental < 0)
+			{
+				printf("\nIncremental conversion failed\n");
+				exit(1);
+			}
+			printf(" %8.1f", 1e6 * tIncremental);
+		}
+		printf("\n");
+		free((void *)doc);
+	}
+	
+	return 0;
+}
@@ -15,18 +15,21 @@
 #define __NMECpp__
 
 #include "NME.h"
+#include "NMEStdAlloc.h"
 #include "NMEErrorCpp.h"
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <iterator>
 
 /** @brief NME parser class (objects can be used for multiple
 conversions, by changing input and/or output format before getting
 output again).
 
 In addition to the conversion of text with NME markup to
-some text output format, it handles memory allocation with
-C++ operators new and delete, which simplifies its use with
-respect to the C interface defined in NME.h. Errors are
-handled via C++ exceptions.
+some text output format, it handles memory allocation,
+which simplifies its use with respect to the C interface
+defined in NME.h. Errors are handled via C++ exceptions.
 */
 class NME
 {
@@ -76,7 +79,7 @@ class NME
 		~NME()
 		{
 			if (buf)
-				delete [] buf;
+				free(buf);
 		}
 		
 		/** Copy operator.
@@ -90,7 +93,7 @@ class NME
 				input = nme.input;
 				inputLength = nme.inputLength;
 				if (buf)
-					delete [] buf;
+					free(buf);
 				buf = output = NULL;	// will be created when required
 				format = nme.format;
 				fontSize = nme.fontSize;
@@ -155,45 +158,28 @@ class NME
 					*outputLength = 0;
 			}
 			
-			if (!buf)
+			if (buf)
 			{
-				bufSize = 1024 + 2 * inputLength;
-				buf = new NMEChar[bufSize];
+				free(buf);
+				buf = NULL;
 			}
 			
-			for (;;)
-			{
-				NMEErr err = NMEProcess(input, inputLength,
-						buf, bufSize,
-						kNMEProcessOptDefault, "\n", &format, fontSize,
-						&this->output, &this->outputLength, NULL);
-				if (err == kNMEErrOk)
-				{
-					if (output)
-						*output = this->output;
-					if (outputLength)
-						*outputLength = this->outputLength;
-					return kNMEErrOk;
-				}
-				else if (err == kNMEErrNotEnoughMemory)
-				{
-					if (bufSize >= 65536 + 10 * inputLength)
+			NMEErr err = NMEProcessAlloc(input, inputLength,
+					kNMEProcessOptDefault, "\n", &format, fontSize,
+					NMEReallocStd, NULL,
+					&buf, &this->outputLength, NULL);
+			if (err != kNMEErrOk)
 #if defined(UseNMECppException)
-						throw NMEError(kNMEErrNotEnoughMemory);
+				throw NMEError(err);
 #else
-						return kNMEErrNotEnoughMemory;
+				return err;
 #endif
-					delete [] buf;
-					bufSize *= 2;
-					buf = new NMEChar[bufSize];
-				}
-				else
-#if defined(UseNMECppException)
-					throw NMEError(err);
-#else
-					return err;
-#endif
-			}
+			this->output = buf;
+			if (output)
+				*output = this->output;
+			if (outputLength)
+				*outputLength = this->outputLength;
+			return kNMEErrOk;
 		}
 		
 	protected:
@@ -201,14 +187,235 @@ class NME
 		NMEConstText input;	///< NME text input (belong to caller)
 		NMEInt inputLength;	///< length of input in bytes
 		
-		NMEText buf;	///< buffer used during conversion (belong to NME object)
-		NMEInt bufSize;	///< length of buf
+		NMEText buf;	///< output allocated by NMEProcessAlloc (belong to NME object)
 		
-		NMEText output;	///< address of processed output (in buf)
+		NMEText output;	///< address of processed output (buf)
 		NMEInt outputLength;	///< length of processed output
 		
 		NMEOutputFormat format;	///< NME output format
 		NMEInt fontSize;	///< font size (0 for default value)
 };
 
+/** @brief Pull parser for NME text (NMEParserOpen and NMENextEvent), as a
+range of NMEEvent which is parsed as it is enumerated.
+
+Example which lists the titles of headings:
+@code
+NMEEvents events(input);
+bool inHeading = false;
+for (NMEEvents::iterator it = events.begin(); it != events.end(); ++it)
+	if (it->kind == kNMEEventEnterPar || it->kind == kNMEEventExitPar)
+		inHeading = it->kind == kNMEEventEnterPar && it->markup[0] == '=';
+	else if (inHeading && it->kind == kNMEEventText)
+		cout << string(it->text, it->textLen);
+@endcode
+The range can be enumerated only once at a time; begin() starts a new
+parsing. Errors are reported with C++ exceptions if UseNMECppException
+is defined, else they end the enumeration and can be checked with error().
+*/
+class NMEEvents
+{
+	public:
+		
+		/** @brief Input iterator over the events of NMEEvents. */
+		class iterator
+		{
+			public:
+				typedef std::input_iterator_tag iterator_category;	///< iterator category
+				typedef NMEEvent value_type;	///< type of events
+				typedef ptrdiff_t difference_type;	///< difference between iterators
+				typedef NMEEvent const *pointer;	///< pointer to event
+				typedef NMEEvent const &reference;	///< reference to event
+				
+				/** Constructor (end of enumeration by default).
+				@param[in] events range, or NULL for end of enumeration
+				*/
+				iterator(NMEEvents *events = NULL)
+				{
+					this->events = events;
+				}
+				
+				/** Get current event.
+				@return event
+				*/
+				NMEEvent const &operator * () const
+				{
+					return events->event;
+				}
+				
+				/** Access current event.
+				@return address of event
+				*/
+				NMEEvent const *operator -> () const
+				{
+					return &events->event;
+				}
+				
+				/** Move to next event.
+				@return *this
+				*/
+				iterator &operator ++ ()
+				{
+					if (!events->next())
+						events = NULL;
+					return *this;
+				}
+				
+				/** Skip the construct entered by the current event
+				(kNMEEventEnterDiv, kNMEEventEnterPar or kNMEEventEnterSpan) and move
+				to the event which follows it.
+				@return *this
+				*/
+				iterator &skip()
+				{
+					if (!events->skip() || !events->next())
+						events = NULL;
+					return *this;
+				}
+				
+				/** Compare iterators.
+				@param[in] it iterator
+				@return true if both are at the end or iterate on the same range
+				*/
+				bool operator == (iterator const &it) const
+				{
+					return events == it.events;
+				}
+				
+				/** Compare iterators.
+				@param[in] it iterator
+				@return true if only one is at the end or they iterate on
+				different ranges
+				*/
+				bool operator != (iterator const &it) const
+				{
+					return events != it.events;
+				}
+				
+			private:
+				
+				NMEEvents *events;	///< range, or NULL at the end
+		};
+		
+		/** Constructor.
+		@param[in] input address of input (must remain valid as long as
+		events are enumerated)
+		@param[in] inputLength input length in bytes (if not specified, input
+		is a null-terminated string)
+		@param[in] options kNMEProcessOptDefault or sum of options
+		@param[in] format format used for parsing (autoconverts, plugins),
+		or NULL for default
+		*/
+		NMEEvents(char const *input, int inputLength = -1,
+				NMEInt options = kNMEProcessOptDefault,
+				NMEOutputFormat const *format = NULL)
+		{
+			this->input = input;
+			if (inputLength >= 0)
+				this->inputLength = inputLength;
+			else
+				this->inputLength = strlen(input);
+			this->options = options;
+			this->format = format;
+			parser = NULL;
+			err = kNMEErrOk;
+		}
+		
+		/** Destructor. */
+		~NMEEvents()
+		{
+			if (parser)
+				NMEParserClose(parser);
+		}
+		
+		/** Start parsing from the beginning.
+		@return iterator on the first event
+		*/
+		iterator begin()
+		{
+			if (parser)
+				NMEParserClose(parser);
+			parser = NULL;
+			err = NMEParserOpen(input, inputLength, options, format,
+					NMEReallocStd, NULL, &parser);
+			if (!check() || !next())
+				return end();
+			return iterator(this);
+		}
+		
+		/** Get the iterator at the end of the events.
+		@return end iterator
+		*/
+		iterator end()
+		{
+			return iterator();
+		}
+		
+		/** Get the error which has ended the enumeration.
+		@return error code (kNMEErrOk if none)
+		*/
+		NMEErr error() const
+		{
+			return err;
+		}
+		
+	protected:
+		
+		/** Check the last error.
+		@return true if there is no error
+		*/
+		bool check()
+		{
+			if (err == kNMEErrOk)
+				return true;
+#if defined(UseNMECppException)
+			throw NMEError(err);
+#else
+			return false;
+#endif
+		}
+		
+		/** Get next event.
+		@return true for success, false at the end or for error
+		*/
+		bool next()
+		{
+			err = NMENextEvent(parser, &event);
+			return check() && event.kind != kNMEEventEnd;
+		}
+		
+		/** Skip the construct entered by the last event.
+		@return true for success, false for error
+		*/
+		bool skip()
+		{
+			err = NMESkipEvents(parser);
+			return check();
+		}
+		
+		friend class iterator;
+		
+	private:
+		
+		/** Copy constructor (not implemented, since the parser can't be shared).
+		@param[in] events object to be copied
+		*/
+		NMEEvents(NMEEvents const &events);
+		
+		/** Copy operator (not implemented).
+		@param[in] events object to be copied
+		@return *this
+		*/
+		NMEEvents &operator = (NMEEvents const &events);
+		
+		NMEConstText input;	///< NME text input (belong to caller)
+		NMEInt inputLength;	///< length of input in bytes
+		NMEInt options;	///< kNMEProcessOptDefault or sum of options
+		NMEOutputFormat const *format;	///< format used for parsing, or NULL
+		
+		NMEParser *parser;	///< pull parser, or NULL before begin()
+		NMEEvent event;	///< current event
+		NMEErr err;	///< last error
+};
+
 #endif
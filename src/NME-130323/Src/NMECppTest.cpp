@@ -8,6 +8,7 @@
 /* License: new BSD license (see NME.h) */
 
 #include <iostream>
+#include <string>
 
 #define UseNMECppException
 #include "NMEStyleCpp.h"
@@ -16,17 +17,34 @@ using namespace std;
 
 int main()
 {
-	NMEStyle nme;
-	
-	nme.setInput("=Test\n"
+	char const *input = "=Test\n"
 		"==Section A\n"
 		"Some text...\n"
 		"==Section B\n"
 		"*First item\n"
 		"*Second item\n"
-		"**Sublist item\n");
+		"**Sublist item\n";
+	NMEStyle nme;
+	
+	nme.setInput(input);
 	char const *output;
 	nme.getOutput(&output);
 	cout << output;
+	
+	// list headings with the pull parser
+	NMEEvents events(input);
+	bool inHeading = false;
+	for (NMEEvents::iterator it = events.begin(); it != events.end(); ++it)
+		if ((it->kind == kNMEEventEnterPar || it->kind == kNMEEventExitPar)
+				&& it->markup[0] == '=')
+		{
+			inHeading = it->kind == kNMEEventEnterPar;
+			if (inHeading)
+				cout << string(it->level, '-') << ' ';
+			else
+				cout << endl;
+		}
+		else if (inHeading && it->kind == kNMEEventText)
+			cout << string(it->text, it->textLen);
 	return 0;
 }
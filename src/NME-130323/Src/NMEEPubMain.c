@@ -10,17 +10,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#if !defined(_WIN32)
+#	include <pthread.h>
+#	define useThreads	///< POSIX threads for option --parallel
+#endif
 #include "zip.h"
 #include "NME.h"
+#include "NMEStdAlloc.h"
+#include "NMEThreads.h"
 #include "NMEAutolink.h"
 #include "NMEEPub.h"
 #include "NE.h"
 
-/// Fixed size allocated for source :-(
-#define SIZE (8 * 1024 * 1024L)
-
 #define kNMENEEndnoteError kNMEErr1stUser
 
+/// Maximum number of threads for option --parallel
+#define MAXTHREADS 64
+
+/// Size of blocks of large files compressed in parallel with option --parallel
+#define DEFLATEBLOCKSIZE (128 * 1024)
+
 static NMEBoolean debug = FALSE;
 
 /// Table of autoconvert functions
@@ -51,26 +60,151 @@ static void DisplayUsageAndExit(char const *progName, int status)
 			"--autourllink     automatic conversion of URLs to links\n"
 			"--debug           XML debug format, sublists outside list items\n"
 			"--headernum1      numbering of level-1 headers\n"
-			"--headernum2      numbering of level-2 headers\n",
+			"--headernum2      numbering of level-2 headers\n"
+			"--level n         compression level of XHTML and CSS (0=store,\n"
+			"                  1=fastest to 9=best; default: 6)\n"
+			"--medialevel n    compression level of GIF, JPEG and PNG images\n"
+			"                  (default: 0, stored)\n"
+			"--parallel n      convert and compress files with n threads\n",
 			progName);
 	exit(status);
 }
 
-///	User data for par hook, to process titles and images
+/// Kind of NE call recorded during the conversion of a file
+typedef enum
+{
+	kOpOther,	///< NEAddOther(str)
+	kOpTOCEntry,	///< NEAddTOCEntry(str, str2)
+	kOpMetadata,	///< NEAddMetadata(arg, str)
+	kOpCoverImage,	///< NESetCoverImage(str)
+	kOpEndnote	///< NEAddEndnote(str), with link of length arg2 at output index arg
+} OpKind;
+
+/// NE call recorded by the conversion of a file, replayed in the order of files
+typedef struct
+{
+	OpKind kind;	///< kind of call
+	int arg;	///< metadata key, or output index of endnote link
+	int arg2;	///< length of endnote link
+	char *str;	///< first string argument (null-terminated)
+	int strLen;	///< length of str
+	char *str2;	///< second string argument (null-terminated, in the same block as str), or NULL
+} Op;
+
+/// File of the book, converted and compressed by any thread
+typedef struct
+{
+	char const *filename;	///< file name, in the command line and in the EPUB
+	Op *ops;	///< NE calls recorded during the conversion
+	int opCount;	///< number of ops
+	int opSize;	///< allocated number of ops
+	int endnoteCount;	///< number of endnotes, or -1 before conversion
+	NMEText dest;	///< XHTML, or NULL once compressed
+	NMEInt destLen;	///< length of XHTML
+	char *deflated;	///< compressed XHTML, or NULL
+	int deflatedLen;	///< length of deflated
+	unsigned long crc;	///< CRC-32 of XHTML
+	NMEBoolean cannotOpen;	///< TRUE if the file cannot be read
+	NMEErr err;	///< conversion error
+	NMEBoolean done;	///< TRUE once ready to be written
+} File;
+
+/// Book whose files are converted by workers and written in order by the main thread
 typedef struct
 {
-	NMEOutputFormat *outputFormat;
 	NE *ne;
+	File *files;	///< files in the order of the book
+	int fileCount;	///< number of files
+	NMEOutputFormat const *outputFormat;	///< output format without hooks and plugins
+	NMEInt options;	///< NMEProcess options
+	NMEBoolean compress;	///< TRUE to compress files before writing them
+	int nextFile;	///< index of next file to convert
+	int numbered;	///< number of files whose endnotes have been added to ne
+	int endnoteCount;	///< number of endnotes of numbered files
+#if defined(useThreads)
+	NMEBoolean threads;	///< TRUE if files are converted by other threads
+	pthread_mutex_t mutex;	///< mutex for the fields above and done flags
+	pthread_cond_t cond;	///< condition for numbered and done flags
+#endif
+} Book;
+
+///	User data for hooks and plugins, to process titles, images, endnotes and metadata
+typedef struct
+{
+	File *file;	///< file being converted, where NE calls are recorded
 	
 	// titles
 	char const *filename;
+	NMEConstText src;	///< source code of the current file
+	NMEInt srcLen;	///< length of src
 	int titleSrcOffset;
+	NMEText titleBuf;	///< heading source code and its conversion to plain text
+	NMEInt titleBufSize;	///< size of titleBuf
 	
 	// images
 	NEBoolean inImageMarkup;	///< TRUE if in image markup
+	
+	// endnotes
+	int endnoteBase;	///< expected number of endnotes in previous files
+	int endnoteCount;	///< number of endnotes in the current file
 } HookData;
 
-/**	Paragraph hook to extract titles.
+/**	Record an NE call, to be made later in the order of files.
+	@param[in,out] file file being converted
+	@param[in] kind kind of call
+	@param[in] arg metadata key or output index
+	@param[in] arg2 length of endnote link
+	@param[in] str first string argument
+	@param[in] strLen length of str, or -1 if null-terminated
+	@param[in] str2 second null-terminated string argument, or NULL
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addOp(File *file, OpKind kind, int arg, int arg2,
+		char const *str, int strLen, char const *str2)
+{
+	Op *op;
+	
+	if (file->opCount >= file->opSize)
+	{
+		op = realloc(file->ops, (file->opSize + 16) * sizeof(Op));
+		if (!op)
+			return FALSE;
+		file->ops = op;
+		file->opSize += 16;
+	}
+	
+	op = &file->ops[file->opCount];
+	if (strLen < 0)
+		strLen = strlen(str);
+	op->str = malloc(strLen + 1 + (str2 ? strlen(str2) + 1 : 0));
+	if (!op->str)
+		return FALSE;
+	memcpy(op->str, str, strLen);
+	op->str[strLen] = '\0';
+	op->str2 = str2 ? strcpy(op->str + strLen + 1, str2) : NULL;
+	op->kind = kind;
+	op->arg = arg;
+	op->arg2 = arg2;
+	op->strLen = strLen;
+	file->opCount++;
+	return TRUE;
+}
+
+/// Discard the NE calls recorded for a file
+static void freeOps(File *file)
+{
+	int i;
+	
+	for (i = 0; i < file->opCount; i++)
+		free(file->ops[i].str);
+	free(file->ops);
+	file->ops = NULL;
+	file->opCount = file->opSize = 0;
+}
+
+/**	Paragraph hook to extract titles during the conversion to XHTML: the
+	source code of level-1 headings is converted to plain text in a side
+	buffer and added as TOC entries.
 	@param[in] level heading or list level (1 = topmost, par=kNMEHookLevelPar,
 	span=kNMEHookLevelSpan)
 	@param[in] item list item or heading counter
@@ -93,35 +227,57 @@ static NMEErr parHookTOC(NMEInt level,
 		void *data)
 {
 	HookData *d = (HookData *)data;
+	NMEOutputFormat titleFormat;
+	NMEText output;
+	NMEInt outputLength, len;
+	char title[512], url[512];
+	NMEErr err;
 	
-	if (markup[0] == '=' && level == 1)
-		if (enter)
-		{
-			NMEResetOutput(context);
-			*d->outputFormat = NMEOutputFormatNull;
-			d->outputFormat->space = " ";
-			d->outputFormat->encodeCharFun = NULL;
-			d->outputFormat->parHookFun = parHookTOC;
-			d->outputFormat->hookData = data;
-			d->titleSrcOffset = NMECurrentInputIndex(context);
-		}
-		else
-		{
-			NMEConstText output;
-			NMEInt outputLength;
-			char title[512], url[512];
-			
-			NMECurrentOutput(context, &output, &outputLength);
-			if (outputLength > 511)
-				outputLength = 511;
-			sprintf(title, "%.*s", outputLength, output);
-			sprintf(url, "%s#h%d", d->filename, d->titleSrcOffset);
-			NEAddTOCEntry(d->ne, title, url, 1);
-			
-			*d->outputFormat = NMEOutputFormatNull;
-			d->outputFormat->parHookFun = parHookTOC;
-			d->outputFormat->hookData = data;
-		}
+	if (markup[0] != '=' || level != 1)
+		return kNMEErrOk;
+	
+	if (enter)
+	{
+		d->titleSrcOffset = NMECurrentInputIndex(context);
+		return kNMEErrOk;
+	}
+	
+	// heading text, from the beginning of the heading to srcIndex
+	// (nothing if the heading comes from the output of a plugin)
+	len = srcIndex - d->titleSrcOffset;
+	if (d->titleSrcOffset < 0 || len < 0 || srcIndex > d->srcLen)
+		len = 0;
+	
+	// "= " followed by heading text, with room for its conversion
+	if (2 * len + 64 > d->titleBufSize)
+	{
+		output = realloc(d->titleBuf, 2 * len + 64);
+		if (!output)
+			return kNMEErrNotEnoughMemory;
+		d->titleBuf = output;
+		d->titleBufSize = 2 * len + 64;
+	}
+	d->titleBuf[0] = '=';
+	d->titleBuf[1] = ' ';
+	memcpy(d->titleBuf + 2, d->src + d->titleSrcOffset, len);
+	
+	// convert heading to plain text without markup
+	titleFormat = NMEOutputFormatNull;
+	titleFormat.space = " ";
+	titleFormat.encodeCharFun = NULL;
+	err = NMEProcess(d->titleBuf, len + 2,
+			d->titleBuf + len + 2, d->titleBufSize - len - 2,
+			kNMEProcessOptDefault, "\n", &titleFormat, 0,
+			&output, &outputLength, NULL);
+	if (err != kNMEErrOk)
+		return err;
+	
+	if (outputLength > 511)
+		outputLength = 511;
+	sprintf(title, "%.*s", outputLength, output);
+	sprintf(url, "%s#h%d", d->filename, d->titleSrcOffset);
+	if (!addOp(d->file, kOpTOCEntry, 0, 0, title, -1, url))
+		return kNMEErrNotEnoughMemory;
 	
 	return kNMEErrOk;
 }
@@ -171,8 +327,8 @@ static NMEErr encodeURL(NMEConstText link, NMEInt linkLen,
 {
 	HookData *d = (HookData *)data;
 	
-	if (d->inImageMarkup)
-		NEAddOther(d->ne, link, linkLen, NULL);
+	if (d->inImageMarkup && !addOp(d->file, kOpOther, 0, 0, link, linkLen, NULL))
+		return kNMEErrNotEnoughMemory;
 	
 	return NMEAddRawString(link, linkLen, context);	// no conversion
 }
@@ -183,7 +339,7 @@ static NMEErr encodeURL(NMEConstText link, NMEInt linkLen,
 	@param[in] data data text (NME code)
 	@param[in] dataLen length of data
 	@param[in,out] context current context
-	@param[in] userData NE (userdata specified when the plugin is installed)
+	@param[in] userData HookData (userdata specified when the plugin is installed)
 	@return error code (kNMEErrOk for success)
 	@test @code
 	Some text<< endnote This is an endnote with **bold** and //italic//. >>.
@@ -194,32 +350,46 @@ NMEErr PluginEndnote(NMEConstText name, NMEInt nameLen,
 		NMEContext *context,
 		void *userData)
 {
+	HookData *d = (HookData *)userData;
 	NMEText buf, output;
 	NMEInt bufSize, outputLen;
+	NMEReallocFun reallocFun;
+	void *reallocData;
+	char refLink[kNERefLinkSize];
+	int refLinkLen;
 	NMEErr nmeerr;
-	NEErr neerr;
-	char const *refLink;
 	
-	NMEGetTempMemory(context, &buf, &bufSize);
-	nmeerr = NMEProcess(data, dataLen,
-			buf, bufSize,
-			kNMEProcessOptNoPreAndPost, "\n", &NMEOutputFormatOPSXHTML, 0,
-			&output, &outputLen, NULL);
+	// convert endnote in memory allocated like the output if possible
+	// (NMEProcessAlloc), else in temporary memory
+	NMEGetReallocFun(context, &reallocFun, &reallocData);
+	if (reallocFun)
+		nmeerr = NMEProcessAlloc(data, dataLen,
+				kNMEProcessOptNoPreAndPost, "\n", &NMEOutputFormatOPSXHTML, 0,
+				reallocFun, reallocData,
+				&output, &outputLen, NULL);
+	else
+	{
+		NMEGetTempMemory(context, &buf, &bufSize);
+		nmeerr = NMEProcess(data, dataLen,
+				buf, bufSize,
+				kNMEProcessOptNoPreAndPost, "\n", &NMEOutputFormatOPSXHTML, 0,
+				&output, &outputLen, NULL);
+	}
 	if (nmeerr != kNMEErrOk)
 		return nmeerr;
 	
-	neerr = NEAddEndnote((NEPtr)userData,
-		output, outputLen,
-		((NEPtr)userData)->currentDoc, -1,
-		&refLink);
-	if (neerr != kNEErrOk)
-		return kNMENEEndnoteError;
+	// record endnote, to be numbered in the order of files, and insert
+	// link with the number it's expected to get (checked when numbered)
+	refLinkLen = NEEndnoteRefLink(d->endnoteBase + ++d->endnoteCount, refLink);
+	if (!addOp(d->file, kOpEndnote, NMECurrentOutputIndex(context), refLinkLen,
+			output, outputLen, NULL))
+		nmeerr = kNMEErrNotEnoughMemory;
+	if (reallocFun)
+		reallocFun(output, 0, reallocData);
+	if (nmeerr == kNMEErrOk && !NMEAddString(refLink, refLinkLen, '\0', context))
+		nmeerr = kNMEErrNotEnoughMemory;
 	
-	// insert link
-	if (!NMEAddString(refLink, -1, '\0', context))
-		return kNMEErrNotEnoughMemory;
-	
-	return kNMEErrOk;
+	return nmeerr;
 }
 
 /**	Plugin for NE metadata.
@@ -229,7 +399,7 @@ NMEErr PluginEndnote(NMEConstText name, NMEInt nameLen,
 	@param[in] data metadata value
 	@param[in] dataLen length of data
 	@param[in,out] context current context
-	@param[in] userData NE (userdata specified when the plugin is installed)
+	@param[in] userData HookData (userdata specified when the plugin is installed)
 	@return error code (kNMEErrOk for success)
 	@test @code
 	<< title My Book >>
@@ -243,34 +413,36 @@ NMEErr PluginMeta(NMEConstText name, NMEInt nameLen,
 		NMEContext *context,
 		void *userData)
 {
-	NEPtr ne = (NEPtr)userData;
+	File *file = ((HookData *)userData)->file;
+	int key;
+	static char const * const keys[] =
+	{
+		"title", "author", "identifier", "language", "subject",
+		"description", "publisher", "date", "source", "rights", NULL
+	};
+	static NEMetadataKey const metadataKeys[] =
+	{
+		kNEMetaTitle, kNEMetaCreator, kNEMetaIdentifier, kNEMetaLanguage,
+		kNEMetaSubject, kNEMetaDescription, kNEMetaPublisher, kNEMetaDate,
+		kNEMetaSource, kNEMetaRights
+	};
 	
 	// remove trailing spaces
 	while (dataLen > 0 && data[dataLen - 1] <= ' ' && data[dataLen - 1] >= '\0')
 		dataLen--;
 	
-	if (!strncmp(name, "title", nameLen))
-		NEAddMetadata(ne, kNEMetaTitle, data, dataLen);
-	else if (!strncmp(name, "author", nameLen))
-		NEAddMetadata(ne, kNEMetaCreator, data, dataLen);
-	else if (!strncmp(name, "identifier", nameLen))
-		NEAddMetadata(ne, kNEMetaIdentifier, data, dataLen);
-	else if (!strncmp(name, "language", nameLen))
-		NEAddMetadata(ne, kNEMetaLanguage, data, dataLen);
-	else if (!strncmp(name, "subject", nameLen))
-		NEAddMetadata(ne, kNEMetaSubject, data, dataLen);
-	else if (!strncmp(name, "description", nameLen))
-		NEAddMetadata(ne, kNEMetaDescription, data, dataLen);
-	else if (!strncmp(name, "publisher", nameLen))
-		NEAddMetadata(ne, kNEMetaPublisher, data, dataLen);
-	else if (!strncmp(name, "date", nameLen))
-		NEAddMetadata(ne, kNEMetaDate, data, dataLen);
-	else if (!strncmp(name, "source", nameLen))
-		NEAddMetadata(ne, kNEMetaSource, data, dataLen);
-	else if (!strncmp(name, "rights", nameLen))
-		NEAddMetadata(ne, kNEMetaRights, data, dataLen);
+	for (key = 0; keys[key] && strncmp(name, keys[key], nameLen); key++)
+		;
+	if (keys[key])
+	{
+		if (!addOp(file, kOpMetadata, metadataKeys[key], 0, data, dataLen, NULL))
+			return kNMEErrNotEnoughMemory;
+	}
 	else if (!strncmp(name, "cover", nameLen))
-		NESetCoverImage(ne, data, dataLen);
+	{
+		if (!addOp(file, kOpCoverImage, 0, 0, data, dataLen, NULL))
+			return kNMEErrNotEnoughMemory;
+	}
 	return kNMEErrOk;
 }
 
@@ -305,42 +477,360 @@ NMEErr PluginGuide(NMEConstText name, NMEInt nameLen,
 	return kNMEErrOk;
 }
 
+/// Plugins (userData is set to the HookData of each conversion)
+static NMEPlugin const plugins[] =
+{
+	{"endnote", kNMEPluginOptDefault, PluginEndnote, NULL},
+	{"title", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"author", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"identifier", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"language", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"subject", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"description", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"publisher", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"date", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"source", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"rights", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"cover", kNMEPluginOptDefault, PluginMeta, NULL},
+	{"guide", kNMEPluginOptDefault, PluginGuide, NULL},
+	NMEPluginTableEnd
+};
+
+/// Number of entries in plugins, including the end marker
+#define kPluginCount ((int)(sizeof(plugins) / sizeof(plugins[0])))
+
+/// Lock the book, if shared by several threads
+static void lockBook(Book *book)
+{
+#if defined(useThreads)
+	if (book->threads)
+		pthread_mutex_lock(&book->mutex);
+#endif
+}
+
+/// Unlock the book, if shared by several threads
+static void unlockBook(Book *book)
+{
+#if defined(useThreads)
+	if (book->threads)
+		pthread_mutex_unlock(&book->mutex);
+#endif
+}
+
+/// Wait for a change of book->numbered or of a done flag (book must be locked)
+static void waitBook(Book *book)
+{
+#if defined(useThreads)
+	if (book->threads)
+		pthread_cond_wait(&book->cond, &book->mutex);
+#endif
+}
+
+/// Signal a change of book->numbered or of a done flag (book must be locked)
+static void signalBook(Book *book)
+{
+#if defined(useThreads)
+	if (book->threads)
+		pthread_cond_broadcast(&book->cond);
+#endif
+}
+
+/**	Convert a file to XHTML, recording the NE calls made by hooks and plugins.
+	@param[in] book book
+	@param[in] file file
+	@param[in] src NME source code
+	@param[in] srcLen length of src
+	@param[in] endnoteBase number of endnotes in previous files (expected)
+	@param[out] endnoteCount number of endnotes in file
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr convertFile(Book *book, File *file,
+		NMEConstText src, NMEInt srcLen,
+		int endnoteBase, int *endnoteCount)
+{
+	NMEOutputFormat outputFormat;
+	NMEPlugin filePlugins[kPluginCount];
+	HookData hookData;
+	NMEErr err;
+	int i;
+	
+	// add URL encoding fun to grab image references, par hook to
+	// add TOC entries, and plugins for endnotes and metadata
+	hookData.file = file;
+	hookData.filename = file->filename;
+	hookData.src = src;
+	hookData.srcLen = srcLen;
+	hookData.titleSrcOffset = 0;
+	hookData.titleBuf = NULL;
+	hookData.titleBufSize = 0;
+	hookData.inImageMarkup = FALSE;
+	hookData.endnoteBase = endnoteBase;
+	hookData.endnoteCount = 0;
+	outputFormat = *book->outputFormat;
+	outputFormat.encodeURLFun = encodeURL;
+	outputFormat.encodeURLData = (void *)&hookData;
+	outputFormat.parHookFun = parHookTOC;
+	outputFormat.spanHookFun = spanHookImg;
+	outputFormat.hookData = (void *)&hookData;
+	for (i = 0; i < kPluginCount; i++)
+	{
+		filePlugins[i] = plugins[i];
+		if (plugins[i].cb)
+			filePlugins[i].userData = &hookData;
+	}
+	outputFormat.plugins = filePlugins;
+	
+	err = NMEProcessAlloc(src, srcLen,
+			book->options, "\n", &outputFormat, 0,
+			NMEReallocStd, NULL,
+			&file->dest, &file->destLen, NULL);
+	
+	free((void *)hookData.titleBuf);
+	*endnoteCount = hookData.endnoteCount;
+	return err;
+}
+
+/**	Add the endnotes of a file to the book once those of all previous files
+	have been added, so that they're numbered in the order of files; update
+	links in the XHTML if they were rendered with other numbers of the same
+	length.
+	@param[in,out] book book (locked)
+	@param[in,out] file file
+	@param[in] endnoteBase number of endnotes expected in previous files
+	when the file was converted
+	@return TRUE if the file must be converted again with book->endnoteCount
+	as the number of endnotes in previous files
+*/
+static NMEBoolean numberEndnotes(Book *book, File *file, int endnoteBase)
+{
+	char refLink[kNERefLinkSize];
+	char const *newRefLink;
+	int i, n;
+	NMEBoolean again = FALSE;
+	
+	for (i = 0, n = 0; i < file->opCount; i++)
+		if (file->ops[i].kind == kOpEndnote)
+		{
+			if (NEAddEndnote(book->ne,
+					file->ops[i].str, file->ops[i].strLen,
+					file->filename, -1,
+					&newRefLink) != kNEErrOk)
+			{
+				file->err = kNMENEEndnoteError;
+				return FALSE;
+			}
+			n++;
+			if (again || endnoteBase == book->endnoteCount)
+				continue;
+			
+			// replace link rendered with the expected number, if it has the same length
+			NEEndnoteRefLink(endnoteBase + n, refLink);
+			if (strlen(newRefLink) == file->ops[i].arg2
+					&& file->ops[i].arg + file->ops[i].arg2 <= file->destLen
+					&& !memcmp(file->dest + file->ops[i].arg, refLink, file->ops[i].arg2))
+				memcpy(file->dest + file->ops[i].arg, newRefLink, file->ops[i].arg2);
+			else
+				again = TRUE;
+		}
+	
+	book->endnoteCount += n;
+	return again;
+}
+
+/**	Read, convert and compress a file (run by any thread).
+	@param[in] i file index
+	@param[in,out] book book
+*/
+static void processFile(int i, Book *book)
+{
+	File *file = &book->files[i];
+	FILE *fp;
+	NMEText src = NULL;
+	long srcLen = 0;
+	int endnoteBase, endnoteCount = 0, k;
+	NMEBoolean again;
+	
+	// read file
+	fp = fopen(file->filename, "rb");
+	if (fp)
+	{
+		if (fseek(fp, 0, SEEK_END) == 0
+				&& (srcLen = ftell(fp)) >= 0
+				&& fseek(fp, 0, SEEK_SET) == 0
+				&& (src = malloc(srcLen > 0 ? srcLen : 1)) != NULL)
+			srcLen = fread(src, 1, srcLen, fp);
+		fclose(fp);
+	}
+	file->cannotOpen = !src;
+	
+	// expected number of endnotes in previous files (exact if all of
+	// them are numbered or converted)
+	lockBook(book);
+	endnoteBase = book->endnoteCount;
+	for (k = book->numbered; k < i; k++)
+		if (book->files[k].endnoteCount > 0)
+			endnoteBase += book->files[k].endnoteCount;
+	unlockBook(book);
+	
+	if (src)
+		file->err = convertFile(book, file, src, srcLen, endnoteBase, &endnoteCount);
+	
+	// number endnotes in the order of files
+	lockBook(book);
+	file->endnoteCount = endnoteCount;
+	while (book->numbered < i)
+		waitBook(book);
+	k = book->endnoteCount;
+	again = src && file->err == kNMEErrOk
+			&& numberEndnotes(book, file, endnoteBase);
+	endnoteBase = k;
+	book->numbered++;
+	signalBook(book);
+	unlockBook(book);
+	
+	if (again)
+	{
+		// convert again with the actual endnote numbers
+		free((void *)file->dest);
+		file->dest = NULL;
+		freeOps(file);
+		file->err = convertFile(book, file, src, srcLen, endnoteBase, &endnoteCount);
+	}
+	free((void *)src);
+	
+	// compress
+	if (file->dest && file->err == kNMEErrOk && book->compress
+			&& NEDeflate(book->ne, file->filename, file->dest, file->destLen,
+				&file->deflated, &file->deflatedLen, &file->crc) == kNEErrOk)
+	{
+		free((void *)file->dest);
+		file->dest = NULL;
+	}
+	
+	lockBook(book);
+	file->done = TRUE;
+	signalBook(book);
+	unlockBook(book);
+}
+
+/**	Add a converted file and the results of its hooks and plugins to the
+	EPUB (run by the main thread in the order of files).
+	@param[in] i file index
+	@param[in,out] book book
+*/
+static void writeFile(int i, Book *book)
+{
+	File *file = &book->files[i];
+	Op const *op;
+	int k;
+	
+	lockBook(book);
+	while (!file->done)
+		waitBook(book);
+	unlockBook(book);
+	
+	if (file->cannotOpen)
+	{
+		fprintf(stderr, "Cannot open file \"%s\".\n", file->filename);
+		exit(1);
+	}
+	if (file->err != kNMEErrOk)
+	{
+		fprintf(stderr, "Conversion error %d\n", file->err);
+		exit(1);
+	}
+	
+	// NE calls of hooks and plugins except for endnotes, already added
+	for (k = 0; k < file->opCount; k++)
+	{
+		op = &file->ops[k];
+		switch (op->kind)
+		{
+			case kOpOther:
+				NEAddOther(book->ne, op->str, op->strLen, NULL);
+				break;
+			case kOpTOCEntry:
+				NEAddTOCEntry(book->ne, op->str, op->str2, 1);
+				break;
+			case kOpMetadata:
+				NEAddMetadata(book->ne, (NEMetadataKey)op->arg, op->str, op->strLen);
+				break;
+			case kOpCoverImage:
+				NESetCoverImage(book->ne, op->str, op->strLen);
+				break;
+			case kOpEndnote:
+				break;
+		}
+	}
+	freeOps(file);
+	
+	// add converted file to epub
+	if (file->deflated)
+	{
+		NEAddDeflatedFile(book->ne, file->filename,
+				file->deflated, file->deflatedLen, file->destLen, file->crc);
+		free(file->deflated);
+		file->deflated = NULL;
+	}
+	else
+	{
+		NENewFile(book->ne, file->filename);
+		NEWriteToFile(book->ne, file->dest, file->destLen);
+		NECloseFile(book->ne);
+		free((void *)file->dest);
+		file->dest = NULL;
+	}
+	NEAddPart(book->ne, file->filename, FALSE);
+}
+
+#if defined(useThreads)
+
+/// Task runner for the compression of large files in blocks
+/// (runTasksData points to the number of threads)
+static NEErr runTasksThreads(int taskCount,
+		NETaskFun task, void *taskData,
+		void *runTasksData)
+{
+	NMERunTasksThreads(taskCount, task, taskData, *(int *)runTasksData);
+	return kNEErrOk;
+}
+
+/// Thread function which converts files until there is none left
+static void *runThread(void *arg)
+{
+	Book *book = (Book *)arg;
+	int i;
+	
+	for (;;)
+	{
+		lockBook(book);
+		i = book->nextFile++;
+		unlockBook(book);
+		if (i >= book->fileCount)
+			return NULL;
+		processFile(i, book);
+	}
+}
+
+#endif
+
 /// Application entry point
 int main(int argc, char **argv)
 {
 	char const *epubFilename = NULL;
 	char epubFilenameStr[512];
-	FILE *fp;
-	NMEText src = NULL, buf, dest;
-	NMEInt srcLen, destLen;
 	NMEOutputFormat outputFormat;
 	NMEInt options = kNMEProcessOptDefault | kNMEProcessOptXRef;
 	NMEBoolean autoURLLink = FALSE, autoCCLink = FALSE;
 	int i;
 	int iFiles;
+	int threadCount = 0;
+	int level = Z_DEFAULT_COMPRESSION, mediaLevel = 0;
 	char const *imgFilename;
 	int imgFilenameLength;
 	NEErr neerr;
-	NMEErr nmeerr;
 	NE ne;
-	HookData hookData;
-	NMEPlugin plugins[] =
-	{
-		{"endnote", kNMEPluginOptDefault, PluginEndnote, NULL},
-		{"title", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"author", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"identifier", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"language", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"subject", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"description", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"publisher", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"date", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"source", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"rights", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"cover", kNMEPluginOptDefault, PluginMeta, NULL},
-		{"guide", kNMEPluginOptDefault, PluginGuide, NULL},
-		NMEPluginTableEnd
-	};
+	Book book;
 	
 	for (i = 1; i < argc; i++)
 		if (!strcmp(argv[i], "-o") && i + 1 < argc)
@@ -359,6 +849,12 @@ int main(int argc, char **argv)
 			options |= kNMEProcessOptH2Num;
 		else if (!strcmp(argv[i], "--debug"))
 			debug = TRUE;
+		else if (!strcmp(argv[i], "--level") && i + 1 < argc)
+			level = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--medialevel") && i + 1 < argc)
+			mediaLevel = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--parallel") && i + 1 < argc)
+			threadCount = strtol(argv[++i], NULL, 0);
 		else if (!strcmp(argv[i], "--strictcreole"))
 			options |= kNMEProcessOptNoUnderline | kNMEProcessOptNoMonospace
 					| kNMEProcessOptNoSubSuperscript | kNMEProcessOptNoIndentedPar
@@ -392,81 +888,85 @@ int main(int argc, char **argv)
 	}
 	
 	NEBegin(&ne, epubFilename);
-	
-	// alloc buffers
-	src = malloc(SIZE);
-	buf = malloc(SIZE);
-	if (!src || !buf)
-	{
-		fprintf(stderr, "Not enough memory.\n");
-		exit(1);
-	}
+	NESetCompression(&ne, level, mediaLevel);
+#if defined(useThreads)
+	if (threadCount > 1)
+		NESetParallelDeflate(&ne, DEFLATEBLOCKSIZE, runTasksThreads, &threadCount);
+#endif
 	
 	// process all files for adding XHTML parts
 	outputFormat = NMEOutputFormatOPSXHTML;
-	
-	// add URL encoding fun to grab image references
-	hookData.outputFormat = &outputFormat;
-	hookData.ne = &ne;
-	hookData.titleSrcOffset = 0;
-	hookData.inImageMarkup = FALSE;
-	outputFormat.encodeURLFun = encodeURL;
-	outputFormat.encodeURLData = (void *)&hookData;
-	outputFormat.spanHookFun = spanHookImg;
-	outputFormat.hookData = (void *)&hookData;
-	
-	for (i = 0; ; i++)
-		if (plugins[i].cb == PluginEndnote || plugins[i].cb == PluginMeta)
-			plugins[i].userData = &ne;
-		else if (plugins[i].cb == NULL)
-			break;
-	outputFormat.plugins = plugins;
 	outputFormat.interwikis = interwikis;
 	if (autoCCLink || autoURLLink)
 	{
 		int n = 0;
 		if (autoCCLink)
-			autoconverts[n++].cb = NMEAutoconvertCamelCase;
-		if (autoURLLink)
-			autoconverts[n++].cb = NMEAutoconvertURL;
-		outputFormat.autoconverts = autoconverts;
-	}
-	for (i = iFiles; i < argc; i++)
-	{
-		// convert NME to XHTML
-		fp = fopen(argv[i], "rb");
-		if (!fp)
 		{
-			fprintf(stderr, "Cannot open file \"%s\".\n", argv[i]);
-			exit(1);
+			autoconverts[n].cb = NMEAutoconvertCamelCase;
+			autoconverts[n++].triggers = NMEAutolinkTriggers;
 		}
-		srcLen = fread(src, 1, SIZE, fp);
-		if (srcLen < 0)
+		if (autoURLLink)
 		{
-			free(src);
-			exit(1);
+			autoconverts[n].cb = NMEAutoconvertURL;
+			autoconverts[n++].triggers = NMEAutolinkTriggers;
 		}
-		fclose(fp);
-		
-		ne.currentDoc = argv[i];
-		
-		nmeerr = NMEProcess(src, srcLen,
-				buf, SIZE,
-				options, "\n", &outputFormat, 0,
-				&dest, &destLen, NULL);
+		outputFormat.autoconverts = autoconverts;
+	}
+	
+	book.ne = &ne;
+	book.fileCount = argc - iFiles;
+	book.files = calloc(book.fileCount, sizeof(File));
+	if (!book.files)
+	{
+		fprintf(stderr, "Not enough memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < book.fileCount; i++)
+	{
+		book.files[i].filename = argv[iFiles + i];
+		book.files[i].endnoteCount = -1;
+	}
+	book.outputFormat = &outputFormat;
+	book.options = options;
+	book.compress = epubFilename != NULL;
+	book.nextFile = 0;
+	book.numbered = 0;
+	book.endnoteCount = 0;
+	
+	// convert and compress files in parallel with other threads, and
+	// write them in order; or one after the other
+#if defined(useThreads)
+	book.threads = threadCount > 1 && book.fileCount > 1;
+	if (book.threads)
+	{
+		pthread_t threads[MAXTHREADS];
+		int k;
 		
-		if (nmeerr != kNMEErrOk)
+		pthread_mutex_init(&book.mutex, NULL);
+		pthread_cond_init(&book.cond, NULL);
+		for (i = 0; i < threadCount && i < book.fileCount && i < MAXTHREADS
+				&& !pthread_create(&threads[i], NULL, runThread, &book); i++)
+			;
+		if (i == 0)
+			book.threads = FALSE;	// no thread: convert files below
+		else
 		{
-			fprintf(stderr, "Conversion error %d\n", nmeerr);
-			exit(1);
+			for (k = 0; k < book.fileCount; k++)
+				writeFile(k, &book);
+			while (i-- > 0)
+				pthread_join(threads[i], NULL);
 		}
-		
-		// add converted file to epub
-		NENewFile(&ne, argv[i]);
-		NEWriteToFile(&ne, dest, destLen);
-		NECloseFile(&ne);
-		NEAddPart(&ne, argv[i], FALSE);
+		pthread_cond_destroy(&book.cond);
+		pthread_mutex_destroy(&book.mutex);
+	}
+	if (!book.threads)
+#endif
+	for (i = 0; i < book.fileCount; i++)
+	{
+		processFile(i, &book);
+		writeFile(i, &book);
 	}
+	free(book.files);
 	
 	// add images
 	imgFilename = NULL;
@@ -488,48 +988,9 @@ int main(int argc, char **argv)
 		}
 	}
 	
-	// process all parts for adding TOC entries
-	outputFormat = NMEOutputFormatTextCompact;
-	outputFormat.parHookFun = parHookTOC;
-	outputFormat.hookData = (void *)&hookData;
-	
-	for (i = iFiles; i < argc; i++)
-	{
-		// convert NME to extract titles and add TOC entries
-		fp = fopen(argv[i], "rb");
-		if (!fp)
-		{
-			fprintf(stderr, "Cannot open file \"%s\".\n", argv[i]);
-			exit(1);
-		}
-		srcLen = fread(src, 1, SIZE, fp);
-		if (srcLen < 0)
-		{
-			free(src);
-			exit(1);
-		}
-		fclose(fp);
-		
-		hookData.filename = argv[i];
-		nmeerr = NMEProcess(src, srcLen,
-				buf, SIZE,
-				kNMEProcessOptDefault, "\n", &outputFormat, 0,
-				&dest, &destLen, NULL);
-		
-		if (nmeerr != kNMEErrOk)
-		{
-			fprintf(stderr, "Conversion error %d\n", nmeerr);
-			exit(1);
-		}
-	}
-	
 	NEMakeCover(&ne);
 	
 	NEEnd(&ne);
 	
-	// deallocate memory used for conversion
-	free((void *)buf);
-	free((void *)src);
-	
 	return 0;
 }
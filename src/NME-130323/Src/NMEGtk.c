@@ -8,6 +8,7 @@
 /* License: new BSD license (see file NME.h) */
 
 #include "NMEGtk.h"
+#include "NMEStdAlloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -224,8 +225,8 @@ NMEErr NMEGtkInsert(GtkTextBuffer *textBuffer,
 		NMEBoolean replaceSel,
 		NMEBoolean links)
 {
-	NMEText buf, dest;
-	NMEInt bufSize, destLen, destLenUCS16;
+	NMEText dest;
+	NMEInt styleTableSize, destLen, destLenUCS16;
 	NMEOutputFormat f;
 	NMEErr err;
 	int length;
@@ -234,38 +235,37 @@ NMEErr NMEGtkInsert(GtkTextBuffer *textBuffer,
 	if (len < 0)
 		len = strlen(str);
 	
-	bufSize = 1024 + 2 * len;
+	styleTableSize = 1024 + 2 * len;
 	f = NMEOutputFormatBasicText;
 	f.spanHookFun = NMEStyleSpanHook;
 	f.parHookFun = NMEStyleSpanHook;
 	
 tryAgain:
-	buf = malloc(bufSize);
-	if (!buf)
-		return kNMEErrNotEnoughMemory;
-	f.hookData = malloc(bufSize);
+	f.hookData = malloc(styleTableSize);
 	if (!f.hookData)
-	{
-		free((void *)buf);
 		return kNMEErrNotEnoughMemory;
-	}
-	NMEStyleInit((NMEStyleTable *)f.hookData, bufSize, TRUE);
+	NMEStyleInit((NMEStyleTable *)f.hookData, styleTableSize, TRUE);
 	
-	err = NMEProcess(str, len, buf, bufSize,
+	err = NMEProcessAlloc(str, len,
 			kNMEProcessOptDefault, "\n", &f, 0,
+			NMEReallocStd, NULL,
 			&dest, &destLen, &destLenUCS16);
-	if (err == kNMEErrNotEnoughMemory || err == kNMEErrStyleTableTooSmall)
+	if (err == kNMEErrStyleTableTooSmall)
 	{
-		free((void *)buf);
 		free((void *)f.hookData);
-		if (bufSize < 65536 + 10 * len)
+		if (styleTableSize < 65536 + 10 * len)
 		{
-			bufSize *= 2;
+			styleTableSize *= 2;
 			goto tryAgain;
 		}
 		else
 			return kNMEErrNotEnoughMemory;
 	}
+	else if (err == kNMEErrNotEnoughMemory)
+	{
+		free((void *)f.hookData);
+		return kNMEErrNotEnoughMemory;
+	}
 	
 	if (replaceSel)
 	{
@@ -282,7 +282,7 @@ tryAgain:
 				0, destLenUCS16, links ? str : NULL);
 	}
 	
-	free((void *)buf);
+	free((void *)dest);
 	free((void *)f.hookData);
 	
 	return kNMEErrOk;
@@ -16,6 +16,10 @@
  *	- \c --2eol           double eol as paragraph breaks (default)
  *	- \c --autocclink     automatic conversion of camelCase words to links
  *	- \c --autourl        automatic conversion of URLs to links
+ *	- \c --batch          convert many documents, each preceded by its length
+ *                        in bytes in decimal and an eol, with the number of
+ *                        threads of option --parallel; output has the same
+ *                        format
  *	- \c --body           naked body without header and footer
  *	- \c --checkhooks     check hooks
  *	- \c --debug          XML debug output, sublists outside list items
@@ -46,6 +50,8 @@
  *	- \c --mediawiki      Mediawiki output
  *	- \c --nme            NME output
  *	- \c --null           no output (still process input)
+ *	- \c --parallel \e n   convert large input in chunks with \e n threads
+ *	- \c --stream         convert input progressively with bounded memory
  *	- \c --strictcreole   dble tt, u, sub/sup, DL, ind par and esc and eble tt nowiki
  *  - \c --structdiv      display division structure
  *  - \c --structpar      display paragraph structure
@@ -66,7 +72,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#if !defined(_WIN32)
+#	include <pthread.h>
+#	define useThreads	///< POSIX threads for option --parallel
+#endif
 #include "NME.h"
+#include "NMEStdAlloc.h"
+#include "NMEThreads.h"
 #include "NMETest.h"
 #include "NMEEPub.h"
 #include "NMEAutolink.h"
@@ -81,6 +93,12 @@
 /// Initial size for reading input
 #define INITIALSIZE (32 * 1024)
 
+/// Buffer size for option --stream
+#define STREAMBUFSIZE (1024 * 1024)
+
+/// Size of buffer for compiled output format templates
+#define COMPILEDFORMATSIZE (8 * 1024)
+
 /// Format strings for slides in HTML
 static NMEOutputFormat const NMEOutputFormatSlidesHTML =
 {
@@ -298,6 +316,20 @@ static NMEPlugin const pluginsHTML[] =
 	NMEPluginTableEnd
 };
 
+/// Table of plugins for conversion to HTML with option --batch (no TOC,
+/// whose data is the source of a single document)
+static NMEPlugin const pluginsHTMLBatch[] =
+{
+	NMEPluginReverseEntry,
+	NMEPluginRot13Entry,
+	NMEPluginUppercaseEntry,
+	NMEPluginRawEntry("rawinpar", kNMEPluginOptDefault),
+	NMEPluginRawEntry("rawoutpar", kNMEPluginOptBetweenPar),
+	NMEPluginCalendarEntry,
+	
+	NMEPluginTableEnd
+};
+
 /// Table of plugins for conversion to all formats but HTML/XML
 static NMEPlugin const plugins[] =
 {
@@ -580,16 +612,64 @@ NMEErr encodeURLEasylink(NMEConstText link, NMEInt linkLen,
 	return kNMEErrOk;
 }
 
+/// Output function for option --stream (write to stdout up to the first
+/// null character, like printf does with the output of NMEProcessAlloc;
+/// data points to an NMEBoolean set once a null character has been found)
+static NMEErr writeOutput(NMEConstText output, NMEInt outputLen, void *data)
+{
+	NMEBoolean *nulFound = (NMEBoolean *)data;
+	NMEInt n;
+	
+	if (*nulFound)
+		return kNMEErrOk;
+	for (n = 0; n < outputLen && output[n] != '\0'; n++)
+		;
+	fwrite(output, 1, n, stdout);
+	*nulFound = n < outputLen;
+	return kNMEErrOk;
+}
+
+#if defined(useThreads)
+
+/// Task runner for option --parallel (runTasksData points to the number of threads)
+static NMEErr runTasksThreads(NMEInt taskCount,
+		NMETaskFun task, void *taskData,
+		void *runTasksData)
+{
+	NMERunTasksThreads(taskCount, task, taskData, *(int *)runTasksData);
+	return kNMEErrOk;
+}
+
+/// Mutex for option --batch
+static pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// Lock function for option --batch
+static void lockBatch(NMEBoolean lock, void *lockData)
+{
+	(void)lockData;
+	
+	if (lock)
+		pthread_mutex_lock(&batchMutex);
+	else
+		pthread_mutex_unlock(&batchMutex);
+}
+
+#endif
+
 /// Application entry point
 int main(int argc, char **argv)
 {
 	NMEInt size;
-	NMEText src = NULL, buf, dest;
+	NMEText src = NULL, buf, dest = NULL;
 	NMEInt srcLen, destLen;
 	NMEOutputFormat outputFormat = NMEOutputFormatHTML;
+	NMEChar compiledFormatBuf[COMPILEDFORMATSIZE];
 	NMEInt options = kNMEProcessOptDefault;
 	NMEBoolean autoURLLink = FALSE, autoCCLink = FALSE;
 	NMEBoolean testPhase = 0;	// no test by default
+	NMEBoolean stream = FALSE;
+	NMEBoolean batch = FALSE;
+	int threadCount = 0;
 	int i;
 	int fontSize = 0;
 	HookDumpData hookDumpData;
@@ -614,6 +694,8 @@ int main(int argc, char **argv)
 			autoCCLink = TRUE;
 		else if (!strcmp(argv[i], "--autourllink"))
 			autoURLLink = TRUE;
+		else if (!strcmp(argv[i], "--batch"))
+			batch = TRUE;
 		else if (!strcmp(argv[i], "--nme"))
 		{
 			outputFormat = NMEOutputFormatNME;
@@ -767,6 +849,10 @@ int main(int argc, char **argv)
 			options |= kNMEProcessOptH1Num;
 		else if (!strcmp(argv[i], "--headernum2"))
 			options |= kNMEProcessOptH2Num;
+		else if (!strcmp(argv[i], "--parallel") && i + 1 < argc)
+			threadCount = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--stream"))
+			stream = TRUE;
 		else if (!strcmp(argv[i], "--strictcreole"))
 			options |= kNMEProcessOptNoUnderline | kNMEProcessOptNoMonospace
 					| kNMEProcessOptNoSubSuperscript | kNMEProcessOptNoIndentedPar
@@ -783,6 +869,10 @@ int main(int argc, char **argv)
 					"--2eol            double eol as paragraph breaks (default)\n"
 					"--autocclink      automatic conversion of camelCase words to links\n"
 					"--autourllink     automatic conversion of URLs to links\n"
+					"--batch           convert many documents, each preceded by its\n"
+					"                  length in bytes in decimal and an eol, with the\n"
+					"                  number of threads of --parallel; output has the\n"
+					"                  same format\n"
 					"--body            naked body without header and footer\n"
 					"--checkhooks      check hooks\n"
 					"--debug           XML debug format, sublists outside list items\n"
@@ -813,6 +903,8 @@ int main(int argc, char **argv)
 					"--nme             NME output\n"
 					"--null            no output, plugins disabled (still process input)\n"
 					"--null-plugins    no normal output, but process plugins\n"
+					"--parallel n      convert large input in chunks with n threads\n"
+					"--stream          convert input progressively with bounded memory\n"
 					"--strictcreole    disable monospace, underline, subscript,\n"
 					"                  superscript, definition lists, and indented\n"
 					"                  paragraphs; and enable nowiki monospace\n"
@@ -837,13 +929,48 @@ int main(int argc, char **argv)
 		int n = 0;
 		
 		if (autoCCLink)
-			autoconverts[n++].cb = NMEAutoconvertCamelCase;
+		{
+			autoconverts[n].cb = NMEAutoconvertCamelCase;
+			autoconverts[n++].triggers = NMEAutolinkTriggers;
+		}
 		if (autoURLLink)
-			autoconverts[n++].cb = NMEAutoconvertURL;
+		{
+			autoconverts[n].cb = NMEAutoconvertURL;
+			autoconverts[n++].triggers = NMEAutolinkTriggers;
+		}
 
 		outputFormat.autoconverts = autoconverts;
 	}
 	
+	if (batch && outputFormat.plugins == pluginsHTML)
+		outputFormat.plugins = pluginsHTMLBatch;
+	
+	// compile templates (if it fails, they're just interpreted)
+	NMECompileOutputFormat(&outputFormat, options, fontSize,
+			compiledFormatBuf, sizeof(compiledFormatBuf), &outputFormat);
+	
+	if (stream)
+	{
+		NMEContext *context;
+		NMEChar chunk[4096];
+		NMEBoolean nulFound = FALSE;
+		
+		buf = malloc(STREAMBUFSIZE);
+		if (!buf)
+			exit(1);
+		err = NMEProcessBegin(buf, STREAMBUFSIZE,
+				options, "\n", &outputFormat, fontSize,
+				writeOutput, &nulFound, &context);
+		while (err == kNMEErrOk && (i = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+			err = NMEProcessFeed(context, chunk, i);
+		if (err == kNMEErrOk)
+			err = NMEProcessEnd(context, NULL, NULL);
+		if (err != kNMEErrOk)
+			printf("Error %d\n", err);
+		free((void *)buf);
+		return err != kNMEErrOk;
+	}
+	
 	size = INITIALSIZE;
 	src = malloc(size);
 	for (srcLen = 0; ; )
@@ -863,28 +990,80 @@ int main(int argc, char **argv)
 		src = realloc(src, size);
 	}
 	
-	size *= 4;	// likely enough
-	buf = malloc(size);
-	if (!buf)
-		exit(1);
+	if (batch)
+	{
+		NMEBatchDoc *docs = NULL;
+		NMEInt docCount, len;
+		
+		// split input into documents
+		for (i = 0, docCount = 0; i < srcLen; i += len)
+		{
+			for (len = 0; i < srcLen && src[i] >= '0' && src[i] <= '9'; i++)
+				len = 10 * len + src[i] - '0';
+			if (i < srcLen && src[i] == '\r')
+				i++;
+			if (i >= srcLen || src[i++] != '\n' || len > srcLen - i)
+			{
+				fprintf(stderr, "Bad length of document %d\n", docCount + 1);
+				exit(1);
+			}
+			if (docCount % 64 == 0)
+			{
+				docs = realloc(docs, (docCount + 64) * sizeof(NMEBatchDoc));
+				if (!docs)
+					exit(1);
+			}
+			docs[docCount].nmeText = src + i;
+			docs[docCount++].nmeTextLen = len;
+		}
+		
+		err = NMEProcessBatch(docs, docCount,
+				options, "\n", &outputFormat, fontSize,
+				threadCount,
+#if defined(useThreads)
+				runTasksThreads, &threadCount,
+				lockBatch, NULL,
+#else
+				NULL, NULL,
+				NULL, NULL,
+#endif
+				NMEReallocStd, NULL);
+		if (err != kNMEErrOk)
+			printf("Error %d\n", err);
+		else
+			for (i = 0; i < docCount; i++)
+			{
+				if (docs[i].err != kNMEErrOk)
+					fprintf(stderr, "Error %d in document %d\n", docs[i].err, i + 1);
+				printf("%d\n", docs[i].outputLen);
+				fwrite(docs[i].output, 1, docs[i].outputLen, stdout);
+				free((void *)docs[i].output);
+			}
+		free((void *)docs);
+		free((void *)src);
+		return err != kNMEErrOk;
+	}
 	
 	tocData.src = src;
 	tocData.srcLen = srcLen;
 	
 process:
-	err = NMEProcess(src, srcLen,
-			buf, size,
-			options, "\n", &outputFormat, fontSize,
-			&dest, &destLen, NULL);
-	if (err == kNMEErrNotEnoughMemory)
-	{
-		free(buf);
-		size *= 2;
-		buf = malloc(size);
-		if (!buf)
-			exit(1);
-		goto process;
-	}
+	if (threadCount > 0)
+		err = NMEProcessParallel(src, srcLen,
+				options, "\n", &outputFormat, fontSize,
+				0,
+#if defined(useThreads)
+				runTasksThreads, &threadCount,
+#else
+				NULL, NULL,
+#endif
+				NMEReallocStd, NULL,
+				&dest, &destLen, NULL);
+	else
+		err = NMEProcessAlloc(src, srcLen,
+				options, "\n", &outputFormat, fontSize,
+				NMEReallocStd, NULL,
+				&dest, &destLen, NULL);
 	
 	if (err != kNMEErrOk)
 		printf("Error %d\n", err);
@@ -904,6 +1083,8 @@ process:
 			outputFormat = NMEOutputFormatTest;
 			outputFormat.sublistInListItem = TRUE;
 			testPhase++;
+			free((void *)dest);
+			dest = NULL;
 			goto process;
 		case 2:	// sublistInListItem = TRUE
 			err = NMETest(dest, destLen, &lineNumber);
@@ -913,7 +1094,7 @@ process:
 			break;
 	}
 	
-	free((void *)buf);
+	free((void *)dest);
 	free((void *)src);
 	
 	return err != kNMEErrOk;
@@ -9,26 +9,20 @@
 
 #import "NMEObjC.h"
 #import "NME.h"
+#import "NMEStdAlloc.h"
 
 @implementation NSData(NME)
 
 + (NSData *)dataWithNME:(char const *)src length:(int)length
 		fontSize:(int)fontSize format:(char)format
 {
-	NMEText buf, dest;
-	NMEInt bufSize, destLen;
+	NMEText dest;
+	NMEInt destLen;
 	NMEErr err;
 	NSData *data;
 	NMEOutputFormat const *f;
 	NMEOutputFormat formatDebugNested;
 	
-	bufSize = 1024 + 2 * length;
-	
-tryAgain:
-	buf = malloc(bufSize);
-	if (!buf)
-		return nil;
-	
 	switch (format)
 	{
 		case 'd':
@@ -56,27 +50,15 @@ tryAgain:
 			break;
 	}
 	
-	err = NMEProcess(src, length,
-			buf, bufSize,
+	err = NMEProcessAlloc(src, length,
 			kNMEProcessOptDefault, "\n", f, fontSize,
+			NMEReallocStd, NULL,
 			&dest, &destLen, NULL);
-	if (err == kNMEErrNotEnoughMemory)
-	{
-		if (bufSize < 65536 + 10 * length)
-		{
-			free((void *)buf);
-			bufSize *= 2;
-			goto tryAgain;
-		}
-		else
-		{
-			free((void *)buf);
-			return nil;
-		}
-	}
+	if (err != kNMEErrOk)
+		return nil;
 	
 	data = [NSData dataWithBytes:dest length:destLen];
-	free((void *)buf);
+	free((void *)dest);
 	return data;
 }
 
@@ -9,6 +9,7 @@
 
 #include "NMEPluginTOC.h"
 #include <stdlib.h>
+#include <string.h>
 
 /// Test if a character is a space, tab, cr or lf
 #define isBlankOrEol(c) ((c) == ' ' || (c) == '\t' || (c) == 10 || (c) == 13)
@@ -16,6 +17,21 @@
 static void switchOutputFormatTOC(HookTOCData *hookData,
 		NMEBoolean heading);
 
+/** Set output format for heading text in TOC entries (HTML without links)
+	@param[out] f address of output format structure
+*/
+static void setOutputFormatTOCHeading(NMEOutputFormat *f)
+{
+	*f = NMEOutputFormatHTML;
+	f->lineBreak = " ";
+	f->beginLink = "";
+	f->endLink = "";
+	f->sepLink = NULL;
+	f->beginImage = "";
+	f->endImage = "";
+	f->sepImage = NULL;
+}
+
 /** Paragraph hook for TOC (switch output on for titles and off for everything else)
 	@param[in] level heading or list level (1 = topmost)
 	@param[in] item list item or heading counter
@@ -54,17 +70,10 @@ static void switchOutputFormatTOC(HookTOCData *hookData,
 {
 	if (heading)
 	{
-		*hookData->outputFormat = NMEOutputFormatHTML;
+		setOutputFormatTOCHeading(hookData->outputFormat);
 		hookData->outputFormat->beginHeading
 				= "%%{l}&nbsp;%%<a href=\"#h%{o}\">%%{i>0}%{i}. %%";
 		hookData->outputFormat->endHeading = "</a><br />\n";
-		hookData->outputFormat->lineBreak = " ";
-		hookData->outputFormat->beginLink = "";
-		hookData->outputFormat->endLink = "";
-		hookData->outputFormat->sepLink = NULL;
-		hookData->outputFormat->beginImage = "";
-		hookData->outputFormat->endImage = "";
-		hookData->outputFormat->sepImage = NULL;
 	}
 	else
 	{
@@ -86,6 +95,133 @@ void NMESetTOCOutputFormat(NMEOutputFormat *f, HookTOCData *d)
 	switchOutputFormatTOC(d, FALSE);
 }
 
+/** Add the TOC title to the output, if any
+	@param[in] title title text
+	@param[in] titleLen length of title (0 for none)
+	@param[in,out] context current context
+	@return TRUE for success, FALSE if not enough memory
+*/
+static NMEBoolean addTitleTOC(NMEConstText title, NMEInt titleLen,
+		NMEContext *context)
+{
+	return titleLen <= 0
+			|| (NMEAddString("<h2%%{s>0} style=\"font-size:%{2*s}pt\"%%>", -1, '%', context)
+				&& NMEAddString(title, titleLen, '\0', context)
+				&& NMEAddString("</h2>\n", -1, '%', context));
+}
+
+/** Write a nonnegative decimal number
+	@param[out] str address where the number is written (at least 10 bytes)
+	@param[in] n number
+	@return number of bytes written
+*/
+static NMEInt writeNumberTOC(NMEText str, NMEInt n)
+{
+	NMEInt len, k;
+	NMEChar c;
+	
+	len = 0;
+	do
+	{
+		str[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	for (k = 0; k < len / 2; k++)
+	{
+		c = str[k];
+		str[k] = str[len - 1 - k];
+		str[len - 1 - k] = c;
+	}
+	return len;
+}
+
+/** Add TOC entries for the headings collected during the conversion of the
+	whole document (plugin called at the end with kNMEPluginOptDeferred)
+	@param[in] level1 lowest heading level
+	@param[in] level2 highest heading level
+	@param[in,out] context current context
+	@return error code (kNMEErrOk for success)
+*/
+static NMEErr addDeferredTOC(NMEInt level1, NMEInt level2,
+		NMEContext *context)
+{
+	NMEOutputFormat outputFormat;
+	NMEInt options, fontSize;
+	NMEReallocFun reallocFun;
+	void *reallocData;
+	NMEInt i, k, n, headingCount, level, item, inputIndex, textLen;
+	NMEConstText text;
+	NMEText buf = NULL, dest;
+	NMEInt bufSize = 0, destLen;
+	NMEErr err = kNMEErrOk;
+	
+	setOutputFormatTOCHeading(&outputFormat);
+	outputFormat.endHeading = "</a><br />\n";
+	NMEGetFormat(context, NULL, &options, &fontSize);
+	options = (options & ~(kNMEProcessOptNoH1 | kNMEProcessOptH1Num | kNMEProcessOptH2Num))
+			| kNMEProcessOptNoPreAndPost;
+	NMEGetReallocFun(context, &reallocFun, &reallocData);
+	
+	headingCount = NMEHeadingCount(context);
+	for (i = 0; i < headingCount; i++)
+	{
+		NMEGetHeading(context, i, &level, &item, &inputIndex, &text, &textLen);
+		if (level < level1 || level > level2)
+			continue;
+		
+		// beginHeading like switchOutputFormatTOC's with literal values,
+		// followed by "= " and heading text as NME source code
+		n = 6 * level + 40 + textLen;
+		if (n > bufSize)
+		{
+			dest = (NMEText)reallocFun(buf, n, reallocData);
+			if (!dest)
+			{
+				err = kNMEErrNotEnoughMemory;
+				break;
+			}
+			buf = dest;
+			bufSize = n;
+		}
+		for (n = 0, k = 0; k < level; k++, n += 6)
+			memcpy(buf + n, "&nbsp;", 6);
+		strcpy(buf + n, "<a href=\"#h");
+		n += 11;
+		n += writeNumberTOC(buf + n, inputIndex);
+		buf[n++] = '"';
+		buf[n++] = '>';
+		if (item > 0)
+		{
+			n += writeNumberTOC(buf + n, item);
+			buf[n++] = '.';
+			buf[n++] = ' ';
+		}
+		buf[n++] = '\0';
+		outputFormat.beginHeading = buf;
+		buf[n] = '=';
+		buf[n + 1] = ' ';
+		for (k = 0; k < textLen; k++)
+			buf[n + 2 + k] = text[k];
+		
+		// render entry
+		err = NMEProcessAlloc(buf + n, textLen + 2,
+				options, "\n", &outputFormat, fontSize,
+				reallocFun, reallocData,
+				&dest, &destLen, NULL);
+		if (err != kNMEErrOk)
+			break;
+		if (!NMEAddString(dest, destLen, '\0', context))
+			err = kNMEErrNotEnoughMemory;
+		reallocFun(dest, 0, reallocData);
+		if (err != kNMEErrOk)
+			break;
+	}
+	
+	if (buf)
+		reallocFun(buf, 0, reallocData);
+	return err;
+}
+
 NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 		NMEConstText data, NMEInt dataLen,
 		NMEContext *context,
@@ -97,6 +233,8 @@ NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 	NMEInt titleLen, bufLen, destLen;
 	NMEOutputFormat outputFormat;
 	NMEInt options, fontSize;
+	NMEReallocFun reallocFun;
+	void *reallocData;
 	NMEErr err;
 	(void)name;
 	(void)nameLen;
@@ -119,29 +257,54 @@ NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 			titleLen--)
 		;
 	
-	// make TOC
-	NMEGetTempMemory(context, &buf, &bufLen);
+	// headings known at the end of the conversion: only entries are rendered
+	if (NMEHeadingCount(context) >= 0)
+	{
+		if (!addTitleTOC(title, titleLen, context)
+				|| !NMEAddString("<p%%{s>0} style=\"font-size:%{s}pt\"%%>\n", -1, '%', context))
+			return kNMEErrNotEnoughMemory;
+		err = addDeferredTOC(hookData.level1, hookData.level2, context);
+		if (err == kNMEErrOk && !NMEAddString("</p>\n", -1, '%', context))
+			err = kNMEErrNotEnoughMemory;
+		return err;
+	}
+	
+	// make TOC by converting the whole source code again, in memory
+	// allocated like the output if possible (NMEProcessAlloc), else in
+	// temporary memory
 	NMEGetFormat(context, NULL, &options, &fontSize);
-	err = NMEProcess(((NMEPluginTocData *)userData)->src,
-			((NMEPluginTocData *)userData)->srcLen,
-			buf, bufLen,
-			options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
-			&dest, &destLen, NULL);
+	NMEGetReallocFun(context, &reallocFun, &reallocData);
+	if (reallocFun)
+		err = NMEProcessAlloc(((NMEPluginTocData *)userData)->src,
+				((NMEPluginTocData *)userData)->srcLen,
+				options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
+				reallocFun, reallocData,
+				&dest, &destLen, NULL);
+	else
+	{
+		NMEGetTempMemory(context, &buf, &bufLen);
+		err = NMEProcess(((NMEPluginTocData *)userData)->src,
+				((NMEPluginTocData *)userData)->srcLen,
+				buf, bufLen,
+				options | kNMEProcessOptNoPreAndPost, "\n", &outputFormat, fontSize,
+				&dest, &destLen, NULL);
+	}
 	if (err != kNMEErrOk)
 		return err;
 	
 	// write TOC title, if any
-	if (titleLen > 0)
-		if (!NMEAddString("<h2%%{s>0} style=\"font-size:%{2*s}pt\"%%>", -1, '%', context)
-				|| !NMEAddString(title, titleLen, '\0', context)
-				|| !NMEAddString("</h2>\n", -1, '%', context))
-			return kNMEErrNotEnoughMemory;
+	if (!addTitleTOC(title, titleLen, context))
+		err = kNMEErrNotEnoughMemory;
 	
 	// write TOC to output
-	if (!NMEAddString("<p%%{s>0} style=\"font-size:%{s}pt\"%%>\n", -1, '%', context)
-			|| !NMEAddString(dest, destLen, '\0', context)
-			|| !NMEAddString("</p>\n", -1, '%', context))
-		return kNMEErrNotEnoughMemory;
+	if (err == kNMEErrOk
+			&& (!NMEAddString("<p%%{s>0} style=\"font-size:%{s}pt\"%%>\n", -1, '%', context)
+				|| !NMEAddString(dest, destLen, '\0', context)
+				|| !NMEAddString("</p>\n", -1, '%', context)))
+		err = kNMEErrNotEnoughMemory;
 	
-	return kNMEErrOk;
+	if (reallocFun)
+		reallocFun(dest, 0, reallocData);
+	
+	return err;
 }
@@ -33,7 +33,8 @@ typedef struct
 */
 void NMESetTOCOutputFormat(NMEOutputFormat *f, HookTOCData *d);
 
-/** User data of NMEPluginTOCEntry
+/** User data of NMEPluginTOCEntry (source code converted again when the
+	plugin cannot be deferred until all headings are known)
 */
 typedef struct
 {
@@ -69,7 +70,7 @@ NMEErr NMEPluginTOC(NMEConstText name, NMEInt nameLen,
 
 /// NMEPlugin entry for table of plugins
 #define NMEPluginTOCEntry(data) \
-	{"toc", kNMEPluginOptBetweenPar, NMEPluginTOC, (void *)data}
+	{"toc", kNMEPluginOptBetweenPar | kNMEPluginOptDeferred, NMEPluginTOC, (void *)data}
 
 #ifdef __cplusplus
 }
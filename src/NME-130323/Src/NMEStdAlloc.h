@@ -0,0 +1,46 @@
+/**
+ *	@file NMEStdAlloc.h
+ *	@brief Memory allocation with the standard C library for NME
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	NME.c doesn't depend on the standard C library; functions which
+ *	allocate memory, such as NMEProcessAlloc, call a function provided by
+ *	the caller. NMEReallocStd is such a function based on realloc and free:
+ *	@code
+ *	#include "NMEStdAlloc.h"
+ *	...
+ *	err = NMEProcessAlloc(..., NMEReallocStd, NULL, &output, &outputLen, NULL);
+ *	...
+ *	free(output);
+ *	@endcode
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#ifndef __NMEStdAlloc__
+#define __NMEStdAlloc__
+
+#include "NME.h"
+#include <stdlib.h>
+
+/** Memory allocation function for NMEProcessAlloc and other functions
+	with an NMEReallocFun argument, based on realloc and free.
+	@param[in] ptr memory block to resize or free, or NULL
+	@param[in] size new size, or 0 to free ptr
+	@param[in] data not used
+	@return address of memory block, or NULL
+*/
+static void *NMEReallocStd(void *ptr, NMEInt size, void *data)
+{
+	(void)data;
+	
+	if (size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, size);
+}
+
+#endif
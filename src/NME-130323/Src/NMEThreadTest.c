@@ -0,0 +1,536 @@
+/**
+ *	@file NMEThreadTest.c
+ *	@brief Multithreaded stress test for Nyctergatis Markup Engine.
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	@section nmethreadtestUsage nmethreadtest Usage
+ *	This program converts random documents produced by nmerandom to
+ *	several output formats with NMEProcessAlloc, NMEProcess,
+ *	NMEProcessBegin/Feed/End and NMEProcessParallel (small chunks
+ *	converted by a few threads), first in a single thread, then in several
+ *	threads at once, and checks that each output is identical to the
+ *	single-threaded one, and that NMEProcessBegin/Feed/End,
+ *	NMEProcessParallel and NMEProcessBatch (all documents at once) give the
+ *	same output as NMEProcessAlloc. Streaming is also checked with a
+ *	document whose autolinks are split by chunks of every size up to
+ *	kSplitChunkSize.
+ *	Output formats are compiled once with
+ *	NMECompileOutputFormat and shared by all threads. It can be called
+ *	as follows:
+ *	@code
+ *	./nmethreadtest options
+ *	@endcode
+ *	Here is the list of options it supports:
+ *	- \c --docs \e n      number of random documents (default: 8)
+ *	- \c --help           help message
+ *	- \c --iterations \e n number of conversions of each document by each
+ *	thread (default: 20)
+ *	- \c --random \e path path of nmerandom (default: ./nmerandom)
+ *	- \c --size \e n      approximate size of documents (default: 20000)
+ *	- \c --threads \e n   number of threads (default: 8)
+ *
+ *	Exit code is 0 if all outputs match, 1 otherwise. With few processor
+ *	cores, data races are more likely to be revealed by building with a
+ *	thread sanitizer (e.g. gcc -fsanitize=thread).
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#include "NME.h"
+#include "NMEStdAlloc.h"
+#include "NMEThreads.h"
+#include "NMEAutolink.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/// Maximum number of random documents
+#define kMaxDocs 64
+
+/// Maximum number of threads
+#define kMaxThreads 64
+
+/// Number of output formats
+#define kFormats 6
+
+/// Number of API functions (NMEProcessAlloc, NMEProcess, NMEProcessBegin,
+/// NMEProcessParallel)
+#define kMethods 4
+
+/// Number of threads used by NMEProcessParallel
+#define kParallelThreads 3
+
+/// Size of buffer for compiled output format templates
+#define kCompiledFormatSize 8192
+
+/// Size of buffer for NMEProcess and NMEProcessBegin
+#define kBufSize (1024 * 1024)
+
+/// Maximum size of the chunks fed with splitDoc
+#define kSplitChunkSize 48
+
+/// Document with CamelCase words and URLs after empty lines, where chunks
+/// fed to NMEProcessFeed are likely to split them
+static char const splitDoc[] =
+	"CamelCase words and http://example.com/ URLs\n"
+	"\n"
+	"WikiWord at the beginning of a paragraph\n"
+	"\n"
+	"http://example.com/path at the beginning of a paragraph\n"
+	"\n"
+	"LongerCamelCaseWord\n"
+	"\n"
+	"ftp://example.org/file\n"
+	"\n"
+	"* ListItem with http://example.net\n"
+	"\n"
+	"LastWord";
+
+/// Output format, compiled once and shared by all threads
+typedef struct
+{
+	NMEOutputFormat f;	///< output format
+	NMEChar compiled[kCompiledFormatSize];	///< buffer for compiled templates
+} Format;
+
+/// Shared test data (read-only while threads are running)
+typedef struct
+{
+	Format formats[kFormats];	///< output formats
+	NMEText doc[kMaxDocs];	///< random documents
+	NMEInt docLen[kMaxDocs];	///< length of doc
+	NMEText ref[kMaxDocs][kFormats][kMethods];	///< single-threaded outputs
+	NMEInt refLen[kMaxDocs][kFormats][kMethods];	///< length of ref
+	int docs;	///< number of documents
+	int iterations;	///< number of conversions of each document by each thread
+} TestData;
+
+/// Data of each thread
+typedef struct
+{
+	TestData const *data;	///< shared test data
+	int index;	///< thread index
+	int mismatches;	///< number of outputs which differ from ref
+	int errors;	///< number of conversion errors
+} ThreadData;
+
+/// Output collected by NMEProcessBegin's output function
+typedef struct
+{
+	NMEText str;	///< output (malloc)
+	NMEInt len;	///< length of str
+	NMEInt size;	///< size of str
+} StreamOutput;
+
+/// Output function for NMEProcessBegin (append to StreamOutput)
+static NMEErr writeOutput(NMEConstText str, NMEInt len, void *data)
+{
+	StreamOutput *s = (StreamOutput *)data;
+	
+	if (s->len + len > s->size)
+	{
+		NMEText p = realloc(s->str, 2 * (s->len + len));
+		
+		if (!p)
+			return kNMEErrNotEnoughMemory;
+		s->str = p;
+		s->size = 2 * (s->len + len);
+	}
+	memcpy(s->str + s->len, str, len);
+	s->len += len;
+	return kNMEErrOk;
+}
+
+/// Mutex for NMEProcessBatch
+static pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// Lock function for NMEProcessBatch
+static void lockBatch(NMEBoolean lock, void *lockData)
+{
+	(void)lockData;
+	
+	if (lock)
+		pthread_mutex_lock(&batchMutex);
+	else
+		pthread_mutex_unlock(&batchMutex);
+}
+
+/// Task runner for NMEProcessParallel and NMEProcessBatch (kParallelThreads
+/// additional threads)
+static NMEErr runTasks(NMEInt taskCount,
+		NMETaskFun task, void *taskData,
+		void *runTasksData)
+{
+	(void)runTasksData;
+	
+	NMERunTasksThreads(taskCount, task, taskData, kParallelThreads + 1);
+	return kNMEErrOk;
+}
+
+/** Read a random document from nmerandom.
+	@param[in] random path of nmerandom
+	@param[in] seed seed of the pseudorandom generator
+	@param[in] size approximate size of document
+	@param[out] len length of document
+	@return document (to be freed with free), or NULL if error
+*/
+static NMEText readRandomDoc(char const *random, int seed, int size, NMEInt *len)
+{
+	char cmd[1024];
+	FILE *fp;
+	NMEText doc;
+	NMEInt docSize = 4 * size + 1024;
+	
+	sprintf(cmd, "%.900s --seed %d --size %d", random, seed, size);
+	fp = popen(cmd, "r");
+	if (!fp)
+		return NULL;
+	doc = malloc(docSize);
+	if (doc)
+		*len = fread(doc, 1, docSize, fp);
+	if (pclose(fp) != 0 || (doc && *len == 0))
+	{
+		free(doc);
+		return NULL;
+	}
+	return doc;
+}
+
+/** Convert a document with one of three API functions.
+	@param[in] data shared test data
+	@param[in] d document index
+	@param[in] k format index
+	@param[in] method 0 for NMEProcessAlloc, 1 for NMEProcess,
+	2 for NMEProcessBegin/Feed/End, 3 for NMEProcessParallel
+	@param[in,out] buf buffer of size kBufSize for methods 1 and 2
+	@param[out] output output (to be freed with free)
+	@param[out] outputLen length of output
+	@return error code
+*/
+static NMEErr convert(TestData const *data, int d, int k, int method,
+		NMEText buf, NMEText *output, NMEInt *outputLen)
+{
+	NMEText out;
+	NMEContext *context;
+	StreamOutput s;
+	NMEInt i, n;
+	NMEErr err;
+	
+	switch (method)
+	{
+		case 0:
+			return NMEProcessAlloc(data->doc[d], data->docLen[d],
+					kNMEProcessOptDefault, "\n", &data->formats[k].f, 0,
+					NMEReallocStd, NULL,
+					output, outputLen, NULL);
+		case 1:
+			err = NMEProcess(data->doc[d], data->docLen[d],
+					buf, kBufSize,
+					kNMEProcessOptDefault, "\n", &data->formats[k].f, 0,
+					&out, outputLen, NULL);
+			if (err != kNMEErrOk)
+				return err;
+			*output = malloc(*outputLen + 1);
+			if (!*output)
+				return kNMEErrNotEnoughMemory;
+			memcpy(*output, out, *outputLen);
+			return kNMEErrOk;
+		case 3:
+			// small chunks, so that cuts occur in many different places
+			return NMEProcessParallel(data->doc[d], data->docLen[d],
+					kNMEProcessOptDefault, "\n", &data->formats[k].f, 0,
+					256 + 97 * d,
+					runTasks, NULL,
+					NMEReallocStd, NULL,
+					output, outputLen, NULL);
+		default:
+			s.str = NULL;
+			s.len = s.size = 0;
+			err = NMEProcessBegin(buf, kBufSize,
+					kNMEProcessOptDefault, "\n", &data->formats[k].f, 0,
+					writeOutput, &s, &context);
+			// feed chunks of varying size
+			for (i = 0; err == kNMEErrOk && i < data->docLen[d]; i += n)
+			{
+				n = 1 + (i * 7 + d) % 3000;
+				if (n > data->docLen[d] - i)
+					n = data->docLen[d] - i;
+				err = NMEProcessFeed(context, data->doc[d] + i, n);
+			}
+			if (err == kNMEErrOk)
+				err = NMEProcessEnd(context, NULL, NULL);
+			*output = s.str;
+			*outputLen = s.len;
+			return err;
+	}
+}
+
+/** Convert splitDoc with NMEProcessBegin/Feed/End in chunks of every size
+	up to kSplitChunkSize and compare the output with NMEProcessAlloc's.
+	@param[in] format output format
+	@param[in,out] buf buffer of size kBufSize
+	@return number of outputs which differ or conversion errors
+*/
+static int checkSplitDoc(NMEOutputFormat const *format, NMEText buf)
+{
+	NMEText ref;
+	NMEInt refLen, len = sizeof(splitDoc) - 1, i, n;
+	NMEContext *context;
+	StreamOutput s;
+	NMEErr err;
+	int chunkSize, mismatches = 0;
+	
+	if (NMEProcessAlloc(splitDoc, len,
+			kNMEProcessOptDefault, "\n", format, 0,
+			NMEReallocStd, NULL,
+			&ref, &refLen, NULL) != kNMEErrOk)
+		return 1;
+	for (chunkSize = 1; chunkSize <= kSplitChunkSize; chunkSize++)
+	{
+		s.str = NULL;
+		s.len = s.size = 0;
+		err = NMEProcessBegin(buf, kBufSize,
+				kNMEProcessOptDefault, "\n", format, 0,
+				writeOutput, &s, &context);
+		for (i = 0; err == kNMEErrOk && i < len; i += n)
+		{
+			n = chunkSize < len - i ? chunkSize : len - i;
+			err = NMEProcessFeed(context, splitDoc + i, n);
+		}
+		if (err == kNMEErrOk)
+			err = NMEProcessEnd(context, NULL, NULL);
+		if (err != kNMEErrOk || s.len != refLen || memcmp(s.str, ref, refLen))
+			mismatches++;
+		free((void *)s.str);
+	}
+	free((void *)ref);
+	return mismatches;
+}
+
+/// Thread entry point: convert all documents repeatedly and compare with ref
+static void *threadMain(void *arg)
+{
+	ThreadData *t = (ThreadData *)arg;
+	TestData const *data = t->data;
+	NMEText buf, output;
+	NMEInt outputLen;
+	int i, d, k, m;
+	
+	buf = malloc(kBufSize);
+	if (!buf)
+	{
+		t->errors++;
+		return NULL;
+	}
+	for (i = 0; i < data->iterations; i++)
+		for (d = 0; d < data->docs; d++)
+			for (k = 0; k < kFormats; k++)
+			{
+				// vary order and API function between threads
+				int dd = (d + t->index) % data->docs;
+				int kk = (k + i) % kFormats;
+				
+				m = (i + t->index) % kMethods;
+				output = NULL;
+				if (convert(data, dd, kk, m, buf, &output, &outputLen) != kNMEErrOk)
+					t->errors++;
+				else if (outputLen != data->refLen[dd][kk][m]
+						|| memcmp(output, data->ref[dd][kk][m], outputLen))
+					t->mismatches++;
+				free((void *)output);
+			}
+	free((void *)buf);
+	return NULL;
+}
+
+/// Application entry point
+int main(int argc, char **argv)
+{
+	static TestData data;
+	ThreadData threadData[kMaxThreads];
+	pthread_t threads[kMaxThreads];
+	NMEOutputFormat const *baseFormats[kFormats] =
+	{
+		&NMEOutputFormatHTML,
+		&NMEOutputFormatLaTeX,
+		&NMEOutputFormatRTF,
+		&NMEOutputFormatNME,
+		&NMEOutputFormatText,
+		&NMEOutputFormatDebug
+	};
+	NMEAutoconvert const autoconverts[] =
+	{
+		NMEAutoconvertCamelCaseEntry,
+		NMEAutoconvertURLEntry,
+		NMEAutoconvertTableEnd
+	};
+	char const *random = "./nmerandom";
+	NMEBatchDoc batchDocs[kMaxDocs];
+	NMEText buf;
+	int i, d, k, m, threadCount = 8, size = 20000, mismatches = 0, errors;
+	
+	data.docs = 8;
+	data.iterations = 20;
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--docs") && i + 1 < argc)
+			data.docs = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			data.iterations = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--random") && i + 1 < argc)
+			random = argv[++i];
+		else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+			size = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			threadCount = strtol(argv[++i], NULL, 0);
+		else
+		{
+			if (strcmp(argv[i], "--help"))
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+			fprintf(stderr, "Usage: %s [options]\n"
+					"Multithreaded stress test for Nyctergatis Markup Engine.\n"
+					"--docs n          number of random documents\n"
+					"--help            display this help message and exit\n"
+					"--iterations n    number of conversions of each document by each thread\n"
+					"--random path     path of nmerandom\n"
+					"--size n          approximate size of documents\n"
+					"--threads n       number of threads\n",
+				argv[0]);
+			exit(0);
+		}
+	if (data.docs < 1 || data.docs > kMaxDocs
+			|| threadCount < 1 || threadCount > kMaxThreads)
+	{
+		fprintf(stderr, "Number of documents or threads out of range\n");
+		exit(1);
+	}
+	
+	// compile output formats, with autolinks
+	for (k = 0; k < kFormats; k++)
+	{
+		data.formats[k].f = *baseFormats[k];
+		data.formats[k].f.autoconverts = autoconverts;
+		if (NMECompileOutputFormat(&data.formats[k].f, kNMEProcessOptDefault, 0,
+				data.formats[k].compiled, kCompiledFormatSize,
+				&data.formats[k].f) != kNMEErrOk)
+		{
+			fprintf(stderr, "Cannot compile output format %d\n", k);
+			exit(1);
+		}
+	}
+	
+	// read random documents and convert them in a single thread
+	buf = malloc(kBufSize);
+	if (!buf)
+		exit(1);
+	for (d = 0; d < data.docs; d++)
+	{
+		data.doc[d] = readRandomDoc(random, d + 1, size, &data.docLen[d]);
+		if (!data.doc[d])
+		{
+			fprintf(stderr, "Cannot run %s\n", random);
+			exit(1);
+		}
+		for (k = 0; k < kFormats; k++)
+			for (m = 0; m < kMethods; m++)
+				if (convert(&data, d, k, m, buf,
+						&data.ref[d][k][m], &data.refLen[d][k][m]) != kNMEErrOk)
+				{
+					fprintf(stderr, "Conversion error (document %d, format %d)\n", d, k);
+					exit(1);
+				}
+		for (k = 0; k < kFormats; k++)
+		{
+			if (data.refLen[d][k][2] != data.refLen[d][k][0]
+					|| memcmp(data.ref[d][k][2], data.ref[d][k][0], data.refLen[d][k][0]))
+			{
+				fprintf(stderr, "Streamed output differs (document %d, format %d)\n", d, k);
+				mismatches++;
+			}
+			if (data.refLen[d][k][3] != data.refLen[d][k][0]
+					|| memcmp(data.ref[d][k][3], data.ref[d][k][0], data.refLen[d][k][0]))
+			{
+				fprintf(stderr, "Parallel output differs (document %d, format %d)\n", d, k);
+				mismatches++;
+			}
+		}
+	}
+	
+	// autolinks split between chunks
+	for (k = 0; k < kFormats; k++)
+	{
+		i = checkSplitDoc(&data.formats[k].f, buf);
+		if (i > 0)
+		{
+			fprintf(stderr, "Streamed output of split autolinks differs (format %d, %d chunk sizes)\n", k, i);
+			mismatches += i;
+		}
+	}
+	free((void *)buf);
+	
+	// convert all of them at once with NMEProcessBatch
+	for (k = 0; k < kFormats; k++)
+	{
+		for (d = 0; d < data.docs; d++)
+		{
+			batchDocs[d].nmeText = data.doc[d];
+			batchDocs[d].nmeTextLen = data.docLen[d];
+		}
+		if (NMEProcessBatch(batchDocs, data.docs,
+				kNMEProcessOptDefault, "\n", &data.formats[k].f, 0,
+				kParallelThreads + 1,
+				runTasks, NULL,
+				lockBatch, NULL,
+				NMEReallocStd, NULL) != kNMEErrOk)
+		{
+			fprintf(stderr, "Batch conversion error (format %d)\n", k);
+			exit(1);
+		}
+		for (d = 0; d < data.docs; d++)
+		{
+			if (batchDocs[d].err != kNMEErrOk
+					|| batchDocs[d].outputLen != data.refLen[d][k][0]
+					|| memcmp(batchDocs[d].output, data.ref[d][k][0], data.refLen[d][k][0]))
+			{
+				fprintf(stderr, "Batch output differs (document %d, format %d)\n", d, k);
+				mismatches++;
+			}
+			free((void *)batchDocs[d].output);
+		}
+	}
+	
+	// convert them again in all threads at once
+	for (i = 0; i < threadCount; i++)
+	{
+		threadData[i].data = &data;
+		threadData[i].index = i;
+		threadData[i].mismatches = threadData[i].errors = 0;
+		if (pthread_create(&threads[i], NULL, threadMain, &threadData[i]))
+		{
+			fprintf(stderr, "Cannot create thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (i = 0, errors = 0; i < threadCount; i++)
+	{
+		pthread_join(threads[i], NULL);
+		mismatches += threadData[i].mismatches;
+		errors += threadData[i].errors;
+	}
+	
+	printf("%d threads, %d documents, %d conversions: %d mismatches, %d errors\n",
+			threadCount, data.docs,
+			threadCount * data.docs * data.iterations * kFormats,
+			mismatches, errors);
+	
+	for (d = 0; d < data.docs; d++)
+	{
+		free((void *)data.doc[d]);
+		for (k = 0; k < kFormats; k++)
+			for (m = 0; m < kMethods; m++)
+				free((void *)data.ref[d][k][m]);
+	}
+	
+	return mismatches > 0 || errors > 0;
+}
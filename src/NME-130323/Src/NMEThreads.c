@@ -0,0 +1,64 @@
+/**
+ *	@file NMEThreads.c
+ *	@brief Task runner based on POSIX threads for NME and NE tools
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#include "NMEThreads.h"
+#include <pthread.h>
+
+/// Tasks shared by the threads of NMERunTasksThreads
+typedef struct
+{
+	int taskCount;	///< number of tasks
+	NMEThreadsTaskFun task;	///< task function
+	void *taskData;	///< data passed to task
+	int next;	///< index of the next task to run
+	pthread_mutex_t mutex;	///< mutex for next
+} ThreadTasks;
+
+/// Thread function which runs tasks until there is none left
+static void *runThread(void *arg)
+{
+	ThreadTasks *t = (ThreadTasks *)arg;
+	int i;
+	
+	for (;;)
+	{
+		pthread_mutex_lock(&t->mutex);
+		i = t->next++;
+		pthread_mutex_unlock(&t->mutex);
+		if (i >= t->taskCount)
+			return NULL;
+		t->task(i, t->taskData);
+	}
+}
+
+void NMERunTasksThreads(int taskCount,
+		NMEThreadsTaskFun task, void *taskData,
+		int threadCount)
+{
+	pthread_t threads[kNMEThreadsMax];
+	ThreadTasks t;
+	int i, n;
+	
+	t.taskCount = taskCount;
+	t.task = task;
+	t.taskData = taskData;
+	t.next = 0;
+	pthread_mutex_init(&t.mutex, NULL);
+	
+	// additional threads, and the calling thread
+	n = threadCount < taskCount ? threadCount : taskCount;
+	for (i = 0; i < n - 1 && i < kNMEThreadsMax
+			&& !pthread_create(&threads[i], NULL, runThread, &t); i++)
+		;
+	runThread(&t);
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+	
+	pthread_mutex_destroy(&t.mutex);
+}
@@ -0,0 +1,59 @@
+/**
+ *	@file NMEThreads.h
+ *	@brief Task runner based on POSIX threads for NME and NE tools
+ *	@author Yves Piguet.
+ *	@copyright 2013, Yves Piguet.
+ *
+ *	NMEProcessParallel, NMEProcessBatch and NESetParallelDeflate run their
+ *	tasks with a function provided by the caller. NMERunTasksThreads runs
+ *	them in a given number of threads; it's meant to be called by such a
+ *	function, e.g. for NMEProcessParallel:
+ *	@code
+ *	#include "NMEThreads.h"
+ *	...
+ *	static NMEErr runTasks(NMEInt taskCount,
+ *			NMETaskFun task, void *taskData,
+ *			void *runTasksData)
+ *	{
+ *		NMERunTasksThreads(taskCount, task, taskData, *(int *)runTasksData);
+ *		return kNMEErrOk;
+ *	}
+ *	@endcode
+ */
+
+/* License: new BSD license (see NME.h) */
+
+#ifndef __NMEThreads__
+#define __NMEThreads__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Maximum number of threads used by NMERunTasksThreads
+#define kNMEThreadsMax 64
+
+/** Task called by NMERunTasksThreads (same type as NMETaskFun and NETaskFun).
+	@param[in] i task index, between 0 and taskCount-1
+	@param[in,out] taskData value passed to NMERunTasksThreads
+*/
+typedef void (*NMEThreadsTaskFun)(int i, void *taskData);
+
+/** Run tasks in the calling thread and additional threads, each thread
+	taking the next task which hasn't been started yet, and return once
+	all tasks are completed.
+	@param[in] taskCount number of tasks
+	@param[in] task function called for each task
+	@param[in,out] taskData value passed to task
+	@param[in] threadCount number of threads, including the calling one
+	(at most kNMEThreadsMax, and no more than taskCount are used)
+*/
+void NMERunTasksThreads(int taskCount,
+		NMEThreadsTaskFun task, void *taskData,
+		int threadCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif